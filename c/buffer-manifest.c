@@ -0,0 +1,176 @@
+//
+// Copyright 2021 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Inlined via #include in gtk/host.c, gtk/container.c, terminal/host.c and terminal/container.c,
+// after unix-socket.c; the includer must define _GNU_SOURCE for memfd_create and the seals.
+//
+// The shared buffers are memfds, listed in a manifest that the host sends to each container
+// over a UNIX socket with the fds attached in entry order. Nothing is left behind in /dev/shm,
+// and read-only buffers are sealed so that no container can make a writable mapping of them
+// even though it holds a read-write fd. The container maps every entry into one reservation in
+// its linear memory.
+
+#define MANIFEST_MAX_BUFFERS  8
+#define BUFFER_NAME_LEN       16
+#define HUGE_PAGE_SIZE        (2 << 20)  // the default hugetlb page size on x86-64 and arm64
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE   0x0010  // Linux 5.1
+#endif
+
+// BufferEntry.flags: backed by huge pages, so the size and alignment are multiples of them.
+#define BUFFER_HUGE_PAGES  1
+
+typedef struct {
+  char name[BUFFER_NAME_LEN];
+  uint32_t size;
+  uint32_t prot;           // PROT_READ, or PROT_READ | PROT_WRITE
+  uint32_t align;          // of the mapping in linear memory; a multiple of the page size
+  uint32_t flags;
+  uint32_t window_offset;  // with PROT_READ, [window_offset, +window_size) is mapped writable
+  uint32_t window_size;
+} BufferEntry;
+
+typedef struct {
+  uint32_t n_buffers;
+  BufferEntry entries[MANIFEST_MAX_BUFFERS];
+} BufferManifest;
+
+static inline uintptr_t align_up(uintptr_t p, size_t align) {
+  return (p + align - 1) & ~(uintptr_t)(align - 1);
+}
+
+// Host side: appends a buffer of 'size' bytes to the manifest, storing its memfd in the
+// matching element of 'fds', and returns the host's read-write mapping of it. With
+// BUFFER_HUGE_PAGES in 'flags' the buffer falls back to normal pages if no huge pages are
+// free. A read-only buffer can still be written through the host's mapping.
+static void *manifest_create(BufferManifest *m, int *fds, const char *name, size_t size,
+                             uint32_t prot, uint32_t flags) {
+  assert(m->n_buffers < MANIFEST_MAX_BUFFERS && strlen(name) < BUFFER_NAME_LEN);
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  int fd = -1;
+  void *mapping = MAP_FAILED;
+  if (flags & BUFFER_HUGE_PAGES) {
+    // hugetlbfs only reserves the pages at mmap() time, so that is where a shortage shows up.
+    size_t huge_size = align_up(size, HUGE_PAGE_SIZE);
+    fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+    if (fd != -1 && ftruncate(fd, huge_size) != -1) {
+      mapping = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping != MAP_FAILED) {
+      size = huge_size;
+    } else {
+      printf("No huge pages for buffer '%s'; using normal pages\n", name);
+      if (fd != -1) {
+        assert(close(fd) != -1);
+      }
+      flags &= ~BUFFER_HUGE_PAGES;
+    }
+  }
+  if (mapping == MAP_FAILED) {
+    size = align_up(size, page_size);
+    fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    assert(fd != -1 && ftruncate(fd, size) != -1);
+    mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(mapping != MAP_FAILED);
+  }
+  assert(size <= UINT32_MAX);
+
+  // The seals have to follow the host's own writable mapping.
+  int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+  if (!(prot & PROT_WRITE)) {
+    seals |= F_SEAL_FUTURE_WRITE;
+  }
+  assert(fcntl(fd, F_ADD_SEALS, seals) != -1);
+
+  BufferEntry *e = &m->entries[m->n_buffers];
+  *e = (BufferEntry){ .size = size, .prot = prot, .flags = flags };
+  strcpy(e->name, name);
+  e->align = (flags & BUFFER_HUGE_PAGES) ? HUGE_PAGE_SIZE : page_size;
+  fds[m->n_buffers++] = fd;
+  return mapping;
+}
+
+static bool send_manifest(int sock, const BufferManifest *m, const int *fds) {
+  return send_with_fds(sock, m, sizeof(*m), fds, m->n_buffers);
+}
+
+// Container side: receives a manifest and its fds, and checks the entries can be mapped as
+// described.
+static bool recv_manifest(int sock, BufferManifest *m, int *fds) {
+  int n_fds = recv_with_fds(sock, m, sizeof(*m), fds, MANIFEST_MAX_BUFFERS);
+  if (n_fds < 0 || (uint32_t)n_fds != m->n_buffers) {
+    return false;
+  }
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  for (int i = 0; i < n_fds; i++) {
+    BufferEntry *e = &m->entries[i];
+    struct stat st;
+    e->name[BUFFER_NAME_LEN - 1] = 0;
+    if (fstat(fds[i], &st) != 0 || st.st_size < e->size || e->align % page_size != 0 ||
+        (e->align & (e->align - 1)) != 0 || e->window_offset % page_size != 0 ||
+        e->window_offset > e->size || e->window_size > e->size - e->window_offset) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Container side: the size of the linear memory reservation needed to map every entry at its
+// alignment, with 'guard' bytes of PROT_NONE pages before, between and after them.
+static size_t manifest_reserve_size(const BufferManifest *m, size_t page_size, size_t guard) {
+  size_t size = page_size + guard;
+  for (uint32_t i = 0; i < m->n_buffers; i++) {
+    size += guard + m->entries[i].align + align_up(m->entries[i].size, page_size);
+  }
+  return size;
+}
+
+// Container side: maps every entry into the 'reserve_size' bytes at 'reserve', aligned against
+// our page boundaries, and stores their addresses in 'bufs'. Returns the end of the overlay,
+// which starts at the first page boundary in the reservation.
+static void *manifest_overlay(const BufferManifest *m, const int *fds, void *reserve,
+                              size_t reserve_size, size_t guard, unsigned char **bufs) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t end = align_up((uintptr_t)reserve, page_size);
+  for (uint32_t i = 0; i < m->n_buffers; i++) {
+    bufs[i] = (unsigned char *)align_up(end + guard, m->entries[i].align);
+    end = align_up((uintptr_t)bufs[i] + m->entries[i].size, page_size);
+  }
+  end += guard;
+
+  // Verify that our overall mmapped size will be safely contained in the reservation.
+  assert(end - (uintptr_t)reserve <= reserve_size);
+
+  int flags = MAP_SHARED | MAP_FIXED;
+  for (uint32_t i = 0; i < m->n_buffers; i++) {
+    const BufferEntry *e = &m->entries[i];
+    assert(mmap(bufs[i], e->size, e->prot, flags, fds[i], 0) == bufs[i]);
+    if (e->window_size != 0) {
+      void *window = bufs[i] + e->window_offset;
+      assert(mmap(window, e->window_size, PROT_READ | PROT_WRITE, flags, fds[i],
+                  e->window_offset) == window);
+    }
+    // A module overrunning a buffer, or its heap running into one, then traps.
+    if (guard) {
+      assert(mprotect(bufs[i] - guard, guard, PROT_NONE) == 0);
+    }
+  }
+  if (guard) {
+    assert(mprotect((void *)(end - guard), guard, PROT_NONE) == 0);
+  }
+  return (void *)end;
+}
@@ -0,0 +1,125 @@
+//
+// Copyright 2021 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Inlined via #include in wamr-wrapper.c and gtk/host.c
+//
+// Per-export call statistics recorded by wasm_call_vec(). Each container owns one CallStats page
+// in shared memory and is its only writer; the host reads it at any time without any messaging.
+// The counters are updated with relaxed atomics, so a reader may see a call counted in 'calls'
+// before its time lands in the histogram, but never a torn value.
+
+#define CALL_STATS_FUNCS    8
+#define CALL_STATS_BUCKETS  32
+#define CALL_STATS_NAME     24
+
+// Histogram bucket b counts calls that took [2^(b-1), 2^b) ns; the last bucket is open ended.
+typedef struct {
+  char name[CALL_STATS_NAME];
+  _Atomic uint64_t calls;
+  _Atomic uint64_t traps;
+  _Atomic uint64_t total_ns;
+  _Atomic uint64_t max_ns;
+  _Atomic uint64_t buckets[CALL_STATS_BUCKETS];
+} CallStatsFunc;
+
+typedef struct {
+  uint32_t n_funcs;
+  CallStatsFunc funcs[CALL_STATS_FUNCS];
+} __attribute__((aligned(4096))) CallStats;
+
+static_assert(sizeof(CallStats) == 4096, "CallStats must fill a page");
+
+static inline uint64_t call_stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int call_stats_bucket(uint64_t ns) {
+  int b = ns ? 64 - __builtin_clzll(ns) : 0;
+  return b < CALL_STATS_BUCKETS ? b : CALL_STATS_BUCKETS - 1;
+}
+
+// Single-writer increment; avoids the locked read-modify-write of atomic_fetch_add.
+static inline void call_stats_add(_Atomic uint64_t *counter, uint64_t n) {
+  uint64_t v = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, v + n, memory_order_relaxed);
+}
+
+// Container side: clears the page and labels one entry per export name.
+static void call_stats_init(CallStats *stats, const char *names[], int n_funcs) {
+  assert(n_funcs <= CALL_STATS_FUNCS);
+  memset(stats, 0, sizeof(*stats));
+  stats->n_funcs = n_funcs;
+  for (int i = 0; i < n_funcs; i++) {
+    strncpy(stats->funcs[i].name, names[i], CALL_STATS_NAME - 1);
+  }
+}
+
+static void call_stats_record(CallStats *stats, int index, uint64_t ns, bool trapped) {
+  CallStatsFunc *f = &stats->funcs[index];
+  call_stats_add(&f->calls, 1);
+  call_stats_add(&f->total_ns, ns);
+  call_stats_add(&f->buckets[call_stats_bucket(ns)], 1);
+  if (trapped) {
+    call_stats_add(&f->traps, 1);
+  }
+  if (ns > atomic_load_explicit(&f->max_ns, memory_order_relaxed)) {
+    atomic_store_explicit(&f->max_ns, ns, memory_order_relaxed);
+  }
+}
+
+// Returns the entry for export 'name', or NULL if it isn't listed.
+static const CallStatsFunc *call_stats_find(const CallStats *stats, const char *name) {
+  int n_funcs = stats->n_funcs < CALL_STATS_FUNCS ? stats->n_funcs : CALL_STATS_FUNCS;
+  for (int i = 0; i < n_funcs; i++) {
+    if (strncmp(stats->funcs[i].name, name, CALL_STATS_NAME) == 0) {
+      return &stats->funcs[i];
+    }
+  }
+  return NULL;
+}
+
+// Returns the upper bound of the bucket holding the p'th percentile call.
+static uint64_t call_stats_percentile(const CallStatsFunc *f, uint64_t calls, int p) {
+  uint64_t rank = (calls * p + 99) / 100;
+  uint64_t seen = 0;
+  for (int b = 0; b < CALL_STATS_BUCKETS; b++) {
+    seen += atomic_load_explicit(&f->buckets[b], memory_order_relaxed);
+    if (seen >= rank) {
+      return 1ull << b;
+    }
+  }
+  return atomic_load_explicit(&f->max_ns, memory_order_relaxed);
+}
+
+// Host side: prints the exports of 'stats' that have been called at least once.
+static void call_stats_dump(const CallStats *stats, const char *label) {
+  int n_funcs = stats->n_funcs < CALL_STATS_FUNCS ? stats->n_funcs : CALL_STATS_FUNCS;
+  for (int i = 0; i < n_funcs; i++) {
+    const CallStatsFunc *f = &stats->funcs[i];
+    uint64_t calls = atomic_load_explicit(&f->calls, memory_order_relaxed);
+    if (calls == 0) {
+      continue;
+    }
+    uint64_t total = atomic_load_explicit(&f->total_ns, memory_order_relaxed);
+    printf("  %-4s %-16.*s %10" PRIu64 " calls %6" PRIu64 " traps  mean %9.1f us  p50 <%9.1f us"
+           "  p99 <%9.1f us  max %9.1f us\n", label, CALL_STATS_NAME, f->name, calls,
+           atomic_load_explicit(&f->traps, memory_order_relaxed), total / 1e3 / calls,
+           call_stats_percentile(f, calls, 50) / 1e3, call_stats_percentile(f, calls, 99) / 1e3,
+           atomic_load_explicit(&f->max_ns, memory_order_relaxed) / 1e3);
+  }
+}
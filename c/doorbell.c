@@ -0,0 +1,194 @@
+//
+// Copyright 2021 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Inlined via #include in gtk/host.c and gtk/container.c
+//
+// Host/container signalling via a shared control page. Each container has a dedicated slot
+// holding a command word written by the host and an ack word written by the container. Both
+// are sequence numbers that the other side waits on with a futex, after a short spin to catch
+// fast responses without a syscall; posts only make the wake syscall when someone is asleep.
+// Containers also publish a running step count that lets a group of them advance through a
+// batch of ticks in lockstep, and a seqlock word around their writes to the shared state so the
+// host can copy it while they run.
+
+#define DOORBELL_SLOT_SIZE   64
+#define DOORBELL_TIMEOUT_MS  100
+
+// Added to a container's step count when it abandons a lockstep batch.
+#define DOORBELL_STEP_ABANDONED  (1u << 30)
+
+// Number of polls before falling back to futex_wait; set to 0 to always sleep in the kernel.
+#ifndef DOORBELL_SPINS
+#define DOORBELL_SPINS       2000
+#endif
+
+// The host only writes the cmd fields and the container only writes the ack fields, step,
+// state_seq and pid. The plain fields are published by the release store on the associated
+// sequence word; pid is set before the container's ready signal.
+typedef struct {
+  _Atomic uint32_t cmd_seq;
+  uint32_t cmd;
+  uint32_t arg;
+  uint32_t peers;  // number of slots (from 0) taking part in step barriers
+  _Atomic uint32_t ack_seq;
+  uint32_t ack;
+  _Atomic uint32_t step;
+  _Atomic uint32_t state_seq;  // odd while the container is writing the read-write buffer
+  _Atomic uint32_t waiters;    // number of processes in futex_wait on any of the above
+  pid_t pid;                   // the container's, so its peers can tell if it dies
+} __attribute__((aligned(DOORBELL_SLOT_SIZE))) DoorbellSlot;
+
+static_assert(sizeof(DoorbellSlot) == DOORBELL_SLOT_SIZE, "DoorbellSlot must fill a cache line");
+
+// Returns whether the process at the other end of the doorbell is still running.
+typedef bool (*PeerCheck)(pid_t peer);
+
+static long futex(_Atomic uint32_t *word, int op, uint32_t val, const struct timespec *timeout) {
+  // The control page is shared between processes, so the non-private futex ops are required.
+  return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Wakes any sleepers on 'word', one of the sequence words in 'slot', after it has been updated.
+// The store to 'word' and the load of 'waiters' are both seq_cst, as are the waiter's increment
+// and re-check in doorbell_wait(), so either the waiter sees the new value or we see the waiter.
+static void doorbell_wake(DoorbellSlot *slot, _Atomic uint32_t *word) {
+  if (atomic_load(&slot->waiters) != 0) {
+    futex(word, FUTEX_WAKE, INT_MAX, NULL);
+  }
+}
+
+static void doorbell_post(DoorbellSlot *slot, _Atomic uint32_t *seq_word, uint32_t *val_word,
+                          uint32_t val, uint32_t seq) {
+  *val_word = val;
+  atomic_store(seq_word, seq);
+  doorbell_wake(slot, seq_word);
+}
+
+// Sequence numbers wrap, so compare them by signed distance.
+static inline bool seq_reached(uint32_t current, uint32_t seq) {
+  return (int32_t)(current - seq) >= 0;
+}
+
+// Blocks until '*seq_word', one of the sequence words in 'slot', reaches 'seq'. The futex wait
+// is bounded so that a crashed peer is noticed; returns false if 'alive' reports that the peer
+// has gone away.
+static bool doorbell_wait(DoorbellSlot *slot, _Atomic uint32_t *seq_word, uint32_t seq,
+                          PeerCheck alive, pid_t peer) {
+  for (int i = 0; i < DOORBELL_SPINS; i++) {
+    if (seq_reached(atomic_load_explicit(seq_word, memory_order_acquire), seq)) {
+      return true;
+    }
+    cpu_relax();
+  }
+  const struct timespec timeout = { 0, DOORBELL_TIMEOUT_MS * 1000000L };
+  bool ok = true;
+  atomic_fetch_add(&slot->waiters, 1);
+  while (true) {
+    uint32_t current = atomic_load(seq_word);
+    if (seq_reached(current, seq)) {
+      break;
+    }
+    if (futex(seq_word, FUTEX_WAIT, current, &timeout) == -1 && errno == ETIMEDOUT &&
+        !alive(peer)) {
+      ok = false;
+      break;
+    }
+  }
+  atomic_fetch_sub(&slot->waiters, 1);
+  return ok;
+}
+
+// Host side: publishes command 'cmd' with argument 'arg' as sequence number 'seq' and wakes
+// the container.
+static void doorbell_ring(DoorbellSlot *slot, uint32_t cmd, uint32_t arg, uint32_t seq) {
+  slot->arg = arg;
+  doorbell_post(slot, &slot->cmd_seq, &slot->cmd, cmd, seq);
+}
+
+// Container side: acknowledges sequence number 'seq' with response code 'ack'.
+static void doorbell_answer(DoorbellSlot *slot, uint32_t ack, uint32_t seq) {
+  doorbell_post(slot, &slot->ack_seq, &slot->ack, ack, seq);
+}
+
+// Container side: publishes that this container has completed 'step' ticks. A container that
+// gives up part way through a batch publishes a step DOORBELL_STEP_ABANDONED ahead so its
+// peers are not left waiting at the barrier.
+static void doorbell_step(DoorbellSlot *slot, uint32_t step, bool wake) {
+  atomic_store(&slot->step, step);
+  if (wake) {
+    doorbell_wake(slot, &slot->step);
+  }
+}
+
+// Whether the process 'pid' is still running. One that was killed stays a zombie until its
+// parent reaps it, which kill(pid, 0) doesn't tell apart, so this checks its state in /proc.
+static bool process_running(pid_t pid) {
+  char path[32];
+  char stat[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  // The state follows the parenthesised command name, which may itself contain parentheses.
+  char *end = fgets(stat, sizeof(stat), f) ? strrchr(stat, ')') : NULL;
+  fclose(f);
+  return end != NULL && end[1] == ' ' && end[2] != 'Z' && end[2] != 'X';
+}
+
+// Container side: waits until every peer slot has completed at least 'step' ticks. A peer that
+// dies part way through a batch can't publish its abandonment, so 'alive' is checked against
+// each peer's pid while waiting on it.
+static bool doorbell_barrier(DoorbellSlot *slots, int peers, uint32_t step, PeerCheck alive) {
+  for (int i = 0; i < peers; i++) {
+    if (!doorbell_wait(&slots[i], &slots[i].step, step, alive, slots[i].pid)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Container side: brackets a write to the read-write buffer. state_seq is odd in between, so a
+// reader that sees the same even value before and after copying the state knows it is whole.
+static void doorbell_write_begin(DoorbellSlot *slot) {
+  uint32_t seq = atomic_load_explicit(&slot->state_seq, memory_order_relaxed);
+  atomic_store_explicit(&slot->state_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void doorbell_write_end(DoorbellSlot *slot) {
+  uint32_t seq = atomic_load_explicit(&slot->state_seq, memory_order_relaxed);
+  atomic_store_explicit(&slot->state_seq, seq + 1, memory_order_release);
+}
+
+// Host side: the seqlock word of 'slot' before a copy of the shared state, or -1 if the
+// container is part way through a write.
+static int64_t doorbell_read_begin(DoorbellSlot *slot) {
+  uint32_t seq = atomic_load_explicit(&slot->state_seq, memory_order_acquire);
+  return (seq & 1) ? -1 : (int64_t)seq;
+}
+
+// Host side: whether a copy started at 'seq' was made without the container writing.
+static bool doorbell_read_valid(DoorbellSlot *slot, uint32_t seq) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&slot->state_seq, memory_order_relaxed) == seq;
+}
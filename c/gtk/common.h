@@ -16,15 +16,24 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Default dimensions; the host can override them at startup, and containers only ever use the
+// values in the GridHeader.
 #define GRID_W      50
 #define GRID_H      30
-#define N_BLOCKS    150
+#define N_BLOCKS    150  // per GRID_W * GRID_H cells; scaled up for larger grids
 #define N_RUNNERS   15
 #define SCARE_DIST  10
 
 #define SCALE       20
 #define TICK_MS     150
 
+#define MAX_CONTAINERS  64
+#define MAX_TILES       32
+
 typedef enum {
   WALKING,
   RUNNING,
@@ -42,13 +51,272 @@ typedef struct {
   int y;
 } Hunter;
 
+#define GRID_MAGIC      0x44495247  // "GRID"
+#define GRID_VERSION    5
+#define GRID_ROW_ALIGN  64
+
+typedef enum {
+  GRID_BYTES,  // one byte per cell
+  GRID_BITS,   // one bit per cell, lowest bit first
+} GridEncoding;
+
+typedef enum {
+  ACTORS_AOS,  // an array of Runner structs
+  ACTORS_SOA,  // separate x[], y[] and state[] arrays, each padded to whole SIMD vectors
+} ActorLayout;
+
+#define ACTOR_LANES     4   // i32 lanes in a wasm v128
+#define RUNNERS_OFFSET  16  // start of the SoA arrays in the read-write buffer
+#define INDEX_SHIFT     3   // with --index, each spatial index bucket covers 8x8 cells
+#define INDEX_NONE      -2  // bucket_next value of a runner that isn't in the index
+#define DIRTY_SHIFT     4   // each bit of the dirty bitmap covers a 16x16 region of cells
+
+// Written by the host at the start of the read-only buffer before any container starts, and
+// checked by the module in create_context. The rows follow at 'grid_offset', each padded to a
+// cache line; a non-zero cell is blocked. The host sets a bit in the dirty bitmap at
+// 'dirty_offset' for each region of cells it changes, and clears them once it has redrawn them.
+// The read-write buffer holds the Hunter followed by the runners, laid out as given by 'layout',
+// then the optional spatial index; with tiles, see TileHeader instead.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t encoding;
+  uint32_t grid_w;
+  uint32_t grid_h;
+  uint32_t row_bytes;
+  uint32_t grid_offset;
+  uint32_t n_runners;
+  uint32_t layout;
+  uint32_t index_shift;  // log2 of the spatial index bucket size; 0 for no index
+  uint32_t n_tiles;      // 0 when a single runner container owns every runner
+  uint32_t dirty_offset;
+} GridHeader;
+
+static inline uint32_t grid_row_bytes(uint32_t w, GridEncoding encoding) {
+  uint32_t bytes = (encoding == GRID_BITS) ? (w + 7) / 8 : w;
+  return (bytes + GRID_ROW_ALIGN - 1) & ~(GRID_ROW_ALIGN - 1);
+}
+
+static inline bool grid_header_valid(const GridHeader *h) {
+  return h->magic == GRID_MAGIC && h->version == GRID_VERSION && h->encoding <= GRID_BITS &&
+         h->row_bytes == grid_row_bytes(h->grid_w, h->encoding) &&
+         h->grid_offset >= sizeof(GridHeader) && h->layout <= ACTORS_SOA &&
+         h->index_shift < 16 && h->n_tiles <= MAX_TILES &&
+         h->dirty_offset >= h->grid_offset + (size_t)h->row_bytes * h->grid_h &&
+         (h->n_tiles == 0 || (h->layout == ACTORS_SOA && h->index_shift == 0));
+}
+
+static inline const uint8_t *grid_row(const GridHeader *h, int y) {
+  return (const uint8_t *)h + h->grid_offset + (size_t)y * h->row_bytes;
+}
+
+static inline bool grid_blocked(const GridHeader *h, int x, int y) {
+  const uint8_t *row = grid_row(h, y);
+  return (h->encoding == GRID_BITS) ? (row[x >> 3] >> (x & 7)) & 1 : row[x] != 0;
+}
+
+static inline uint32_t dirty_regions_w(const GridHeader *h) {
+  return (h->grid_w + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT;
+}
+
+static inline uint32_t dirty_regions_h(const GridHeader *h) {
+  return (h->grid_h + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT;
+}
+
+static inline size_t dirty_bitmap_size(const GridHeader *h) {
+  return ((size_t)dirty_regions_w(h) * dirty_regions_h(h) + 7) / 8;
+}
+
+// Bit dirty_region(x, y) of the bitmap covers cell (x, y).
+static inline uint32_t dirty_region(const GridHeader *h, int x, int y) {
+  return (y >> DIRTY_SHIFT) * dirty_regions_w(h) + (x >> DIRTY_SHIFT);
+}
+
+static inline const uint8_t *dirty_bitmap(const GridHeader *h) {
+  return (const uint8_t *)h + h->dirty_offset;
+}
+
+static inline size_t ro_buffer_size(const GridHeader *h) {
+  return h->dirty_offset + dirty_bitmap_size(h);
+}
+
+// Length of each SoA array; the padding runners are kept DEAD.
+static inline uint32_t runner_stride(const GridHeader *h) {
+  return (h->n_runners + ACTOR_LANES - 1) & ~(ACTOR_LANES - 1);
+}
+
+static inline size_t actors_size(const GridHeader *h) {
+  if (h->layout == ACTORS_SOA) {
+    return RUNNERS_OFFSET + 3 * sizeof(int) * (size_t)runner_stride(h);
+  }
+  return sizeof(Hunter) + (size_t)h->n_runners * sizeof(Runner);
+}
+
+static inline uint32_t index_buckets_w(const GridHeader *h) {
+  return (h->grid_w + (1 << h->index_shift) - 1) >> h->index_shift;
+}
+
+static inline uint32_t index_buckets_h(const GridHeader *h) {
+  return (h->grid_h + (1 << h->index_shift) - 1) >> h->index_shift;
+}
+
+typedef struct {
+  int *x;
+  int *y;
+  int *state;
+} RunnerArrays;
+
+static inline RunnerArrays runner_arrays(const GridHeader *h, void *rw_ptr) {
+  int *base = (int *)((uint8_t *)rw_ptr + RUNNERS_OFFSET);
+  uint32_t stride = runner_stride(h);
+  return (RunnerArrays){ base, base + stride, base + 2 * stride };
+}
+
+// Reads runner 'i' in either layout; tiled runners are read with tile_arrays().
+static inline Runner get_runner(const GridHeader *h, const void *rw_ptr, int i) {
+  if (h->layout == ACTORS_SOA) {
+    RunnerArrays a = runner_arrays(h, (void *)rw_ptr);
+    return (Runner){ a.x[i], a.y[i], a.state[i] };
+  }
+  return ((const Runner *)((const uint8_t *)rw_ptr + sizeof(Hunter)))[i];
+}
+
+// Uniform-grid index over the runners, written only by the runner container as its runners
+// move. bucket_head[b] is the first runner in bucket b and bucket_next[i] the one after runner
+// i; lists end in -1. Dead runners are removed, and have a bucket_next of INDEX_NONE.
+typedef struct {
+  int *bucket_head;
+  int *bucket_next;  // runner_stride() entries, so the SoA padding runners have one too
+} SpatialIndex;
+
+static inline SpatialIndex spatial_index(const GridHeader *h, void *rw_ptr) {
+  if (h->index_shift == 0) {
+    return (SpatialIndex){ NULL, NULL };
+  }
+  int *head = (int *)((uint8_t *)rw_ptr + ((actors_size(h) + 15) & ~15));
+  return (SpatialIndex){ head, head + index_buckets_w(h) * index_buckets_h(h) };
+}
+
+// With --tiles K the grid is split into K vertical strips, each with its own runner container
+// owning the runners inside it. The read-write buffer then holds the Hunter in its first
+// TILE_ALIGN bytes, followed by one TILE_ALIGN-aligned region per tile: a TileHeader and the
+// tile's SoA runner arrays. Every container maps the whole buffer read-only apart from its own
+// region, so a tile can read its neighbours but only write its own state.
+//
+// A runner that leaves its strip is swap-removed and pushed onto the migration queue towards
+// that neighbour, which takes it in at the start of the next tick. Queues are double-buffered
+// by tick parity: the host doesn't start a tick until every container has finished the last,
+// so the half a tile reads was completed by its neighbour in the previous tick. A tile only
+// sends a neighbour up to half of the spare capacity that neighbour published last tick, as
+// it may be filled from both sides, and the published figure holds back room for a full tick
+// of runners still in flight. Runners that don't fit wait outside the strip.
+#define TILE_ALIGN       65536  // the largest page size of the supported hosts
+#define MIGRATION_SLOTS  64     // per direction per tick
+#define TILE_LEFT        0
+#define TILE_RIGHT       1
+
+typedef struct {
+  uint32_t count;
+  Runner runners[MIGRATION_SLOTS];
+} MigrationQueue;
+
+typedef struct {
+  uint32_t n;        // runner slots in use; [n, capacity) are DEAD at (0, 0)
+  uint32_t tick;     // ticks completed; its parity selects the queue half being written
+  uint32_t free[2];  // spare capacity at the end of the last tick with each parity
+  MigrationQueue out[2][2];  // [TILE_LEFT/TILE_RIGHT][tick parity]
+} TileHeader;
+
+#define TILE_ARRAYS_OFFSET  ((sizeof(TileHeader) + 15) & ~15)
+
+#define MIGRATION_RESERVE  (2 * MIGRATION_SLOTS)
+
+// Each tile can hold twice its even share of the runners, plus the in-flight reserve.
+static inline uint32_t tile_capacity(const GridHeader *h) {
+  uint32_t cap = 2 * ((h->n_runners + h->n_tiles - 1) / h->n_tiles) + MIGRATION_RESERVE;
+  return (cap + ACTOR_LANES - 1) & ~(ACTOR_LANES - 1);
+}
+
+static inline size_t tile_region_size(const GridHeader *h) {
+  size_t size = TILE_ARRAYS_OFFSET + 3 * sizeof(int) * (size_t)tile_capacity(h);
+  return (size + TILE_ALIGN - 1) & ~(size_t)(TILE_ALIGN - 1);
+}
+
+static inline size_t tile_region_offset(const GridHeader *h, int tile) {
+  return TILE_ALIGN + tile * tile_region_size(h);
+}
+
+// Tile t covers columns [tile_x0(t), tile_x0(t + 1)).
+static inline int tile_x0(const GridHeader *h, int tile) {
+  return (int)((uint64_t)h->grid_w * tile / h->n_tiles);
+}
+
+static inline TileHeader *tile_header(const GridHeader *h, void *rw_ptr, int tile) {
+  return (TileHeader *)((uint8_t *)rw_ptr + tile_region_offset(h, tile));
+}
+
+static inline RunnerArrays tile_arrays(const GridHeader *h, void *rw_ptr, int tile) {
+  int *base = (int *)((uint8_t *)tile_header(h, rw_ptr, tile) + TILE_ARRAYS_OFFSET);
+  uint32_t cap = tile_capacity(h);
+  return (RunnerArrays){ base, base + cap, base + 2 * cap };
+}
+
+// Host side: the runners are read as groups, one per tile or a single group when untiled.
+static inline int runner_groups(const GridHeader *h) {
+  return h->n_tiles ? (int)h->n_tiles : 1;
+}
+
+static inline int group_size(const GridHeader *h, void *rw_ptr, int group) {
+  if (h->n_tiles == 0) {
+    return h->n_runners;
+  }
+  uint32_t n = tile_header(h, rw_ptr, group)->n;
+  return n < tile_capacity(h) ? n : tile_capacity(h);
+}
+
+static inline Runner group_runner(const GridHeader *h, void *rw_ptr, int group, int i) {
+  if (h->n_tiles == 0) {
+    return get_runner(h, rw_ptr, i);
+  }
+  RunnerArrays a = tile_arrays(h, rw_ptr, group);
+  return (Runner){ a.x[i], a.y[i], a.state[i] };
+}
+
+static inline size_t rw_buffer_size(const GridHeader *h) {
+  if (h->n_tiles != 0) {
+    return TILE_ALIGN + h->n_tiles * tile_region_size(h);
+  }
+  if (h->index_shift == 0) {
+    return actors_size(h);
+  }
+  size_t n_buckets = (size_t)index_buckets_w(h) * index_buckets_h(h);
+  return ((actors_size(h) + 15) & ~15) + sizeof(int) * (n_buckets + runner_stride(h));
+}
+
 typedef enum {
   CMD_READY = '@',
   CMD_FAILED = '*',
   CMD_INIT = 'i',
   CMD_TICK = 't',
+  CMD_TICK_N = 'n',
   CMD_EXIT = 'x',
-  CMD_MODIFY_GRID = 'm'
+  CMD_MODIFY_GRID = 'm',
+  CMD_LARGE_ALLOC = 'a'
 } Command;
 
+// CMD_TICK_N's argument is the number of ticks to run, optionally combined with this flag to
+// keep all containers in step with each other after every tick.
+#define TICK_N_LOCKSTEP  (1u << 31)
+
+// Sent by the host to start a container, with the control page fd attached, and followed by a
+// BufferManifest of the shared buffers (see buffer-manifest.c): the grid, then the actors. It
+// goes to the container zygote, which replies with the new container's pid, or straight to a
+// container exec'd by the host.
+typedef struct {
+  int module;  // index into the zygote's module list
+  int slot;
+  int tile;    // -1 for the hunter, or when untiled
+  char label[8];
+} SpawnRequest;
+
 #endif
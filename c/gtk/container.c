@@ -13,64 +13,81 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
 #include "wasm_c_api.h"
 #include "common.h"
 
-enum ExportFuncs {
-  FN_MALLOC,
-  FN_CREATE_CONTEXT,
-  FN_UPDATE_CONTEXT,
-  FN_INIT,
-  FN_TICK,
-  FN_MODIFY_GRID,
-};
-
-const char *kExportFuncNames[] = {
-  "malloc_",
-  "create_context",
-  "update_context",
-  "init",
-  "tick",
-  "modify_grid",
-};
+// (ID, export name, i32 params, i32 results); see wamr-wrapper.c.
+#define EXPORT_FUNCS(X)                    \
+  X(MALLOC, malloc_, 1, 1)                 \
+  X(CREATE_CONTEXT, create_context, 2, 1)  \
+  X(UPDATE_CONTEXT, update_context, 3, 0)  \
+  X(INIT, init, 3, 0)                      \
+  X(TICK, tick, 1, 0)                      \
+  X(MODIFY_GRID, modify_grid, 1, 0)        \
+  X(LARGE_ALLOC, large_alloc, 0, 0)
 
 #include "../wamr-wrapper.c"
+#include "../doorbell.c"
+#include "../unix-socket.c"
+#include "../buffer-manifest.c"
 
 typedef struct {
   const char *label;
 
   // Host/container comms
-  int read_fd;
-  int write_fd;
+  DoorbellSlot *doorbells;
+  DoorbellSlot *doorbell;
+  int ctl_size;
+  uint32_t seq;
+  uint32_t steps;
+  pid_t parent_pid;
 
   // Module runtime context
   int wasm_context;
+  int wasm_alloc_index;
+  int wasm_alloc_size;
 
-  // Shared buffers
-  unsigned char *ro_buf;
-  const char *ro_name;
-  int ro_size;
+  // Linear memory location as of the last call into the module
+  void *memory_base;
+  size_t memory_size;
 
-  unsigned char *rw_buf;
-  const char *rw_name;
-  int rw_size;
+  // With WASM_GUARD_PAGES set, the shared buffers are fenced off by PROT_NONE pages and memory
+  // accesses are only checked by the engine's guard region; see check_guard_region().
+  bool guard_pages;
+  // Shared buffers, as given by the host's manifest: the grid is first and the actors second.
+  // A tile's runner container only has a writable window onto its own region of the actors,
+  // so it can read its neighbours' regions but not change them.
+  BufferManifest buffers;
+  int buffer_fds[MANIFEST_MAX_BUFFERS];
+  unsigned char *bufs[MANIFEST_MAX_BUFFERS];
+  int tile;
 } Context;
 
 Context ctx = { 0 };
 
-// Aligns to next largest page boundary, unless p is already aligned.
-static void *page_align(void *p, size_t page_size) {
-  return (void *)((((size_t)p - 1) & ~(page_size - 1)) + page_size);
-}
-
 static void info(const char *fmt, ...) {
   char msg[500];
   va_list ap;
@@ -90,89 +107,244 @@ static bool error(const char *fmt, ...) {
   return false;
 }
 
-static bool map_shared_buffers() {
-  // Call wasm.malloc to reserve enough space for the shared buffers plus alignment concerns.
-  int page_size = sysconf(_SC_PAGESIZE);
-  int wasm_alloc_size = ctx.ro_size + ctx.rw_size + 3 * page_size;
-  CallResult wasm_alloc_res = wasm_call(FN_MALLOC, wasm_alloc_size);
-  if (!wasm_alloc_res.ok) {
-    return false;
+static bool host_alive(pid_t pid) {
+  // Our parent is either the host or the zygote, which exits along with the host. Either way,
+  // if it dies we are reparented, so our parent pid changes.
+  return getppid() == pid;
+}
+
+// For lockstep barriers: the peer we are waiting on, and the host, must both still be running.
+static bool peer_alive(pid_t pid) {
+  return process_running(pid) && host_alive(ctx.parent_pid);
+}
+
+// The control buffer holds every slot's doorbell followed by every slot's call stats page. The
+// stats are only recorded with WASM_CALL_STATS set, as timing every export call isn't free.
+static void map_doorbell(int fd, int slot) {
+  assert(slot < MAX_CONTAINERS);
+  ctx.ctl_size = MAX_CONTAINERS * (sizeof(DoorbellSlot) + sizeof(CallStats));
+  ctx.doorbells = mmap(NULL, ctx.ctl_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(ctx.doorbells != MAP_FAILED && close(fd) != -1);
+  ctx.doorbell = &ctx.doorbells[slot];
+  ctx.doorbell->pid = getpid();
+  ctx.parent_pid = getppid();
+
+  if (getenv("WASM_CALL_STATS") != NULL) {
+    wc.stats = (CallStats *)&ctx.doorbells[MAX_CONTAINERS] + slot;
+    call_stats_init(wc.stats, kExportFuncNames, N_FUNCS);
   }
+}
+
+static bool check_memory();
+
+// Any i32 address plus any i32 offset, as reserved by WAMR's hardware bound check.
+#define GUARD_REGION_SIZE  (8ull << 30)
 
-  // Get the location of wasm's linear memory buffer in our address space.
+// Overlays the shared buffers onto the reserved allocation in linear memory, aligned against
+// our page boundaries. The alignment depends on where the engine has placed linear memory, so
+// it is recomputed each time.
+static void overlay_shared_buffers() {
+  int page_size = sysconf(_SC_PAGESIZE);
+  int guard = ctx.guard_pages ? page_size : 0;
   void *wasm_memory_base = wasm_memory_data(wc.memory);
 
   // Convert the reserve alloc's linear address to our address space.
-  void *wasm_alloc_ptr = wasm_memory_base + wasm_alloc_res.val;
+  void *wasm_alloc_ptr = wasm_memory_base + ctx.wasm_alloc_index;
+  manifest_overlay(&ctx.buffers, ctx.buffer_fds, wasm_alloc_ptr, ctx.wasm_alloc_size,
+                               guard, ctx.bufs);
+  ctx.memory_base = wasm_memory_base;
+  ctx.memory_size = wasm_memory_data_size(wc.memory);
+  for (uint32_t i = 0; i < ctx.buffers.n_buffers; i++) {
+    const BufferEntry *e = &ctx.buffers.entries[i];
+    info("  %-8s buffer: %p, %s%s", e->name, ctx.bufs[i],
+         (e->prot & PROT_WRITE) ? "read-write" : e->window_size ? "writable window" : "read-only",
+         (e->flags & BUFFER_HUGE_PAGES) ? ", huge pages" : "");
+  }
+}
+
+static bool map_shared_buffers() {
+  // Call wasm.malloc to reserve enough space for every shared buffer at its alignment, and the
+  // guard pages.
+  int page_size = sysconf(_SC_PAGESIZE);
+  size_t reserve = manifest_reserve_size(&ctx.buffers, page_size, ctx.guard_pages ? page_size : 0);
+  if (reserve > INT_MAX) {
+    return error("Shared buffers too large for linear memory");
+  }
+  ctx.wasm_alloc_size = reserve;
+  CallResult wasm_alloc_res = wasm_call_malloc_(ctx.wasm_alloc_size);
+  if (!wasm_alloc_res.ok) {
+    return false;
+  }
+  ctx.wasm_alloc_index = wasm_alloc_res.val;
+  overlay_shared_buffers();
 
-  // Align the shared buffers inside wasm's linear memory against our page boundaries.
-  void *aligned_ro_ptr = page_align(wasm_alloc_ptr, page_size);
-  void *aligned_rw_ptr = page_align(aligned_ro_ptr + ctx.ro_size, page_size);
+  // Inform the wasm module of the aligned shared buffer location in linear memory.
+  int ro_index = (void *)ctx.bufs[0] - ctx.memory_base;
+  int rw_index = (void *)ctx.bufs[1] - ctx.memory_base;
+  CallResult ctx_res = wasm_call_create_context(ro_index, rw_index);
+  ctx.wasm_context = ctx_res.val;
+  if (ctx_res.ok && ctx.wasm_context == 0) {
+    return error("Module rejected the shared buffer layout");
+  }
+  return ctx_res.ok && check_memory();
+}
 
-  // Verify that our overall mmapped size will be safely contained in the wasm allocation.
-  void *end = page_align(aligned_rw_ptr + ctx.rw_size, page_size);
-  assert(end - wasm_alloc_ptr <= wasm_alloc_size);
+// Whether [addr, addr + size) is still mapped from the start of 'fd' (or, with an 'fd' of -1,
+// is anonymous PROT_NONE memory), going by /proc/self/maps.
+static bool mapped_from(void *addr, size_t size, int fd) {
+  struct stat st = { 0 };
+  assert(fd == -1 || fstat(fd, &st) == 0);
+  FILE *maps = fopen("/proc/self/maps", "r");
+  assert(maps != NULL);
+  uintptr_t start = (uintptr_t)addr;
+  uintptr_t cur = start;
+  char line[PATH_MAX + 100];
+  while (cur < start + size && fgets(line, sizeof(line), maps) != NULL) {
+    unsigned long lo, hi, offset, inode;
+    unsigned int major, minor;
+    char perms[5];
+    if (sscanf(line, "%lx-%lx %4s %lx %x:%x %lu", &lo, &hi, perms, &offset, &major, &minor,
+               &inode) != 7 || hi <= cur) {
+      continue;
+    }
+    // The entries are sorted, so this is either the one holding 'cur' or there is a gap.
+    bool ours = (fd == -1) ? inode == 0 && strncmp(perms, "---", 3) == 0
+                           : inode == st.st_ino && makedev(major, minor) == st.st_dev &&
+                             offset + (cur - lo) == cur - start;
+    if (lo > cur || !ours) {
+      break;
+    }
+    cur = hi;
+  }
+  fclose(maps);
+  return cur >= start + size;
+}
 
-  // Map read-only buffer.
-  int flags = MAP_SHARED | MAP_FIXED;
-  int ro_fd = shm_open(ctx.ro_name, O_RDONLY, S_IRUSR | S_IWUSR);
-  if (ro_fd == -1) {
-    return error("Error calling shm_open");
+// Replaces what is left of the overlay at 'old_bufs' after linear memory has moved. If the
+// engine returned the old memory to the C heap rather than unmapping it, the buffers are still
+// mapped there and heap writes would land in them (or fault on the read-only one and the guard
+// pages), so they become plain private pages. If it was unmapped, the range may already have
+// been reused, so only pages that are provably still our mappings are touched.
+static void release_old_overlay(unsigned char **old_bufs) {
+  size_t guard = ctx.guard_pages ? sysconf(_SC_PAGESIZE) : 0;
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+  for (uint32_t i = 0; i < ctx.buffers.n_buffers; i++) {
+    size_t size = ctx.buffers.entries[i].size;
+    if (!mapped_from(old_bufs[i], size, ctx.buffer_fds[i])) {
+      continue;
+    }
+    // The guard pages are only trusted next to a buffer that is still mapped. The last buffer
+    // is also followed by one.
+    void *before = old_bufs[i] - guard;
+    void *after = (void *)align_up((uintptr_t)old_bufs[i] + size, sysconf(_SC_PAGESIZE));
+    if (guard && mapped_from(before, guard, -1)) {
+      assert(mmap(before, guard, prot, flags, -1, 0) == before);
+    }
+    if (guard && i == ctx.buffers.n_buffers - 1 && mapped_from(after, guard, -1)) {
+      assert(mmap(after, guard, prot, flags, -1, 0) == after);
+    }
+    assert(mmap(old_bufs[i], size, prot, flags, -1, 0) == old_bufs[i]);
   }
-  ctx.ro_buf = mmap(aligned_ro_ptr, ctx.ro_size, PROT_READ, flags, ro_fd, 0);
-  assert(ctx.ro_buf == aligned_ro_ptr);
+}
 
-  // Map read-write buffer.
-  int rw_fd = shm_open(ctx.rw_name, O_RDWR, S_IRUSR | S_IWUSR);
-  if (rw_fd == -1) {
-    return error("Error calling shm_open");
+// Must be called after every call into the module. If memory.grow made the engine reallocate
+// linear memory, the buffers are no longer overlaid on the module's view of them: the new
+// memory only holds a copy taken at the time of the move. Re-map them inside the relocated
+// reservation and tell the module where they are now.
+static bool check_memory() {
+  void *base = wasm_memory_data(wc.memory);
+  size_t size = wasm_memory_data_size(wc.memory);
+  if (base == ctx.memory_base) {
+    // Grown in place (or not at all); the overlay is intact.
+    ctx.memory_size = size;
+    return true;
   }
-  ctx.rw_buf = mmap(aligned_rw_ptr, ctx.rw_size, PROT_READ | PROT_WRITE, flags, rw_fd, 0);
-  assert(ctx.rw_buf == aligned_rw_ptr);
+  info("Linear memory moved from %p (%zu bytes) to %p (%zu bytes)", ctx.memory_base,
+       ctx.memory_size, base, size);
 
-  // We don't need the file descriptors once the buffers have been mapped.
-  assert(close(rw_fd) != -1 && close(ro_fd) != -1);
-  info("  read-only  buffer: %p", ctx.ro_buf);
-  info("  read-write buffer: %p", ctx.rw_buf);
+  unsigned char *old_bufs[MANIFEST_MAX_BUFFERS];
+  memcpy(old_bufs, ctx.bufs, sizeof(old_bufs));
+  overlay_shared_buffers();
+  release_old_overlay(old_bufs);
 
-  // Inform the wasm module of the aligned shared buffer location in linear memory.
-  int ro_index = (void *)ctx.ro_buf - wasm_memory_base;
-  int rw_index = (void *)ctx.rw_buf - wasm_memory_base;
-  CallResult ctx_res = wasm_call(FN_CREATE_CONTEXT, ro_index, rw_index);
-  ctx.wasm_context = ctx_res.val;
-  return ctx_res.ok;
+  int ro_index = (void *)ctx.bufs[0] - ctx.memory_base;
+  int rw_index = (void *)ctx.bufs[1] - ctx.memory_base;
+  return wasm_call_update_context(ctx.wasm_context, ro_index, rw_index).ok;
 }
 
 static void destroy_context() {
-  if (ctx.rw_buf != NULL) {
-    assert(munmap(ctx.rw_buf, ctx.rw_size) != -1);
+  // The buffer fds are kept open while the container runs, for re-mapping after memory.grow.
+  for (uint32_t i = 0; i < ctx.buffers.n_buffers; i++) {
+    if (ctx.bufs[i] != NULL) {
+      assert(munmap(ctx.bufs[i], ctx.buffers.entries[i].size) != -1);
+    }
+    assert(close(ctx.buffer_fds[i]) != -1);
   }
-  if (ctx.ro_buf != NULL) {
-    assert(munmap(ctx.ro_buf, ctx.ro_size) != -1);
+  if (ctx.doorbells != NULL) {
+    assert(munmap(ctx.doorbells, ctx.ctl_size) != -1);
   }
 }
 
-static void send(Command code) {
-  assert(write(ctx.write_fd, &code, 1) == 1);
+// Acks the current command sequence number.
+static void send_ack(Command code) {
+  doorbell_answer(ctx.doorbell, code, ctx.seq);
+}
+
+// Runs 'n' ticks within a single command. Every tick advances the step count in our doorbell
+// slot; in lockstep mode we then wait for all peers to reach the same step before continuing.
+// Each tick is a seqlock write, so the host can copy the state in between.
+static bool run_ticks(uint32_t n, bool lockstep) {
+  int peers = ctx.doorbell->peers;
+  for (uint32_t i = 0; i < n; i++) {
+    doorbell_write_begin(ctx.doorbell);
+    bool ticked = wasm_call_tick(ctx.wasm_context).ok;
+    doorbell_write_end(ctx.doorbell);
+    if (!ticked || !check_memory()) {
+      doorbell_step(ctx.doorbell, ctx.steps + DOORBELL_STEP_ABANDONED, lockstep);
+      return false;
+    }
+    doorbell_step(ctx.doorbell, ++ctx.steps, lockstep);
+    if (lockstep && !doorbell_barrier(ctx.doorbells, peers, ctx.steps, peer_alive)) {
+      // Release any peers still waiting on us.
+      doorbell_step(ctx.doorbell, ctx.steps + DOORBELL_STEP_ABANDONED, true);
+      return error("A peer or the host exited during lockstep batch");
+    }
+  }
+  return true;
 }
 
 static void command_loop() {
   bool ok = true;
   while (ok) {
-    char cmd = '-';
-    assert(read(ctx.read_fd, &cmd, 1) == 1);
+    DoorbellSlot *slot = ctx.doorbell;
+    if (!doorbell_wait(slot, &slot->cmd_seq, ++ctx.seq, host_alive, ctx.parent_pid)) {
+      error("Host has exited");
+      return;
+    }
+    char cmd = ctx.doorbell->cmd;
     switch (cmd) {
       case CMD_INIT:
-        ok = wasm_call(FN_INIT, ctx.wasm_context, time(NULL)).ok;
+        // The argument is the seed chosen by the host, so a run can be repeated with --seed.
+        doorbell_write_begin(ctx.doorbell);
+        ok = wasm_call_init(ctx.wasm_context, ctx.doorbell->arg, ctx.tile).ok;
+        doorbell_write_end(ctx.doorbell);
+        ok = ok && check_memory();
         break;
       case CMD_TICK:
-        ok = wasm_call(FN_TICK, ctx.wasm_context).ok;
+        ok = run_ticks(1, false);
+        break;
+      case CMD_TICK_N:
+        ok = run_ticks(ctx.doorbell->arg & ~TICK_N_LOCKSTEP, ctx.doorbell->arg & TICK_N_LOCKSTEP);
         break;
       case CMD_MODIFY_GRID:
-        ok = wasm_call(FN_MODIFY_GRID, ctx.wasm_context).ok;
+        ok = wasm_call_modify_grid(ctx.wasm_context).ok && check_memory();
+        break;
+      case CMD_LARGE_ALLOC:
+        ok = wasm_call_large_alloc().ok && check_memory();
         break;
       case CMD_EXIT:
-        send(cmd);
+        send_ack(cmd);
         return;
       default:
         ok = error("Unknown command code: '%c' (%d)", cmd, cmd);
@@ -180,30 +352,148 @@ static void command_loop() {
     }
     if (ok) {
       // Send ack to host.
-      send(cmd);
+      send_ack(cmd);
     } else {
       printf("Command failed: %c\n", cmd);
-      send(CMD_FAILED);
+      send_ack(CMD_FAILED);
     }
   }
 }
 
-int main(int argc, const char *argv[]) {
-  assert(argc == 9);
-  const char *module_name = argv[1];
-  ctx.label = argv[2];
-  ctx.read_fd = atoi(argv[3]);
-  ctx.write_fd = atoi(argv[4]);
-  ctx.ro_name = argv[5];
-  ctx.ro_size = atoi(argv[6]);
-  ctx.rw_name = argv[7];
-  ctx.rw_size = atoi(argv[8]);
+// Module code compiled without bounds checks relies on every reachable address faulting
+// outside linear memory, so the engine must have reserved the whole GUARD_REGION_SIZE from the
+// start of it; WAMR does with its hardware bound check, which also keeps memory.grow in place.
+// The reservation shows up as contiguous mappings in /proc/self/maps.
+static bool check_guard_region() {
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) {
+    return error("Cannot read /proc/self/maps");
+  }
+  uintptr_t base = (uintptr_t)wasm_memory_data(wc.memory);
+  uintptr_t end = base;
+  uintptr_t lo, hi;
+  char line[512];
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR, &lo, &hi) == 2 && lo <= end && hi > end) {
+      end = hi;
+    }
+  }
+  fclose(maps);
+  if (end - base < GUARD_REGION_SIZE) {
+    return error("WASM_GUARD_PAGES needs an engine built with hardware bound checks; only "
+                 "%" PRIuPTR " bytes are reserved for linear memory", end - base);
+  }
+  return true;
+}
 
-  info("Container started; module '%s', pid %d", module_name, getpid());
-  if (init_module(module_name) && map_shared_buffers()) {
-    send(CMD_READY);
+// Instantiates wc.module in the slot's sandbox and serves host commands until told to exit.
+// The module is NULL if it failed to compile, which is reported to the host like any other
+// startup failure.
+static int run_container(int ctl_fd, int slot) {
+  map_doorbell(ctl_fd, slot);
+
+  // The ready signal (or failure) is always the first sequence number on the doorbell.
+  ctx.seq = 1;
+  if (wc.module != NULL && instantiate_module() && (!ctx.guard_pages || check_guard_region()) &&
+      map_shared_buffers()) {
+    send_ack(CMD_READY);
     command_loop();
+  } else {
+    send_ack(CMD_FAILED);
   }
   destroy_context();
   destroy_module();
+  return 0;
+}
+
+// Reads the guard page mode from the environment before any module is compiled, as it changes
+// how cached AOT code is built.
+static void init_guard_pages() {
+  ctx.guard_pages = getenv("WASM_GUARD_PAGES") != NULL;
+  aot_no_bounds_checks = ctx.guard_pages;
+}
+
+// Receives a SpawnRequest, with the control page fd attached, followed by the manifest of the
+// shared buffers. Returns the control page fd, or -1 once the host has closed the socket.
+static int recv_spawn_request(int sock, SpawnRequest *req) {
+  int ctl_fd = -1;
+  if (recv_with_fds(sock, req, sizeof(*req), &ctl_fd, 1) != 1) {
+    return -1;
+  }
+  req->label[sizeof(req->label) - 1] = 0;
+  if (!recv_manifest(sock, &ctx.buffers, ctx.buffer_fds) || ctx.buffers.n_buffers < 2) {
+    error("Invalid buffer manifest");
+    return -1;
+  }
+  return ctl_fd;
+}
+
+// Compiles every module up front, then forks a container for each SpawnRequest received on
+// 'sock'. Children start from the compiled module, so spawning costs a fork plus instantiation
+// rather than an exec, engine setup and compilation. Exits when the host closes the socket.
+static int run_zygote(int sock, int n_modules, const char *module_names[]) {
+  ctx.label = "z";
+  init_guard_pages();
+  info("Zygote started; %d modules, pid %d", n_modules, getpid());
+  wasm_module_t *modules[n_modules];
+  for (int i = 0; i < n_modules; i++) {
+    if ((modules[i] = compile_module(module_names[i])) == NULL) {
+      return 1;
+    }
+  }
+
+  // Containers are reaped automatically; the host monitors them with kill(pid, 0).
+  signal(SIGCHLD, SIG_IGN);
+
+  static SpawnRequest req;
+  int ctl_fd;
+  while ((ctl_fd = recv_spawn_request(sock, &req)) != -1) {
+    assert(req.module >= 0 && req.module < n_modules);
+    pid_t pid = fork();
+    if (pid == 0) {
+      // Child
+      assert(close(sock) != -1);
+      signal(SIGCHLD, SIG_DFL);
+      ctx.label = req.label;
+      ctx.tile = req.tile;
+      wc.module = modules[req.module];
+      info("Container started; module '%s', pid %d", module_names[req.module], getpid());
+      return run_container(ctl_fd, req.slot);
+    }
+    assert(close(ctl_fd) != -1);
+    for (uint32_t i = 0; i < ctx.buffers.n_buffers; i++) {
+      assert(close(ctx.buffer_fds[i]) != -1);
+    }
+    assert(send_with_fds(sock, &pid, sizeof(pid), NULL, 0));
+  }
+
+  for (int i = 0; i < n_modules; i++) {
+    wasm_module_delete(modules[i]);
+  }
+  destroy_module();
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc >= 3 && strcmp(argv[1], "--zygote") == 0) {
+    return run_zygote(atoi(argv[2]), argc - 3, argv + 3);
+  }
+
+  // container module sock: the rest of the setup arrives on the socket as for the zygote.
+  assert(argc == 3);
+  const char *module_name = argv[1];
+  int sock = atoi(argv[2]);
+  static SpawnRequest req;
+  int ctl_fd = recv_spawn_request(sock, &req);
+  assert(close(sock) != -1);
+  if (ctl_fd == -1) {
+    return 1;
+  }
+  ctx.label = req.label;
+  ctx.tile = req.tile;
+
+  info("Container started; module '%s', pid %d", module_name, getpid());
+  init_guard_pages();
+  wc.module = compile_module(module_name);
+  return run_container(ctl_fd, req.slot);
 }
@@ -13,138 +13,506 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include "common.h"
+#include "../doorbell.c"
+#include "../unix-socket.c"
+#include "../buffer-manifest.c"
+#include "../call-stats.c"
 
-const char *kReadOnlyBufName = "/shared_ro";
-const char *kReadWriteBufName = "/shared_rw";
-const int kReadOnlyBufSize = sizeof(int[GRID_H][GRID_W]);
-const int kReadWriteBufSize = sizeof(Hunter) + N_RUNNERS * sizeof(Runner);
-
-#define R 0
-#define W 1
+// Every slot's doorbell, followed by every slot's call stats page.
+const int kControlBufSize = MAX_CONTAINERS * (sizeof(DoorbellSlot) + sizeof(CallStats));
 
 typedef struct {
-  int p2c[2];
-  int c2p[2];
-} Pipes;
+  int index;
+  char label[8];
+  pid_t pid;
+  uint32_t seq;
+} Container;
+
+typedef enum {
+  // Ring every container's doorbell, then gather the acks; containers run concurrently.
+  DISPATCH_BROADCAST,
+  // Ring each doorbell and wait for its ack before moving on to the next container.
+  DISPATCH_SERIAL,
+} DispatchMode;
 
 typedef struct {
-  Pipes pipes[2];
+  Container containers[MAX_CONTAINERS];
+  int n_containers;
+  const char **modules;
+  bool use_zygote;
+  int zygote_sock;
+  DispatchMode dispatch;
+  uint32_t ticks_per_frame;
+  bool lockstep;
+  bool async_ticks;    // ticks are left running while the host draws; see take_snapshot()
+  bool ticks_pending;  // a tick command has been rung but not yet collected
+  bool headless;
+  uint32_t headless_ticks;
+  uint32_t seed;
+  bool huge_pages;
+  DoorbellSlot *doorbells;
+  CallStats *stats;    // only filled in by the containers with WASM_CALL_STATS set
+  int ctl_fd;
+
+  // The grid and actor buffers; the fds stay open to be handed to each new container.
+  BufferManifest buffers;
+  int buffer_fds[MANIFEST_MAX_BUFFERS];
+
+  // Simulation layout, fixed by the options at startup
+  int grid_w;
+  int grid_h;
+  int n_runners;
+  GridEncoding encoding;
+  ActorLayout layout;
+  int index_shift;
+  int n_tiles;
+  int ro_size;
+  int rw_size;
+  double scale;
+
+  GridHeader *grid;  // at the start of shared_ro
+  cairo_surface_t *grid_layer;  // the grid as last drawn; see update_grid_layer()
   void *shared_ro;
   void *shared_rw;
+  void *snapshots[2];  // with --async, copies of the actor state; 'front' is the last whole one
+  int front;
   bool enable_host_modify;
 } Context;
 
 Context ctx = { 0 };
 
-static void *create_shared_buffer(const char *name, int size) {
-  // shm_open() creates the actual memory buffer for sharing.
-  int fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
-  assert(fd != -1);
-  assert(ftruncate(fd, size) != -1);
-
-  // mmap() allows the host to access the shared buffers (initialise, read for GUI display, etc).
-  char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  assert(close(fd) != -1);
+// The control page is mapped by the containers outside linear memory, so it isn't part of the
+// manifest; its fd is attached to each SpawnRequest instead.
+static void *create_control_buffer() {
+  ctx.ctl_fd = memfd_create("ctl", MFD_CLOEXEC);
+  assert(ctx.ctl_fd != -1 && ftruncate(ctx.ctl_fd, kControlBufSize) != -1);
+  void *shared = mmap(NULL, kControlBufSize, PROT_READ | PROT_WRITE, MAP_SHARED, ctx.ctl_fd, 0);
+  assert(shared != MAP_FAILED);
   return shared;
 }
 
-static void fork_container(Pipes *pipes, const char *module, const char *label) {
-  assert(pipe(pipes->p2c) == 0);
-  assert(pipe(pipes->c2p) == 0);
-
-  if (fork() == 0) {
-    // Child
-    close(pipes->p2c[W]);
-    close(pipes->c2p[R]);
-
-    char read_fd[3];
-    char write_fd[3];
-    char ro_size[20];
-    char rw_size[20];
-    sprintf(read_fd, "%d", pipes->p2c[R]);
-    sprintf(write_fd, "%d", pipes->c2p[W]);
-    sprintf(ro_size, "%d", kReadOnlyBufSize);
-    sprintf(rw_size, "%d", kReadWriteBufSize);
-    execlp("./container", "container", module, label, read_fd, write_fd,
-           kReadOnlyBufName, ro_size, kReadWriteBufName, rw_size, NULL);
+static bool container_alive(pid_t pid) {
+  // WNOWAIT leaves an exited container as a zombie so it is still reaped on shutdown.
+  siginfo_t info = { 0 };
+  if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0) {
+    return info.si_pid == 0;
+  }
+  // Containers spawned by the zygote are not our children; the zygote reaps them.
+  return errno == ECHILD && kill(pid, 0) == 0;
+}
+
+// Waits for the container to acknowledge its most recent command.
+static Command wait_ack(Container *c) {
+  DoorbellSlot *slot = &ctx.doorbells[c->index];
+  if (!doorbell_wait(slot, &slot->ack_seq, c->seq, container_alive, c->pid)) {
+    printf(">> Container %d exited unexpectedly\n", c->index);
+    return CMD_FAILED;
+  }
+  return slot->ack;
+}
+
+// Sends 'req' and the shared buffers to a container, or to the zygote to pass on to one. The
+// container may only write [window_offset, +window_size) of the actors buffer.
+static void send_spawn_request(int sock, const SpawnRequest *req, size_t window_offset,
+                               size_t window_size) {
+  BufferManifest m = ctx.buffers;
+  BufferEntry *rw = &m.entries[1];
+  if (window_offset != 0 || window_size != rw->size) {
+    rw->prot = PROT_READ;
+    rw->window_offset = window_offset;
+    rw->window_size = window_size;
+  }
+  assert(send_with_fds(sock, req, sizeof(*req), &ctx.ctl_fd, 1));
+  assert(send_manifest(sock, &m, ctx.buffer_fds));
+}
+
+static pid_t fork_container(const char *module, const SpawnRequest *req, size_t window_offset,
+                            size_t window_size) {
+  int sv[2];
+  assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != -1);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Child: only the container's end of the socket should survive the exec.
+    char sock[12];
+    sprintf(sock, "%d", sv[1]);
+    assert(fcntl(sv[1], F_SETFD, 0) != -1);
+    execlp("./container", "container", module, sock, NULL);
+    assert(false);  // should not be reached
+  }
+  assert(pid != -1 && close(sv[1]) != -1);
+  send_spawn_request(sv[0], req, window_offset, window_size);
+  assert(close(sv[0]) != -1);
+  return pid;
+}
+
+// Starts the zygote, which compiles all of ctx.modules before serving spawn requests.
+static void start_zygote(int n_modules) {
+  int sv[2];
+  assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != -1);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Child: only the zygote's end of the socket should survive the exec.
+    char sock[12];
+    sprintf(sock, "%d", sv[1]);
+    assert(fcntl(sv[1], F_SETFD, 0) != -1);
+    const char *args[4 + MAX_CONTAINERS] = { "container", "--zygote", sock };
+    assert(n_modules <= MAX_CONTAINERS);
+    memcpy(args + 3, ctx.modules, n_modules * sizeof(*args));
+    execvp("./container", (char **)args);
     assert(false);  // should not be reached
+  }
+  assert(pid != -1 && close(sv[1]) != -1);
+  ctx.zygote_sock = sv[0];
+}
+
+// Asks the zygote to fork a container, handing over the shared buffers as fds. The grid's
+// memfd is sealed against writable mappings, so the container can only map it read-only.
+static pid_t spawn_container(const SpawnRequest *req, size_t window_offset, size_t window_size) {
+  pid_t pid = -1;
+  send_spawn_request(ctx.zygote_sock, req, window_offset, window_size);
+  assert(recv_with_fds(ctx.zygote_sock, &pid, sizeof(pid), NULL, 0) == 0);
+  return pid;
+}
+
+// Starts a container running ctx.modules[module] in the next doorbell slot, able to write only
+// [window_offset, +window_size) of the read-write buffer. 'tile' is passed on to init().
+static void start_container(int module, const char *label, int tile, size_t window_offset,
+                            size_t window_size) {
+  assert(ctx.n_containers < MAX_CONTAINERS);
+  int index = ctx.n_containers++;
+  Container *c = &ctx.containers[index];
+  c->index = index;
+  snprintf(c->label, sizeof(c->label), "%s", label);
+  SpawnRequest req = { .module = module, .slot = index, .tile = tile };
+  snprintf(req.label, sizeof(req.label), "%s", label);
+  if (ctx.use_zygote) {
+    c->pid = spawn_container(&req, window_offset, window_size);
   } else {
-    // Parent
-    close(pipes->p2c[R]);
-    close(pipes->c2p[W]);
+    c->pid = fork_container(ctx.modules[module], &req, window_offset, window_size);
+  }
+
+  // Wait for the ready signal from the container, which is always the first sequence number
+  // on the doorbell.
+  assert(c->pid != -1);
+  c->seq = 1;
+  assert(wait_ack(c) == CMD_READY);
+}
+
+static void ring(Container *c, Command code, uint32_t arg) {
+  ctx.doorbells[c->index].peers = ctx.n_containers;
+  doorbell_ring(&ctx.doorbells[c->index], code, arg, ++c->seq);
+}
+
+static bool collect(Container *c, Command code) {
+  Command ack = wait_ack(c);
+  if (ack == CMD_FAILED) {
+    printf(">> Received failure signal, aborting\n");
+    return false;
+  }
+  if (ack != code) {
+    printf(">> Incorrect ack '%c' received for command '%c'\n", ack, code);
+    return false;
+  }
+  return true;
+}
 
-    // Wait for the ready signal from the container binary.
-    char ready;
-    assert(read(pipes->c2p[R], &ready, 1) == 1);
-    assert(ready == CMD_READY);
+static void ring_all(Command code, uint32_t arg) {
+  for (int i = 0; i < ctx.n_containers; i++) {
+    ring(&ctx.containers[i], code, arg);
   }
 }
 
-static bool send(Command code) {
-  for (int i = 0; i < 2; i++) {
-    assert(write(ctx.pipes[i].p2c[W], &code, 1) == 1);
+// Gathers every ack, even after a failure, to keep the sequence numbers in step.
+static bool collect_all(Command code) {
+  bool ok = true;
+  for (int i = 0; i < ctx.n_containers; i++) {
+    ok = collect(&ctx.containers[i], code) && ok;
+  }
+  return ok;
+}
+
+static Command tick_cmd(uint32_t *arg) {
+  *arg = ctx.ticks_per_frame | (ctx.lockstep ? TICK_N_LOCKSTEP : 0);
+  return (ctx.ticks_per_frame == 1) ? CMD_TICK : CMD_TICK_N;
+}
+
+// Collects the acks of a tick command left running by send_ticks() in async mode.
+static bool finish_ticks() {
+  if (!ctx.ticks_pending) {
+    return true;
+  }
+  ctx.ticks_pending = false;
+  uint32_t arg;
+  return collect_all(tick_cmd(&arg));
+}
+
+// In broadcast mode a command takes as long as the slowest container rather than the sum of
+// all of them. Containers then see each other's shared state from either before or after the
+// concurrent step; serial mode keeps the strict hunter-then-runner ordering.
+static bool send_cmd_arg(Command code, uint32_t arg) {
+  if (!finish_ticks()) {
+    return false;
+  }
+  if (ctx.dispatch == DISPATCH_SERIAL) {
+    for (int i = 0; i < ctx.n_containers; i++) {
+      ring(&ctx.containers[i], code, arg);
+      if (!collect(&ctx.containers[i], code)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  ring_all(code, arg);
+  return collect_all(code);
+}
+
+static bool send_cmd(Command code) {
+  return send_cmd_arg(code, 0);
+}
 
-    char ack = '-';
-    assert(read(ctx.pipes[i].c2p[R], &ack, 1) == 1);
-    if (ack == CMD_FAILED) {
-      printf(">> Received failure signal, aborting\n");
+// Advances the simulation by ctx.ticks_per_frame steps with a single round trip. In async mode
+// the containers are left running and the acks are collected before the next command.
+static bool send_ticks() {
+  uint32_t arg;
+  Command code = tick_cmd(&arg);
+  if (!ctx.async_ticks) {
+    return send_cmd_arg(code, arg);
+  }
+  if (!finish_ticks()) {
+    return false;
+  }
+  ring_all(code, arg);
+  ctx.ticks_pending = true;
+  return true;
+}
+
+// Copies the actors (but not the spatial index) into the back snapshot as a seqlock reader,
+// and makes it the front one if no container wrote to the read-write buffer meanwhile. Fails
+// if a container was part way through a tick, leaving the last whole snapshot in front.
+static bool take_snapshot() {
+  int64_t seqs[MAX_CONTAINERS];
+  for (int i = 0; i < ctx.n_containers; i++) {
+    if ((seqs[i] = doorbell_read_begin(&ctx.doorbells[i])) < 0) {
       return false;
     }
-    if (ack != code) {
-      printf(">> Incorrect ack '%c' received for command '%c'\n", ack, code);
+  }
+  uint8_t *back = ctx.snapshots[!ctx.front];
+  if (ctx.n_tiles == 0) {
+    memcpy(back, ctx.shared_rw, actors_size(ctx.grid));
+  } else {
+    memcpy(back, ctx.shared_rw, sizeof(Hunter));
+    size_t used = TILE_ARRAYS_OFFSET + 3 * sizeof(int) * (size_t)tile_capacity(ctx.grid);
+    for (int t = 0; t < ctx.n_tiles; t++) {
+      size_t offset = tile_region_offset(ctx.grid, t);
+      memcpy(back + offset, (uint8_t *)ctx.shared_rw + offset, used);
+    }
+  }
+  for (int i = 0; i < ctx.n_containers; i++) {
+    if (!doorbell_read_valid(&ctx.doorbells[i], seqs[i])) {
       return false;
     }
   }
+  ctx.front = !ctx.front;
+  return true;
+}
+
+// The actor state to display: the shared buffer itself when the host is in lockstep with the
+// containers, otherwise the front snapshot.
+static void *actor_view() {
+  return ctx.async_ticks ? ctx.snapshots[ctx.front] : ctx.shared_rw;
+}
+
+// Prints the per-export call stats of every container; run on exit and on SIGUSR1.
+static gboolean dump_stats(gpointer data) {
+  if (getenv("WASM_CALL_STATS") == NULL) {
+    return true;
+  }
+  printf("Call stats:\n");
+  for (int i = 0; i < ctx.n_containers; i++) {
+    call_stats_dump(&ctx.stats[i], ctx.containers[i].label);
+  }
+  fflush(stdout);
   return true;
 }
 
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Total time container i has spent in its tick() export so far.
+static uint64_t tick_ns(int i) {
+  const CallStatsFunc *f = call_stats_find(&ctx.stats[i], "tick");
+  return f ? atomic_load_explicit(&f->total_ns, memory_order_relaxed) : 0;
+}
+
+// Runs ctx.headless_ticks ticks back to back with no timer or drawing, then reports throughput,
+// round trip latency and how the time splits between the containers' tick() calls and host
+// dispatch plus wake-ups. Broadcast containers run concurrently, so only the busiest one is
+// counted against the elapsed time. In async mode the host also tries to snapshot the actors
+// in every round trip while the containers run.
+static void run_headless() {
+  int n_frames = (ctx.headless_ticks + ctx.ticks_per_frame - 1) / ctx.ticks_per_frame;
+  uint64_t *latency = malloc(n_frames * sizeof(uint64_t));
+  uint64_t exec_start[MAX_CONTAINERS];
+  for (int i = 0; i < ctx.n_containers; i++) {
+    exec_start[i] = tick_ns(i);
+  }
+  int n_snapshots = 0;
+  uint64_t snapshot_ns = 0;
+  uint64_t start = call_stats_now_ns();
+  for (int f = 0; f < n_frames; f++) {
+    uint64_t t = call_stats_now_ns();
+    assert(send_ticks());
+    if (ctx.async_ticks) {
+      uint64_t s = call_stats_now_ns();
+      n_snapshots += take_snapshot();
+      snapshot_ns += call_stats_now_ns() - s;
+      assert(finish_ticks());
+    }
+    latency[f] = call_stats_now_ns() - t;
+  }
+  uint64_t elapsed = call_stats_now_ns() - start;
+  uint64_t n_ticks = (uint64_t)n_frames * ctx.ticks_per_frame;
+
+  printf("Headless: %" PRIu64 " ticks in %.3f s, %.1f ticks/sec (seed %u)\n", n_ticks,
+         elapsed / 1e9, n_ticks * 1e9 / elapsed, ctx.seed);
+  qsort(latency, n_frames, sizeof(*latency), compare_u64);
+  printf("  round trip (%u ticks): p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n",
+         ctx.ticks_per_frame, latency[(n_frames - 1) * 50 / 100] / 1e3,
+         latency[(n_frames - 1) * 90 / 100] / 1e3, latency[(n_frames - 1) * 99 / 100] / 1e3,
+         latency[n_frames - 1] / 1e3);
+  uint64_t busy = 0;
+  for (int i = 0; i < ctx.n_containers; i++) {
+    uint64_t ns = tick_ns(i) - exec_start[i];
+    printf("  %-4s tick()             %10.1f ms  %5.1f%%\n", ctx.containers[i].label, ns / 1e6,
+           100.0 * ns / elapsed);
+    busy = (ctx.dispatch == DISPATCH_SERIAL) ? busy + ns : (ns > busy ? ns : busy);
+  }
+  uint64_t host_ns = elapsed > busy ? elapsed - busy : 0;
+  printf("  host dispatch, wake-ups %10.1f ms  %5.1f%%\n", host_ns / 1e6,
+         100.0 * host_ns / elapsed);
+  if (ctx.async_ticks) {
+    printf("  snapshots               %10.1f ms  %d of %d whole\n", snapshot_ns / 1e6, n_snapshots,
+           n_frames);
+  }
+  free(latency);
+}
+
+static GridHeader make_header() {
+  return (GridHeader){
+    .magic = GRID_MAGIC,
+    .version = GRID_VERSION,
+    .encoding = ctx.encoding,
+    .grid_w = ctx.grid_w,
+    .grid_h = ctx.grid_h,
+    .row_bytes = grid_row_bytes(ctx.grid_w, ctx.encoding),
+    .grid_offset = GRID_ROW_ALIGN,
+    .n_runners = ctx.n_runners,
+    .layout = ctx.layout,
+    .index_shift = ctx.index_shift,
+    .n_tiles = ctx.n_tiles,
+    .dirty_offset = GRID_ROW_ALIGN + grid_row_bytes(ctx.grid_w, ctx.encoding) * ctx.grid_h,
+  };
+}
+
+// Sizes the shared buffers for the configured grid and actor count.
+static void init_layout() {
+  GridHeader header = make_header();
+  size_t ro_size = ro_buffer_size(&header);
+  size_t rw_size = rw_buffer_size(&header);
+  assert(ro_size <= INT_MAX && rw_size <= INT_MAX);
+  ctx.ro_size = ro_size;
+  ctx.rw_size = rw_size;
+
+  // Keep the window no larger than the default grid's.
+  double sx = (double)GRID_W * SCALE / ctx.grid_w;
+  double sy = (double)GRID_H * SCALE / ctx.grid_h;
+  ctx.scale = (sx < sy) ? sx : sy;
+  if (ctx.scale > SCALE) {
+    ctx.scale = SCALE;
+  }
+}
+
+static void set_cell(int x, int y, bool blocked) {
+  uint8_t *row = (uint8_t *)grid_row(ctx.grid, y);
+  if (ctx.encoding == GRID_BITS) {
+    row[x >> 3] = (row[x >> 3] & ~(1 << (x & 7))) | (blocked << (x & 7));
+  } else {
+    row[x] = blocked;
+  }
+  uint8_t *dirty = (uint8_t *)dirty_bitmap(ctx.grid);
+  uint32_t region = dirty_region(ctx.grid, x, y);
+  dirty[region >> 3] |= 1 << (region & 7);
+}
+
 static void init_grid() {
-  int (*grid)[GRID_W] = ctx.shared_ro;
-  memset(grid, 0, kReadOnlyBufSize);
-  for (int x = 0; x < GRID_W; x++) {
-    grid[0][x] = grid[GRID_H - 1][x] = 1;
+  // The buffer was freshly truncated, so every cell starts clear.
+  ctx.grid = ctx.shared_ro;
+  *ctx.grid = make_header();
+  for (int x = 0; x < ctx.grid_w; x++) {
+    set_cell(x, 0, true);
+    set_cell(x, ctx.grid_h - 1, true);
   }
-  for (int y = 1; y < GRID_H - 1; y++) {
-    grid[y][0] = grid[y][GRID_W - 1] = 1;
+  for (int y = 1; y < ctx.grid_h - 1; y++) {
+    set_cell(0, y, true);
+    set_cell(ctx.grid_w - 1, y, true);
   }
-  for (int i = 0; i < N_BLOCKS; i++) {
-    int x = 1 + rand() % (GRID_W - 2);
-    int y = 1 + rand() % (GRID_H - 2);
-    grid[y][x] = 1;
+  // Keep the default grid's density of blocks.
+  long n_blocks = (long)N_BLOCKS * ctx.grid_w * ctx.grid_h / (GRID_W * GRID_H);
+  for (long i = 0; i < n_blocks; i++) {
+    int x = 1 + rand() % (ctx.grid_w - 2);
+    int y = 1 + rand() % (ctx.grid_h - 2);
+    set_cell(x, y, true);
   }
 }
 
 #if 0
 static void print_grid() {
-  int grid[GRID_H][GRID_W];
-  int *gp = &grid[0][0];
-  int *sp = ctx.shared_ro;
-  for (int i = 0; i < GRID_H * GRID_W; i++) {
-    *gp++ = *sp++ ? '#' : ' ';
+  char grid[ctx.grid_h][ctx.grid_w];
+  for (int y = 0; y < ctx.grid_h; y++) {
+    for (int x = 0; x < ctx.grid_w; x++) {
+      grid[y][x] = grid_blocked(ctx.grid, x, y) ? '#' : ' ';
+    }
   }
 
-  Runner *r = ctx.shared_rw + sizeof(Hunter);
-  for (int i = 0; i < N_RUNNERS; r++, i++) {
-    grid[r->y][r->x] = "~+%"[r->state];
+  for (int g = 0; g < runner_groups(ctx.grid); g++) {
+    for (int i = 0; i < group_size(ctx.grid, ctx.shared_rw, g); i++) {
+      Runner r = group_runner(ctx.grid, ctx.shared_rw, g, i);
+      grid[r.y][r.x] = "~+%"[r.state];
+    }
   }
 
   Hunter *h = ctx.shared_rw;
   grid[h->y][h->x] = 'X';
 
-  for (int y = 0; y < GRID_H; y++) {
-    for (int x = 0; x < GRID_W; x++) {
+  for (int y = 0; y < ctx.grid_h; y++) {
+    for (int x = 0; x < ctx.grid_w; x++) {
       printf("%c ", grid[y][x]);
     }
     printf("\n");
@@ -153,15 +521,18 @@ static void print_grid() {
 #endif
 
 static gboolean tick(gpointer data) {
+  // The containers are idle once the last tick is collected, so that snapshot is always whole.
+  if (ctx.async_ticks) {
+    assert(finish_ticks() && take_snapshot());
+  }
   if (ctx.enable_host_modify) {
-    int (*grid)[GRID_W] = ctx.shared_ro;
     for (int i = 0; i < 5; i++) {
-      int x = 1 + rand() % (GRID_W - 2);
-      int y = 1 + rand() % (GRID_H - 2);
-      grid[y][x] = 1 - grid[y][x];
+      int x = 1 + rand() % (ctx.grid_w - 2);
+      int y = 1 + rand() % (ctx.grid_h - 2);
+      set_cell(x, y, !grid_blocked(ctx.grid, x, y));
     }
   }
-  assert(send(CMD_TICK));
+  assert(send_ticks());
   gtk_widget_queue_draw(data);
   return true;
 }
@@ -171,43 +542,92 @@ static gboolean delay_start(gpointer data) {
   return false;
 }
 
-static void draw_fn(GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer data) {
-  // Super dumb animation: just redraw the whole field, every time.
+// Repaints dirty region 'region' of the grid layer: the background, then its blocked cells as a
+// single path.
+static void paint_region(cairo_t *cr, uint32_t region) {
+  double s = ctx.scale;
+  int x0 = (region % dirty_regions_w(ctx.grid)) << DIRTY_SHIFT;
+  int y0 = (region / dirty_regions_w(ctx.grid)) << DIRTY_SHIFT;
+  int x1 = (x0 + (1 << DIRTY_SHIFT) < ctx.grid_w) ? x0 + (1 << DIRTY_SHIFT) : ctx.grid_w;
+  int y1 = (y0 + (1 << DIRTY_SHIFT) < ctx.grid_h) ? y0 + (1 << DIRTY_SHIFT) : ctx.grid_h;
+  cairo_save(cr);
+  cairo_rectangle(cr, x0 * s, y0 * s, (x1 - x0) * s, (y1 - y0) * s);
+  cairo_clip(cr);
   cairo_set_source_rgb(cr, 1, 1, 0.95);
-  cairo_rectangle(cr, 0, 0, width, height);
+  cairo_paint(cr);
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      if (grid_blocked(ctx.grid, x, y)) {
+        cairo_rectangle(cr, x * s, y * s, s, s);
+      }
+    }
+  }
+  cairo_set_source_rgb(cr, 0.3, 0.3, 0.3);
   cairo_fill(cr);
+  cairo_restore(cr);
+}
 
-  int (*grid)[GRID_W] = ctx.shared_ro;
-  for (int y = 0; y < GRID_H; y++) {
-    for (int x = 0; x < GRID_W; x++) {
-      if (grid[y][x] == 1) {
-        cairo_set_source_rgb(cr, 0.3, 0.3, 0.3);
-        cairo_rectangle(cr, x * SCALE, y * SCALE, SCALE, SCALE);
-        cairo_fill(cr);
-      }
+// The grid is drawn onto a cached image surface, all of it for the first frame and then only the
+// regions set in the dirty bitmap since. Blocks only change through set_cell(); a container
+// writing to the grid faults on its read-only mapping.
+static void update_grid_layer() {
+  bool all = ctx.grid_layer == NULL;
+  if (all) {
+    ctx.grid_layer = cairo_image_surface_create(CAIRO_FORMAT_RGB24, ctx.grid_w * ctx.scale + 1,
+                                                ctx.grid_h * ctx.scale + 1);
+  }
+  cairo_t *cr = cairo_create(ctx.grid_layer);
+  uint8_t *dirty = (uint8_t *)dirty_bitmap(ctx.grid);
+  uint32_t n_regions = dirty_regions_w(ctx.grid) * dirty_regions_h(ctx.grid);
+  for (uint32_t i = 0; i < n_regions; i++) {
+    if (all || (dirty[i >> 3] >> (i & 7)) & 1) {
+      paint_region(cr, i);
+    } else if (dirty[i >> 3] == 0) {
+      i |= 7;  // skip the rest of a clean byte
     }
   }
+  memset(dirty, 0, dirty_bitmap_size(ctx.grid));
+  cairo_destroy(cr);
+}
 
-  Hunter *h = ctx.shared_rw;
+static void draw_fn(GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer data) {
+  // GTK4 always redraws the whole widget, so the grid is copied from its cached layer and just
+  // the actors are drawn afresh. A batch of async ticks may have reached a newer whole state.
+  cairo_set_source_rgb(cr, 1, 1, 0.95);
+  cairo_rectangle(cr, 0, 0, width, height);
+  cairo_fill(cr);
+  update_grid_layer();
+  cairo_set_source_surface(cr, ctx.grid_layer, 0, 0);
+  cairo_paint(cr);
+  if (ctx.async_ticks) {
+    take_snapshot();
+  }
+
+  double s = ctx.scale;
+  void *actors = actor_view();
+
+  Hunter *h = actors;
   cairo_set_source_rgb(cr, 0.8, 0.5, 0.9);
-  cairo_rectangle(cr, h->x * SCALE, h->y * SCALE, SCALE, SCALE);
+  cairo_rectangle(cr, h->x * s, h->y * s, s, s);
   cairo_fill(cr);
 
-  Runner *r = ctx.shared_rw + sizeof(Hunter);
-  for (int i = 0; i < N_RUNNERS; r++, i++) {
-    switch (r->state) {
-      case WALKING:
-        cairo_set_source_rgb(cr, 0.5, 0.8, 0.9);
-        break;
-      case RUNNING:
-        cairo_set_source_rgb(cr, 1, 0.8, 0.5);
-        break;
-      case DEAD:
-        cairo_set_source_rgb(cr, 1, 0.4, 0.4);
-        break;
+  for (int g = 0; g < runner_groups(ctx.grid); g++) {
+    for (int i = 0; i < group_size(ctx.grid, actors, g); i++) {
+      Runner r = group_runner(ctx.grid, actors, g, i);
+      switch (r.state) {
+        case WALKING:
+          cairo_set_source_rgb(cr, 0.5, 0.8, 0.9);
+          break;
+        case RUNNING:
+          cairo_set_source_rgb(cr, 1, 0.8, 0.5);
+          break;
+        case DEAD:
+          cairo_set_source_rgb(cr, 1, 0.4, 0.4);
+          break;
+      }
+      cairo_arc(cr, r.x * s + s / 2, r.y * s + s / 2, s / 2, 0, 2 * G_PI);
+      cairo_fill(cr);
     }
-    cairo_arc(cr, r->x * SCALE + SCALE / 2, r->y * SCALE + SCALE / 2, SCALE / 2, 0, 2 * G_PI);
-    cairo_fill(cr);
   }
 }
 
@@ -217,7 +637,11 @@ static void host_modify(GtkWidget *button, gpointer data) {
 
 static void container_modify(GtkWidget *button, gpointer data) {
   // Crashes!
-  send(CMD_MODIFY_GRID);
+  send_cmd(CMD_MODIFY_GRID);
+}
+
+static void large_alloc(GtkWidget *button, gpointer data) {
+  assert(send_cmd(CMD_LARGE_ALLOC));
 }
 
 static void on_open(GtkApplication *app, gpointer data) {
@@ -225,8 +649,8 @@ static void on_open(GtkApplication *app, gpointer data) {
   gtk_window_set_title(GTK_WINDOW(window), "WebAssembly shared buffers [C]");
 
   GtkWidget *drawing_area = gtk_drawing_area_new();
-  gtk_drawing_area_set_content_width(GTK_DRAWING_AREA(drawing_area), GRID_W * SCALE);
-  gtk_drawing_area_set_content_height(GTK_DRAWING_AREA(drawing_area), GRID_H * SCALE);
+  gtk_drawing_area_set_content_width(GTK_DRAWING_AREA(drawing_area), ctx.grid_w * ctx.scale);
+  gtk_drawing_area_set_content_height(GTK_DRAWING_AREA(drawing_area), ctx.grid_h * ctx.scale);
   gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(drawing_area), draw_fn, NULL, NULL);
 
   GtkWidget *host_modify_btn = gtk_button_new_with_label("Host modifies grid");
@@ -235,9 +659,13 @@ static void on_open(GtkApplication *app, gpointer data) {
   GtkWidget *container_modify_btn = gtk_button_new_with_label("Container modifies grid");
   g_signal_connect(container_modify_btn, "clicked", G_CALLBACK(container_modify), NULL);
 
+  GtkWidget *large_alloc_btn = gtk_button_new_with_label("Request large alloc");
+  g_signal_connect(large_alloc_btn, "clicked", G_CALLBACK(large_alloc), NULL);
+
   GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
   gtk_box_append(GTK_BOX(hbox), host_modify_btn);
   gtk_box_append(GTK_BOX(hbox), container_modify_btn);
+  gtk_box_append(GTK_BOX(hbox), large_alloc_btn);
 
   GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
   gtk_box_append(GTK_BOX(vbox), drawing_area);
@@ -249,31 +677,157 @@ static void on_open(GtkApplication *app, gpointer data) {
 }
 
 static void on_shutdown(GtkApplication *app, gpointer data) {
-  assert(send(CMD_EXIT));
-  wait(NULL);
+  assert(send_cmd(CMD_EXIT));
+  dump_stats(NULL);
+  if (ctx.use_zygote) {
+    // The zygote exits when its socket is closed.
+    assert(close(ctx.zygote_sock) != -1);
+  }
+  while (wait(NULL) > 0) {
+  }
+
+  if (ctx.grid_layer != NULL) {
+    cairo_surface_destroy(ctx.grid_layer);
+  }
+  free(ctx.snapshots[0]);
+  free(ctx.snapshots[1]);
+  assert(munmap(ctx.shared_ro, ctx.ro_size) != -1);
+  assert(munmap(ctx.shared_rw, ctx.rw_size) != -1);
+  assert(munmap(ctx.doorbells, kControlBufSize) != -1);
+  for (uint32_t i = 0; i < ctx.buffers.n_buffers; i++) {
+    assert(close(ctx.buffer_fds[i]) != -1);
+  }
+  assert(close(ctx.ctl_fd) != -1);
+}
 
-  assert(munmap(ctx.shared_ro, kReadOnlyBufSize) != -1);
-  assert(munmap(ctx.shared_rw, kReadWriteBufSize) != -1);
-  assert(shm_unlink(kReadOnlyBufName) != -1);
-  assert(shm_unlink(kReadWriteBufName) != -1);
+// Host options are consumed here; the remaining args (the module paths) are passed on to
+// GtkApplication, which treats them as files to open.
+static int parse_options(int argc, char *argv[]) {
+  ctx.ticks_per_frame = 1;
+  ctx.grid_w = GRID_W;
+  ctx.grid_h = GRID_H;
+  ctx.n_runners = N_RUNNERS;
+  ctx.encoding = GRID_BYTES;
+  ctx.layout = ACTORS_AOS;
+  ctx.headless_ticks = 1000;
+  ctx.seed = time(NULL);
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--serial") == 0) {
+      ctx.dispatch = DISPATCH_SERIAL;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      ctx.ticks_per_frame = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--lockstep") == 0) {
+      ctx.lockstep = true;
+    } else if (strcmp(argv[i], "--async") == 0) {
+      ctx.async_ticks = true;
+    } else if (strcmp(argv[i], "--zygote") == 0) {
+      ctx.use_zygote = true;
+    } else if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc) {
+      assert(sscanf(argv[++i], "%dx%d", &ctx.grid_w, &ctx.grid_h) == 2);
+    } else if (strcmp(argv[i], "--runners") == 0 && i + 1 < argc) {
+      ctx.n_runners = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bits") == 0) {
+      ctx.encoding = GRID_BITS;
+    } else if (strcmp(argv[i], "--soa") == 0) {
+      ctx.layout = ACTORS_SOA;
+    } else if (strcmp(argv[i], "--index") == 0) {
+      ctx.index_shift = INDEX_SHIFT;
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      ctx.headless = true;
+    } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+      ctx.headless_ticks = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      ctx.seed = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+      ctx.n_tiles = atoi(argv[++i]);
+      ctx.layout = ACTORS_SOA;
+    } else if (strcmp(argv[i], "--huge-pages") == 0) {
+      ctx.huge_pages = true;
+    } else {
+      argv[n++] = argv[i];
+    }
+  }
+  argv[n] = NULL;
+
+  // Lockstep containers wait on each other mid-command, so they must all be rung at once.
+  assert(ctx.ticks_per_frame > 0 && ctx.ticks_per_frame < TICK_N_LOCKSTEP);
+  assert(!ctx.lockstep || ctx.dispatch == DISPATCH_BROADCAST);
+  assert(!ctx.async_ticks || ctx.dispatch == DISPATCH_BROADCAST);
+  assert(ctx.grid_w >= 3 && ctx.grid_h >= 3 && ctx.n_runners > 0);
+  assert(ctx.headless_ticks > 0);
+
+  // Tiles always use SoA; each strip needs a column, and batched ticks must stay in step so
+  // that the migration queues are read in the tick after they were written.
+  assert(ctx.n_tiles >= 0 && ctx.n_tiles <= MAX_TILES && ctx.n_tiles < MAX_CONTAINERS);
+  assert(ctx.n_tiles == 0 || (ctx.index_shift == 0 && ctx.n_tiles <= ctx.grid_w));
+  assert(ctx.n_tiles == 0 || ctx.ticks_per_frame == 1 || ctx.lockstep);
+
+  // A hugetlb mapping can't be split into the tiles' page-aligned write windows.
+  assert(!ctx.huge_pages || ctx.n_tiles == 0);
+  return n;
 }
 
 int main(int argc, char *argv[]) {
   printf("Host started; pid %d\n", getpid());
-  ctx.shared_ro = create_shared_buffer(kReadOnlyBufName, kReadOnlyBufSize);
-  ctx.shared_rw = create_shared_buffer(kReadWriteBufName, kReadWriteBufSize);
+  argc = parse_options(argc, argv);
+  if (ctx.headless) {
+    // run_headless() takes the containers' tick() time from their call stats. The containers,
+    // and the zygote they are forked from, inherit the setting.
+    assert(setenv("WASM_CALL_STATS", "1", 1) == 0);
+  }
+  init_layout();
+  uint32_t flags = ctx.huge_pages ? BUFFER_HUGE_PAGES : 0;
+  ctx.shared_ro = manifest_create(&ctx.buffers, ctx.buffer_fds, "grid", ctx.ro_size, PROT_READ,
+                                  flags);
+  ctx.shared_rw = manifest_create(&ctx.buffers, ctx.buffer_fds, "actors", ctx.rw_size,
+                                  PROT_READ | PROT_WRITE, flags);
+  // The buffers are rounded up to whole pages; an untiled container's window is all of one.
+  assert(ctx.buffers.entries[0].size <= INT_MAX && ctx.buffers.entries[1].size <= INT_MAX);
+  ctx.ro_size = ctx.buffers.entries[0].size;
+  ctx.rw_size = ctx.buffers.entries[1].size;
+  ctx.doorbells = create_control_buffer();
+  ctx.stats = (CallStats *)&ctx.doorbells[MAX_CONTAINERS];
+  if (ctx.async_ticks) {
+    ctx.snapshots[0] = calloc(1, ctx.rw_size);
+    ctx.snapshots[1] = calloc(1, ctx.rw_size);
+    assert(ctx.snapshots[0] != NULL && ctx.snapshots[1] != NULL);
+  }
 
-  srand(time(NULL));
+  // The containers are given the same seed, so a serial run can be repeated exactly.
+  srand(ctx.seed);
   init_grid();
   if (argc <= 2) {
-    printf("usage: host hunter.wasm runner.wasm");
+    printf("usage: host [--serial | --async] [--batch N [--lockstep]] [--zygote] [--grid WxH] "
+           "[--runners N] [--bits] [--soa] [--index] [--tiles K] [--headless [--ticks N]] "
+           "[--seed S] [--huge-pages] hunter.wasm runner.wasm");
+  }
+  ctx.modules = (const char **)argv + 1;
+  if (ctx.use_zygote) {
+    start_zygote(2);
+  }
+  if (ctx.n_tiles == 0) {
+    start_container(0, "h", -1, 0, ctx.rw_size); // Path to hunter.wasm
+    start_container(1, "r", -1, 0, ctx.rw_size); // Path to runner.wasm
+  } else {
+    // The hunter owns the first TILE_ALIGN bytes, and each tile's container its own region.
+    start_container(0, "h", -1, 0, TILE_ALIGN);
+    for (int t = 0; t < ctx.n_tiles; t++) {
+      char label[8];
+      snprintf(label, sizeof(label), "r%d", t);
+      start_container(1, label, t, tile_region_offset(ctx.grid, t), tile_region_size(ctx.grid));
+    }
+  }
+  assert(send_cmd_arg(CMD_INIT, ctx.seed));
+  if (ctx.headless) {
+    run_headless();
+    on_shutdown(NULL, NULL);
+    return 0;
   }
-  fork_container(&ctx.pipes[0], argv[1], "h"); // Path to hunter.wasm
-  fork_container(&ctx.pipes[1], argv[2], "r"); // Path to runner.wasm
-  assert(send(CMD_INIT));
 
   GtkApplication *app = gtk_application_new(NULL, G_APPLICATION_HANDLES_OPEN);
   g_signal_connect(app, "open", G_CALLBACK(on_open), &ctx);
   g_signal_connect(app, "shutdown", G_CALLBACK(on_shutdown), &ctx);
+  g_unix_signal_add(SIGUSR1, dump_stats, NULL);
   return g_application_run(G_APPLICATION(app), argc, argv);
 }
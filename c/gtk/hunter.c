@@ -13,6 +13,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,18 +22,147 @@
 #include "common.h"
 
 typedef struct {
-  int (*grid)[GRID_W];
+  const GridHeader *grid;
   Hunter *hunter;
   const Runner *runners;
+  RunnerArrays soa;
+  SpatialIndex index;
 } Context;
 
 #include "module-common.c"
 
+// The hunter is never tiled; it reads every tile's runners.
 EMSCRIPTEN_KEEPALIVE
-void init(Context *ctx, int rand_seed) {
+void init(Context *ctx, int rand_seed, int tile) {
   srand(rand_seed);
-  ctx->hunter->x = GRID_W / 2;
-  ctx->hunter->y = GRID_H / 2;
+  ctx->hunter->x = ctx->grid->grid_w / 2;
+  ctx->hunter->y = ctx->grid->grid_h / 2;
+}
+
+// Returns the index of the closest live runner in the first 'stride' entries of the SoA arrays,
+// or -1 if they are all dead, and sets 'min_dist' to its distance. Ties go to the lowest index,
+// as in the AoS loop in tick().
+static int nearest_soa(Context *ctx, RunnerArrays a, int stride, int *min_dist) {
+  int hx = ctx->hunter->x;
+  int hy = ctx->hunter->y;
+  int dist[ACTOR_LANES] __attribute__((aligned(16)));
+  int index[ACTOR_LANES] __attribute__((aligned(16)));
+#ifdef __wasm_simd128__
+  v128_t best = wasm_i32x4_splat(INT_MAX);
+  v128_t best_index = wasm_i32x4_splat(-1);
+  v128_t lane_index = wasm_i32x4_make(0, 1, 2, 3);
+  for (int i = 0; i < stride; i += ACTOR_LANES) {
+    v128_t dx = wasm_i32x4_sub(wasm_v128_load(&a.x[i]), wasm_i32x4_splat(hx));
+    v128_t dy = wasm_i32x4_sub(wasm_v128_load(&a.y[i]), wasm_i32x4_splat(hy));
+    v128_t d = wasm_i32x4_add(wasm_i32x4_mul(dx, dx), wasm_i32x4_mul(dy, dy));
+    v128_t alive = wasm_i32x4_ne(wasm_v128_load(&a.state[i]), wasm_i32x4_splat(DEAD));
+    v128_t closer = wasm_v128_and(alive, wasm_i32x4_lt(d, best));
+    best = wasm_v128_bitselect(d, best, closer);
+    best_index = wasm_v128_bitselect(lane_index, best_index, closer);
+    lane_index = wasm_i32x4_add(lane_index, wasm_i32x4_splat(ACTOR_LANES));
+  }
+  wasm_v128_store(dist, best);
+  wasm_v128_store(index, best_index);
+#else
+  for (int l = 0; l < ACTOR_LANES; l++) {
+    dist[l] = INT_MAX;
+    index[l] = -1;
+  }
+  for (int i = 0; i < stride; i += ACTOR_LANES) {
+    for (int l = 0; l < ACTOR_LANES; l++) {
+      int dx = a.x[i + l] - hx;
+      int dy = a.y[i + l] - hy;
+      int d = dx * dx + dy * dy;
+      if (a.state[i + l] != DEAD && d < dist[l]) {
+        dist[l] = d;
+        index[l] = i + l;
+      }
+    }
+  }
+#endif
+  int min = 0;
+  for (int l = 1; l < ACTOR_LANES; l++) {
+    if (index[l] != -1 && (index[min] == -1 || dist[l] < dist[min] ||
+                           (dist[l] == dist[min] && index[l] < index[min]))) {
+      min = l;
+    }
+  }
+  *min_dist = dist[min];
+  return index[min];
+}
+
+// Scans each tile's runners in turn, returning the closest with ties going to the lower tile.
+static bool nearest_tiled(Context *ctx, Runner *nearest) {
+  const GridHeader *h = ctx->grid;
+  void *rw_ptr = ctx->hunter;
+  int best_dist = INT_MAX;
+  bool found = false;
+  for (int t = 0; t < h->n_tiles; t++) {
+    // The tile is moving runners as we read; a stale count just skips or repeats one.
+    RunnerArrays a = tile_arrays(h, rw_ptr, t);
+    int stride = (group_size(h, rw_ptr, t) + ACTOR_LANES - 1) & ~(ACTOR_LANES - 1);
+    int dist;
+    int i = nearest_soa(ctx, a, stride, &dist);
+    if (i != -1 && dist < best_dist) {
+      *nearest = (Runner){ a.x[i], a.y[i], a.state[i] };
+      best_dist = dist;
+      found = true;
+    }
+  }
+  return found;
+}
+
+// Searches the spatial index in square rings of buckets around the hunter, returning the same
+// runner as the linear scans: once rings 0..r are done, every other runner is at least
+// r * bucket size + 1 cells away along x or y.
+static int nearest_indexed(Context *ctx) {
+  const GridHeader *h = ctx->grid;
+  int bw = index_buckets_w(h);
+  int bh = index_buckets_h(h);
+  int hx = ctx->hunter->x;
+  int hy = ctx->hunter->y;
+  int bx = hx >> h->index_shift;
+  int by = hy >> h->index_shift;
+  int max_ring = bx;
+  max_ring = (bw - 1 - bx > max_ring) ? bw - 1 - bx : max_ring;
+  max_ring = (by > max_ring) ? by : max_ring;
+  max_ring = (bh - 1 - by > max_ring) ? bh - 1 - by : max_ring;
+
+  // Bounds the walk in case the runner container relinks a list under us.
+  int n = runner_stride(h);
+  int steps = n;
+  int best = -1;
+  int best_dist = INT_MAX;
+  for (int ring = 0; ring <= max_ring; ring++) {
+    for (int y = by - ring; y <= by + ring; y++) {
+      if (y < 0 || y >= bh) {
+        continue;
+      }
+      // Only the top and bottom rows of the ring are full; the rest just have their ends.
+      int x_step = (y == by - ring || y == by + ring) ? 1 : 2 * ring;
+      for (int x = bx - ring; x <= bx + ring; x += x_step) {
+        if (x < 0 || x >= bw) {
+          continue;
+        }
+        int i = ctx->index.bucket_head[y * bw + x];
+        for (; i >= 0 && i < n && steps-- > 0; i = ctx->index.bucket_next[i]) {
+          Runner r = get_runner(h, ctx->hunter, i);
+          int rdx = r.x - hx;
+          int rdy = r.y - hy;
+          int dist = rdx * rdx + rdy * rdy;
+          if (r.state != DEAD && (dist < best_dist || (dist == best_dist && i < best))) {
+            best = i;
+            best_dist = dist;
+          }
+        }
+      }
+    }
+    int reach = (ring << h->index_shift) + 1;
+    if (best_dist < reach * reach) {
+      break;
+    }
+  }
+  return best;
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -40,9 +170,31 @@ void tick(Context *ctx) {
   // Find the closest runner and move towards it.
   int min_dx = 0;
   int min_dy = 0;
-  int min_dist = 99999;
+  if (ctx->grid->n_tiles != 0) {
+    Runner r;
+    if (nearest_tiled(ctx, &r)) {
+      min_dx = r.x - ctx->hunter->x;
+      min_dy = r.y - ctx->hunter->y;
+    }
+    move(ctx, &ctx->hunter->x, &ctx->hunter->y, step(min_dx), step(min_dy));
+    return;
+  }
+  if (ctx->grid->index_shift != 0 || ctx->grid->layout == ACTORS_SOA) {
+    int dist;
+    int i = (ctx->grid->index_shift != 0)
+                ? nearest_indexed(ctx)
+                : nearest_soa(ctx, ctx->soa, runner_stride(ctx->grid), &dist);
+    if (i != -1) {
+      Runner r = get_runner(ctx->grid, ctx->hunter, i);
+      min_dx = r.x - ctx->hunter->x;
+      min_dy = r.y - ctx->hunter->y;
+    }
+    move(ctx, &ctx->hunter->x, &ctx->hunter->y, step(min_dx), step(min_dy));
+    return;
+  }
+  int min_dist = INT_MAX;
   const Runner *r = ctx->runners;
-  for (int i = 0; i < N_RUNNERS; r++, i++) {
+  for (int i = 0; i < ctx->grid->n_runners; r++, i++) {
     if (r->state == DEAD)
       continue;
     int dx = r->x - ctx->hunter->x;
@@ -60,5 +212,5 @@ void tick(Context *ctx) {
 EMSCRIPTEN_KEEPALIVE
 void modify_grid(Context *ctx) {
   print("[h] Attempting to write to read-only memory...\n");
-  ctx->grid[0][0] = 2;
+  *(uint8_t *)grid_row(ctx->grid, 0) = 2;
 }
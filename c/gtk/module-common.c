@@ -16,6 +16,17 @@
 
 // Inlined via #include in hunter.c and runner.c
 
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+// Build with -DSHARED_PAGES to give the shared buffers whole wasm pages of their own rather than
+// a malloc block; see malloc_().
+#ifdef SHARED_PAGES
+#include <unistd.h>
+#define WASM_PAGE_SIZE  65536
+#endif
+
 EM_JS(void, print_callback, (int, const char *msg), {})
 extern void print_callback(int len, const char *msg);
 
@@ -29,9 +40,24 @@ void print(const char *fmt, ...) {
   print_callback(len, msg);
 }
 
+// Reserves linear memory for the container to map the shared buffers onto. With SHARED_PAGES the
+// reservation is taken straight from sbrk at a wasm page boundary, so it is never part of a heap
+// chunk, its start is already aligned for any host page size, and its size is only limited by
+// the module's maximum memory. malloc() copes with the gap this leaves in its sbrk region.
 EMSCRIPTEN_KEEPALIVE
 void *malloc_(size_t size) {
+#ifdef SHARED_PAGES
+  uintptr_t brk = (uintptr_t)sbrk(0);
+  size_t pad = (WASM_PAGE_SIZE - brk % WASM_PAGE_SIZE) % WASM_PAGE_SIZE;
+  size_t pages_size = (size + WASM_PAGE_SIZE - 1) & ~(size_t)(WASM_PAGE_SIZE - 1);
+  if (pages_size < size || pad + pages_size < pages_size) {
+    return NULL;
+  }
+  void *p = sbrk(pad + pages_size);
+  return (p == (void *)-1) ? NULL : (char *)p + pad;
+#else
   return malloc(size);
+#endif
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -39,40 +65,167 @@ void update_context(Context *ctx, void *ro_ptr, void *rw_ptr) {
   ctx->grid = ro_ptr;
   ctx->hunter = rw_ptr;
   ctx->runners = rw_ptr + sizeof(Hunter);
+  ctx->soa = runner_arrays(ro_ptr, rw_ptr);
+  ctx->index = spatial_index(ro_ptr, rw_ptr);
 }
 
+// Returns NULL if the host's GridHeader is not one this module understands.
 EMSCRIPTEN_KEEPALIVE
 Context *create_context(void *ro_ptr, void *rw_ptr) {
+  if (!grid_header_valid(ro_ptr)) {
+    print("Unsupported grid header (version %u)\n", ((GridHeader *)ro_ptr)->version);
+    return NULL;
+  }
   Context *ctx = malloc(sizeof(Context));
   update_context(ctx, ro_ptr, rw_ptr);
   return ctx;
 }
 
+// The latest large_alloc() block. Keeping and touching it stops the compiler from eliding the
+// allocation, which would skip the memory.grow it is meant to cause.
+void *large_block;
+
 EMSCRIPTEN_KEEPALIVE
 void large_alloc() {
-  // Not implemented.
+  // Big enough to force memory.grow when the modules are built with a small initial heap.
+  print("Requesting large allocation\n");
+  large_block = malloc(1 << 20);
+  if (large_block == NULL) {
+    print("Large allocation failed\n");
+    return;
+  }
+  memset(large_block, 1, 1 << 20);
 }
 
 int rand_step() {
   return (rand() % 3) - 1;
 }
 
-void move(Context *ctx, int *x, int *y, int mx, int my) {
-  // If the dest cell is blocked, try a random move; if that's also blocked just stay still.
+bool try_move(Context *ctx, int *x, int *y, int mx, int my) {
   int tx = *x + mx;
   int ty = *y + my;
-  if (ctx->grid[ty][tx] == 1) {
-    tx = *x + rand_step();
-    ty = *y + rand_step();
-    if (ctx->grid[ty][tx] == 1) {
-      return;
-    }
+  if (grid_blocked(ctx->grid, tx, ty)) {
+    return false;
   }
   *x = tx;
   *y = ty;
+  return true;
+}
+
+void move(Context *ctx, int *x, int *y, int mx, int my) {
+  // If the dest cell is blocked, try a random move; if that's also blocked just stay still.
+  if (!try_move(ctx, x, y, mx, my)) {
+    try_move(ctx, x, y, rand_step(), rand_step());
+  }
+}
+
+// Spatial index upkeep, run by the runner container. The hunter walks the lists while runners
+// are being relinked, so it bounds its walk and reads the runners' actual positions; like the
+// positions themselves, a runner that moves mid-walk may be seen in either bucket or neither.
+static inline int index_bucket(const GridHeader *h, int x, int y) {
+  return (y >> h->index_shift) * index_buckets_w(h) + (x >> h->index_shift);
+}
+
+static void index_insert(Context *ctx, int i, int x, int y) {
+  int *head = &ctx->index.bucket_head[index_bucket(ctx->grid, x, y)];
+  ctx->index.bucket_next[i] = *head;
+  *head = i;
+}
+
+static void index_remove(Context *ctx, int i, int x, int y) {
+  int *link = &ctx->index.bucket_head[index_bucket(ctx->grid, x, y)];
+  while (*link >= 0 && *link != i) {
+    link = &ctx->index.bucket_next[*link];
+  }
+  if (*link == i) {
+    *link = ctx->index.bucket_next[i];
+  }
+  ctx->index.bucket_next[i] = INDEX_NONE;
+}
+
+// Puts every live runner in the index; called once the runners have been placed.
+void index_build(Context *ctx) {
+  if (ctx->grid->index_shift == 0) {
+    return;
+  }
+  int n_buckets = index_buckets_w(ctx->grid) * index_buckets_h(ctx->grid);
+  for (int b = 0; b < n_buckets; b++) {
+    ctx->index.bucket_head[b] = -1;
+  }
+  for (int i = 0; i < runner_stride(ctx->grid); i++) {
+    ctx->index.bucket_next[i] = INDEX_NONE;
+  }
+  for (int i = ctx->grid->n_runners - 1; i >= 0; i--) {
+    Runner r = get_runner(ctx->grid, ctx->hunter, i);
+    if (r.state != DEAD) {
+      index_insert(ctx, i, r.x, r.y);
+    }
+  }
+}
+
+// Relinks runner 'i' after it has moved from (old_x, old_y) to (x, y).
+void index_moved(Context *ctx, int i, int old_x, int old_y, int x, int y) {
+  if (ctx->grid->index_shift != 0 &&
+      index_bucket(ctx->grid, old_x, old_y) != index_bucket(ctx->grid, x, y)) {
+    index_remove(ctx, i, old_x, old_y);
+    index_insert(ctx, i, x, y);
+  }
+}
+
+// Removes a dead runner from the index; a no-op once it has been removed.
+void index_died(Context *ctx, int i, int x, int y) {
+  if (ctx->grid->index_shift != 0 && ctx->index.bucket_next[i] != INDEX_NONE) {
+    index_remove(ctx, i, x, y);
+  }
 }
 
 // Converts an arbitrary delta into a unit step.
 int step(int delta) {
   return (delta == 0) ? 0 : ((delta > 0) ? 1 : -1);
 }
+
+// The SoA kernels draw their random numbers from one xorshift32 generator per vector lane, so
+// the SIMD and scalar builds make exactly the same moves for a given seed.
+static uint32_t xs_state[ACTOR_LANES] __attribute__((aligned(16)));
+
+void xs_seed(uint32_t seed) {
+  for (int i = 0; i < ACTOR_LANES; i++) {
+    seed = seed * 0x9e3779b1u + 0x7f4a7c15u;
+    xs_state[i] = seed | 1;  // xorshift never leaves zero
+  }
+}
+
+static inline uint32_t xs_next_lane(int lane) {
+  uint32_t x = xs_state[lane];
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return xs_state[lane] = x;
+}
+
+// Maps the 10 bits of 'r' at 'shift' to 0, 1 or 2 with a multiply rather than a divide.
+static inline int rand3(uint32_t r, int shift) {
+  return (((r >> shift) & 0x3ff) * 3) >> 10;
+}
+
+#ifdef __wasm_simd128__
+static inline v128_t xs_next() {
+  v128_t x = wasm_v128_load(xs_state);
+  x = wasm_v128_xor(x, wasm_i32x4_shl(x, 13));
+  x = wasm_v128_xor(x, wasm_u32x4_shr(x, 17));
+  x = wasm_v128_xor(x, wasm_i32x4_shl(x, 5));
+  wasm_v128_store(xs_state, x);
+  return x;
+}
+
+static inline v128_t rand3_x4(v128_t r, int shift) {
+  v128_t bits = wasm_v128_and(wasm_u32x4_shr(r, shift), wasm_i32x4_splat(0x3ff));
+  return wasm_u32x4_shr(wasm_i32x4_mul(bits, wasm_i32x4_splat(3)), 10);
+}
+
+// Vector step(): the comparison masks are -1 where true.
+static inline v128_t step_x4(v128_t delta) {
+  v128_t zero = wasm_i32x4_splat(0);
+  return wasm_i32x4_sub(wasm_i32x4_lt(delta, zero), wasm_i32x4_gt(delta, zero));
+}
+#endif
@@ -21,33 +21,215 @@
 #include "common.h"
 
 typedef struct {
-  int (*grid)[GRID_W];
+  const GridHeader *grid;
   const Hunter *hunter;
   Runner *runners;
+  RunnerArrays soa;
+  SpatialIndex index;
+  int tile;  // -1 when untiled
 } Context;
 
 #include "module-common.c"
 
+// Places this tile's share of the runners at random within its strip, and clears its queues.
+static void init_tile(Context *ctx) {
+  const GridHeader *h = ctx->grid;
+  TileHeader *th = tile_header(h, (void *)ctx->hunter, ctx->tile);
+  RunnerArrays a = tile_arrays(h, (void *)ctx->hunter, ctx->tile);
+  int x0 = tile_x0(h, ctx->tile);
+  int x1 = tile_x0(h, ctx->tile + 1);
+  uint32_t cap = tile_capacity(h);
+  th->n = h->n_runners / h->n_tiles + (ctx->tile < h->n_runners % h->n_tiles);
+  for (int i = 0; i < cap; i++) {
+    bool pad = i >= th->n;
+    int x = x0 + rand() % (x1 - x0);
+    x = (x < 1) ? 1 : (x > h->grid_w - 2) ? h->grid_w - 2 : x;
+    a.x[i] = pad ? 0 : x;
+    a.y[i] = pad ? 0 : 1 + rand() % (h->grid_h - 2);
+    a.state[i] = pad ? DEAD : WALKING;
+  }
+  for (int d = TILE_LEFT; d <= TILE_RIGHT; d++) {
+    th->out[d][0].count = 0;
+    th->out[d][1].count = 0;
+  }
+  th->free[0] = th->free[1] = cap - th->n - MIGRATION_RESERVE;
+  th->tick = 0;
+}
+
+// 'tile' is this container's tile, or -1 when untiled.
 EMSCRIPTEN_KEEPALIVE
-void init(Context *ctx, int rand_seed) {
+void init(Context *ctx, int rand_seed, int tile) {
+  ctx->tile = tile;
+  if (tile >= 0) {
+    srand(rand_seed + tile);
+    xs_seed(rand_seed + tile);
+    init_tile(ctx);
+    return;
+  }
   srand(rand_seed);
+  if (ctx->grid->layout == ACTORS_SOA) {
+    xs_seed(rand_seed);
+    RunnerArrays a = ctx->soa;
+    for (int i = 0; i < runner_stride(ctx->grid); i++) {
+      bool pad = i >= ctx->grid->n_runners;
+      a.x[i] = pad ? 0 : 1 + rand() % (ctx->grid->grid_w - 2);
+      a.y[i] = pad ? 0 : 1 + rand() % (ctx->grid->grid_h - 2);
+      a.state[i] = pad ? DEAD : WALKING;
+    }
+    index_build(ctx);
+    return;
+  }
   Runner *r = ctx->runners;
-  for (int i = 0; i < N_RUNNERS; r++, i++) {
-    r->x = 1 + rand() % (GRID_W - 2);
-    r->y = 1 + rand() % (GRID_H - 2);
+  for (int i = 0; i < ctx->grid->n_runners; r++, i++) {
+    r->x = 1 + rand() % (ctx->grid->grid_w - 2);
+    r->y = 1 + rand() % (ctx->grid->grid_h - 2);
     r->state = WALKING;
   }
+  index_build(ctx);
+}
+
+// Works out the new state and step of ACTOR_LANES runners at a time, following the same rules
+// as the AoS loop in tick(). Each step is then tried against the grid one runner at a time, with
+// a fallback step drawn up front in place of move()'s rand_step() calls. 'stride' is a whole
+// number of vectors.
+static void tick_soa(Context *ctx, RunnerArrays a, int stride) {
+  int hx = ctx->hunter->x;
+  int hy = ctx->hunter->y;
+  int mx[ACTOR_LANES] __attribute__((aligned(16)));
+  int my[ACTOR_LANES] __attribute__((aligned(16)));
+  int alt_mx[ACTOR_LANES] __attribute__((aligned(16)));
+  int alt_my[ACTOR_LANES] __attribute__((aligned(16)));
+  for (int i = 0; i < stride; i += ACTOR_LANES) {
+#ifdef __wasm_simd128__
+    v128_t zero = wasm_i32x4_splat(0);
+    v128_t one = wasm_i32x4_splat(1);
+    v128_t dx = wasm_i32x4_sub(wasm_v128_load(&a.x[i]), wasm_i32x4_splat(hx));
+    v128_t dy = wasm_i32x4_sub(wasm_v128_load(&a.y[i]), wasm_i32x4_splat(hy));
+    v128_t dead = wasm_v128_or(wasm_i32x4_eq(wasm_v128_load(&a.state[i]), wasm_i32x4_splat(DEAD)),
+                               wasm_v128_and(wasm_i32x4_eq(dx, zero), wasm_i32x4_eq(dy, zero)));
+    v128_t dist = wasm_i32x4_add(wasm_i32x4_mul(dx, dx), wasm_i32x4_mul(dy, dy));
+    v128_t far = wasm_i32x4_gt(dist, wasm_i32x4_splat(SCARE_DIST * SCARE_DIST));
+
+    // Far runners walk randomly; near ones run on x (choice 0), y (choice 1) or both.
+    v128_t r = xs_next();
+    v128_t choice = rand3_x4(r, 20);
+    v128_t run_x = wasm_v128_andnot(wasm_i32x4_ne(choice, one), far);
+    v128_t run_y = wasm_v128_andnot(wasm_i32x4_ne(choice, zero), far);
+    v128_t walk_x = wasm_i32x4_sub(rand3_x4(r, 0), one);
+    v128_t walk_y = wasm_i32x4_sub(rand3_x4(r, 10), one);
+    wasm_v128_store(mx, wasm_v128_bitselect(step_x4(dx), walk_x, run_x));
+    wasm_v128_store(my, wasm_v128_bitselect(step_x4(dy), walk_y, run_y));
+    v128_t state = wasm_v128_bitselect(wasm_i32x4_splat(WALKING), wasm_i32x4_splat(RUNNING), far);
+    wasm_v128_store(&a.state[i], wasm_v128_bitselect(wasm_i32x4_splat(DEAD), state, dead));
+
+    v128_t alt = xs_next();
+    wasm_v128_store(alt_mx, wasm_i32x4_sub(rand3_x4(alt, 0), one));
+    wasm_v128_store(alt_my, wasm_i32x4_sub(rand3_x4(alt, 10), one));
+#else
+    for (int l = 0; l < ACTOR_LANES; l++) {
+      int dx = a.x[i + l] - hx;
+      int dy = a.y[i + l] - hy;
+      bool dead = a.state[i + l] == DEAD || (dx == 0 && dy == 0);
+      bool far = dx * dx + dy * dy > SCARE_DIST * SCARE_DIST;
+      uint32_t r = xs_next_lane(l);
+      int choice = rand3(r, 20);
+      mx[l] = (far || choice == 1) ? rand3(r, 0) - 1 : step(dx);
+      my[l] = (far || choice == 0) ? rand3(r, 10) - 1 : step(dy);
+      a.state[i + l] = dead ? DEAD : (far ? WALKING : RUNNING);
+
+      uint32_t alt = xs_next_lane(l);
+      alt_mx[l] = rand3(alt, 0) - 1;
+      alt_my[l] = rand3(alt, 10) - 1;
+    }
+#endif
+    for (int l = 0; l < ACTOR_LANES; l++) {
+      int *x = &a.x[i + l];
+      int *y = &a.y[i + l];
+      int old_x = *x;
+      int old_y = *y;
+      if (a.state[i + l] == DEAD) {
+        index_died(ctx, i + l, old_x, old_y);
+      } else if (try_move(ctx, x, y, mx[l], my[l]) || try_move(ctx, x, y, alt_mx[l], alt_my[l])) {
+        index_moved(ctx, i + l, old_x, old_y, *x, *y);
+      }
+    }
+  }
+}
+
+// Takes in the runners sent by the neighbouring tiles last tick, moves every runner, then sends
+// those that have left the strip. See TileHeader in common.h.
+static void tick_tile(Context *ctx) {
+  const GridHeader *h = ctx->grid;
+  void *rw_ptr = (void *)ctx->hunter;
+  TileHeader *th = tile_header(h, rw_ptr, ctx->tile);
+  RunnerArrays a = tile_arrays(h, rw_ptr, ctx->tile);
+  uint32_t cap = tile_capacity(h);
+  int parity = th->tick & 1;
+  uint32_t budget[2] = { 0, 0 };
+  for (int d = TILE_LEFT; d <= TILE_RIGHT; d++) {
+    int from = ctx->tile + (d == TILE_LEFT ? -1 : 1);
+    th->out[d][parity].count = 0;
+    if (from < 0 || from >= h->n_tiles) {
+      continue;
+    }
+    // The neighbour on our left sends to us through its right-hand queue, and vice versa.
+    TileHeader *nh = tile_header(h, rw_ptr, from);
+    const MigrationQueue *q = &nh->out[1 - d][!parity];
+    // The budgets below mean capacity can't run out; the checks just guard against bad counts.
+    for (uint32_t i = 0; i < q->count && i < MIGRATION_SLOTS && th->n < cap; i++) {
+      a.x[th->n] = q->runners[i].x;
+      a.y[th->n] = q->runners[i].y;
+      a.state[th->n] = q->runners[i].state;
+      th->n++;
+    }
+    budget[d] = nh->free[!parity] / 2;
+    budget[d] = (budget[d] < MIGRATION_SLOTS) ? budget[d] : MIGRATION_SLOTS;
+  }
+
+  tick_soa(ctx, a, (th->n + ACTOR_LANES - 1) & ~(ACTOR_LANES - 1));
+
+  int x0 = tile_x0(h, ctx->tile);
+  int x1 = tile_x0(h, ctx->tile + 1);
+  for (int i = 0; i < th->n;) {
+    int d = (a.x[i] < x0) ? TILE_LEFT : (a.x[i] >= x1) ? TILE_RIGHT : -1;
+    if (d == -1 || th->out[d][parity].count >= budget[d]) {
+      i++;
+      continue;
+    }
+    MigrationQueue *q = &th->out[d][parity];
+    q->runners[q->count++] = (Runner){ a.x[i], a.y[i], a.state[i] };
+
+    // Swap-remove, keeping [n, capacity) DEAD for the kernel's padding lanes.
+    th->n--;
+    a.x[i] = a.x[th->n];
+    a.y[i] = a.y[th->n];
+    a.state[i] = a.state[th->n];
+    a.x[th->n] = 0;
+    a.y[th->n] = 0;
+    a.state[th->n] = DEAD;
+  }
+  th->free[parity] = (cap - th->n > MIGRATION_RESERVE) ? cap - th->n - MIGRATION_RESERVE : 0;
+  th->tick++;
 }
 
 EMSCRIPTEN_KEEPALIVE
 void tick(Context *ctx) {
+  if (ctx->tile >= 0) {
+    tick_tile(ctx);
+    return;
+  }
+  if (ctx->grid->layout == ACTORS_SOA) {
+    tick_soa(ctx, ctx->soa, runner_stride(ctx->grid));
+    return;
+  }
   Runner *r = ctx->runners;
-  for (int i = 0; i < N_RUNNERS; r++, i++) {
+  for (int i = 0; i < ctx->grid->n_runners; r++, i++) {
     // If the hunter has reached us, we're dead.
     int dx = r->x - ctx->hunter->x;
     int dy = r->y - ctx->hunter->y;
     if (r->state == DEAD || (dx == 0 && dy == 0)) {
       r->state = DEAD;
+      index_died(ctx, i, r->x, r->y);
       continue;
     }
 
@@ -77,7 +259,10 @@ void tick(Context *ctx) {
           break;
       }
     }
+    int old_x = r->x;
+    int old_y = r->y;
     move(ctx, &r->x, &r->y, mx, my);
+    index_moved(ctx, i, old_x, old_y, r->x, r->y);
   }
 }
 
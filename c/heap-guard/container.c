@@ -13,23 +13,28 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "wasm_c_api.h"
 
-enum ExportFuncs {
-  FN_MALLOC,
-  FN_TEST_OVERFLOW_ATTACK,
-};
-
-const char *kExportFuncNames[] = {
-  "malloc",
-  "test_overflow_attack",
-};
+#define EXPORT_FUNCS(X)                                \
+  X(MALLOC, malloc, 1, 1)                              \
+  X(TEST_OVERFLOW_ATTACK, test_overflow_attack, 0, 0)
 
 #include "../wamr-wrapper.c"
 
@@ -38,7 +43,7 @@ const char *kExportFuncNames[] = {
 static void apply_heap_guard() {
   size_t page_size = sysconf(_SC_PAGESIZE);
   int guard_size = 2 * page_size;
-  int guard_alloc = wasm_call(FN_MALLOC, guard_size).val;
+  int guard_alloc = wasm_call_malloc(guard_size).val;
   void *guard_alloc_end = wasm_memory_data(wc.memory) + guard_alloc + guard_size;
   void *end_page = (void *)(((size_t)guard_alloc_end - page_size) & ~(page_size - 1));
   int res = mprotect(end_page, page_size, PROT_NONE);
@@ -51,7 +56,7 @@ int main(int argc, const char *argv[]) {
     if (argc > 1 && *argv[1] == '+') {
       apply_heap_guard();
     }
-    wasm_call(FN_TEST_OVERFLOW_ATTACK);
+    wasm_call_test_overflow_attack();
   }
   destroy_module();
 }
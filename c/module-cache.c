@@ -0,0 +1,134 @@
+//
+// Copyright 2021 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Inlined via #include in wamr-wrapper.c, terminal/container.c and profile/src-c/container-wamr.c
+//
+// Loads wasm modules via mmap and, when the WASM_CACHE_DIR environment variable is set, keeps
+// an on-disk cache of AOT-compiled modules. Cache entries are named by a hash of the wasm bytes
+// and WASM_ENGINE_VERSION, and are produced by running wamrc (from $WAMRC, or the PATH) on a
+// cache miss. WAMR recognises AOT files by their magic number, so cached entries are passed
+// straight to wasm_module_new in place of the wasm bytes.
+//
+// Setting aot_no_bounds_checks compiles entries without software bounds checks, leaving them to
+// the engine's guard region after linear memory; the includer must check that it exists. Those
+// entries are cached under a separate key.
+
+#ifndef WASM_ENGINE_VERSION
+#define WASM_ENGINE_VERSION "wamr"
+#endif
+
+static bool aot_no_bounds_checks = false;
+
+typedef struct {
+  void *data;
+  size_t size;
+} MappedFile;
+
+static bool map_file(const char *path, MappedFile *file) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+  if (ok) {
+    file->size = st.st_size;
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = file->data != MAP_FAILED;
+  }
+  close(fd);
+  return ok;
+}
+
+static void unmap_file(MappedFile *file) {
+  assert(munmap(file->data, file->size) != -1);
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static wasm_module_t *module_from_file(wasm_store_t *store, MappedFile *file) {
+  // wasm_module_new copies the binary, so the mapping can be released straight away.
+  wasm_byte_vec_t bytes = { 0 };
+  bytes.size = file->size;
+  bytes.data = file->data;
+  wasm_module_t *module = wasm_module_new(store, &bytes);
+  unmap_file(file);
+  return module;
+}
+
+// Runs wamrc to compile 'wasm_path' into a temporary file, then renames it into place so
+// concurrently starting containers never observe a partially written cache entry.
+static bool compile_aot(const char *wasm_path, const char *aot_path) {
+  const char *wamrc = getenv("WAMRC") ? getenv("WAMRC") : "wamrc";
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", aot_path, getpid());
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Keep the compiler's chatter off stdout.
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    if (aot_no_bounds_checks) {
+      execlp(wamrc, wamrc, "--bounds-checks=0", "-o", tmp_path, wasm_path, NULL);
+    } else {
+      execlp(wamrc, wamrc, "-o", tmp_path, wasm_path, NULL);
+    }
+    _exit(127);
+  }
+  int status = 0;
+  if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    unlink(tmp_path);
+    return false;
+  }
+  return rename(tmp_path, aot_path) == 0;
+}
+
+static wasm_module_t *load_module(wasm_store_t *store, const char *wasm_path) {
+  MappedFile wasm;
+  if (!map_file(wasm_path, &wasm)) {
+    return NULL;
+  }
+  const char *cache_dir = getenv("WASM_CACHE_DIR");
+  if (cache_dir == NULL || (mkdir(cache_dir, 0755) == -1 && errno != EEXIST)) {
+    return module_from_file(store, &wasm);
+  }
+
+  uint64_t key = fnv1a(0xcbf29ce484222325ull, WASM_ENGINE_VERSION, strlen(WASM_ENGINE_VERSION));
+  key = fnv1a(key, wasm.data, wasm.size);
+  if (aot_no_bounds_checks) {
+    key = fnv1a(key, "--bounds-checks=0", 17);
+  }
+  char aot_path[PATH_MAX];
+  snprintf(aot_path, sizeof(aot_path), "%s/%016" PRIx64 ".aot", cache_dir, key);
+
+  MappedFile aot;
+  if (map_file(aot_path, &aot) || (compile_aot(wasm_path, aot_path) && map_file(aot_path, &aot))) {
+    wasm_module_t *module = module_from_file(store, &aot);
+    if (module != NULL) {
+      unmap_file(&wasm);
+      return module;
+    }
+    // Unloadable entry (e.g. produced by an incompatible wamrc); drop it so it is rebuilt.
+    unlink(aot_path);
+  }
+  return module_from_file(store, &wasm);
+}
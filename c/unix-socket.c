@@ -0,0 +1,65 @@
+//
+// Copyright 2021 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Inlined via #include in gtk/host.c, gtk/container.c, terminal/host.c and terminal/container.c
+//
+// Message passing over a UNIX domain socket with file descriptors attached via SCM_RIGHTS.
+
+#define MAX_PASSED_FDS  16
+
+// Sends 'len' bytes of 'data' plus 'n_fds' descriptors as a single message.
+static bool send_with_fds(int sock, const void *data, size_t len, const int *fds, int n_fds) {
+  assert(n_fds <= MAX_PASSED_FDS);
+  struct iovec iov = { (void *)data, len };
+  char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))] = { 0 };
+  struct msghdr msg = { 0 };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n_fds > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+// Receives a message of exactly 'len' bytes; any attached descriptors (up to 'max_fds') are
+// stored in 'fds'. Returns the number of descriptors received, or -1 on error or EOF.
+static int recv_with_fds(int sock, void *data, size_t len, int *fds, int max_fds) {
+  assert(max_fds <= MAX_PASSED_FDS);
+  struct iovec iov = { data, len };
+  char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))] = { 0 };
+  struct msghdr msg = { 0 };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)len) {
+    return -1;
+  }
+  int n_fds = 0;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    assert(n_fds <= max_fds);
+    memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+  }
+  return n_fds;
+}
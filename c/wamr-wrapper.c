@@ -15,8 +15,28 @@
 //
 
 // Inlined via #include in gtk/container.c and heap-guard/container.c
+//
+// The including file lists the module's function exports first:
+//
+//   #define EXPORT_FUNCS(X)  X(ID, name, n_params, n_results) ...
+//
+// Each entry becomes enum value FN_<ID>, kExportFuncNames[FN_<ID>] and the stub
+// wasm_call_<name>(). All params and results are i32, with at most 4 params and 1 result.
+
+#include "module-cache.c"
+#include "call-stats.c"
+
+#define EXPORT_ENUM(id, name, n_params, n_results)  FN_##id,
+enum ExportFuncs { EXPORT_FUNCS(EXPORT_ENUM) N_FUNCS };
+
+#define EXPORT_NAME(id, name, n_params, n_results)  #name,
+const char *kExportFuncNames[] = { EXPORT_FUNCS(EXPORT_NAME) };
 
-#define N_FUNCS  (sizeof(kExportFuncNames) / sizeof(*kExportFuncNames))
+#define EXPORT_SIGNATURE(id, name, n_params, n_results)  { n_params, n_results },
+static const struct {
+  size_t params;
+  size_t results;
+} kExportSignatures[] = { EXPORT_FUNCS(EXPORT_SIGNATURE) };
 
 // Ownership indicator as used by the wasm-c-api code.
 #define own
@@ -33,6 +53,9 @@ typedef struct {
   // Export references
   wasm_memory_t *memory;
   wasm_func_t *funcs[N_FUNCS];
+
+  // Shared call statistics for kExportFuncNames; wasm_call_vec() only records them when set.
+  CallStats *stats;
 } WasmComponents;
 
 WasmComponents wc = { 0 };
@@ -42,36 +65,18 @@ typedef struct {
   int val;
 } CallResult;
 
-// Wraps the cumbersome wasm_func_call API. Assumes args and return value, where present, are i32.
-static CallResult wasm_call(int index, ...) {
-  wasm_func_t *fn = wc.funcs[index];
-  int arity = wasm_func_param_arity(fn);
-  bool has_result = wasm_func_result_arity(fn);
-  const char *name = kExportFuncNames[index];
-
-  // Args vector; capacity of 10 but reset current number to 0.
-  wasm_val_t args[10] = { 0 };
-  wasm_val_vec_t args_vec = WASM_ARRAY_VEC(args);
-  args_vec.num_elems = 0;
-  assert(arity <= args_vec.size);
-
-  // Process varags to fill in required number of elements in args/args_vec.
-  va_list ap;
-  va_start(ap, index);
-  for (int i = 0; i < arity; i++) {
-    int val = va_arg(ap, int);
-    args[i].kind = WASM_I32;
-    args[i].of.i32 = val;
-    args_vec.num_elems++;
-  }
-  va_end(ap);
-
-  // Call the wasm function.
+// Calls export 'index' with a prebuilt argument vector; the signature was checked against
+// EXPORT_FUNCS when the module was instantiated, so nothing is queried here.
+static CallResult wasm_call_vec(int index, wasm_val_vec_t *args_vec, bool has_result) {
   CallResult result = { false, 0 };
   wasm_val_t res[1] = { WASM_INIT_VAL };
   wasm_val_vec_t res_vec = WASM_ARRAY_VEC(res);
+  uint64_t start = wc.stats ? call_stats_now_ns() : 0;
   own wasm_trap_t *trap =
-      wasm_func_call(fn, arity ? &args_vec : NULL, has_result ? &res_vec : NULL);
+      wasm_func_call(wc.funcs[index], args_vec, has_result ? &res_vec : NULL);
+  if (wc.stats != NULL) {
+    call_stats_record(wc.stats, index, call_stats_now_ns() - start, trap != NULL);
+  }
   if (trap == NULL) {
     // Success - extract the result if required.
     if (has_result) {
@@ -82,13 +87,36 @@ static CallResult wasm_call(int index, ...) {
     // Failure - display the error message.
     own wasm_message_t msg;
     wasm_trap_message(trap, &msg);
-    fprintf(stderr, "Error calling '%s': %s", name, msg.data);
+    fprintf(stderr, "Error calling '%s': %s", kExportFuncNames[index], msg.data);
     wasm_byte_vec_delete(&msg);
     wasm_trap_delete(trap);
   }
   return result;
 }
 
+#define WASM_PARAMS_0  void
+#define WASM_PARAMS_1  int a0
+#define WASM_PARAMS_2  int a0, int a1
+#define WASM_PARAMS_3  int a0, int a1, int a2
+#define WASM_PARAMS_4  int a0, int a1, int a2, int a3
+
+#define WASM_ARGS_0
+#define WASM_ARGS_1  WASM_I32_VAL(a0)
+#define WASM_ARGS_2  WASM_ARGS_1, WASM_I32_VAL(a1)
+#define WASM_ARGS_3  WASM_ARGS_2, WASM_I32_VAL(a2)
+#define WASM_ARGS_4  WASM_ARGS_3, WASM_I32_VAL(a3)
+
+// wasm_call_<name>(): a typed stub per export with its arguments built in place. The array has
+// a spare element so that it is never zero-length.
+#define DEFINE_CALL_STUB(id, name, n_params, n_results)                     \
+  static inline CallResult wasm_call_##name(WASM_PARAMS_##n_params) {       \
+    wasm_val_t args[n_params + 1] = { WASM_ARGS_##n_params };               \
+    wasm_val_vec_t args_vec = WASM_ARRAY_VEC(args);                         \
+    args_vec.num_elems = n_params;                                          \
+    return wasm_call_vec(FN_##id, n_params ? &args_vec : NULL, n_results);  \
+  }
+EXPORT_FUNCS(DEFINE_CALL_STUB)
+
 static wasm_trap_t *print_callback(const wasm_val_vec_t *args, wasm_val_vec_t *results) {
   // args: int len, const char *msg
   assert(args->size == 2);
@@ -103,29 +131,22 @@ static wasm_trap_t *print_callback(const wasm_val_vec_t *args, wasm_val_vec_t *r
   return NULL;
 }
 
-static bool init_module(const char *module_name) {
-  FILE *file = fopen(module_name, "r");
-  if (file == NULL) {
-    fprintf(stderr, "Error loading wasm file '%s'", module_name);
-    return false;
+// Loads and compiles a module, creating the engine and store on first use. The result can be
+// instantiated any number of times, including by processes forked after compilation.
+static wasm_module_t *compile_module(const char *module_name) {
+  if (wc.engine == NULL) {
+    wc.engine = wasm_engine_new();
+    wc.store = wasm_store_new(wc.engine);
   }
-  fseek(file, 0, SEEK_END);
-  wasm_byte_vec_t wasm_bytes;
-  wasm_bytes.size = ftell(file);
-  wasm_bytes.data = malloc(wasm_bytes.size);
-  fseek(file, 0, SEEK_SET);
-  fread(wasm_bytes.data, 1, wasm_bytes.size, file);
-  fclose(file);
-
-  wc.engine = wasm_engine_new();
-  wc.store = wasm_store_new(wc.engine);
-  wc.module = wasm_module_new(wc.store, &wasm_bytes);
-  if (wc.module == NULL) {
-    fprintf(stderr, "Error compiling module");
-    return false;
+  wasm_module_t *module = load_module(wc.store, module_name);
+  if (module == NULL) {
+    fprintf(stderr, "Error loading wasm file '%s'", module_name);
   }
-  free(wasm_bytes.data);
+  return module;
+}
 
+// Instantiates wc.module and resolves the memory and kExportFuncNames exports.
+static bool instantiate_module() {
   // Set up the 'print_callback' import function.
   own wasm_importtype_vec_t expected_imports;
   wasm_module_imports(wc.module, &expected_imports);
@@ -178,10 +199,21 @@ static bool init_module(const char *module_name) {
       fprintf(stderr, "Function export '%s' not found", kExportFuncNames[i]);
       return false;
     }
+    if (wasm_func_param_arity(wc.funcs[i]) != kExportSignatures[i].params ||
+        wasm_func_result_arity(wc.funcs[i]) != kExportSignatures[i].results) {
+      fprintf(stderr, "Function export '%s' does not match its EXPORT_FUNCS signature",
+              kExportFuncNames[i]);
+      return false;
+    }
   }
   return true;
 }
 
+static bool init_module(const char *module_name) {
+  wc.module = compile_module(module_name);
+  return wc.module != NULL && instantiate_module();
+}
+
 static void destroy_module() {
   if (wc.instance_exports.data != NULL) {
     wasm_extern_vec_delete(&wc.instance_exports);
@@ -29,7 +29,8 @@ WAMR=$DEPS/wasm-micro-runtime
   cd src-c
   . $DEPS/emsdk/emsdk_env.sh &>/dev/null
   emcc module-c.c -o module-c.wasm -O3 -s "TOTAL_MEMORY=1088KB" -s "TOTAL_STACK=1MB" --no-entry
-  gcc container-wamr.c -o container-wamr -O3 -s -I$WAMR/core/iwasm/include -L$WAMR/build -lvmlib -lm -lpthread -lrt
+  gcc container-wamr.c -o container-wamr -O3 -s -DWASM_ENGINE_VERSION="\"wamr-$(git -C $WAMR rev-parse --short HEAD)\"" \
+    -I$WAMR/core/iwasm/include -L$WAMR/build -lvmlib -lm -lpthread -lrt
 )
 
 cargo build --release --target "wasm32-unknown-unknown" --bin module-rust
@@ -42,6 +43,24 @@ ln -sf ../target/release/{container-wasmer,container-wasmi} .
 ln -sf ../src-c/{container-wamr,module-c.wasm} .
 echo
 
+# ./profile.sh bench: measure each engine without sleeps, writing one summary row per
+# engine/module/mode to bench.csv and per-instance samples to <engine>-<module>-<mode>.csv.
+# The 'snapshot' mode maps later instances' memory copy-on-write from the first instance's.
+if [[ "$1" == "bench" ]]; then
+  echo "engine,module,mode,compile_ms,instantiate_p50_us,instantiate_p99_us,tick_p50_ns,tick_p99_ns,rss_kb_per_instance,pss_kb_per_instance" > bench.csv
+  for ENGINE in wamr wasmer wasmi; do
+    for MODULE in c rust; do
+      ./container-$ENGINE --bench $ENGINE-$MODULE-fresh.csv module-$MODULE.wasm >> bench.csv
+      ./container-$ENGINE --bench $ENGINE-$MODULE-snapshot.csv --snapshot module-$MODULE.wasm >> bench.csv
+    done
+  done
+  column -s, -t bench.csv
+  gnuplot plot-bench
+  xdg-open instantiation.png
+  xdg-open instance-memory.png
+  exit
+fi
+
 for ENGINE in wamr wasmer wasmi; do
   for MODULE in c rust; do
     ./container-$ENGINE module-$MODULE.wasm &
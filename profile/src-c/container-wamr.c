@@ -13,16 +13,76 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include "wasm_c_api.h"
+#include "../../c/module-cache.c"
 
 const int INSTANCE_LIMIT = 100;
 const int START_DELAY_SECS = 2;
 const int LOOP_DELAY_SECS = 1;
+const int TICK_ROUNDS = 100;
 
-wasm_func_t *instantiate(wasm_store_t *store, wasm_module_t *module) {
+// --snapshot mode: the first instance's linear memory is captured into a memfd straight after
+// instantiation, and mapped copy-on-write over the memory of every later instance so that pages
+// an instance never writes stay shared. No module code has run at that point, so the globals of
+// each new instance already match the snapshot's.
+typedef struct {
+  int fd;       // -1 until captured
+  size_t size;
+  size_t lead;  // offset of the memory within its first page; the image is stored at this offset
+} Snapshot;
+
+static void share_memory(Snapshot *snap, wasm_memory_t *memory) {
+  uint8_t *data = (uint8_t *)wasm_memory_data(memory);
+  size_t size = wasm_memory_data_size(memory);
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t lead = (uintptr_t)data & (page - 1);
+  if (snap->fd == -1) {
+    snap->fd = memfd_create("snapshot", MFD_CLOEXEC);
+    assert(snap->fd != -1);
+    for (size_t done = 0; done < size;) {
+      ssize_t n = pwrite(snap->fd, data + done, size - done, lead + done);
+      assert(n > 0);
+      done += n;
+    }
+    snap->size = size;
+    snap->lead = lead;
+    return;
+  }
+
+  // File offsets must be page aligned, so the image can only be mapped over memory with the same
+  // alignment; the partial pages at either end keep their own copy.
+  assert(size == snap->size);
+  if (lead != snap->lead) {
+    fprintf(stderr, "linear memory alignment differs from the snapshot; not shared\n");
+    return;
+  }
+  uint8_t *start = data + (lead ? page - lead : 0);
+  uint8_t *end = (uint8_t *)((uintptr_t)(data + size) & ~(page - 1));
+  if (end > start) {
+    void *res = mmap(start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snap->fd,
+                     lead + (start - data));
+    assert(res == start);
+  }
+}
+
+// Returns the new instance's tick function; 'snap' is NULL unless snapshots are enabled.
+wasm_func_t *instantiate(wasm_store_t *store, wasm_module_t *module, Snapshot *snap) {
   wasm_instance_t *instance = wasm_instance_new(store, module, NULL, NULL);
   assert(instance != NULL);
 
@@ -30,34 +90,128 @@ wasm_func_t *instantiate(wasm_store_t *store, wasm_module_t *module) {
   wasm_extern_vec_t instance_exports;
   wasm_module_exports(module, &module_exports);
   wasm_instance_exports(instance, &instance_exports);
+  wasm_func_t *tick = NULL;
   for (int i = 0; i < module_exports.size; i++) {
     wasm_exporttype_t *export_type = module_exports.data[i];
     const wasm_name_t *name = wasm_exporttype_name(export_type);
+    wasm_extern_t *export = instance_exports.data[i];
     if (strncmp("tick", name->data, name->size) == 0) {
-      return wasm_extern_as_func(instance_exports.data[i]);
+      tick = wasm_extern_as_func(export);
+    } else if (snap != NULL && wasm_extern_kind(export) == WASM_EXTERN_MEMORY) {
+      share_memory(snap, wasm_extern_as_memory(export));
+    }
+  }
+  assert(tick != NULL);
+  return tick;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Reads the process's total Rss and Pss (in kB) from /proc/self/smaps_rollup.
+static void read_memory(long *rss_kb, long *pss_kb) {
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  assert(f != NULL);
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "Rss: %ld kB", rss_kb);
+    sscanf(line, "Pss: %ld kB", pss_kb);
+  }
+  fclose(f);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Sorts 'samples' and returns the p'th percentile.
+static uint64_t percentile(uint64_t *samples, int n, int p) {
+  qsort(samples, n, sizeof(uint64_t), compare_u64);
+  return samples[(n - 1) * p / 100];
+}
+
+// --bench mode: creates INSTANCE_LIMIT instances back to back, writing each one's instantiation
+// time and the cumulative memory growth to 'out_name', then times TICK_ROUNDS tick calls on every
+// instance. The summary is printed as a CSV row; see profile.sh for the columns.
+static void run_bench(wasm_store_t *store, wasm_module_t *module, const char *module_name,
+                      uint64_t compile_ns, const char *out_name, Snapshot *snap) {
+  FILE *out = fopen(out_name, "w");
+  assert(out != NULL);
+  fprintf(out, "instance,instantiate_us,rss_kb,pss_kb\n");
+
+  wasm_func_t *tick_fn[INSTANCE_LIMIT];
+  uint64_t inst_ns[INSTANCE_LIMIT];
+  uint64_t tick_ns[INSTANCE_LIMIT * TICK_ROUNDS];
+  long rss0 = 0, pss0 = 0, rss = 0, pss = 0;
+  read_memory(&rss0, &pss0);
+  for (int i = 0; i < INSTANCE_LIMIT; i++) {
+    uint64_t start = now_ns();
+    tick_fn[i] = instantiate(store, module, snap);
+    inst_ns[i] = now_ns() - start;
+    read_memory(&rss, &pss);
+    fprintf(out, "%d,%.1f,%ld,%ld\n", i + 1, inst_ns[i] / 1e3, rss - rss0, pss - pss0);
+  }
+  fclose(out);
+
+  int n = 0;
+  for (int r = 1; r <= TICK_ROUNDS; r++) {
+    for (int i = 0; i < INSTANCE_LIMIT; i++) {
+      wasm_val_t res[1] = { WASM_INIT_VAL };
+      wasm_val_vec_t res_vec = WASM_ARRAY_VEC(res);
+      uint64_t start = now_ns();
+      wasm_func_call(tick_fn[i], NULL, &res_vec);
+      tick_ns[n++] = now_ns() - start;
+      assert(res[0].of.i32 == r);
     }
   }
-  assert(false);
+
+  printf("wamr,%s,%s,%.3f,%.1f,%.1f,%" PRIu64 ",%" PRIu64 ",%.1f,%.1f\n", module_name,
+         snap ? "snapshot" : "fresh", compile_ns / 1e6,
+         percentile(inst_ns, INSTANCE_LIMIT, 50) / 1e3, percentile(inst_ns, INSTANCE_LIMIT, 99) / 1e3,
+         percentile(tick_ns, n, 50), percentile(tick_ns, n, 99),
+         (double)(rss - rss0) / INSTANCE_LIMIT, (double)(pss - pss0) / INSTANCE_LIMIT);
 }
 
 int main(int argc, const char *argv[]) {
-  printf("container-wamr %s\n", argv[1]);
-
-  FILE *file = fopen(argv[1], "r");
-  assert(file != NULL);
-  fseek(file, 0, SEEK_END);
-  wasm_byte_vec_t wasm_bytes;
-  wasm_bytes.size = ftell(file);
-  wasm_bytes.data = malloc(wasm_bytes.size);
-  fseek(file, 0, SEEK_SET);
-  fread(wasm_bytes.data, 1, wasm_bytes.size, file);
-  fclose(file);
+  const char *bench_out = NULL;
+  const char *module_name = NULL;
+  Snapshot snapshot = { -1, 0, 0 };
+  Snapshot *snap = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+      bench_out = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot") == 0) {
+      snap = &snapshot;
+    } else if (module_name == NULL) {
+      module_name = argv[i];
+    } else {
+      module_name = NULL;
+      break;
+    }
+  }
+  if (module_name == NULL) {
+    fprintf(stderr, "Usage: %s [--bench <per-instance.csv>] [--snapshot] <module.wasm>\n", argv[0]);
+    return 1;
+  }
+  bool bench = bench_out != NULL;
+  if (!bench) {
+    printf("container-wamr %s%s\n", module_name, snap ? " (snapshot)" : "");
+  }
 
   wasm_engine_t *engine = wasm_engine_new();
   wasm_store_t *store = wasm_store_new(engine);
-  wasm_module_t *module = wasm_module_new(store, &wasm_bytes);
-  free(wasm_bytes.data);
+  uint64_t start = now_ns();
+  wasm_module_t *module = load_module(store, module_name);
+  uint64_t compile_ns = now_ns() - start;
   assert(module != NULL);
+  if (bench) {
+    run_bench(store, module, module_name, compile_ns, bench_out, snap);
+    return 0;
+  }
 
   wasm_func_t *tick_fn[INSTANCE_LIMIT];
   int counter[INSTANCE_LIMIT];
@@ -68,7 +222,7 @@ int main(int argc, const char *argv[]) {
   int wi = 0;
   while (true) {
     if (wi < INSTANCE_LIMIT) {
-      tick_fn[wi++] = instantiate(store, module);
+      tick_fn[wi++] = instantiate(store, module, snap);
     }
     for (int i = 0; i < wi; i++) {
       wasm_val_t res[1] = { WASM_INIT_VAL };
@@ -0,0 +1,113 @@
+//
+// Copyright 2021 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// --bench mode shared by the Rust containers; matches run_bench() in container-wamr.c.
+//
+// Creates 'limit' instances back to back, writing each one's instantiation time and the
+// cumulative memory growth to the --bench file, then times TICK_ROUNDS tick calls on every
+// instance. The summary is printed as a CSV row; see profile.sh for the columns.
+
+use std::{env, fs, io::prelude::*, time::{Duration, Instant}};
+
+const TICK_ROUNDS: i32 = 100;
+
+// Command line options common to the containers.
+pub struct Args {
+    pub bench_out: Option<String>,
+    pub snapshot: bool,
+    pub module_name: String,
+}
+
+pub fn parse_args() -> Args {
+    let mut args = env::args();
+    let program = args.next().unwrap();
+    let usage = || -> String { panic!("usage: {} [--bench <per-instance.csv>] [--snapshot] <module.wasm>", program) };
+    let (mut bench_out, mut snapshot, mut module_name) = (None, false, None);
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--bench" => bench_out = Some(args.next().unwrap_or_else(usage)),
+            "--snapshot" => snapshot = true,
+            _ if module_name.is_none() => module_name = Some(arg),
+            _ => { usage(); }
+        }
+    }
+    Args { bench_out, snapshot, module_name: module_name.unwrap_or_else(usage) }
+}
+
+pub fn run<T>(
+    engine: &str,
+    args: &Args,
+    compile: Duration,
+    limit: usize,
+    mut instantiate: impl FnMut() -> T,
+    mut tick: impl FnMut(&T) -> i32,
+) {
+    let mut out = fs::File::create(args.bench_out.as_ref().unwrap()).unwrap();
+    writeln!(out, "instance,instantiate_us,rss_kb,pss_kb").unwrap();
+
+    let mut instances = Vec::with_capacity(limit);
+    let mut inst_times = Vec::with_capacity(limit);
+    let (rss0, pss0) = read_memory();
+    let (mut rss, mut pss) = (rss0, pss0);
+    for i in 0..limit {
+        let start = Instant::now();
+        instances.push(instantiate());
+        inst_times.push(start.elapsed());
+        let mem = read_memory();
+        rss = mem.0;
+        pss = mem.1;
+        writeln!(out, "{},{:.1},{},{}", i + 1, micros(inst_times[i]), rss - rss0, pss - pss0).unwrap();
+    }
+
+    let mut tick_times = Vec::with_capacity(limit * TICK_ROUNDS as usize);
+    for r in 1..=TICK_ROUNDS {
+        for instance in &instances {
+            let start = Instant::now();
+            let val = tick(instance);
+            tick_times.push(start.elapsed());
+            assert_eq!(val, r);
+        }
+    }
+
+    println!("{},{},{},{:.3},{:.1},{:.1},{},{},{:.1},{:.1}", engine, args.module_name,
+             if args.snapshot { "snapshot" } else { "fresh" }, micros(compile) / 1e3,
+             micros(percentile(&mut inst_times, 50)), micros(percentile(&mut inst_times, 99)),
+             percentile(&mut tick_times, 50).as_nanos(), percentile(&mut tick_times, 99).as_nanos(),
+             (rss - rss0) as f64 / limit as f64, (pss - pss0) as f64 / limit as f64);
+}
+
+// Returns the process's total Rss and Pss (in kB) from /proc/self/smaps_rollup.
+fn read_memory() -> (i64, i64) {
+    let rollup = fs::read_to_string("/proc/self/smaps_rollup").unwrap();
+    let field = |name: &str| -> i64 {
+        rollup
+            .lines()
+            .find_map(|line| line.strip_prefix(name))
+            .and_then(|rest| rest.split_whitespace().next())
+            .map_or(0, |kb| kb.parse().unwrap())
+    };
+    (field("Rss:"), field("Pss:"))
+}
+
+// Sorts 'samples' and returns the p'th percentile.
+fn percentile(samples: &mut [Duration], p: usize) -> Duration {
+    samples.sort();
+    samples[(samples.len() - 1) * p / 100]
+}
+
+fn micros(d: Duration) -> f64 {
+    d.as_nanos() as f64 / 1e3
+}
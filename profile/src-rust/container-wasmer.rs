@@ -13,20 +13,43 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
-use std::{env, fs, io::prelude::*, thread, time::Duration};
-use wasmer_runtime::{Func, ImportObject, Instance, instantiate};
+mod bench;
+mod snapshot;
+
+use snapshot::Snapshot;
+use std::{env, fs, io::prelude::*, path::Path, thread, time::{Duration, Instant}};
+use wasmer_runtime::{
+    cache::{Cache, FileSystemCache, WasmHash}, compile, Func, ImportObject, Instance, Module,
+};
 
 const INSTANCE_LIMIT: usize = 100;
 const START_DELAY_SECS: u64 = 2;
 const LOOP_DELAY_SECS: u64 = 1;
 
 fn main() {
-    let module_name = env::args().nth(1).expect("missing module name arg");
-    println!("container-wasmer {}", module_name);
+    let args = bench::parse_args();
+    let module_name = &args.module_name;
+    if args.bench_out.is_none() {
+        println!("container-wasmer {}{}", module_name, if args.snapshot { " (snapshot)" } else { "" });
+    }
 
+    let start = Instant::now();
     let mut bytes = Vec::new();
     fs::File::open(module_name).unwrap().read_to_end(&mut bytes).unwrap();
+    let module = load_module(&bytes);
+    let compile = start.elapsed();
     let imports = ImportObject::new();
+    let mut snapshot = if args.snapshot { Some(Snapshot::new()) } else { None };
+
+    if args.bench_out.is_some() {
+        // Typed function handles borrow their instance, so the export lookup is timed as well.
+        return bench::run("wasmer", &args, compile, INSTANCE_LIMIT,
+            || instantiate(&module, &imports, &mut snapshot),
+            |instance| {
+                let tick: Func<(), i32> = instance.exports.get("tick").unwrap();
+                tick.call().unwrap()
+            });
+    }
 
     let mut instance: Vec<Instance> = Vec::with_capacity(INSTANCE_LIMIT);
     let mut counter = vec![0; INSTANCE_LIMIT];
@@ -35,7 +58,7 @@ fn main() {
     let mut wi = 0;
     loop {
         if wi < INSTANCE_LIMIT {
-            instance.push(instantiate(&bytes, &imports).unwrap());
+            instance.push(instantiate(&module, &imports, &mut snapshot));
             wi += 1;
         }
         for i in 0..wi {
@@ -47,3 +70,28 @@ fn main() {
         thread::sleep(Duration::from_secs(LOOP_DELAY_SECS));
     }
 }
+
+fn instantiate(module: &Module, imports: &ImportObject, snapshot: &mut Option<Snapshot>) -> Instance {
+    let instance = module.instantiate(imports).unwrap();
+    if let Some(snapshot) = snapshot {
+        let view = instance.context().memory(0).view::<u8>();
+        snapshot.share(view.as_ptr() as *mut u8, view.len());
+    }
+    instance
+}
+
+// Compiles the module once, using wasmer's serialized-module cache under WASM_CACHE_DIR (if set)
+// so later launches skip compilation. Entries are separated by wasmer version.
+fn load_module(bytes: &[u8]) -> Module {
+    let dir = match env::var("WASM_CACHE_DIR") {
+        Ok(dir) => Path::new(&dir).join(format!("wasmer-{}", wasmer_runtime::VERSION)),
+        Err(_) => return compile(bytes).unwrap(),
+    };
+    let mut cache = unsafe { FileSystemCache::new(dir).unwrap() };
+    let key = WasmHash::generate(bytes);
+    cache.load(key).unwrap_or_else(|_| {
+        let module = compile(bytes).unwrap();
+        cache.store(key, module.clone()).unwrap();
+        module
+    })
+}
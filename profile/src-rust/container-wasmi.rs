@@ -13,23 +13,47 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
-use std::{env, fs, io::prelude::*, thread, time::Duration};
-use wasmi::{ImportsBuilder, Module, ModuleInstance, ModuleRef, NopExternals, RuntimeValue};
+mod bench;
+mod snapshot;
+
+use snapshot::Snapshot;
+use std::{fs, io::prelude::*, thread, time::{Duration, Instant}};
+use wasmi::{FuncInstance, ImportsBuilder, Module, ModuleInstance, ModuleRef, NopExternals, RuntimeValue};
 
 const INSTANCE_LIMIT: usize = 100;
 const START_DELAY_SECS: u64 = 2;
 const LOOP_DELAY_SECS: u64 = 1;
 
 fn main() {
-    let module_name = env::args().nth(1).expect("missing module name arg");
-    println!("container-wasmi {}", module_name);
+    let args = bench::parse_args();
+    let module_name = &args.module_name;
+    if args.bench_out.is_none() {
+        println!("container-wasmi {}{}", module_name, if args.snapshot { " (snapshot)" } else { "" });
+    }
 
+    let start = Instant::now();
     let module = {
         let mut bytes = Vec::new();
         fs::File::open(module_name).unwrap().read_to_end(&mut bytes).unwrap();
         Module::from_buffer(&bytes).unwrap()
     };
+    let compile = start.elapsed();
     let imports = ImportsBuilder::default();
+    let mut snapshot = if args.snapshot { Some(Snapshot::new()) } else { None };
+
+    if args.bench_out.is_some() {
+        // Resolve 'tick' once per instance so that only the call itself is timed.
+        return bench::run("wasmi", &args, compile, INSTANCE_LIMIT,
+            || {
+                let instance = instantiate(&module, &imports, &mut snapshot);
+                let tick = instance.export_by_name("tick").unwrap().as_func().unwrap().clone();
+                (instance, tick)
+            },
+            |(_, tick)| match FuncInstance::invoke(tick, &[], &mut NopExternals).unwrap() {
+                Some(RuntimeValue::I32(val)) => val,
+                _ => panic!("tick returned an unexpected value"),
+            });
+    }
 
     let mut instance: Vec<ModuleRef> = Vec::with_capacity(INSTANCE_LIMIT);
     let mut counter = vec![0; INSTANCE_LIMIT];
@@ -38,7 +62,7 @@ fn main() {
     let mut wi = 0;
     loop {
         if wi < INSTANCE_LIMIT {
-            instance.push(ModuleInstance::new(&module, &imports).unwrap().assert_no_start());
+            instance.push(instantiate(&module, &imports, &mut snapshot));
             wi += 1;
         }
         for i in 0..wi {
@@ -51,3 +75,12 @@ fn main() {
         thread::sleep(Duration::from_secs(LOOP_DELAY_SECS));
     }
 }
+
+fn instantiate(module: &Module, imports: &ImportsBuilder, snapshot: &mut Option<Snapshot>) -> ModuleRef {
+    let instance = ModuleInstance::new(module, imports).unwrap().assert_no_start();
+    if let Some(snapshot) = snapshot {
+        let memory = instance.export_by_name("memory").expect("module does not export memory");
+        memory.as_memory().unwrap().with_direct_access_mut(|buf| snapshot.share(buf.as_mut_ptr(), buf.len()));
+    }
+    instance
+}
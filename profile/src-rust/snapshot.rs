@@ -0,0 +1,73 @@
+//
+// Copyright 2021 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// --snapshot mode shared by the Rust containers; matches share_memory() in container-wamr.c.
+//
+// The first instance's linear memory is captured into a memfd straight after instantiation, and
+// mapped copy-on-write over the memory of every later instance so that pages an instance never
+// writes stay shared. No module code has run at that point, so the globals of each new instance
+// already match the snapshot's.
+
+use libc::{MAP_FIXED, MAP_PRIVATE, MFD_CLOEXEC, PROT_READ, PROT_WRITE};
+
+pub struct Snapshot {
+    fd: i32,  // -1 until captured
+    size: usize,
+    lead: usize,  // offset of the memory within its first page; the image is stored at this offset
+}
+
+impl Snapshot {
+    pub fn new() -> Self {
+        Self { fd: -1, size: 0, lead: 0 }
+    }
+
+    pub fn share(&mut self, data: *mut u8, size: usize) {
+        let page = unsafe { libc::sysconf(libc::_SC_PAGESIZE) as usize };
+        let lead = data as usize & (page - 1);
+        if self.fd == -1 {
+            self.fd = unsafe { libc::memfd_create(b"snapshot\0".as_ptr() as *const libc::c_char, MFD_CLOEXEC) };
+            assert!(self.fd != -1, "memfd_create failed");
+            let mut done = 0;
+            while done < size {
+                let n = unsafe {
+                    libc::pwrite(self.fd, data.add(done) as *const libc::c_void, size - done, (lead + done) as i64)
+                };
+                assert!(n > 0, "failed to write snapshot");
+                done += n as usize;
+            }
+            self.size = size;
+            self.lead = lead;
+            return;
+        }
+
+        // File offsets must be page aligned, so the image can only be mapped over memory with the
+        // same alignment; the partial pages at either end keep their own copy.
+        assert_eq!(size, self.size);
+        if lead != self.lead {
+            eprintln!("linear memory alignment differs from the snapshot; not shared");
+            return;
+        }
+        let start = data as usize + if lead > 0 { page - lead } else { 0 };
+        let end = (data as usize + size) & !(page - 1);
+        if end > start {
+            let res = unsafe {
+                libc::mmap(start as *mut libc::c_void, end - start, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_FIXED, self.fd, (lead + start - data as usize) as i64)
+            };
+            assert_eq!(res as usize, start, "failed to map snapshot");
+        }
+    }
+}
@@ -42,6 +42,24 @@ setup_deps() {
   cd ..
 }
 
+# Builds the WAMR AOT compiler, used to populate the compiled-module cache when WASM_CACHE_DIR
+# is set. This requires building LLVM the first time and takes a while.
+setup_wamrc() {
+  if [ ! -x $WAMR/wamr-compiler/build/wamrc ]; then
+    echo "-- Setting up wamrc --"
+    (
+      cd $WAMR/wamr-compiler
+      ./build_llvm.sh
+      mkdir -p build
+      cd build
+      cmake ..
+      make
+    )
+    echo
+  fi
+  export WAMRC=$WAMR/wamr-compiler/build/wamrc
+}
+
 get_rust_tooling() {
   if ! rustup -V &>/dev/null; then
     echo "Installing Rustup"
@@ -60,13 +78,14 @@ get_rust_tooling() {
   echo "Done"
 }
 
+# Builds NAME.wasm from NAME.c, or from WASM_SRC.c if set.
 build_wasm_c() {
-  local F NAME=$1 FLAGS="$2"
+  local F NAME=$1 FLAGS="$2" SRC=${WASM_SRC:-$1}
   . $EMSDK/emsdk_env.sh &>/dev/null
-  for F in $NAME.c "${@:3}"; do
+  for F in $SRC.c "${@:3}"; do
     if [ $F -nt $NAME.wasm ]; then
       echo "Building $NAME.wasm"
-      emcc --no-entry -s EXPORTED_FUNCTIONS="['_malloc']" $FLAGS -Os $NAME.c -o $NAME.wasm
+      emcc --no-entry -s EXPORTED_FUNCTIONS="['_malloc']" $FLAGS -Os $SRC.c -o $NAME.wasm
       break
     fi
   done
@@ -79,18 +98,24 @@ build_gtk_wasm_c() {
   fi
   cd c/gtk
   for W in hunter runner; do
-    build_wasm_c $W "-s TOTAL_MEMORY=16MB" module-common.c common.h
+    build_wasm_c $W "-s INITIAL_MEMORY=1MB -s ALLOW_MEMORY_GROWTH=1 $SIMD_CFLAGS $PAGES_CFLAGS" \
+      module-common.c common.h
   done
   cd ../..
 }
 
 build_gtk_wasm_rust() {
-  cargo build $MODE_FLAG --target "$RUST_WASM_TARGET" --manifest-path "$RUST_CONFIG" --features modules
+  RUSTFLAGS="$SIMD_RUSTFLAGS" cargo build $MODE_FLAG --target "$RUST_WASM_TARGET" --manifest-path "$RUST_CONFIG" --features "modules $PAGES_FEATURE"
 }
 
 build_wasm_container() {
   echo "Building container"
-  gcc container.c -o container -I$WAMR/core/iwasm/include -L$WAMR/build -lvmlib -lm -lpthread -lrt
+  local VERSION="wamr-$(git -C $WAMR rev-parse --short HEAD)"
+  gcc container.c -o container -DWASM_ENGINE_VERSION="\"$VERSION\"" \
+    -I$WAMR/core/iwasm/include -L$WAMR/build -lvmlib -lm -lpthread -lrt
+  if [ -n "$WASM_CACHE_DIR" ]; then
+    setup_wamrc
+  fi
 }
 
 build_wasm_host() {
@@ -100,10 +125,43 @@ build_wasm_host() {
 
 run() {
   echo -e "\n-- Running --"
-  rm -f /dev/shm/{shared_ro,shared_rw}
+  rm -f /dev/shm/{shared_ro,shared_rw,shared_ctl}
   ./host "$@"
 }
 
+# Sets RUST_HOST_ARGS to the given host options minus those only the C host has, warning about
+# each one dropped.
+rust_host_args() {
+  RUST_HOST_ARGS=()
+  while [ $# -gt 0 ]; do
+    case $1 in
+      --serial|--lockstep|--zygote|--huge-pages)
+        echo "Rust host: ignoring C-only option $1" >&2 ;;
+      --batch|--tiles)
+        echo "Rust host: ignoring C-only option $1 $2" >&2
+        shift ;;
+      *) RUST_HOST_ARGS+=("$1") ;;
+    esac
+    shift
+  done
+}
+
+# Runs one host and module combination headless, passing on any extra host options.
+run_headless() {
+  local COMBO=$1 C_HOST=$BASE/c/gtk/host R_HOST=$BASE/rust/gtk/target/${MODE}/host
+  local C_MODULES=($BASE/c/gtk/{hunter,runner}.wasm)
+  local R_MODULES=($BASE/${RUST_MODULES_OUT}/{hunter,runner}.wasm)
+  echo -e "\n-- $COMBO --"
+  rm -f /dev/shm/{shared_ro,shared_rw,shared_ctl}
+  rust_host_args "${@:2}"
+  case $COMBO in
+    gc) ( cd c/gtk && $C_HOST --headless "${@:2}" "${C_MODULES[@]}" ) ;;
+    gr) $R_HOST --headless "${RUST_HOST_ARGS[@]}" "${R_MODULES[@]}" ;;
+    grc) $R_HOST --headless "${RUST_HOST_ARGS[@]}" "${C_MODULES[@]}" ;;
+    gcr) ( cd c/gtk && $C_HOST --headless "${@:2}" "${R_MODULES[@]}" ) ;;
+  esac
+}
+
 # Handle the command line arguments
 MODE="debug"
 MODE_FLAG=""
@@ -120,6 +178,26 @@ RUST_WASM_TARGET="wasm32-unknown-unknown"
 RUST_CONFIG="rust/gtk/Cargo.toml"
 RUST_MODULES_OUT="rust/gtk/target/${RUST_WASM_TARGET}/${MODE}"
 
+# WASM_SIMD=1 builds the gtk modules with wasm SIMD128, used by the host's --soa actor layout.
+# The engine must support SIMD; without it the modules use equivalent scalar loops. Delete the
+# C modules' .wasm files when changing this, as they are only rebuilt when their sources change.
+SIMD_CFLAGS=""
+SIMD_RUSTFLAGS=""
+if [ -n "$WASM_SIMD" ]; then
+  SIMD_CFLAGS="-msimd128"
+  SIMD_RUSTFLAGS="-C target-feature=+simd128"
+fi
+
+# WASM_SHARED_PAGES=1 builds the gtk modules to give the shared buffers whole wasm pages taken
+# straight from memory growth, instead of a malloc block (see malloc_ in module-common.c). The
+# same rebuild caveat as WASM_SIMD applies.
+PAGES_CFLAGS=""
+PAGES_FEATURE=""
+if [ -n "$WASM_SHARED_PAGES" ]; then
+  PAGES_CFLAGS="-DSHARED_PAGES"
+  PAGES_FEATURE="shared-pages"
+fi
+
 case "$1" in
   gc) # C GTK demo
     setup_deps
@@ -152,6 +230,18 @@ case "$1" in
     ./host "../../${RUST_MODULES_OUT}/hunter.wasm" "../../${RUST_MODULES_OUT}/runner.wasm"
     ;;
 
+  b) # Headless throughput of every GTK host and module combination
+    shift
+    setup_deps
+    build_gtk_wasm_c
+    build_gtk_wasm_rust
+    cargo build $MODE_FLAG --manifest-path "$RUST_CONFIG" --features host
+    ( cd c/gtk && build_wasm_container && build_wasm_host )
+    for COMBO in gc gr grc gcr; do
+      run_headless $COMBO --seed ${BENCH_SEED:-1} "$@"
+    done
+    ;;
+
   h) # Heap guard demo
     cd c/heap-guard
     build_wasm_c module "-s TOTAL_MEMORY=64KB -s TOTAL_STACK=16KB"
@@ -178,26 +268,45 @@ case "$1" in
     ./host
     ;;
 
+  ts) # Terminal stress test: shared buffer vs pipe round trips
+    shift
+    setup_deps
+    cd terminal
+    WASM_SRC=module build_wasm_c stress "-s TOTAL_MEMORY=4MB -s TOTAL_STACK=64KB"
+    build_wasm_container
+    gcc -O2 host.c -o host -lrt
+    ./host --stress "$@"
+    ;;
+
   i) # Install any deps needed
     setup_deps
     get_rust_tooling
     ;;
 
   clean)
-    rm -vf {c/{gtk,heap-guard},terminal}/{*.wasm,container,host} /dev/shm/{shared_ro,shared_rw}
+    rm -vf {c/{gtk,heap-guard},terminal}/{*.wasm,container,host} /dev/shm/{shared_ro,shared_rw,shared_ctl}
     ( cd rust/gtk && cargo clean -v )
     ( cd rust/lookup && cargo clean -v )
     ;;
 
-  *)  echo "Usage: ./run.sh [-r] (gc | gr | grc | gcr | h | t | i | clean)"
+  *)  echo "Usage: ./run.sh [-r] (gc | gr | grc | gcr | b | h | t | ts | i | clean)"
       echo "  gc: GTK demo in C"
       echo "  gr: GTK demo in Rust"
       echo "  grc: GTK demo with Rust host and C wasm modules"
       echo "  gcr: GTK demo with C host and Rust wasm modules"
+      echo "  b: headless GTK benchmark of gc, gr, grc and gcr; extra args go to the hosts, e.g."
+      echo "     --ticks N, --grid WxH, --runners N, --soa (BENCH_SEED sets the seed, default 1)"
       echo "  h: Heap guard demo"
       echo "  l: Lookup store performance tests"
       echo "  t: terminal-only tests"
+      echo "  ts: terminal stress test; extra args go to the host, e.g. --iters N, --sizes MIN-MAX"
       echo "  i: install dependencies"
       echo "  clean: cleans up build artifacts"
       echo "  -r: use release mode for rust"
+      echo "Set WASM_CACHE_DIR to cache AOT-compiled modules between container launches."
+      echo "Set WASM_CALL_STATS=1 to have the C containers time every export call; the C host"
+      echo "prints the stats on exit and on SIGUSR1, and always enables them when headless."
+      echo "Set WASM_GUARD_PAGES=1 to fence the GTK shared buffers with guard pages and, with"
+      echo "WASM_CACHE_DIR, compile modules without software bounds checks (needs WAMR's hardware"
+      echo "bound check, the default on 64-bit Linux)."
 esac
@@ -14,20 +14,68 @@
 // limitations under the License.
 //
 use common::host_common::*;
-use common::shared::{cptr, State};
+use common::shared::{
+    cptr, GridHeader, State, ACTORS_AOS, ACTORS_SOA, DIRTY_SHIFT, GRID_BITS, GRID_BYTES, INDEX_SHIFT, RUNNERS_OFFSET,
+};
 use fork::{fork, Fork};
 use gtk::{cairo, gio, prelude::*};
 use libc::{MAP_SHARED, O_CREAT, O_RDWR, O_TRUNC, PROT_READ, PROT_WRITE, S_IRUSR, S_IWUSR};
-use rand::Rng;
-use std::{cell::RefCell, ffi::CString, process, rc::Rc, slice, thread, time::Duration};
+use rand::{rngs::StdRng, Rng, SeedableRng};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use std::{cell::RefCell, ffi::CString, process, rc::Rc, slice};
 
 fn main() {
     println!("Host started; pid {}", process::id());
     assert_eq!(PAGE_SIZE, unsafe { libc::sysconf(libc::_SC_PAGESIZE) });
 
-    let hunter_path = std::env::args().nth(1).expect("missing hunter module path arg");
-    let runner_path = std::env::args().nth(2).expect("missing runner module path arg");
-    let ctx = Rc::new(RefCell::new(HostContext::new(&hunter_path, &runner_path)));
+    // Host options are consumed here; only the module paths are passed on to GtkApplication.
+    let mut args = std::env::args();
+    let program = args.next().unwrap();
+    let (mut grid_w, mut grid_h, mut n_runners) = (GRID_W as u32, GRID_H as u32, N_RUNNERS as u32);
+    let (mut encoding, mut layout, mut index_shift) = (GRID_BYTES, ACTORS_AOS, 0);
+    let (mut headless, mut headless_ticks, mut async_ticks) = (false, 1000, false);
+    let mut seed = SystemTime::now().duration_since(UNIX_EPOCH).unwrap().as_secs() as u32;
+    let mut paths = Vec::new();
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--grid" => {
+                let dims = args.next().expect("--grid needs WxH");
+                let (w, h) = dims.split_once('x').expect("--grid needs WxH");
+                grid_w = w.parse().expect("bad grid width");
+                grid_h = h.parse().expect("bad grid height");
+            }
+            "--runners" => n_runners = args.next().and_then(|n| n.parse().ok()).expect("--runners needs a count"),
+            "--bits" => encoding = GRID_BITS,
+            "--soa" => layout = ACTORS_SOA,
+            "--index" => index_shift = INDEX_SHIFT,
+            "--headless" => headless = true,
+            "--async" => async_ticks = true,
+            "--ticks" => headless_ticks = args.next().and_then(|n| n.parse().ok()).expect("--ticks needs a count"),
+            "--seed" => seed = args.next().and_then(|n| n.parse().ok()).expect("--seed needs a number"),
+            _ if arg.starts_with("--") => {
+                println!("Unknown option {}", arg);
+                println!("usage: host [--grid WxH] [--runners N] [--bits] [--soa] [--index] [--async] \
+                          [--headless [--ticks N]] [--seed S] hunter.wasm runner.wasm");
+                process::exit(1);
+            }
+            _ => paths.push(arg),
+        }
+    }
+    assert!(grid_w >= 3 && grid_h >= 3 && n_runners > 0 && headless_ticks > 0);
+    let header = GridHeader::new(grid_w, grid_h, n_runners, encoding, layout, index_shift, 0);
+
+    let hunter_path = paths.get(0).expect("missing hunter module path arg");
+    let runner_path = paths.get(1).expect("missing runner module path arg");
+
+    // The containers are given the same seed, so a run can be repeated.
+    seed_rng(seed);
+    if headless {
+        let mut ctx = HostContext::new(hunter_path, runner_path, header, seed, async_ticks);
+        run_headless(&mut ctx, headless_ticks, seed);
+        println!("Host stopping");
+        return;
+    }
+    let ctx = Rc::new(RefCell::new(HostContext::new(hunter_path, runner_path, header, seed, async_ticks)));
     let app = gtk::Application::new(None, gio::ApplicationFlags::HANDLES_OPEN);
     {
         let ctx = ctx.clone();
@@ -38,65 +86,118 @@ fn main() {
         // from being dropped. We need to clear the timeout to fix this.
         glib::source::source_remove(ctx.borrow_mut().timeout_id.take().expect("Timeout could not be taken!?"));
     });
-    app.run();
+    let gtk_args: Vec<String> = std::iter::once(program).chain(paths).collect();
+    app.run_with_args(&gtk_args);
     println!("Host stopping");
 }
 
 struct HostContext<'a> {
     grid: Grid<'a>,
     actors: Actors<'a>,
+    containers: Containers,
+    n_runners: i32,
+    scale: f64,
+    grid_layer: Option<cairo::ImageSurface>, // the grid as last drawn; see update_grid_layer()
+    ro_size: i32,
+    rw_size: i32,
     shared_ro: cptr,
     shared_rw: cptr,
+    control: cptr,
     timeout_id: Option<glib::source::SourceId>,
     enable_host_modify: bool,
+    async_ticks: bool, // ticks are left running while the host draws; see take_snapshot()
 }
 
 impl HostContext<'_> {
-    fn new(hunter_path: &str, runner_path: &str) -> Self {
-        let shared_ro = create_shared_buffer(READ_ONLY_BUF_NAME, READ_ONLY_BUF_SIZE);
-        let shared_rw = create_shared_buffer(READ_WRITE_BUF_NAME, READ_WRITE_BUF_SIZE);
+    fn new(hunter_path: &str, runner_path: &str, header: GridHeader, seed: u32, async_ticks: bool) -> Self {
+        let ro_size = read_only_buf_size(&header);
+        let rw_size = read_write_buf_size(&header);
+        let shared_ro = create_shared_buffer(READ_ONLY_BUF_NAME, ro_size);
+        let shared_rw = create_shared_buffer(READ_WRITE_BUF_NAME, rw_size);
+
+        // The grid is written before the containers start, as their modules check its header.
+        let mut grid = Grid::new(shared_ro, header);
+        grid.init();
+        let control = create_shared_buffer(CONTROL_BUF_NAME, CONTROL_BUF_SIZE);
+        let mut containers = Containers::new(control);
         // TODO: Use own path to find the other binaries
-        fork_container("rust/gtk/target/debug/container-wasmer", hunter_path, HUNTER_SIGNAL_INDEX);
-        fork_container("rust/gtk/target/debug/container-wasmi", runner_path, RUNNER_SIGNAL_INDEX);
+        containers.fork("rust/gtk/target/debug/container-wasmer", hunter_path, HUNTER_SIGNAL_INDEX);
+        containers.fork("rust/gtk/target/debug/container-wasmi", runner_path, RUNNER_SIGNAL_INDEX);
+
+        // Keep the window no larger than the default grid's.
+        let scale = (GRID_W as f64 * SCALE / header.grid_w as f64)
+            .min(GRID_H as f64 * SCALE / header.grid_h as f64)
+            .min(SCALE);
 
-        // Grid and Actors do *not* take ownership of the shared buffers.
+        // Grid, Actors and Containers do *not* take ownership of the shared buffers.
         let mut ctx = Self {
-            grid: Grid::new(shared_ro, READ_ONLY_BUF_SIZE),
-            actors: Actors::new(shared_rw, READ_WRITE_BUF_SIZE),
+            grid,
+            actors: Actors::new(shared_rw, &header, async_ticks),
+            containers,
+            n_runners: header.n_runners as i32,
+            scale,
+            grid_layer: None,
+            ro_size,
+            rw_size,
             shared_ro,
             shared_rw,
+            control,
             timeout_id: None,
             enable_host_modify: false,
+            async_ticks,
         };
-        ctx.grid.init();
-        ctx.actors.send_signal(Signal::Init, true);
+        ctx.containers.send_signal_arg(Signal::Init, seed, true);
         ctx
     }
 
     fn toggle_host_modify(&mut self) {
         self.enable_host_modify = !self.enable_host_modify;
     }
+
+    // Copies the actors (but not the spatial index) into the back snapshot as a seqlock reader,
+    // and makes it the front one if no container wrote to the read-write buffer meanwhile. Fails
+    // if a container was part way through a tick, leaving the last whole snapshot in front.
+    fn take_snapshot(&mut self) -> bool {
+        let seqs: Option<Vec<u32>> = self.containers.doorbells.iter().map(|d| d.read_begin()).collect();
+        let seqs = match seqs {
+            Some(seqs) => seqs,
+            None => return false,
+        };
+        self.actors.copy_to_back();
+        if !self.containers.doorbells.iter().zip(seqs).all(|(d, seq)| d.read_valid(seq)) {
+            return false;
+        }
+        self.actors.swap_snapshots();
+        true
+    }
 }
 
 impl Drop for HostContext<'_> {
     fn drop(&mut self) {
-        self.actors.send_signal(Signal::Exit, false);
+        self.containers.send_signal(Signal::Exit, false);
 
         let cname_ro = CString::new(READ_ONLY_BUF_NAME).unwrap();
         let cname_rw = CString::new(READ_WRITE_BUF_NAME).unwrap();
+        let cname_ctl = CString::new(CONTROL_BUF_NAME).unwrap();
         unsafe {
-            if libc::munmap(self.shared_ro, READ_ONLY_BUF_SIZE as usize) == -1 {
+            if libc::munmap(self.shared_ro, self.ro_size as usize) == -1 {
                 println!("munmap failed for shared_ro");
             }
-            if libc::munmap(self.shared_rw, READ_ONLY_BUF_SIZE as usize) == -1 {
+            if libc::munmap(self.shared_rw, self.rw_size as usize) == -1 {
                 println!("munmap failed for shared_rw");
             }
+            if libc::munmap(self.control, CONTROL_BUF_SIZE as usize) == -1 {
+                println!("munmap failed for control");
+            }
             if libc::shm_unlink(cname_ro.as_ptr()) == -1 {
                 println!("shm_unlink failed for shared_ro");
             }
             if libc::shm_unlink(cname_rw.as_ptr()) == -1 {
                 println!("shm_unlink failed for shared_rw");
             }
+            if libc::shm_unlink(cname_ctl.as_ptr()) == -1 {
+                println!("shm_unlink failed for control");
+            }
         }
     }
 }
@@ -122,117 +223,238 @@ fn create_shared_buffer(name: &str, size: i32) -> cptr {
     }
 }
 
-fn fork_container(binary: &str, module: &str, index: usize) {
-    match fork() {
-        Ok(Fork::Parent(_)) => (),
-        Ok(Fork::Child) => {
-            let err = exec::execvp(binary, &[binary, module, &index.to_string()]);
-            panic!("exec failed: {}", err); // should not be reached
+// Tracks the container processes and their doorbell slots in the (unowned) control page.
+struct Containers {
+    control: cptr,
+    doorbells: Vec<Doorbell>,
+    pids: Vec<i32>,
+    pending: Option<Signal>, // a tick command rung by start_ticks() but not yet collected
+}
+
+impl Containers {
+    fn new(control: cptr) -> Self {
+        Self { control, doorbells: Vec::new(), pids: Vec::new(), pending: None }
+    }
+
+    fn fork(&mut self, binary: &str, module: &str, index: usize) {
+        assert_eq!(index, self.doorbells.len());
+        match fork() {
+            Ok(Fork::Parent(pid)) => {
+                // The container acks the first sequence number once its buffers are mapped.
+                let doorbell = Doorbell::new(self.control, index);
+                if !doorbell.wait_ack(pid) {
+                    panic!("container {} failed to start", index);
+                }
+                self.doorbells.push(doorbell);
+                self.pids.push(pid);
+            }
+            Ok(Fork::Child) => {
+                let err = exec::execvp(binary, &[binary, module, &index.to_string()]);
+                panic!("exec failed: {}", err); // should not be reached
+            }
+            Err(_) => panic!("fork failed"),
+        }
+    }
+
+    // Each container has a dedicated doorbell slot in the control page. The host rings every
+    // doorbell before waiting on any acks, so the containers run the command concurrently.
+    fn send_signal(&mut self, signal: Signal, wait_for_ack: bool) {
+        self.send_signal_arg(signal, 0, wait_for_ack);
+    }
+
+    // Runs 'n' ticks in every container with a single round trip.
+    fn send_ticks(&mut self, n: u32, lockstep: bool) {
+        self.start_ticks(n, lockstep);
+        self.finish_ticks();
+    }
+
+    // Rings 'n' ticks but leaves the containers running; the acks are collected by
+    // finish_ticks(), which every other command calls first.
+    fn start_ticks(&mut self, n: u32, lockstep: bool) {
+        self.finish_ticks();
+        let (signal, arg) = match n {
+            1 => (Signal::Tick, 0),
+            _ => (Signal::TickN, n | if lockstep { TICK_N_LOCKSTEP } else { 0 }),
+        };
+        self.ring_all(signal, arg);
+        self.pending = Some(signal);
+    }
+
+    fn finish_ticks(&mut self) {
+        if let Some(signal) = self.pending.take() {
+            self.wait_all(signal);
+        }
+    }
+
+    fn send_signal_arg(&mut self, signal: Signal, arg: u32, wait_for_ack: bool) {
+        self.finish_ticks();
+        self.ring_all(signal, arg);
+        if wait_for_ack {
+            self.wait_all(signal);
+        }
+    }
+
+    fn ring_all(&mut self, signal: Signal, arg: u32) {
+        let peers = self.doorbells.len();
+        for doorbell in self.doorbells.iter_mut() {
+            doorbell.ring(signal, arg, peers);
+        }
+    }
+
+    fn wait_all(&self, signal: Signal) {
+        for (i, doorbell) in self.doorbells.iter().enumerate() {
+            if !doorbell.wait_ack(self.pids[i]) {
+                panic!("failed to receive ack for signal {} from container {}", signal as i32, i);
+            }
         }
-        Err(_) => panic!("fork failed"),
     }
 }
 
-// Wraps the (unowned) read-only buffer to provide 2D-array-style access.
+// Wraps the (unowned) read-only buffer: the GridHeader followed by the encoded rows.
 struct Grid<'a> {
-    data: &'a mut [i32],
+    header: GridHeader,
+    data: &'a mut [u8],
 }
 
 impl Grid<'_> {
-    fn new(shared_ro: cptr, len: i32) -> Self {
-        Self {
-            data: unsafe { slice::from_raw_parts_mut(shared_ro as *mut i32, len as usize) },
-        }
+    fn new(shared_ro: cptr, header: GridHeader) -> Self {
+        let data = unsafe { slice::from_raw_parts_mut(shared_ro as *mut u8, header.buffer_size()) };
+        unsafe { *(shared_ro as *mut GridHeader) = header };
+        Self { header, data }
+    }
+
+    fn width(&self) -> i32 {
+        self.header.grid_w as i32
     }
 
+    fn height(&self) -> i32 {
+        self.header.grid_h as i32
+    }
+
+    // The buffer was freshly truncated, so every cell starts clear.
     fn init(&mut self) {
-        for x in 0..GRID_W {
-            self.set(x, 0, 1);
-            self.set(x, GRID_H - 1, 1);
+        let (w, h) = (self.width(), self.height());
+        for x in 0..w {
+            self.set(x, 0, true);
+            self.set(x, h - 1, true);
         }
-        for y in 1..(GRID_H - 1) {
-            self.set(0, y, 1);
-            self.set(GRID_W - 1, y, 1);
-            for x in 1..(GRID_W - 1) {
-                self.set(x, y, 0);
-            }
+        for y in 1..(h - 1) {
+            self.set(0, y, true);
+            self.set(w - 1, y, true);
         }
-        for _ in 0..N_BLOCKS {
-            let x = rand_range(1, GRID_W - 2);
-            let y = rand_range(1, GRID_H - 2);
-            self.set(x, y, 1);
+        let n_blocks = N_BLOCKS as i64 * w as i64 * h as i64 / (GRID_W * GRID_H) as i64;
+        for _ in 0..n_blocks {
+            let x = rand_range(1, w - 2);
+            let y = rand_range(1, h - 2);
+            self.set(x, y, true);
         }
     }
 
     fn modify(&mut self) {
         for _ in 0..5 {
-            let x = rand_range(1, GRID_W - 2);
-            let y = rand_range(1, GRID_H - 2);
-            self.set(x, y, 1 - self.get(x, y));
+            let x = rand_range(1, self.width() - 2);
+            let y = rand_range(1, self.height() - 2);
+            self.set(x, y, !self.get(x, y));
         }
     }
 
-    fn get(&self, x: i32, y: i32) -> i32 {
-        self.data[(y * GRID_W + x) as usize]
+    fn get(&self, x: i32, y: i32) -> bool {
+        let (index, bits) = self.header.cell(x as usize, y as usize);
+        self.data[index] & bits != 0
     }
 
-    fn set(&mut self, x: i32, y: i32, val: i32) {
-        self.data[(y * GRID_W + x) as usize] = val;
+    fn set(&mut self, x: i32, y: i32, blocked: bool) {
+        let (index, bits) = self.header.cell(x as usize, y as usize);
+        if blocked {
+            self.data[index] |= bits;
+        } else {
+            self.data[index] &= !bits;
+        }
+        let (index, bit) = self.header.dirty_bit(x as usize, y as usize);
+        self.data[index] |= bit;
+    }
+
+    // Returns the regions marked in the dirty bitmap (or every region if 'all' is set), then
+    // clears the bitmap.
+    fn take_dirty(&mut self, all: bool) -> Vec<usize> {
+        let n_regions = self.header.dirty_regions_w() * self.header.dirty_regions_h();
+        let dirty = &mut self.data[self.header.dirty_offset as usize..];
+        let regions = (0..n_regions).filter(|&i| all || dirty[i / 8] & (1 << (i % 8)) != 0).collect();
+        dirty[..(n_regions + 7) / 8].fill(0);
+        regions
     }
 }
 
+thread_local! {
+    static RNG: RefCell<StdRng> = RefCell::new(StdRng::from_entropy());
+}
+
+fn seed_rng(seed: u32) {
+    RNG.with(|rng| *rng.borrow_mut() = StdRng::seed_from_u64(seed as u64));
+}
+
 fn rand_range(a: i32, b: i32) -> i32 {
-    rand::thread_rng().gen_range(a..=b)
+    RNG.with(|rng| rng.borrow_mut().gen_range(a..=b))
 }
 
-// Wraps the (unowned) read-write buffer to provide access to the hunter and runner
-// data and to manage communication between the host and container processes.
+// Wraps the (unowned) read-write buffer to provide access to the hunter and runner data. With
+// snapshots, the actors are read from the front copy instead of the buffer itself.
 struct Actors<'a> {
-    // Layout: [sig, hx, hy, r0x, r0y, r0s, r1x, r1y, r1s, ...]
+    // AoS layout: [hx, hy, r0x, r0y, r0s, r1x, r1y, r1s, ...]
+    // SoA layout: [hx, hy, pad, pad, r0x, r1x, ..., r0y, r1y, ..., r0s, r1s, ...]
     data: &'a mut [i32],
-    hunter_signal: *mut u8,
-    runner_signal: *mut u8,
+    snapshots: [Vec<i32>; 2],
+    front: usize,
+    layout: u32,
+    stride: usize,
 }
 
 impl Actors<'_> {
-    fn new(shared_rw: cptr, len: i32) -> Self {
+    fn new(shared_rw: cptr, header: &GridHeader, snapshots: bool) -> Self {
+        let len = header.rw_buffer_size() / 4;
+        let snapshot_len = if snapshots { header.actors_size() / 4 } else { 0 };
         Self {
-            data: unsafe { slice::from_raw_parts_mut(shared_rw as *mut i32, len as usize) },
-            hunter_signal: unsafe { shared_rw.add(HUNTER_SIGNAL_INDEX) as *mut u8 },
-            runner_signal: unsafe { shared_rw.add(RUNNER_SIGNAL_INDEX) as *mut u8 },
+            data: unsafe { slice::from_raw_parts_mut(shared_rw as *mut i32, len) },
+            snapshots: [vec![0; snapshot_len], vec![0; snapshot_len]],
+            front: 0,
+            layout: header.layout,
+            stride: header.runner_stride(),
         }
     }
 
-    // IPC is handled with a simple polling loop. The host always moves from zero (Signal::Idle)
-    // to non-zero and the containers always move from non-zero to zero. Each container has a
-    // dedicated i32 value in the read-write buffer.
-    fn send_signal(&mut self, signal: Signal, wait_for_idle: bool) {
-        unsafe { *self.hunter_signal = signal as u8 };
-        unsafe { *self.runner_signal = signal as u8 };
-        if wait_for_idle {
-            let idle = Signal::Idle as u8;
-            for _ in 0..SIGNAL_REPS {
-                if unsafe { *self.hunter_signal == idle && *self.runner_signal == idle } {
-                    return;
-                }
-                thread::sleep(Duration::from_millis(SIGNAL_WAIT));
-            }
-            panic!("failed to receive idle for signal {}", signal as i32);
+    fn view(&self) -> &[i32] {
+        match self.snapshots[0].is_empty() {
+            true => self.data,
+            false => &self.snapshots[self.front],
         }
     }
 
+    fn copy_to_back(&mut self) {
+        let n = self.snapshots[0].len();
+        self.snapshots[1 - self.front].copy_from_slice(&self.data[..n]);
+    }
+
+    fn swap_snapshots(&mut self) {
+        self.front = 1 - self.front;
+    }
+
     fn hunter(&self) -> Position {
-        // Hunter co-ords are after the i32 signal value.
-        Position { x: self.data[1], y: self.data[2] }
+        let data = self.view();
+        Position { x: data[0], y: data[1] }
     }
 
     fn runner(&self, index: i32) -> (Position, State) {
-        // Runners start after i32 signal value + 2 * i32 hunter co-ords.
-        let i = 3 + 3 * index as usize;
-        (
-            Position { x: self.data[i], y: self.data[i + 1] },
-            State::from(self.data[i + 2]),
-        )
+        let index = index as usize;
+        let (x, y, state) = match self.layout {
+            ACTORS_SOA => {
+                let i = RUNNERS_OFFSET / 4 + index;
+                (i, i + self.stride, i + 2 * self.stride)
+            }
+            // Runners start after the 2 * i32 hunter co-ords.
+            _ => (2 + 3 * index, 3 + 3 * index, 4 + 3 * index),
+        };
+        let data = self.view();
+        (Position { x: data[x], y: data[y] }, State::from(data[state]))
     }
 }
 
@@ -241,15 +463,58 @@ struct Position {
     y: i32,
 }
 
+// Runs 'ticks' ticks back to back with no timer or drawing, then reports throughput, round trip
+// latency and how the time splits between ringing the doorbells and waiting for the acks. The
+// Rust containers don't record call stats, so the wait includes their wake-ups as well as tick().
+// In async mode the host also tries to snapshot the actors in every round trip while the
+// containers run.
+fn run_headless(ctx: &mut HostContext, ticks: u32, seed: u32) {
+    let mut latency = Vec::with_capacity(ticks as usize);
+    let (mut ring, mut wait, mut snapshot) = (Duration::ZERO, Duration::ZERO, Duration::ZERO);
+    let mut n_snapshots = 0;
+    let start = Instant::now();
+    for _ in 0..ticks {
+        let t = Instant::now();
+        ctx.containers.ring_all(Signal::Tick, 0);
+        let mut rung = Instant::now();
+        ring += rung - t;
+        if ctx.async_ticks {
+            n_snapshots += ctx.take_snapshot() as u32;
+            snapshot += rung.elapsed();
+            rung = Instant::now();
+        }
+        ctx.containers.wait_all(Signal::Tick);
+        let done = Instant::now();
+        wait += done - rung;
+        latency.push(done - t);
+    }
+    let elapsed = start.elapsed().as_secs_f64();
+    latency.sort();
+    let us = |p: usize| latency[(latency.len() - 1) * p / 100].as_secs_f64() * 1e6;
+    let share = |d: Duration| (d.as_secs_f64() * 1e3, 100.0 * d.as_secs_f64() / elapsed);
+    println!("Headless: {} ticks in {:.3} s, {:.1} ticks/sec (seed {})", ticks, elapsed, ticks as f64 / elapsed, seed);
+    println!("  round trip (1 ticks): p50 {:.1} us  p90 {:.1} us  p99 {:.1} us  max {:.1} us",
+             us(50), us(90), us(99), us(100));
+    println!("  ring doorbells  {:10.1} ms  {:5.1}%", share(ring).0, share(ring).1);
+    println!("  wait for acks   {:10.1} ms  {:5.1}%", share(wait).0, share(wait).1);
+    if ctx.async_ticks {
+        println!("  snapshots       {:10.1} ms  {} of {} whole", share(snapshot).0, n_snapshots, ticks);
+    }
+}
+
 fn on_open(ctx: Rc<RefCell<HostContext<'static>>>, app: &gtk::Application) {
     let window = gtk::ApplicationWindow::builder()
         .application(app)
         .title("WebAssembly shared buffers [Rust]")
         .build();
 
+    let (width, height) = {
+        let hc = ctx.borrow();
+        ((hc.grid.width() as f64 * hc.scale) as i32, (hc.grid.height() as f64 * hc.scale) as i32)
+    };
     let drawing_area = gtk::DrawingArea::builder()
-        .content_width(GRID_W * SCALE as i32)
-        .content_height(GRID_H * SCALE as i32)
+        .content_width(width)
+        .content_height(height)
         .build();
     {
         let ctx = ctx.clone();
@@ -269,7 +534,7 @@ fn on_open(ctx: Rc<RefCell<HostContext<'static>>>, app: &gtk::Application) {
         let ctx = ctx.clone();
         container_modify_btn.connect_clicked(move |_btn| {
             // Container will crash, which will cause host to panic when idle signal is not received.
-            ctx.borrow_mut().actors.send_signal(Signal::ModifyGrid, true);
+            ctx.borrow_mut().containers.send_signal(Signal::ModifyGrid, true);
         });
     }
 
@@ -277,7 +542,7 @@ fn on_open(ctx: Rc<RefCell<HostContext<'static>>>, app: &gtk::Application) {
     {
         let ctx = ctx.clone();
         large_alloc_btn.connect_clicked(move |_btn| {
-            ctx.borrow_mut().actors.send_signal(Signal::LargeAlloc, true)
+            ctx.borrow_mut().containers.send_signal(Signal::LargeAlloc, true)
         });
     }
 
@@ -301,47 +566,92 @@ fn on_open(ctx: Rc<RefCell<HostContext<'static>>>, app: &gtk::Application) {
     });
 }
 
+// The grid is drawn onto a cached image surface, all of it for the first frame and then only the
+// regions set in the dirty bitmap since. Blocks only change through Grid::set(); a container
+// writing to the grid faults on its read-only mapping.
+fn update_grid_layer(hc: &mut HostContext) {
+    let scale = hc.scale;
+    let (w, h) = (hc.grid.width(), hc.grid.height());
+    let all = hc.grid_layer.is_none();
+    if all {
+        let (lw, lh) = ((w as f64 * scale) as i32 + 1, (h as f64 * scale) as i32 + 1);
+        hc.grid_layer = Some(cairo::ImageSurface::create(cairo::Format::Rgb24, lw, lh).unwrap());
+    }
+    let cr = cairo::Context::new(hc.grid_layer.as_ref().unwrap()).unwrap();
+    let regions_w = hc.grid.header.dirty_regions_w();
+    let size = 1 << DIRTY_SHIFT;
+    for region in hc.grid.take_dirty(all) {
+        let x0 = (region % regions_w) as i32 * size;
+        let y0 = (region / regions_w) as i32 * size;
+        let (x1, y1) = ((x0 + size).min(w), (y0 + size).min(h));
+        cr.save().unwrap();
+        cr.rectangle(x0 as f64 * scale, y0 as f64 * scale, (x1 - x0) as f64 * scale, (y1 - y0) as f64 * scale);
+        cr.clip();
+        cr.set_source_rgb(1.0, 1.0, 0.95);
+        cr.paint().unwrap();
+        for y in y0..y1 {
+            for x in x0..x1 {
+                if hc.grid.get(x, y) {
+                    cr.rectangle(x as f64 * scale, y as f64 * scale, scale, scale);
+                }
+            }
+        }
+        cr.set_source_rgb(0.3, 0.3, 0.3);
+        cr.fill().unwrap();
+        cr.restore().unwrap();
+    }
+}
+
 fn on_draw(ctx: Rc<RefCell<HostContext>>, _da: &gtk::DrawingArea, cr: &cairo::Context, width: i32, height: i32) {
+    // GTK4 always redraws the whole widget, so the grid is copied from its cached layer and just
+    // the actors are drawn afresh. A batch of async ticks may have reached a newer whole state.
     cr.set_source_rgb(1.0, 1.0, 0.95);
     cr.rectangle(0.0, 0.0, width as f64, height as f64);
     cr.fill().unwrap();
 
-    let hc = ctx.borrow();
-    for y in 0..GRID_H {
-        for x in 0..GRID_W {
-            if hc.grid.get(x, y) == 1 {
-                cr.set_source_rgb(0.3, 0.3, 0.3);
-                cr.rectangle(x as f64 * SCALE, y as f64 * SCALE, SCALE, SCALE);
-                cr.fill().unwrap();
-            }
-        }
+    let mut hc = ctx.borrow_mut();
+    update_grid_layer(&mut hc);
+    cr.set_source_surface(hc.grid_layer.as_ref().unwrap(), 0.0, 0.0).unwrap();
+    cr.paint().unwrap();
+    if hc.async_ticks {
+        hc.take_snapshot();
     }
 
+    let scale = hc.scale;
+
     let hunter = hc.actors.hunter();
     cr.set_source_rgb(0.8, 0.5, 0.9);
-    cr.rectangle(hunter.x as f64 * SCALE, hunter.y as f64 * SCALE, SCALE, SCALE);
+    cr.rectangle(hunter.x as f64 * scale, hunter.y as f64 * scale, scale, scale);
     cr.fill().unwrap();
 
     const TWO_PI: f64 = 2.0 * std::f64::consts::PI;
-    const HSCALE: f64 = SCALE / 2.0;
-    for i in 0..N_RUNNERS {
+    let hscale = scale / 2.0;
+    for i in 0..hc.n_runners {
         let (pos, state) = hc.actors.runner(i);
         match state {
             State::Walking => cr.set_source_rgb(0.5, 0.8, 0.9),
             State::Running => cr.set_source_rgb(1.0, 0.8, 0.5),
             State::Dead => cr.set_source_rgb(1.0, 0.4, 0.4),
         }
-        cr.arc(pos.x as f64 * SCALE + HSCALE, pos.y as f64 * SCALE + HSCALE, HSCALE, 0.0, TWO_PI);
+        cr.arc(pos.x as f64 * scale + hscale, pos.y as f64 * scale + hscale, hscale, 0.0, TWO_PI);
         cr.fill().unwrap();
     }
 }
 
 fn on_tick(ctx: Rc<RefCell<HostContext>>, area: &gtk::DrawingArea) -> glib::Continue {
     let mut hc = ctx.borrow_mut();
+    // The containers are idle once the last tick is collected, so that snapshot is always whole.
+    if hc.async_ticks {
+        hc.containers.finish_ticks();
+        assert!(hc.take_snapshot(), "containers wrote while idle");
+    }
     if hc.enable_host_modify {
         hc.grid.modify();
     }
-    hc.actors.send_signal(Signal::Tick, true);
+    match hc.async_ticks {
+        true => hc.containers.start_ticks(TICKS_PER_FRAME, false),
+        false => hc.containers.send_ticks(TICKS_PER_FRAME, false),
+    }
     area.queue_draw();
     glib::Continue(true)
 }
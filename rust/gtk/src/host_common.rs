@@ -14,27 +14,41 @@
 // limitations under the License.
 //
 
-use super::shared::cptr;
+use super::shared::{cptr, GridHeader};
 use libc::{MAP_FIXED, MAP_SHARED, O_RDONLY, O_RDWR, PROT_READ, PROT_WRITE, S_IRUSR, S_IWUSR};
-use std::{ffi::CString, thread, time::Duration};
+use std::{ffi::CString, hint, ptr, sync::atomic::{fence, AtomicU32, Ordering}};
 
-// Shared buffer config.
+// Shared buffer config; the sizes follow from the GridHeader chosen by the host at startup.
 pub const PAGE_SIZE: i64 = 4096;
 pub const READ_ONLY_BUF_NAME: &str = "/shared_ro";
 pub const READ_WRITE_BUF_NAME: &str = "/shared_rw";
-pub const READ_ONLY_BUF_SIZE: i32 = GRID_W * GRID_H * 4;
-// 1 * i32 for signals, 2 * i32 for hunter, N * 3 * i32 for runners
-pub const READ_WRITE_BUF_SIZE: i32 = SIGNAL_BYTES + 8 + N_RUNNERS * 12;
-pub const WASM_ALLOC_SIZE: i32 = READ_ONLY_BUF_SIZE + READ_WRITE_BUF_SIZE + 3 * PAGE_SIZE as i32;
 
-// IPC config.
-pub const SIGNAL_BYTES: i32 = 4;
+pub fn read_only_buf_size(header: &GridHeader) -> i32 {
+    assert!(header.buffer_size() <= i32::MAX as usize, "grid too large");
+    header.buffer_size() as i32
+}
+
+pub fn read_write_buf_size(header: &GridHeader) -> i32 {
+    assert!(header.rw_buffer_size() <= i32::MAX as usize, "too many runners");
+    header.rw_buffer_size() as i32
+}
+
+pub fn wasm_alloc_size(ro_size: i32, rw_size: i32) -> i32 {
+    ro_size + rw_size + 3 * PAGE_SIZE as i32
+}
+
+// IPC config; the control page holds one doorbell slot per container.
+pub const CONTROL_BUF_NAME: &str = "/shared_ctl";
+pub const CONTROL_BUF_SIZE: i32 = 2 * DOORBELL_SLOT_SIZE as i32;
+pub const DOORBELL_SLOT_SIZE: usize = 64;
+pub const DOORBELL_SPINS: u32 = 2000;
+pub const DOORBELL_TIMEOUT_MS: i64 = 100;
+pub const DOORBELL_STEP_ABANDONED: u32 = 1 << 30;
+pub const TICK_N_LOCKSTEP: u32 = 1 << 31;
 pub const HUNTER_SIGNAL_INDEX: usize = 0;
 pub const RUNNER_SIGNAL_INDEX: usize = 1;
-pub const SIGNAL_REPS: i32 = 300;
-pub const SIGNAL_WAIT: u64 = 100;
 
-// Grid setup.
+// Default grid setup; N_BLOCKS is scaled with the grid area.
 pub const GRID_W: i32 = 50;
 pub const GRID_H: i32 = 30;
 pub const N_BLOCKS: i32 = 150;
@@ -43,9 +57,12 @@ pub const N_RUNNERS: i32 = 15;
 // GUI settings.
 pub const SCALE: f64 = 20.0;
 pub const TICK_MS: u64 = 150;
+pub const TICKS_PER_FRAME: u32 = 1;
 
 // -- Definitions for both host and containers --
 
+// TickN carries the number of ticks in the doorbell argument, optionally ORed with
+// TICK_N_LOCKSTEP to keep all containers in step with each other after every tick.
 #[derive(Copy, Clone, PartialEq)]
 pub enum Signal {
     Idle,
@@ -54,48 +71,314 @@ pub enum Signal {
     LargeAlloc,
     ModifyGrid,
     Exit,
+    TickN,
 }
 
 impl Signal {
     pub fn from(value: u8) -> Self {
-        assert!((0..6).contains(&value));
-        [Self::Idle, Self::Init, Self::Tick, Self::LargeAlloc, Self::ModifyGrid, Self::Exit][value as usize]
+        assert!((0..7).contains(&value));
+        [
+            Self::Idle, Self::Init, Self::Tick, Self::LargeAlloc, Self::ModifyGrid, Self::Exit, Self::TickN
+        ][value as usize]
+    }
+}
+
+// Matches the DoorbellSlot layout in c/doorbell.c. The host only writes the cmd fields and the
+// container only writes the ack fields, step, state_seq and pid (set before its ready signal);
+// the plain values are published by the release store on the associated sequence word, which
+// is also the futex word the other side sleeps on. 'peers' is the number of slots (from 0)
+// taking part in step barriers, state_seq is odd while the container is writing the read-write
+// buffer, and 'waiters' counts the processes in futex_wait on any of the slot's words, so posts
+// can skip the wake syscall.
+#[repr(C, align(64))]
+pub struct DoorbellSlot {
+    cmd_seq: AtomicU32,
+    cmd: AtomicU32,
+    arg: AtomicU32,
+    peers: AtomicU32,
+    ack_seq: AtomicU32,
+    ack: AtomicU32,
+    step: AtomicU32,
+    state_seq: AtomicU32,
+    waiters: AtomicU32,
+    pid: AtomicU32,
+}
+
+// Handle to one slot in the mapped control page. The first sequence number on every doorbell
+// is the container's ready signal, sent when its buffers have been mapped.
+pub struct Doorbell {
+    slots: *const DoorbellSlot,
+    index: usize,
+    pub seq: u32,
+    steps: u32,
+    // Container side: the host's pid, recorded up front since getppid() changes once we are
+    // reparented after it dies.
+    parent_pid: i32,
+}
+
+impl Doorbell {
+    pub fn new(control: cptr, index: usize) -> Self {
+        assert!((index + 1) * DOORBELL_SLOT_SIZE <= CONTROL_BUF_SIZE as usize);
+        let parent_pid = unsafe { libc::getppid() };
+        Self { slots: control as *const DoorbellSlot, index, seq: 1, steps: 0, parent_pid }
+    }
+
+    // Container side: our parent is the host, so if it dies we are reparented.
+    fn host_alive(&self) -> bool {
+        unsafe { libc::getppid() == self.parent_pid }
+    }
+
+    fn slot(&self) -> &DoorbellSlot {
+        self.peer(self.index)
+    }
+
+    fn peer(&self, index: usize) -> &DoorbellSlot {
+        unsafe { &*self.slots.add(index) }
+    }
+
+    // Host side: publishes the next command and wakes the container.
+    pub fn ring(&mut self, signal: Signal, arg: u32, peers: usize) {
+        self.seq += 1;
+        self.slot().arg.store(arg, Ordering::Relaxed);
+        self.slot().peers.store(peers as u32, Ordering::Relaxed);
+        post(self.slot(), &self.slot().cmd_seq, &self.slot().cmd, signal as u32, self.seq);
+    }
+
+    // Host side: waits for the container to ack the current command. Returns false if the
+    // container process has exited.
+    pub fn wait_ack(&self, pid: i32) -> bool {
+        wait(self.slot(), &self.slot().ack_seq, self.seq, || container_alive(pid))
+    }
+
+    // Container side: waits for the next command from the host.
+    pub fn wait_cmd(&mut self) -> Option<Signal> {
+        self.seq += 1;
+        match wait(self.slot(), &self.slot().cmd_seq, self.seq, || self.host_alive()) {
+            true => Some(Signal::from(self.slot().cmd.load(Ordering::Relaxed) as u8)),
+            false => None,
+        }
+    }
+
+    // Container side: acks the current command.
+    pub fn answer(&self, signal: Signal) {
+        post(self.slot(), &self.slot().ack_seq, &self.slot().ack, signal as u32, self.seq);
+    }
+
+    // Container side: records our pid in the slot, so peers waiting on us at a step barrier can
+    // tell if we die.
+    pub fn register(&self) {
+        self.slot().pid.store(std::process::id(), Ordering::Relaxed);
+    }
+
+    // Container side: the argument of the current command.
+    pub fn arg(&self) -> u32 {
+        self.slot().arg.load(Ordering::Relaxed)
+    }
+
+    // Container side: records that a tick has completed. In lockstep mode this wakes any peers
+    // waiting on our step count then waits for all of them to reach the same step. A peer that
+    // dies part way through can't publish its abandonment, so its pid is checked while waiting;
+    // if the barrier fails, we abandon the batch ourselves to release anyone waiting on us.
+    pub fn step(&mut self, lockstep: bool) -> bool {
+        self.steps += 1;
+        self.publish_step(self.steps, lockstep);
+        if !lockstep {
+            return true;
+        }
+        let peers = self.slot().peers.load(Ordering::Relaxed) as usize;
+        let ok = (0..peers).all(|i| {
+            let pid = self.peer(i).pid.load(Ordering::Relaxed);
+            wait(self.peer(i), &self.peer(i).step, self.steps, || process_running(pid) && self.host_alive())
+        });
+        if !ok {
+            self.abandon_steps();
+        }
+        ok
+    }
+
+    // Container side: releases peers from the current lockstep batch after a failed tick.
+    pub fn abandon_steps(&self) {
+        self.publish_step(self.steps.wrapping_add(DOORBELL_STEP_ABANDONED), true);
+    }
+
+    // Container side: brackets a write to the read-write buffer (each tick, and init) as a
+    // seqlock, so the host can tell whether a copy it made meanwhile is whole.
+    pub fn write_begin(&self) {
+        let seq = self.slot().state_seq.load(Ordering::Relaxed);
+        self.slot().state_seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+        fence(Ordering::Release);
+    }
+
+    pub fn write_end(&self) {
+        let seq = self.slot().state_seq.load(Ordering::Relaxed);
+        self.slot().state_seq.store(seq.wrapping_add(1), Ordering::Release);
+    }
+
+    // Host side: the seqlock word before copying the shared state, or None if the container is
+    // part way through a write.
+    pub fn read_begin(&self) -> Option<u32> {
+        let seq = self.slot().state_seq.load(Ordering::Acquire);
+        if seq & 1 == 0 { Some(seq) } else { None }
+    }
+
+    // Host side: whether a copy started at 'seq' was made without the container writing.
+    pub fn read_valid(&self, seq: u32) -> bool {
+        fence(Ordering::Acquire);
+        self.slot().state_seq.load(Ordering::Relaxed) == seq
+    }
+
+    fn publish_step(&self, step: u32, wake: bool) {
+        self.slot().step.store(step, Ordering::SeqCst);
+        if wake {
+            wake_waiters(self.slot(), &self.slot().step);
+        }
+    }
+}
+
+fn futex(word: &AtomicU32, op: i32, val: u32, timeout: *const libc::timespec) -> i64 {
+    // The control page is shared between processes, so the non-private futex ops are required.
+    unsafe { libc::syscall(libc::SYS_futex, word.as_ptr(), op, val, timeout, ptr::null::<u32>(), 0) }
+}
+
+// Wakes any sleepers on 'word', one of the sequence words in 'slot', after it has been updated.
+// The store to 'word' and the load of 'waiters' are both SeqCst, as are the waiter's increment
+// and re-check in wait(), so either the waiter sees the new value or we see the waiter.
+fn wake_waiters(slot: &DoorbellSlot, word: &AtomicU32) {
+    if slot.waiters.load(Ordering::SeqCst) != 0 {
+        futex(word, libc::FUTEX_WAKE, i32::MAX as u32, ptr::null());
+    }
+}
+
+fn post(slot: &DoorbellSlot, seq_word: &AtomicU32, val_word: &AtomicU32, val: u32, seq: u32) {
+    val_word.store(val, Ordering::Relaxed);
+    seq_word.store(seq, Ordering::SeqCst);
+    wake_waiters(slot, seq_word);
+}
+
+// Sequence numbers wrap, so compare them by signed distance.
+fn seq_reached(current: u32, seq: u32) -> bool {
+    current.wrapping_sub(seq) as i32 >= 0
+}
+
+// Spins briefly then sleeps on the futex until 'seq_word', one of the sequence words in 'slot',
+// reaches 'seq'. The futex wait is bounded so a dead peer is noticed; returns false if 'alive'
+// reports that it has gone away.
+fn wait(slot: &DoorbellSlot, seq_word: &AtomicU32, seq: u32, alive: impl Fn() -> bool) -> bool {
+    for _ in 0..DOORBELL_SPINS {
+        if seq_reached(seq_word.load(Ordering::Acquire), seq) {
+            return true;
+        }
+        hint::spin_loop();
+    }
+    let timeout = libc::timespec { tv_sec: 0, tv_nsec: DOORBELL_TIMEOUT_MS * 1_000_000 };
+    slot.waiters.fetch_add(1, Ordering::SeqCst);
+    let ok = loop {
+        let current = seq_word.load(Ordering::SeqCst);
+        if seq_reached(current, seq) {
+            break true;
+        }
+        if futex(seq_word, libc::FUTEX_WAIT, current, &timeout) == -1
+            && std::io::Error::last_os_error().raw_os_error() == Some(libc::ETIMEDOUT)
+            && !alive() {
+            break false;
+        }
+    };
+    slot.waiters.fetch_sub(1, Ordering::SeqCst);
+    ok
+}
+
+// Whether the process 'pid' is still running. One that was killed stays a zombie until its
+// parent reaps it, which kill(pid, 0) doesn't tell apart, so this checks its state in /proc.
+fn process_running(pid: u32) -> bool {
+    match std::fs::read_to_string(format!("/proc/{}/stat", pid)) {
+        // The state follows the parenthesised command name, which may itself contain parentheses.
+        Ok(stat) => match stat.rfind(')').and_then(|end| stat[end + 1..].chars().nth(1)) {
+            Some(state) => state != 'Z' && state != 'X',
+            None => false,
+        },
+        Err(_) => false,
+    }
+}
+
+fn container_alive(pid: i32) -> bool {
+    // WNOWAIT leaves an exited container as a zombie so it can still be reaped normally.
+    unsafe {
+        let mut info: libc::siginfo_t = std::mem::zeroed();
+        let flags = libc::WEXITED | libc::WNOHANG | libc::WNOWAIT;
+        libc::waitid(libc::P_PID, pid as libc::id_t, &mut info, flags) == 0 && info.si_pid() == 0
     }
 }
 
 // -- Definitions for containers only --
 
+// The buffer sizes can be found with buffer_size() before mapping.
 pub struct Buffers {
     pub shared_ro: cptr,
     pub shared_rw: cptr,
+    ro_size: i32,
+    rw_size: i32,
+    control: cptr,
     index: usize,
-    signal: *mut u8,
+    doorbell: Doorbell,
 }
 
 impl Buffers {
-    pub fn new(shared_ro: cptr, shared_rw: cptr, index: usize) -> Self {
+    pub fn new(shared_ro: cptr, ro_size: i32, shared_rw: cptr, rw_size: i32, index: usize) -> Self {
         assert!(index == HUNTER_SIGNAL_INDEX || index == RUNNER_SIGNAL_INDEX);
-        Self {
-            shared_ro,
-            shared_rw,
-            index,
-            signal: unsafe { shared_rw.add(index) as *mut u8 },
-        }
+        let control = map_buffer(0, CONTROL_BUF_NAME, CONTROL_BUF_SIZE, false);
+        let doorbell = Doorbell::new(control, index);
+        doorbell.register();
+        doorbell.answer(Signal::Idle);
+        Self { shared_ro, shared_rw, ro_size, rw_size, control, index, doorbell }
     }
 
-    pub fn wait_for_signal(&self) -> Signal {
-        for _ in 0..SIGNAL_REPS {
-            let signal = Signal::from(unsafe { *self.signal });
-            if signal != Signal::Idle {
-                return signal;
+    // For use when memory.grow has moved linear memory: overlays the buffers again at their
+    // new aligned locations. If the old memory was returned to the heap rather than unmapped,
+    // the stale overlay is still there, so it is replaced with private pages; if it was
+    // unmapped, the range may already have been reused and is left alone. The caller must then
+    // pass the new offsets to the module's update_context.
+    pub fn remap(&mut self, aligned_ro_ptr: i64, aligned_rw_ptr: i64) {
+        let (old_ro, old_rw) = (self.shared_ro, self.shared_rw);
+        self.shared_ro = map_buffer(aligned_ro_ptr, READ_ONLY_BUF_NAME, self.ro_size, true);
+        self.shared_rw = map_buffer(aligned_rw_ptr, READ_WRITE_BUF_NAME, self.rw_size, false);
+        let old = [(old_ro, READ_ONLY_BUF_NAME, self.ro_size), (old_rw, READ_WRITE_BUF_NAME, self.rw_size)];
+        for (ptr, name, size) in old {
+            if !mapped_from(ptr as usize, size as usize, name) {
+                continue;
+            }
+            unsafe {
+                let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | MAP_FIXED;
+                let buf = libc::mmap(ptr, size as usize, PROT_READ | PROT_WRITE, flags, -1, 0);
+                assert!(buf == ptr);
             }
-            thread::sleep(Duration::from_millis(SIGNAL_WAIT));
         }
-        panic!("container {} failed to received signal", self.index);
+    }
+
+    pub fn wait_for_signal(&mut self) -> Signal {
+        match self.doorbell.wait_cmd() {
+            Some(signal) => signal,
+            None => panic!("container {} lost contact with the host", self.index),
+        }
     }
 
     pub fn send_idle(&self) {
-        unsafe { *self.signal = Signal::Idle as u8 };
+        self.doorbell.answer(Signal::Idle);
+    }
+
+    // For Signal::TickN: the requested tick count and whether to run them in lockstep.
+    pub fn tick_count(&self) -> (u32, bool) {
+        let arg = self.doorbell.arg();
+        (arg & !TICK_N_LOCKSTEP, arg & TICK_N_LOCKSTEP != 0)
+    }
+
+    // Must be called after every tick, including single Signal::Tick ones, so that all
+    // containers' step counts stay aligned for lockstep batches.
+    pub fn tick_done(&mut self, ok: bool, lockstep: bool) -> bool {
+        if !ok {
+            self.doorbell.abandon_steps();
+            return false;
+        }
+        self.doorbell.step(lockstep)
     }
 }
 
@@ -103,18 +386,22 @@ impl Drop for Buffers {
     fn drop(&mut self) {
         unsafe {
             if !self.shared_ro.is_null()
-                && libc::munmap(self.shared_ro, READ_ONLY_BUF_SIZE as usize) == -1 {
+                && libc::munmap(self.shared_ro, self.ro_size as usize) == -1 {
                 println!("munmap failed for shared_ro");
             }
             if !self.shared_rw.is_null()
-                && libc::munmap(self.shared_rw, READ_WRITE_BUF_SIZE as usize) == -1 {
+                && libc::munmap(self.shared_rw, self.rw_size as usize) == -1 {
                 println!("munmap failed for shared_rw");
             }
+            if libc::munmap(self.control, CONTROL_BUF_SIZE as usize) == -1 {
+                println!("munmap failed for control");
+            }
         }
     }
 }
 
-// Uses the libc POSIX API to map in a shared memory buffer.
+// Uses the libc POSIX API to map in a shared memory buffer. An 'aligned_ptr' of 0 lets the
+// kernel choose the address rather than overlaying wasm linear memory.
 pub fn map_buffer(aligned_ptr: i64, name: &str, size: i32, read_only: bool) -> cptr {
     let cname = CString::new(name).unwrap();
     let (open_flags, map_flags) = match read_only {
@@ -126,8 +413,9 @@ pub fn map_buffer(aligned_ptr: i64, name: &str, size: i32, read_only: bool) -> c
         if fd == -1 {
             panic!("shm_open failed for {}", name);
         }
-        let buf = libc::mmap(aligned_ptr as cptr, size as usize, map_flags, MAP_FIXED | MAP_SHARED, fd, 0);
-        assert!(buf == aligned_ptr as cptr);
+        let fixed = if aligned_ptr != 0 { MAP_FIXED } else { 0 };
+        let buf = libc::mmap(aligned_ptr as cptr, size as usize, map_flags, fixed | MAP_SHARED, fd, 0);
+        assert!(buf != libc::MAP_FAILED && (aligned_ptr == 0 || buf == aligned_ptr as cptr));
         if libc::close(fd) == -1 {
             panic!("close failed for {}", name);
         }
@@ -135,6 +423,58 @@ pub fn map_buffer(aligned_ptr: i64, name: &str, size: i32, read_only: bool) -> c
     }
 }
 
+// Whether [ptr, ptr + size) is still mapped from the start of the named shared memory buffer,
+// going by /proc/self/maps.
+fn mapped_from(ptr: usize, size: usize, name: &str) -> bool {
+    let cname = CString::new(name).unwrap();
+    let mut stat: libc::stat = unsafe { std::mem::zeroed() };
+    unsafe {
+        let fd = libc::shm_open(cname.as_ptr(), O_RDONLY, 0);
+        assert!(fd != -1 && libc::fstat(fd, &mut stat) == 0 && libc::close(fd) == 0);
+    }
+    let maps = std::fs::read_to_string("/proc/self/maps").expect("failed to read /proc/self/maps");
+    let mut cur = ptr;
+    for (start, end, offset, dev, inode) in maps.lines().filter_map(parse_maps_line) {
+        if end <= cur {
+            continue;
+        }
+        // The entries are sorted, so this is either the one holding 'cur' or there is a gap.
+        if start > cur || dev != stat.st_dev || inode != stat.st_ino || offset + (cur - start) != cur - ptr {
+            return false;
+        }
+        cur = end;
+        if cur >= ptr + size {
+            return true;
+        }
+    }
+    false
+}
+
+// Splits a /proc/self/maps line into (start, end, file offset, device, inode).
+fn parse_maps_line(line: &str) -> Option<(usize, usize, usize, libc::dev_t, libc::ino_t)> {
+    let mut fields = line.split_whitespace();
+    let (start, end) = fields.next()?.split_once('-')?;
+    let offset = fields.nth(1)?;
+    let (major, minor) = fields.next()?.split_once(':')?;
+    let hex = |s| usize::from_str_radix(s, 16).ok();
+    let dev = libc::makedev(u32::from_str_radix(major, 16).ok()?, u32::from_str_radix(minor, 16).ok()?);
+    Some((hex(start)?, hex(end)?, hex(offset)?, dev, fields.next()?.parse().ok()?))
+}
+
+// Returns the size of the named shared memory buffer, as set by the host.
+pub fn buffer_size(name: &str) -> i32 {
+    let cname = CString::new(name).unwrap();
+    unsafe {
+        let fd = libc::shm_open(cname.as_ptr(), O_RDONLY, 0);
+        if fd == -1 {
+            panic!("shm_open failed for {}", name);
+        }
+        let mut stat: libc::stat = std::mem::zeroed();
+        assert!(libc::fstat(fd, &mut stat) == 0 && libc::close(fd) == 0);
+        stat.st_size as i32
+    }
+}
+
 // Aligns to next largest page boundary, unless ptr is already aligned.
 pub fn page_align(ptr: i64) -> i64 {
     ((ptr - 1) & !(PAGE_SIZE - 1)) + PAGE_SIZE
@@ -16,12 +16,10 @@
 
 // Imported via `use` in hunter.rs and runner.rs
 
-use super::shared::{cptr, State};
-
-// Grid setup.
-pub const GRID_W: usize = 50;
-pub const GRID_H: usize = 30;
-pub const N_RUNNERS: usize = 15;
+use super::shared::{
+    cptr, GridHeader, State, TileHeader, ACTORS_SOA, ACTOR_LANES, INDEX_NONE, RUNNERS_OFFSET, TILE_ARRAYS_OFFSET,
+};
+use std::slice;
 
 extern "C" {
     pub fn print_callback(len: usize, msg: *const u8);
@@ -70,6 +68,31 @@ pub fn rand_usize() -> usize {
     }
 }
 
+// Reserves linear memory for the container to map the shared buffers onto; see malloc_() in
+// module-common.c. With the shared-pages feature the reservation is whole wasm pages from
+// memory.grow, which the allocator never owns as it only ever grows memory itself.
+pub fn reserve_shared(size: usize) -> cptr {
+    #[cfg(feature = "shared-pages")]
+    {
+        const WASM_PAGE_SIZE: usize = 65536;
+        let pages = match size.checked_add(WASM_PAGE_SIZE - 1) {
+            Some(n) => n / WASM_PAGE_SIZE,
+            None => return std::ptr::null_mut(),
+        };
+        match core::arch::wasm32::memory_grow::<0>(pages) {
+            usize::MAX => std::ptr::null_mut(),
+            old => (old * WASM_PAGE_SIZE) as cptr,
+        }
+    }
+    #[cfg(not(feature = "shared-pages"))]
+    {
+        let vec: Vec<u8> = Vec::with_capacity(size);
+        let ptr = vec.as_ptr();
+        std::mem::forget(vec); // Leak the vector
+        ptr as cptr
+    }
+}
+
 pub struct Runner {
     pub x: usize,
     pub y: usize,
@@ -81,35 +104,222 @@ pub struct Hunter {
     pub y: usize,
 }
 
-pub type GridType = [[i32; GRID_W]; GRID_H];
-pub type RunnersType = [Runner; N_RUNNERS];
+// The (unowned) read-only buffer. The host never changes the header once containers have
+// started, so a copy is kept alongside the whole buffer.
+pub struct Grid {
+    pub header: GridHeader,
+    data: &'static [u8],
+}
+
+impl Grid {
+    unsafe fn new(header: GridHeader, ro_ptr: cptr) -> Self {
+        Self { header, data: slice::from_raw_parts(ro_ptr as *const u8, header.buffer_size()) }
+    }
+
+    pub fn width(&self) -> usize {
+        self.header.grid_w as usize
+    }
+
+    pub fn height(&self) -> usize {
+        self.header.grid_h as usize
+    }
+
+    pub fn blocked(&self, x: usize, y: usize) -> bool {
+        let (index, bits) = self.header.cell(x, y);
+        self.data[index] & bits != 0
+    }
+
+    pub fn cell_ptr(&self, x: usize, y: usize) -> *const u8 {
+        &self.data[self.header.cell(x, y).0]
+    }
+}
+
+// The runners in the SoA layout; each array is GridHeader::runner_stride() long.
+pub struct RunnerArrays {
+    pub x: &'static mut [i32],
+    pub y: &'static mut [i32],
+    pub state: &'static mut [i32],
+}
+
+// Uniform-grid index over the runners, written only by the runner container as its runners
+// move. head[b] is the first runner in bucket b and next[i] the one after runner i; lists end
+// in -1. Dead runners are removed, and have a next of INDEX_NONE. Both slices are empty when
+// the GridHeader's index_shift is 0.
+//
+// The hunter walks the lists while runners are being relinked, so it bounds its walk and reads
+// the runners' actual positions; like the positions themselves, a runner that moves mid-walk
+// may be seen in either bucket or neither.
+pub struct SpatialIndex {
+    pub head: &'static mut [i32],
+    pub next: &'static mut [i32], // runner_stride() entries, so the SoA padding runners have one too
+}
 
+impl SpatialIndex {
+    pub fn bucket(header: &GridHeader, x: usize, y: usize) -> usize {
+        (y >> header.index_shift) * header.index_buckets_w() + (x >> header.index_shift)
+    }
+
+    fn insert(&mut self, header: &GridHeader, i: usize, x: usize, y: usize) {
+        let b = Self::bucket(header, x, y);
+        self.next[i] = self.head[b];
+        self.head[b] = i as i32;
+    }
+
+    fn remove(&mut self, header: &GridHeader, i: usize, x: usize, y: usize) {
+        let b = Self::bucket(header, x, y);
+        if self.head[b] == i as i32 {
+            self.head[b] = self.next[i];
+        } else {
+            let mut j = self.head[b];
+            while j >= 0 && self.next[j as usize] != i as i32 {
+                j = self.next[j as usize];
+            }
+            if j >= 0 {
+                self.next[j as usize] = self.next[i];
+            }
+        }
+        self.next[i] = INDEX_NONE;
+    }
+
+    // Relinks runner 'i' after it has moved from 'old' to 'new'.
+    pub fn moved(&mut self, header: &GridHeader, i: usize, old: (usize, usize), new: (usize, usize)) {
+        if !self.head.is_empty() && Self::bucket(header, old.0, old.1) != Self::bucket(header, new.0, new.1) {
+            self.remove(header, i, old.0, old.1);
+            self.insert(header, i, new.0, new.1);
+        }
+    }
+
+    // Removes a dead runner from the index; a no-op once it has been removed.
+    pub fn died(&mut self, header: &GridHeader, i: usize, x: usize, y: usize) {
+        if !self.head.is_empty() && self.next[i] != INDEX_NONE {
+            self.remove(header, i, x, y);
+        }
+    }
+}
+
+// One tile's region of the read-write buffer; its arrays are GridHeader::tile_capacity() long.
+pub struct Tile {
+    pub header: &'static mut TileHeader,
+    pub soa: RunnerArrays,
+}
+
+// Only one of 'runners', 'soa' and 'tiles' is non-empty, as given by the GridHeader's layout and
+// tile count. 'tile' is the one this container owns, set by init().
 pub struct Context {
-    pub grid: &'static mut GridType,
+    pub grid: Grid,
     pub hunter: &'static mut Hunter,
-    pub runners: &'static mut RunnersType,
+    pub runners: &'static mut [Runner],
+    pub soa: RunnerArrays,
+    pub index: SpatialIndex,
+    pub tiles: Vec<Tile>,
+    pub tile: Option<usize>,
 }
 
 impl Context {
+    // Returns null if the host's GridHeader is not one this module understands.
     pub fn new_unowned(ro_ptr: cptr, rw_ptr: cptr) -> *mut Self {
+        let header = unsafe { *(ro_ptr as *const GridHeader) };
+        if !header.valid() {
+            print_str(&format!("Unsupported grid header (version {})\n", header.version));
+            return std::ptr::null_mut();
+        }
         Box::into_raw(Box::new(unsafe {
             Context {
-                grid: &mut *(ro_ptr as *mut GridType),
+                grid: Grid::new(header, ro_ptr),
                 hunter: &mut *(rw_ptr as *mut Hunter),
-                runners: &mut *(skip_hunter(rw_ptr) as *mut RunnersType),
+                runners: runners(rw_ptr, &header),
+                soa: runner_arrays(rw_ptr, &header),
+                index: spatial_index(rw_ptr, &header),
+                tiles: tiles(rw_ptr, &header),
+                tile: None,
             }
         }))
     }
 
     pub fn update(&mut self, ro_ptr: cptr, rw_ptr: cptr) {
+        let header = self.grid.header;
         unsafe {
-            self.grid = &mut *(ro_ptr as *mut GridType);
+            self.grid = Grid::new(header, ro_ptr);
             self.hunter = &mut *(rw_ptr as *mut Hunter);
-            self.runners = &mut *(skip_hunter(rw_ptr) as *mut RunnersType);
+            self.runners = runners(rw_ptr, &header);
+            self.soa = runner_arrays(rw_ptr, &header);
+            self.index = spatial_index(rw_ptr, &header);
+            self.tiles = tiles(rw_ptr, &header);
+        }
+    }
+
+    // Puts every live runner in the spatial index; called once the runners have been placed.
+    pub fn build_index(&mut self) {
+        if self.index.head.is_empty() {
+            return;
+        }
+        self.index.head.iter_mut().for_each(|b| *b = -1);
+        self.index.next.iter_mut().for_each(|n| *n = INDEX_NONE);
+        for i in (0..self.grid.header.n_runners as usize).rev() {
+            let (x, y, dead) = self.runner(i);
+            if !dead {
+                self.index.insert(&self.grid.header, i, x, y);
+            }
+        }
+    }
+
+    // Returns runner i's position, and whether it is dead, in either layout.
+    pub fn runner(&self, i: usize) -> (usize, usize, bool) {
+        if self.grid.header.layout == ACTORS_SOA {
+            let dead = self.soa.state[i] == State::Dead as i32;
+            (self.soa.x[i] as usize, self.soa.y[i] as usize, dead)
+        } else {
+            let r = &self.runners[i];
+            (r.x, r.y, r.state == State::Dead)
         }
     }
 }
 
+unsafe fn runners(rw_ptr: cptr, header: &GridHeader) -> &'static mut [Runner] {
+    let n = if header.layout == ACTORS_SOA { 0 } else { header.n_runners as usize };
+    slice::from_raw_parts_mut(skip_hunter(rw_ptr) as *mut Runner, n)
+}
+
+unsafe fn runner_arrays(rw_ptr: cptr, header: &GridHeader) -> RunnerArrays {
+    let n = if header.layout == ACTORS_SOA { header.runner_stride() } else { 0 };
+    let base = (rw_ptr as *mut u8).add(RUNNERS_OFFSET) as *mut i32;
+    RunnerArrays {
+        x: slice::from_raw_parts_mut(base, n),
+        y: slice::from_raw_parts_mut(base.add(n), n),
+        state: slice::from_raw_parts_mut(base.add(2 * n), n),
+    }
+}
+
+unsafe fn spatial_index(rw_ptr: cptr, header: &GridHeader) -> SpatialIndex {
+    let (n_buckets, n) = match header.index_shift {
+        0 => (0, 0),
+        _ => (header.index_buckets_w() * header.index_buckets_h(), header.runner_stride()),
+    };
+    let head = (rw_ptr as *mut u8).add(header.index_offset()) as *mut i32;
+    SpatialIndex {
+        head: slice::from_raw_parts_mut(head, n_buckets),
+        next: slice::from_raw_parts_mut(head.add(n_buckets), n),
+    }
+}
+
+unsafe fn tiles(rw_ptr: cptr, header: &GridHeader) -> Vec<Tile> {
+    let n = if header.n_tiles == 0 { 0 } else { header.tile_capacity() };
+    (0..header.n_tiles as usize)
+        .map(|t| {
+            let region = (rw_ptr as *mut u8).add(header.tile_region_offset(t));
+            let base = region.add(TILE_ARRAYS_OFFSET) as *mut i32;
+            Tile {
+                header: &mut *(region as *mut TileHeader),
+                soa: RunnerArrays {
+                    x: slice::from_raw_parts_mut(base, n),
+                    y: slice::from_raw_parts_mut(base.add(n), n),
+                    state: slice::from_raw_parts_mut(base.add(2 * n), n),
+                },
+            }
+        })
+        .collect()
+}
+
 fn skip_hunter(ptr: cptr) -> cptr {
     unsafe { ptr.add(std::mem::size_of::<Hunter>()) }
 }
@@ -118,19 +328,19 @@ pub fn rand_step() -> i32 {
     (rand().abs() % 3) - 1
 }
 
-pub fn move_by(grid: &GridType, x: &mut usize, y: &mut usize, mx: i32, my: i32) {
+pub fn move_by(grid: &Grid, x: &mut usize, y: &mut usize, mx: i32, my: i32) {
     // If the dest cell is blocked, try a random move;
     // if that's also blocked just stay still.
     let (mx, my) = (step(mx), step(my));
     let mut tx: usize = (*x as i32).saturating_add(mx) as usize;
     let mut ty: usize = (*y as i32).saturating_add(my) as usize;
-    if ty >= grid.len() || tx >= grid[ty].len() {
+    if ty >= grid.height() || tx >= grid.width() {
         return;
     }
-    if grid[ty][tx] == 1 {
+    if grid.blocked(tx, ty) {
         tx = (*x as i32).saturating_add(rand_step()) as usize;
         ty = (*y as i32).saturating_add(rand_step()) as usize;
-        if ty >= grid.len() || tx >= grid[ty].len() || grid[ty][tx] == 1 {
+        if ty >= grid.height() || tx >= grid.width() || grid.blocked(tx, ty) {
             return;
         }
     }
@@ -138,6 +348,18 @@ pub fn move_by(grid: &GridType, x: &mut usize, y: &mut usize, mx: i32, my: i32)
     *y = ty;
 }
 
+// Moves (x, y) by the given step if the destination is on the grid and clear.
+pub fn try_move(grid: &Grid, x: &mut i32, y: &mut i32, mx: i32, my: i32) -> bool {
+    let (tx, ty) = (*x + mx, *y + my);
+    if tx < 0 || ty < 0 || tx as usize >= grid.width() || ty as usize >= grid.height()
+        || grid.blocked(tx as usize, ty as usize) {
+        return false;
+    }
+    *x = tx;
+    *y = ty;
+    true
+}
+
 // Converts an arbitrary delta into a unit step.
 pub fn step(delta: i32) -> i32 {
     use std::cmp::Ordering::*;
@@ -147,3 +369,70 @@ pub fn step(delta: i32) -> i32 {
         Less => -1,
     }
 }
+
+// The SoA kernels draw their random numbers from one xorshift32 generator per vector lane, so
+// the SIMD and scalar builds make exactly the same moves for a given seed.
+static mut XS_STATE: [u32; ACTOR_LANES] = [0; ACTOR_LANES];
+
+pub fn xs_seed(mut seed: u32) {
+    for lane in 0..ACTOR_LANES {
+        seed = seed.wrapping_mul(0x9e37_79b1).wrapping_add(0x7f4a_7c15);
+        unsafe {
+            XS_STATE[lane] = seed | 1; // xorshift never leaves zero
+        }
+    }
+}
+
+pub fn xs_next_lane(lane: usize) -> u32 {
+    unsafe {
+        let mut x = XS_STATE[lane];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        XS_STATE[lane] = x;
+        x
+    }
+}
+
+// Maps the 10 bits of 'r' at 'shift' to 0, 1 or 2 with a multiply rather than a divide.
+pub fn rand3(r: u32, shift: u32) -> i32 {
+    ((((r >> shift) & 0x3ff) * 3) >> 10) as i32
+}
+
+#[cfg(target_feature = "simd128")]
+pub mod simd {
+    use super::XS_STATE;
+    pub use core::arch::wasm32::*;
+    use std::ptr;
+
+    pub fn xs_next() -> v128 {
+        unsafe {
+            let state = ptr::addr_of_mut!(XS_STATE) as *mut v128;
+            let mut x = v128_load(state);
+            x = v128_xor(x, i32x4_shl(x, 13));
+            x = v128_xor(x, u32x4_shr(x, 17));
+            x = v128_xor(x, i32x4_shl(x, 5));
+            v128_store(state, x);
+            x
+        }
+    }
+
+    pub fn rand3_x4(r: v128, shift: u32) -> v128 {
+        let bits = v128_and(u32x4_shr(r, shift), i32x4_splat(0x3ff));
+        u32x4_shr(i32x4_mul(bits, i32x4_splat(3)), 10)
+    }
+
+    // Vector step(): the comparison masks are -1 where true.
+    pub fn step_x4(delta: v128) -> v128 {
+        let zero = i32x4_splat(0);
+        i32x4_sub(i32x4_lt(delta, zero), i32x4_gt(delta, zero))
+    }
+
+    pub unsafe fn load(slice: &[i32], i: usize) -> v128 {
+        v128_load(slice[i..i + 4].as_ptr() as *const v128)
+    }
+
+    pub unsafe fn store(slice: &mut [i32], i: usize, v: v128) {
+        v128_store(slice[i..i + 4].as_mut_ptr() as *mut v128, v)
+    }
+}
@@ -14,16 +14,13 @@
 // limitations under the License.
 //
 
-use common::module_common::{move_by, print_str, srand, Context, GRID_H, GRID_W};
+use common::module_common::{move_by, print_str, reserve_shared, srand, Context, RunnerArrays, SpatialIndex};
 use common::println;
-use common::shared::{cptr, State};
+use common::shared::{cptr, State, ACTORS_SOA, ACTOR_LANES};
 
 #[no_mangle]
 pub extern "C" fn malloc_(size: usize) -> cptr {
-    let vec: Vec<u8> = Vec::with_capacity(size);
-    let ptr = vec.as_ptr();
-    std::mem::forget(vec); // Leak the vector
-    ptr as cptr
+    reserve_shared(size)
 }
 
 #[no_mangle]
@@ -36,11 +33,121 @@ pub extern "C" fn update_context(ctx: &mut Context, ro_ptr: cptr, rw_ptr: cptr)
     ctx.update(ro_ptr, rw_ptr);
 }
 
+// The hunter is never tiled; it reads every tile's runners.
 #[no_mangle]
-pub extern "C" fn init(ctx: &mut Context, rand_seed: i32) {
+pub extern "C" fn init(ctx: &mut Context, rand_seed: i32, _tile: i32) {
     srand(rand_seed as usize);
-    ctx.hunter.x = GRID_W / 2;
-    ctx.hunter.y = GRID_H / 2;
+    ctx.hunter.x = ctx.grid.width() / 2;
+    ctx.hunter.y = ctx.grid.height() / 2;
+}
+
+// Returns the distance and index of the closest live runner in the first 'len' entries of the
+// SoA arrays, if any is alive. Ties go to the lowest index, as in the AoS loop in tick().
+fn nearest_soa(soa: &RunnerArrays, len: usize, hx: i32, hy: i32) -> Option<(i32, usize)> {
+    let mut dist = [i32::MAX; ACTOR_LANES];
+    let mut index = [-1; ACTOR_LANES];
+    nearest_lanes(soa, len, hx, hy, &mut dist, &mut index);
+    (0..ACTOR_LANES)
+        .filter(|&l| index[l] != -1)
+        .min_by_key(|&l| (dist[l], index[l]))
+        .map(|l| (dist[l], index[l] as usize))
+}
+
+// Scans each tile's runners in turn, returning the closest with ties going to the lower tile.
+fn nearest_tiled(ctx: &Context, hx: i32, hy: i32) -> Option<(i32, i32)> {
+    let mut best: Option<(i32, (i32, i32))> = None;
+    for tile in &ctx.tiles {
+        // The tile is moving runners as we read; a stale count just skips or repeats one.
+        let n = (tile.header.n as usize).min(tile.soa.x.len());
+        let len = (n + ACTOR_LANES - 1) & !(ACTOR_LANES - 1);
+        if let Some((dist, i)) = nearest_soa(&tile.soa, len, hx, hy) {
+            if best.map_or(true, |b| dist < b.0) {
+                best = Some((dist, (tile.soa.x[i], tile.soa.y[i])));
+            }
+        }
+    }
+    best.map(|b| b.1)
+}
+
+// Leaves the closest live runner seen by each lane in 'dist' and 'index'.
+#[cfg(target_feature = "simd128")]
+fn nearest_lanes(soa: &RunnerArrays, len: usize, hx: i32, hy: i32, dist: &mut [i32], index: &mut [i32]) {
+    use common::module_common::simd::*;
+    unsafe {
+        let mut best = load(dist, 0);
+        let mut best_index = load(index, 0);
+        let mut lane_index = i32x4(0, 1, 2, 3);
+        for i in (0..len).step_by(ACTOR_LANES) {
+            let dx = i32x4_sub(load(&soa.x, i), i32x4_splat(hx));
+            let dy = i32x4_sub(load(&soa.y, i), i32x4_splat(hy));
+            let d = i32x4_add(i32x4_mul(dx, dx), i32x4_mul(dy, dy));
+            let alive = i32x4_ne(load(&soa.state, i), i32x4_splat(State::Dead as i32));
+            let closer = v128_and(alive, i32x4_lt(d, best));
+            best = v128_bitselect(d, best, closer);
+            best_index = v128_bitselect(lane_index, best_index, closer);
+            lane_index = i32x4_add(lane_index, i32x4_splat(ACTOR_LANES as i32));
+        }
+        store(dist, 0, best);
+        store(index, 0, best_index);
+    }
+}
+
+#[cfg(not(target_feature = "simd128"))]
+fn nearest_lanes(soa: &RunnerArrays, len: usize, hx: i32, hy: i32, dist: &mut [i32], index: &mut [i32]) {
+    for i in (0..len).step_by(ACTOR_LANES) {
+        for l in 0..ACTOR_LANES {
+            let (dx, dy) = (soa.x[i + l] - hx, soa.y[i + l] - hy);
+            let d = dx * dx + dy * dy;
+            if soa.state[i + l] != State::Dead as i32 && d < dist[l] {
+                dist[l] = d;
+                index[l] = (i + l) as i32;
+            }
+        }
+    }
+}
+
+// Searches the spatial index in square rings of buckets around the hunter, returning the same
+// runner as the linear scans: once rings 0..r are done, every other runner is at least
+// r * bucket size + 1 cells away along x or y.
+fn nearest_indexed(ctx: &Context) -> Option<usize> {
+    let header = &ctx.grid.header;
+    let (bw, bh) = (header.index_buckets_w() as i32, header.index_buckets_h() as i32);
+    let (hx, hy) = (ctx.hunter.x as i32, ctx.hunter.y as i32);
+    let bucket = SpatialIndex::bucket(header, ctx.hunter.x, ctx.hunter.y) as i32;
+    let (bx, by) = (bucket % bw, bucket / bw);
+    let max_ring = bx.max(bw - 1 - bx).max(by).max(bh - 1 - by);
+
+    // Bounds the walk in case the runner container relinks a list under us.
+    let n = ctx.index.next.len() as i32;
+    let mut steps = n;
+    let mut best: Option<(i32, usize)> = None;
+    for ring in 0..=max_ring {
+        for y in (by - ring).max(0)..=(by + ring).min(bh - 1) {
+            // Only the top and bottom rows of the ring are full; the rest just have their ends.
+            let x_step = if y == by - ring || y == by + ring { 1 } else { 2 * ring as usize };
+            for x in ((bx - ring)..=(bx + ring)).step_by(x_step) {
+                if x < 0 || x >= bw {
+                    continue;
+                }
+                let mut i = ctx.index.head[(y * bw + x) as usize];
+                while i >= 0 && i < n && steps > 0 {
+                    steps -= 1;
+                    let (rx, ry, dead) = ctx.runner(i as usize);
+                    let (dx, dy) = (rx as i32 - hx, ry as i32 - hy);
+                    let dist = dx * dx + dy * dy;
+                    if !dead && best.map_or(true, |b| (dist, i as usize) < b) {
+                        best = Some((dist, i as usize));
+                    }
+                    i = ctx.index.next[i as usize];
+                }
+            }
+        }
+        let reach = (ring << header.index_shift) + 1;
+        if best.map_or(i32::MAX, |b| b.0) < reach * reach {
+            break;
+        }
+    }
+    best.map(|b| b.1)
 }
 
 #[no_mangle]
@@ -48,7 +155,30 @@ pub extern "C" fn tick(ctx: &mut Context) {
     // Find the closest runner and move towards it.
     let mut min_dx: i32 = 0;
     let mut min_dy: i32 = 0;
-    let mut min_dist = 99999;
+    if ctx.grid.header.n_tiles != 0 {
+        let (hx, hy) = (ctx.hunter.x as i32, ctx.hunter.y as i32);
+        if let Some((x, y)) = nearest_tiled(ctx, hx, hy) {
+            min_dx = x - hx;
+            min_dy = y - hy;
+        }
+        move_by(&ctx.grid, &mut ctx.hunter.x, &mut ctx.hunter.y, min_dx, min_dy);
+        return;
+    }
+    if ctx.grid.header.index_shift != 0 || ctx.grid.header.layout == ACTORS_SOA {
+        let (hx, hy) = (ctx.hunter.x as i32, ctx.hunter.y as i32);
+        let nearest = match ctx.grid.header.index_shift {
+            0 => nearest_soa(&ctx.soa, ctx.soa.x.len(), hx, hy).map(|n| n.1),
+            _ => nearest_indexed(ctx),
+        };
+        if let Some(i) = nearest {
+            let (x, y, _) = ctx.runner(i);
+            min_dx = x as i32 - hx;
+            min_dy = y as i32 - hy;
+        }
+        move_by(&ctx.grid, &mut ctx.hunter.x, &mut ctx.hunter.y, min_dx, min_dy);
+        return;
+    }
+    let mut min_dist = i32::MAX;
     for r in &*ctx.runners {
         if r.state == State::Dead {
             continue;
@@ -74,7 +204,9 @@ pub extern "C" fn large_alloc() {
 #[no_mangle]
 pub extern "C" fn modify_grid(ctx: &mut Context) {
     println!("[h] Attempting to write to read-only memory...");
-    ctx.grid[0][0] = 2;
+    unsafe {
+        *(ctx.grid.cell_ptr(0, 0) as *mut u8) = 2;
+    }
 }
 
 fn main() {
@@ -14,18 +14,22 @@
 // limitations under the License.
 //
 
-use common::module_common::{move_by, print_str, rand, rand_step, rand_usize, srand, Context, GRID_H, GRID_W};
+use common::module_common::{
+    move_by, print_str, rand, rand_step, rand_usize, reserve_shared, srand, try_move, xs_seed, Context, Grid,
+    RunnerArrays, SpatialIndex,
+};
+#[cfg(not(target_feature = "simd128"))]
+use common::module_common::{rand3, step, xs_next_lane};
 use common::println;
-use common::shared::{cptr, State};
+use common::shared::{
+    cptr, State, ACTORS_SOA, ACTOR_LANES, MIGRATION_RESERVE, MIGRATION_SLOTS, TILE_LEFT, TILE_RIGHT,
+};
 
 const SCARE_DIST: i32 = 10;
 
 #[no_mangle]
 pub extern "C" fn malloc_(size: usize) -> cptr {
-    let vec: Vec<u8> = Vec::with_capacity(size);
-    let ptr = vec.as_ptr();
-    std::mem::forget(vec); // Leak the vector
-    ptr as cptr
+    reserve_shared(size)
 }
 
 #[no_mangle]
@@ -38,20 +42,231 @@ pub extern "C" fn update_context(ctx: &mut Context, ro_ptr: cptr, rw_ptr: cptr)
     ctx.update(ro_ptr, rw_ptr);
 }
 
+// Places this tile's share of the runners at random within its strip, and clears its queues.
+fn init_tile(ctx: &mut Context, t: usize) {
+    let header = ctx.grid.header;
+    let (w, h) = (ctx.grid.width() as i32, ctx.grid.height());
+    let (x0, x1) = (header.tile_x0(t), header.tile_x0(t + 1));
+    let (n_runners, n_tiles) = (header.n_runners as usize, header.n_tiles as usize);
+    let n = n_runners / n_tiles + (t < n_runners % n_tiles) as usize;
+    let tile = &mut ctx.tiles[t];
+    let soa = &mut tile.soa;
+    for i in 0..soa.x.len() {
+        let pad = i >= n;
+        let x = (x0 + (rand_usize() % (x1 - x0) as usize) as i32).max(1).min(w - 2);
+        soa.x[i] = if pad { 0 } else { x };
+        soa.y[i] = if pad { 0 } else { 1 + (rand_usize() % (h - 2)) as i32 };
+        soa.state[i] = (if pad { State::Dead } else { State::Walking }) as i32;
+    }
+    let th = &mut *tile.header;
+    th.n = n as u32;
+    for queues in th.out.iter_mut() {
+        queues.iter_mut().for_each(|q| q.count = 0);
+    }
+    th.free = [(soa.x.len() - n - MIGRATION_RESERVE) as u32; 2];
+    th.tick = 0;
+}
+
+// 'tile' is this container's tile, or -1 when untiled.
 #[no_mangle]
-pub extern "C" fn init(ctx: &mut Context, rand_seed: i32) {
+pub extern "C" fn init(ctx: &mut Context, rand_seed: i32, tile: i32) {
+    if tile >= 0 {
+        ctx.tile = Some(tile as usize);
+        srand(rand_seed.wrapping_add(tile) as usize);
+        xs_seed(rand_seed.wrapping_add(tile) as u32);
+        init_tile(ctx, tile as usize);
+        return;
+    }
     srand(rand_seed as usize);
+    let (w, h) = (ctx.grid.width(), ctx.grid.height());
+    if ctx.grid.header.layout == ACTORS_SOA {
+        xs_seed(rand_seed as u32);
+        let n = ctx.grid.header.n_runners as usize;
+        let soa = &mut ctx.soa;
+        for i in 0..soa.x.len() {
+            let pad = i >= n;
+            soa.x[i] = if pad { 0 } else { 1 + (rand_usize() % (w - 2)) as i32 };
+            soa.y[i] = if pad { 0 } else { 1 + (rand_usize() % (h - 2)) as i32 };
+            soa.state[i] = (if pad { State::Dead } else { State::Walking }) as i32;
+        }
+        ctx.build_index();
+        return;
+    }
     for r in &mut *ctx.runners {
-        r.x = 1 + rand_usize() % (GRID_W - 2);
-        r.y = 1 + rand_usize() % (GRID_H - 2);
+        r.x = 1 + rand_usize() % (w - 2);
+        r.y = 1 + rand_usize() % (h - 2);
         r.state = State::Walking;
     }
+    ctx.build_index();
+}
+
+type Lanes = [i32; ACTOR_LANES];
+
+// The steps chosen for one vector of runners, and the fallbacks used if a step is blocked.
+#[derive(Default)]
+struct Steps {
+    mx: Lanes,
+    my: Lanes,
+    alt_mx: Lanes,
+    alt_my: Lanes,
+}
+
+// Works out the new state and step of the runners at [i, i + ACTOR_LANES), following the same
+// rules as the AoS loop in tick().
+#[cfg(target_feature = "simd128")]
+fn soa_steps(soa: &mut RunnerArrays, i: usize, hx: i32, hy: i32) -> Steps {
+    use common::module_common::simd::*;
+    let mut s = Steps::default();
+    unsafe {
+        let (zero, one) = (i32x4_splat(0), i32x4_splat(1));
+        let dx = i32x4_sub(load(&soa.x, i), i32x4_splat(hx));
+        let dy = i32x4_sub(load(&soa.y, i), i32x4_splat(hy));
+        let dead = v128_or(i32x4_eq(load(&soa.state, i), i32x4_splat(State::Dead as i32)),
+                           v128_and(i32x4_eq(dx, zero), i32x4_eq(dy, zero)));
+        let dist = i32x4_add(i32x4_mul(dx, dx), i32x4_mul(dy, dy));
+        let far = i32x4_gt(dist, i32x4_splat(SCARE_DIST * SCARE_DIST));
+
+        // Far runners walk randomly; near ones run on x (choice 0), y (choice 1) or both.
+        let r = xs_next();
+        let choice = rand3_x4(r, 20);
+        let run_x = v128_andnot(i32x4_ne(choice, one), far);
+        let run_y = v128_andnot(i32x4_ne(choice, zero), far);
+        store(&mut s.mx, 0, v128_bitselect(step_x4(dx), i32x4_sub(rand3_x4(r, 0), one), run_x));
+        store(&mut s.my, 0, v128_bitselect(step_x4(dy), i32x4_sub(rand3_x4(r, 10), one), run_y));
+        let state = v128_bitselect(i32x4_splat(State::Walking as i32), i32x4_splat(State::Running as i32), far);
+        store(&mut soa.state, i, v128_bitselect(i32x4_splat(State::Dead as i32), state, dead));
+
+        let alt = xs_next();
+        store(&mut s.alt_mx, 0, i32x4_sub(rand3_x4(alt, 0), one));
+        store(&mut s.alt_my, 0, i32x4_sub(rand3_x4(alt, 10), one));
+    }
+    s
+}
+
+#[cfg(not(target_feature = "simd128"))]
+fn soa_steps(soa: &mut RunnerArrays, i: usize, hx: i32, hy: i32) -> Steps {
+    let mut s = Steps::default();
+    for l in 0..ACTOR_LANES {
+        let j = i + l;
+        let (dx, dy) = (soa.x[j] - hx, soa.y[j] - hy);
+        let dead = soa.state[j] == State::Dead as i32 || (dx == 0 && dy == 0);
+        let far = dx * dx + dy * dy > SCARE_DIST * SCARE_DIST;
+        let r = xs_next_lane(l);
+        let choice = rand3(r, 20);
+        s.mx[l] = if far || choice == 1 { rand3(r, 0) - 1 } else { step(dx) };
+        s.my[l] = if far || choice == 0 { rand3(r, 10) - 1 } else { step(dy) };
+        soa.state[j] = (if dead { State::Dead } else if far { State::Walking } else { State::Running }) as i32;
+
+        let alt = xs_next_lane(l);
+        s.alt_mx[l] = rand3(alt, 0) - 1;
+        s.alt_my[l] = rand3(alt, 10) - 1;
+    }
+    s
+}
+
+// Each live runner's step is tried against the grid one at a time, with a fallback step drawn
+// up front in place of move_by()'s rand_step() calls. 'len' is a whole number of vectors.
+fn tick_soa(grid: &Grid, index: &mut SpatialIndex, soa: &mut RunnerArrays, len: usize, hunter: (i32, i32)) {
+    let (hx, hy) = hunter;
+    for i in (0..len).step_by(ACTOR_LANES) {
+        let s = soa_steps(soa, i, hx, hy);
+        for l in 0..ACTOR_LANES {
+            let j = i + l;
+            let old = (soa.x[j] as usize, soa.y[j] as usize);
+            if soa.state[j] == State::Dead as i32 {
+                index.died(&grid.header, j, old.0, old.1);
+            } else if try_move(grid, &mut soa.x[j], &mut soa.y[j], s.mx[l], s.my[l])
+                || try_move(grid, &mut soa.x[j], &mut soa.y[j], s.alt_mx[l], s.alt_my[l]) {
+                index.moved(&grid.header, j, old, (soa.x[j] as usize, soa.y[j] as usize));
+            }
+        }
+    }
+}
+
+// Takes in the runners sent by the neighbouring tiles last tick, moves every runner, then sends
+// those that have left the strip. See TileHeader in c/gtk/common.h.
+fn tick_tile(ctx: &mut Context, t: usize) {
+    let header = ctx.grid.header;
+    let cap = header.tile_capacity();
+    let parity = (ctx.tiles[t].header.tick & 1) as usize;
+    // The neighbours' queues can't be read while this tile is borrowed, so stage their runners.
+    let mut incoming = [[0; 3]; 2 * MIGRATION_SLOTS];
+    let mut n_in = 0;
+    let mut budget = [0; 2];
+    for d in TILE_LEFT..=TILE_RIGHT {
+        ctx.tiles[t].header.out[d][parity].count = 0;
+        let from = if d == TILE_LEFT { t.wrapping_sub(1) } else { t + 1 };
+        if from >= ctx.tiles.len() {
+            continue;
+        }
+        // The neighbour on our left sends to us through its right-hand queue, and vice versa.
+        let nh = &ctx.tiles[from].header;
+        let q = &nh.out[1 - d][1 - parity];
+        let count = (q.count as usize).min(MIGRATION_SLOTS);
+        incoming[n_in..n_in + count].copy_from_slice(&q.runners[..count]);
+        n_in += count;
+        budget[d] = (nh.free[1 - parity] as usize / 2).min(MIGRATION_SLOTS);
+    }
+
+    let hunter = (ctx.hunter.x as i32, ctx.hunter.y as i32);
+    let tile = &mut ctx.tiles[t];
+    let (th, soa) = (&mut *tile.header, &mut tile.soa);
+    // The budgets mean capacity can't run out; the limit just guards against bad counts.
+    for r in incoming[..n_in].iter().take(cap.saturating_sub(th.n as usize)) {
+        let n = th.n as usize;
+        soa.x[n] = r[0];
+        soa.y[n] = r[1];
+        soa.state[n] = r[2];
+        th.n += 1;
+    }
+    let len = (th.n as usize + ACTOR_LANES - 1) & !(ACTOR_LANES - 1);
+    tick_soa(&ctx.grid, &mut ctx.index, soa, len, hunter);
+
+    let (x0, x1) = (header.tile_x0(t), header.tile_x0(t + 1));
+    let mut i = 0;
+    while i < th.n as usize {
+        let d = match soa.x[i] {
+            x if x < x0 => TILE_LEFT,
+            x if x >= x1 => TILE_RIGHT,
+            _ => {
+                i += 1;
+                continue;
+            }
+        };
+        let q = &mut th.out[d][parity];
+        if q.count as usize >= budget[d] {
+            i += 1;
+            continue;
+        }
+        q.runners[q.count as usize] = [soa.x[i], soa.y[i], soa.state[i]];
+        q.count += 1;
+
+        // Swap-remove, keeping [n, capacity) Dead for the kernel's padding lanes.
+        th.n -= 1;
+        let last = th.n as usize;
+        soa.x[i] = soa.x[last];
+        soa.y[i] = soa.y[last];
+        soa.state[i] = soa.state[last];
+        soa.x[last] = 0;
+        soa.y[last] = 0;
+        soa.state[last] = State::Dead as i32;
+    }
+    th.free[parity] = cap.saturating_sub(th.n as usize + MIGRATION_RESERVE) as u32;
+    th.tick += 1;
 }
 
 #[no_mangle]
 pub extern "C" fn tick(ctx: &mut Context) {
-    // Find the closest runner and move towards it.
-    for r in &mut *ctx.runners {
+    if let Some(t) = ctx.tile {
+        tick_tile(ctx, t);
+        return;
+    }
+    if ctx.grid.header.layout == ACTORS_SOA {
+        let (hunter, len) = ((ctx.hunter.x as i32, ctx.hunter.y as i32), ctx.soa.x.len());
+        tick_soa(&ctx.grid, &mut ctx.index, &mut ctx.soa, len, hunter);
+        return;
+    }
+    for (i, r) in ctx.runners.iter_mut().enumerate() {
         if r.state == State::Dead {
             continue;
         }
@@ -60,6 +275,7 @@ pub extern "C" fn tick(ctx: &mut Context) {
         // If the hunter has reached us, we're dead.
         if dx == 0 && dy == 0 {
             r.state = State::Dead;
+            ctx.index.died(&ctx.grid.header, i, r.x, r.y);
             continue;
         }
 
@@ -78,7 +294,9 @@ pub extern "C" fn tick(ctx: &mut Context) {
                 _ => return,
             }
         };
+        let old = (r.x, r.y);
         move_by(&ctx.grid, &mut r.x, &mut r.y, mx, my);
+        ctx.index.moved(&ctx.grid.header, i, old, (r.x, r.y));
     }
 }
 
@@ -30,3 +30,185 @@ impl State {
 
 #[allow(non_camel_case_types)]
 pub type cptr = *mut core::ffi::c_void;
+
+pub const GRID_MAGIC: u32 = 0x4449_5247; // "GRID"
+pub const GRID_VERSION: u32 = 5;
+pub const GRID_ROW_ALIGN: u32 = 64;
+pub const GRID_BYTES: u32 = 0; // one byte per cell
+pub const GRID_BITS: u32 = 1; // one bit per cell, lowest bit first
+pub const ACTORS_AOS: u32 = 0; // an array of Runner structs
+pub const ACTORS_SOA: u32 = 1; // separate x[], y[] and state[] arrays, padded to whole vectors
+pub const ACTOR_LANES: usize = 4; // i32 lanes in a wasm v128
+pub const RUNNERS_OFFSET: usize = 16; // start of the SoA arrays in the read-write buffer
+pub const INDEX_SHIFT: u32 = 3; // with --index, each spatial index bucket covers 8x8 cells
+pub const INDEX_NONE: i32 = -2; // bucket_next value of a runner that isn't in the index
+pub const MAX_TILES: u32 = 32;
+pub const DIRTY_SHIFT: u32 = 4; // each bit of the dirty bitmap covers a 16x16 region of cells
+
+// Matches GridHeader in c/gtk/common.h. Written by the host at the start of the read-only
+// buffer before any container starts, and checked by the module in create_context. The rows
+// follow at 'grid_offset', each padded to a cache line; a set cell is blocked. The host sets a bit
+// in the dirty bitmap at 'dirty_offset' for each region of cells it changes. The read-write
+// buffer holds the hunter followed by 'n_runners' runners; with tiles, see TileHeader instead.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct GridHeader {
+    pub magic: u32,
+    pub version: u32,
+    pub encoding: u32,
+    pub grid_w: u32,
+    pub grid_h: u32,
+    pub row_bytes: u32,
+    pub grid_offset: u32,
+    pub n_runners: u32,
+    pub layout: u32,
+    pub index_shift: u32, // log2 of the spatial index bucket size; 0 for no index
+    pub n_tiles: u32,     // 0 when a single runner container owns every runner
+    pub dirty_offset: u32,
+}
+
+impl GridHeader {
+    pub fn new(
+        grid_w: u32, grid_h: u32, n_runners: u32, encoding: u32, layout: u32, index_shift: u32, n_tiles: u32,
+    ) -> Self {
+        Self {
+            magic: GRID_MAGIC,
+            version: GRID_VERSION,
+            encoding,
+            grid_w,
+            grid_h,
+            row_bytes: Self::row_bytes(grid_w, encoding),
+            grid_offset: GRID_ROW_ALIGN,
+            n_runners,
+            layout,
+            index_shift,
+            n_tiles,
+            dirty_offset: GRID_ROW_ALIGN + Self::row_bytes(grid_w, encoding) * grid_h,
+        }
+    }
+
+    pub fn row_bytes(grid_w: u32, encoding: u32) -> u32 {
+        let bytes = if encoding == GRID_BITS { (grid_w + 7) / 8 } else { grid_w };
+        (bytes + GRID_ROW_ALIGN - 1) & !(GRID_ROW_ALIGN - 1)
+    }
+
+    pub fn valid(&self) -> bool {
+        self.magic == GRID_MAGIC && self.version == GRID_VERSION && self.encoding <= GRID_BITS
+            && self.row_bytes == Self::row_bytes(self.grid_w, self.encoding)
+            && self.grid_offset as usize >= std::mem::size_of::<Self>()
+            && self.layout <= ACTORS_SOA
+            && self.index_shift < 16
+            && self.n_tiles <= MAX_TILES
+            && self.dirty_offset as usize >= self.grid_offset as usize + self.row_bytes as usize * self.grid_h as usize
+            && (self.n_tiles == 0 || (self.layout == ACTORS_SOA && self.index_shift == 0))
+    }
+
+    // Size of the read-only buffer, header and dirty bitmap included.
+    pub fn buffer_size(&self) -> usize {
+        self.dirty_offset as usize + (self.dirty_regions_w() * self.dirty_regions_h() + 7) / 8
+    }
+
+    pub fn dirty_regions_w(&self) -> usize {
+        ((self.grid_w + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT) as usize
+    }
+
+    pub fn dirty_regions_h(&self) -> usize {
+        ((self.grid_h + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT) as usize
+    }
+
+    // Returns the buffer offset of the dirty bitmap byte covering cell (x, y), and its bit.
+    pub fn dirty_bit(&self, x: usize, y: usize) -> (usize, u8) {
+        let region = (y >> DIRTY_SHIFT) * self.dirty_regions_w() + (x >> DIRTY_SHIFT);
+        (self.dirty_offset as usize + region / 8, 1 << (region % 8))
+    }
+
+    // Length of each SoA array; the padding runners are kept Dead.
+    pub fn runner_stride(&self) -> usize {
+        (self.n_runners as usize + ACTOR_LANES - 1) & !(ACTOR_LANES - 1)
+    }
+
+    // Size of the hunter's x and y followed by the runners' x, y and state.
+    pub fn actors_size(&self) -> usize {
+        match self.layout {
+            ACTORS_SOA => RUNNERS_OFFSET + 3 * 4 * self.runner_stride(),
+            _ => 8 + 12 * self.n_runners as usize,
+        }
+    }
+
+    pub fn index_buckets_w(&self) -> usize {
+        ((self.grid_w + (1 << self.index_shift) - 1) >> self.index_shift) as usize
+    }
+
+    pub fn index_buckets_h(&self) -> usize {
+        ((self.grid_h + (1 << self.index_shift) - 1) >> self.index_shift) as usize
+    }
+
+    // Byte offset of the spatial index's bucket heads, which are followed by the next links.
+    pub fn index_offset(&self) -> usize {
+        (self.actors_size() + 15) & !15
+    }
+
+    // Each tile can hold twice its even share of the runners, plus the in-flight reserve.
+    pub fn tile_capacity(&self) -> usize {
+        let share = (self.n_runners + self.n_tiles - 1) / self.n_tiles;
+        (2 * share as usize + MIGRATION_RESERVE + ACTOR_LANES - 1) & !(ACTOR_LANES - 1)
+    }
+
+    pub fn tile_region_size(&self) -> usize {
+        let size = TILE_ARRAYS_OFFSET + 3 * 4 * self.tile_capacity();
+        (size + TILE_ALIGN - 1) & !(TILE_ALIGN - 1)
+    }
+
+    pub fn tile_region_offset(&self, tile: usize) -> usize {
+        TILE_ALIGN + tile * self.tile_region_size()
+    }
+
+    // Tile t covers columns [tile_x0(t), tile_x0(t + 1)).
+    pub fn tile_x0(&self, tile: usize) -> i32 {
+        (self.grid_w as u64 * tile as u64 / self.n_tiles as u64) as i32
+    }
+
+    pub fn rw_buffer_size(&self) -> usize {
+        if self.n_tiles != 0 {
+            return TILE_ALIGN + self.n_tiles as usize * self.tile_region_size();
+        }
+        match self.index_shift {
+            0 => self.actors_size(),
+            _ => self.index_offset() + 4 * (self.index_buckets_w() * self.index_buckets_h() + self.runner_stride()),
+        }
+    }
+
+    // Returns the buffer offset of the byte holding cell (x, y), and the cell's bits within it.
+    pub fn cell(&self, x: usize, y: usize) -> (usize, u8) {
+        let row = self.grid_offset as usize + y * self.row_bytes as usize;
+        match self.encoding {
+            GRID_BITS => (row + (x >> 3), 1 << (x & 7)),
+            _ => (row + x, 0xff),
+        }
+    }
+}
+
+
+// Matches TileHeader in c/gtk/common.h, which describes the tiled layout. Each tile's region in
+// the read-write buffer starts with this header, followed by its SoA runner arrays of
+// tile_capacity() entries at TILE_ARRAYS_OFFSET.
+pub const TILE_ALIGN: usize = 65536; // the largest page size of the supported hosts
+pub const MIGRATION_SLOTS: usize = 64; // per direction per tick
+pub const MIGRATION_RESERVE: usize = 2 * MIGRATION_SLOTS;
+pub const TILE_LEFT: usize = 0;
+pub const TILE_RIGHT: usize = 1;
+pub const TILE_ARRAYS_OFFSET: usize = (std::mem::size_of::<TileHeader>() + 15) & !15;
+
+#[repr(C)]
+pub struct MigrationQueue {
+    pub count: u32,
+    pub runners: [[i32; 3]; MIGRATION_SLOTS], // x, y, state
+}
+
+#[repr(C)]
+pub struct TileHeader {
+    pub n: u32,       // runner slots in use; [n, capacity) are Dead at (0, 0)
+    pub tick: u32,    // ticks completed; its parity selects the queue half being written
+    pub free: [u32; 2], // spare capacity at the end of the last tick with each parity
+    pub out: [[MigrationQueue; 2]; 2], // [TILE_LEFT/TILE_RIGHT][tick parity]
+}
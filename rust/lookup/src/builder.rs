@@ -0,0 +1,418 @@
+//
+// Copyright 2022 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Bulk serialization of key/value pairs into the formats described in table.rs.
+//
+// A counting pass computes the final position of every index entry, bucket and chain, so the
+// output file is sized once and then filled through a shared mapping, with threads writing
+// disjoint regions. There are no per-field writes or seeks. The header, with the checksum of
+// the rest of the table, is written last.
+
+use crate::hash::KeyHash;
+use crate::table::{
+    self, Bucket, FilterBlock, Header, BUCKET_ENTRIES, BUCKET_SIZE, FILTER_BLOCK_SIZE, FORMAT_BUCKETED, FORMAT_CHAINED,
+    FORMAT_COMPACT, HEADER_SIZE,
+};
+use libc::{MAP_FAILED, MAP_SHARED, PROT_READ, PROT_WRITE};
+use std::{cmp, fs::File, os::unix::io::AsRawFd, slice, thread};
+
+// Bucketed tables are sized for an average of this many entries per bucket (75% full).
+const BUCKET_LOAD: usize = BUCKET_ENTRIES * 3 / 4;
+
+pub struct Builder {
+    pub format: u32,
+    pub key_hash: KeyHash,
+    // Number of index slots for the chained and compact formats; bucketed tables are sized
+    // automatically.
+    pub index_slots: usize,
+    // Bloom filter bits per key, or 0 for no filter.
+    pub filter_bits: usize,
+    pub threads: usize,
+}
+
+impl Builder {
+    pub fn new(format: u32, key_hash: KeyHash, index_slots: usize, filter_bits: usize) -> Self {
+        let threads = thread::available_parallelism().map_or(1, |n| n.get());
+        Self { format, key_hash, index_slots, filter_bits, threads }
+    }
+
+    // Serializes 'pairs' into 'file', replacing its contents, and returns the table size.
+    pub fn build<'a>(&self, pairs: impl IntoIterator<Item = (&'a str, &'a str)>, file: &File) -> usize {
+        let pairs: Vec<(&str, &str)> = pairs.into_iter().collect();
+        let hashes = self.hash_all(&pairs);
+        match self.format {
+            FORMAT_CHAINED | FORMAT_COMPACT => self.build_chained(&pairs, &hashes, file),
+            FORMAT_BUCKETED => self.build_bucketed(&pairs, &hashes, file),
+            _ => panic!("unknown lookup table format {}", self.format),
+        }
+    }
+
+    fn hash_all(&self, pairs: &[(&str, &str)]) -> Vec<u64> {
+        let mut hashes = vec![0u64; pairs.len()];
+        let chunk = cmp::max(pairs.len() / self.threads, 1);
+        thread::scope(|s| {
+            for (out, input) in hashes.chunks_mut(chunk).zip(pairs.chunks(chunk)) {
+                s.spawn(move || {
+                    for (h, (key, _)) in out.iter_mut().zip(input) {
+                        *h = self.key_hash.hash(key.as_bytes());
+                    }
+                });
+            }
+        });
+        hashes
+    }
+
+    // Chained and compact formats; see table.rs for the layouts.
+    fn build_chained(&self, pairs: &[(&str, &str)], hashes: &[u64], file: &File) -> usize {
+        let slots = self.index_slots;
+        let compact = self.format == FORMAT_COMPACT;
+
+        // Group the pairs by slot; 'first[s]' is the position of slot s's pairs in 'order'.
+        let slot_of: Vec<usize> = hashes.iter().map(|h| (h % slots as u64) as usize).collect();
+        let mut counts = vec![0usize; slots];
+        for &s in &slot_of {
+            counts[s] += 1;
+        }
+        let mut first = Vec::with_capacity(slots + 1);
+        let mut n = 0usize;
+        for s in 0..slots {
+            first.push(n);
+            n += counts[s];
+        }
+        first.push(n);
+
+        let mut order = vec![0u32; pairs.len()];
+        let mut next = first.clone();
+        for (i, &s) in slot_of.iter().enumerate() {
+            order[next[s]] = i as u32;
+            next[s] += 1;
+        }
+
+        // Counting pass, with each thread taking a contiguous range of slots. Pairs within a chain
+        // are sorted to keep the output deterministic, and a compact chain's size depends on the
+        // order.
+        let per_thread = (slots + self.threads - 1) / self.threads;
+        let mut chain_bytes = vec![0usize; slots];
+        thread::scope(|sc| {
+            let mut order = &mut order[..];
+            for (t, bytes_part) in chain_bytes.chunks_mut(per_thread).enumerate() {
+                let (s0, s1) = (t * per_thread, t * per_thread + bytes_part.len());
+                let (order_part, order_rest) = order.split_at_mut(first[s1] - first[s0]);
+                let first = &first;
+                sc.spawn(move || {
+                    for s in s0..s1 {
+                        let chain = &mut order_part[first[s] - first[s0]..first[s + 1] - first[s0]];
+                        chain.sort_unstable_by_key(|&i| pairs[i as usize]);
+                        bytes_part[s - s0] = chain_size(pairs, chain, compact);
+                    }
+                });
+                order = order_rest;
+            }
+        });
+
+        // Chains are packed in slot order, starting after the bumper byte.
+        let mut chain_start = Vec::with_capacity(slots + 1);
+        let mut offset = 1usize;
+        for s in 0..slots {
+            chain_start.push(offset);
+            offset += chain_bytes[s];
+        }
+        chain_start.push(offset);
+        assert!(offset <= u32::MAX as usize, "lookup table too large for u32 offsets");
+
+        let filter_blocks = table::filter_blocks(pairs.len(), self.filter_bits);
+        let filter_size = filter_blocks * FILTER_BLOCK_SIZE;
+        let size = HEADER_SIZE + filter_size + slots * 4 + offset;
+        let mut out = MappedOutput::new(file, size);
+        let buf = out.bytes();
+        let (header, body) = buf.split_at_mut(HEADER_SIZE);
+        let (filter, rest) = body.split_at_mut(filter_size);
+        build_filter(filter, hashes);
+        let (mut index, mut data) = rest.split_at_mut(slots * 4);
+        let mut order = &order[..];
+
+        // Give each thread the same range of slots as before, along with the matching (disjoint)
+        // parts of the index table, packed data and pair ordering.
+        thread::scope(|sc| {
+            let mut s0 = 0;
+            let mut data_base = 0;
+            while s0 < slots {
+                let s1 = cmp::min(s0 + per_thread, slots);
+                let end = chain_start[s1] - data_base;
+                let (index_part, index_rest) = index.split_at_mut((s1 - s0) * 4);
+                let (data_part, data_rest) = data.split_at_mut(end);
+                let (order_part, order_rest) = order.split_at(first[s1] - first[s0]);
+                let (chain_start, first, counts) = (&chain_start, &first, &counts);
+                sc.spawn(move || {
+                    for s in s0..s1 {
+                        let index_entry = if counts[s] > 0 { chain_start[s] as u32 } else { 0 };
+                        index_part[(s - s0) * 4..][..4].copy_from_slice(&index_entry.to_le_bytes());
+                        if counts[s] == 0 {
+                            continue;
+                        }
+                        let chain = &order_part[first[s] - first[s0]..][..counts[s]];
+                        let mut w = Writer { buf: data_part, pos: chain_start[s] - data_base };
+                        if compact {
+                            w.put_varint(counts[s] as u32);
+                            let mut prev: &[u8] = &[];
+                            for &i in chain {
+                                let (key, val) = pairs[i as usize];
+                                let shared = table::common_prefix(prev, key.as_bytes());
+                                w.put_varint(shared as u32);
+                                w.put_var_bytes(&key.as_bytes()[shared..]);
+                                w.put_var_bytes(val.as_bytes());
+                                prev = key.as_bytes();
+                            }
+                        } else {
+                            w.put_u32(counts[s] as u32);
+                            for &i in chain {
+                                let (key, val) = pairs[i as usize];
+                                w.put_str(key);
+                                w.put_str(val);
+                            }
+                        }
+                        assert_eq!(w.pos, chain_start[s + 1] - data_base);
+                    }
+                });
+                index = index_rest;
+                data = data_rest;
+                order = order_rest;
+                data_base += end;
+                s0 = s1;
+            }
+        });
+
+        let checksum = table::checksum(body);
+        let header_bytes = Header::new(self.format, self.key_hash, slots, filter_blocks, size, checksum);
+        header.copy_from_slice(header_bytes.as_bytes());
+
+        let n_chains = counts.iter().filter(|&&c| c > 0).count();
+        println!("  size: {:.1} Mb", size as f64 / (1024.0 * 1024.0));
+        print_filter_size(filter_size, pairs.len());
+        println!("  avg chain: {:.1}", pairs.len() as f64 / n_chains as f64);
+        println!("  max chain: {}", counts.iter().max().unwrap_or(&0));
+        size
+    }
+
+    // Bucketed format; see table.rs for the layout.
+    fn build_bucketed(&self, pairs: &[(&str, &str)], hashes: &[u64], file: &File) -> usize {
+        let n_buckets = cmp::max(pairs.len() / BUCKET_LOAD, 1).next_power_of_two();
+
+        // Counting pass: pairs are packed in input order.
+        let mut pair_offsets = Vec::with_capacity(pairs.len() + 1);
+        let mut offset = 0usize;
+        for (key, val) in pairs {
+            assert!(key.len() <= u16::MAX as usize);
+            pair_offsets.push(offset);
+            offset += key.len() + 4 + val.len();
+        }
+        pair_offsets.push(offset);
+        assert!(offset <= u32::MAX as usize, "lookup table too large for u32 offsets");
+
+        let filter_blocks = table::filter_blocks(pairs.len(), self.filter_bits);
+        let filter_size = filter_blocks * FILTER_BLOCK_SIZE;
+        let size = HEADER_SIZE + filter_size + n_buckets * BUCKET_SIZE + offset;
+        let mut out = MappedOutput::new(file, size);
+        let buf = out.bytes();
+        let (header, body) = buf.split_at_mut(HEADER_SIZE);
+        let (filter, rest) = body.split_at_mut(filter_size);
+        build_filter(filter, hashes);
+        let (bucket_bytes, mut data) = rest.split_at_mut(n_buckets * BUCKET_SIZE);
+        // The mapping is page aligned and the header and filter blocks fill cache lines, so this
+        // is aligned.
+        let buckets = unsafe { slice::from_raw_parts_mut(bucket_bytes.as_mut_ptr() as *mut Bucket, n_buckets) };
+
+        let mut sum_probes = 0usize;
+        let mut max_probes = 0usize;
+        thread::scope(|sc| {
+            // Worker threads copy the pairs into place..
+            let per_thread = (pairs.len() + self.threads - 1) / cmp::max(self.threads, 1);
+            let mut p0 = 0;
+            while p0 < pairs.len() {
+                let p1 = cmp::min(p0 + per_thread, pairs.len());
+                let (part, rest) = data.split_at_mut(pair_offsets[p1] - pair_offsets[p0]);
+                let chunk = &pairs[p0..p1];
+                sc.spawn(move || {
+                    let mut w = Writer { buf: part, pos: 0 };
+                    for (key, val) in chunk {
+                        w.put_bytes(key.as_bytes());
+                        w.put_str(val);
+                    }
+                });
+                data = rest;
+                p0 = p1;
+            }
+
+            // ..while this one fills in the buckets, which needs the sequential probe order.
+            for (i, &hash) in hashes.iter().enumerate() {
+                let mut b = table::home_bucket(hash, n_buckets);
+                let mut probes = 1;
+                let e = loop {
+                    if let Some(e) = buckets[b].fp.iter().position(|&f| f == 0) {
+                        break e;
+                    }
+                    b = (b + 1) & (n_buckets - 1);
+                    probes += 1;
+                };
+                buckets[b].fp[e] = table::fingerprint(hash);
+                buckets[b].off[e] = pair_offsets[i] as u32;
+                buckets[b].key_len[e] = pairs[i].0.len() as u16;
+                sum_probes += probes;
+                max_probes = cmp::max(probes, max_probes);
+            }
+        });
+
+        let checksum = table::checksum(body);
+        let header_bytes = Header::new(FORMAT_BUCKETED, self.key_hash, n_buckets, filter_blocks, size, checksum);
+        header.copy_from_slice(header_bytes.as_bytes());
+
+        println!("  size: {:.1} Mb", size as f64 / (1024.0 * 1024.0));
+        print_filter_size(filter_size, pairs.len());
+        println!("  buckets: {} ({:.0}% full)", n_buckets,
+                 100.0 * pairs.len() as f64 / (n_buckets * BUCKET_ENTRIES) as f64);
+        println!("  avg probes: {:.2}", sum_probes as f64 / pairs.len() as f64);
+        println!("  max probes: {}", max_probes);
+        size
+    }
+}
+
+// The packed size of a sorted chain of pairs; see table.rs.
+fn chain_size(pairs: &[(&str, &str)], chain: &[u32], compact: bool) -> usize {
+    if chain.is_empty() {
+        return 0;
+    }
+    if !compact {
+        return 4 + chain.iter().map(|&i| 8 + pairs[i as usize].0.len() + pairs[i as usize].1.len()).sum::<usize>();
+    }
+    let mut size = table::varint_len(chain.len() as u32);
+    let mut prev: &[u8] = &[];
+    for &i in chain {
+        let (key, val) = pairs[i as usize];
+        let shared = table::common_prefix(prev, key.as_bytes());
+        let suffix_len = key.len() - shared;
+        size += table::varint_len(shared as u32) + table::varint_len(suffix_len as u32) + suffix_len;
+        size += table::varint_len(val.len() as u32) + val.len();
+        prev = key.as_bytes();
+    }
+    size
+}
+
+// Sets every key's bits in the (zeroed) filter following the header.
+fn build_filter(filter: &mut [u8], hashes: &[u64]) {
+    // The filter starts a cache line into the page-aligned mapping.
+    let blocks = unsafe {
+        slice::from_raw_parts_mut(filter.as_mut_ptr() as *mut FilterBlock, filter.len() / FILTER_BLOCK_SIZE)
+    };
+    if !blocks.is_empty() {
+        for &hash in hashes {
+            table::filter_insert(blocks, hash);
+        }
+    }
+}
+
+fn print_filter_size(filter_size: usize, n_keys: usize) {
+    if filter_size > 0 {
+        println!("  filter: {:.1} Kb ({:.1} bits/key)", filter_size as f64 / 1024.0,
+                 (filter_size * 8) as f64 / n_keys as f64);
+    }
+}
+
+// Returns the page size of the hugetlbfs mount holding 'file', or None for other filesystems.
+pub fn hugetlbfs_page_size(file: &File) -> Option<usize> {
+    let mut fs: libc::statfs = unsafe { std::mem::zeroed() };
+    assert!(unsafe { libc::fstatfs(file.as_raw_fd(), &mut fs) } == 0, "fstatfs failed");
+    if fs.f_type as i64 == HUGETLBFS_MAGIC {
+        Some(fs.f_bsize as usize)
+    } else {
+        None
+    }
+}
+
+const HUGETLBFS_MAGIC: i64 = 0x9584_58f6;
+
+// A writable shared mapping of the whole output file. Files on hugetlbfs can only be written
+// through a mapping, and are padded out to a whole number of huge pages.
+struct MappedOutput {
+    ptr: *mut u8,
+    size: usize,
+    mapped: usize,
+}
+
+impl MappedOutput {
+    fn new(file: &File, size: usize) -> Self {
+        let page = hugetlbfs_page_size(file).unwrap_or(1);
+        let mapped = (size + page - 1) / page * page;
+        file.set_len(0).unwrap();
+        file.set_len(mapped as u64).unwrap();
+        let ptr = unsafe {
+            libc::mmap(std::ptr::null_mut(), mapped, PROT_READ | PROT_WRITE, MAP_SHARED, file.as_raw_fd(), 0)
+        };
+        assert!(ptr != MAP_FAILED, "mmap failed for lookup table output");
+        Self { ptr: ptr as *mut u8, size, mapped }
+    }
+
+    fn bytes(&mut self) -> &mut [u8] {
+        unsafe { slice::from_raw_parts_mut(self.ptr, self.size) }
+    }
+}
+
+impl Drop for MappedOutput {
+    fn drop(&mut self) {
+        unsafe {
+            if libc::munmap(self.ptr as *mut libc::c_void, self.mapped) == -1 {
+                println!("munmap failed for lookup table output");
+            }
+        }
+    }
+}
+
+// Appends little-endian u32s, LEB128 varints and packed strings (u32 or varint length followed by
+// bytes) to a buffer.
+struct Writer<'a> {
+    buf: &'a mut [u8],
+    pos: usize,
+}
+
+impl Writer<'_> {
+    fn put_bytes(&mut self, bytes: &[u8]) {
+        self.buf[self.pos..self.pos + bytes.len()].copy_from_slice(bytes);
+        self.pos += bytes.len();
+    }
+
+    fn put_u32(&mut self, val: u32) {
+        self.put_bytes(&val.to_le_bytes());
+    }
+
+    fn put_str(&mut self, s: &str) {
+        self.put_u32(s.len() as u32);
+        self.put_bytes(s.as_bytes());
+    }
+
+    fn put_varint(&mut self, mut val: u32) {
+        while val >= 0x80 {
+            self.buf[self.pos] = val as u8 | 0x80;
+            self.pos += 1;
+            val >>= 7;
+        }
+        self.buf[self.pos] = val as u8;
+        self.pos += 1;
+    }
+
+    fn put_var_bytes(&mut self, bytes: &[u8]) {
+        self.put_varint(bytes.len() as u32);
+        self.put_bytes(bytes);
+    }
+}
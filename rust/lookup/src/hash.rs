@@ -0,0 +1,133 @@
+//
+// Copyright 2022 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Seeded key hashes shared by the host (main.rs) and the wasm reader. The id and seed used to
+// build a table are recorded in its header, so both sides must produce identical results on
+// 64-bit hosts and wasm32.
+
+#![allow(dead_code)]
+
+use std::{collections::hash_map::DefaultHasher, hash::Hasher};
+
+// SipHash-1-3 via std's DefaultHasher, keyed by writing the seed first.
+pub const HASH_SIP: u32 = 1;
+// wyhash (final version 4).
+pub const HASH_WYHASH: u32 = 2;
+// 64-bit FNV-1a, with the seed folded into the offset basis.
+pub const HASH_FNV1A: u32 = 3;
+
+pub const HASHES: [(&str, u32); 3] = [("sip", HASH_SIP), ("wyhash", HASH_WYHASH), ("fnv1a", HASH_FNV1A)];
+
+#[derive(Clone, Copy, Debug)]
+pub struct KeyHash {
+    pub id: u32,
+    pub seed: u64,
+}
+
+impl KeyHash {
+    pub fn hash(&self, key: &[u8]) -> u64 {
+        match self.id {
+            HASH_SIP => sip(key, self.seed),
+            HASH_WYHASH => wyhash(key, self.seed),
+            HASH_FNV1A => fnv1a(key, self.seed),
+            _ => panic!("unknown hash id {}", self.id),
+        }
+    }
+}
+
+pub fn name(id: u32) -> &'static str {
+    HASHES.iter().find(|(_, h)| *h == id).map(|(n, _)| *n).unwrap_or("unknown")
+}
+
+pub fn sip(key: &[u8], seed: u64) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    hasher.write_u64(seed);
+    hasher.write(key);
+    hasher.finish()
+}
+
+pub fn fnv1a(key: &[u8], seed: u64) -> u64 {
+    let mut hash = 0xcbf2_9ce4_8422_2325 ^ seed;
+    for &b in key {
+        hash = (hash ^ b as u64).wrapping_mul(0x0000_0100_0000_01b3);
+    }
+    hash
+}
+
+const WY: [u64; 4] = [0xa076_1d64_78bd_642f, 0xe703_7ed1_a0b4_28db, 0x8ebc_6af0_9c88_c6e3, 0x5899_65cc_7537_4cc3];
+
+fn wymum(a: u64, b: u64) -> (u64, u64) {
+    let r = a as u128 * b as u128;
+    (r as u64, (r >> 64) as u64)
+}
+
+fn wymix(a: u64, b: u64) -> u64 {
+    let (lo, hi) = wymum(a, b);
+    lo ^ hi
+}
+
+fn wyr8(p: &[u8]) -> u64 {
+    u64::from_le_bytes([p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]])
+}
+
+fn wyr4(p: &[u8]) -> u64 {
+    u32::from_le_bytes([p[0], p[1], p[2], p[3]]) as u64
+}
+
+fn wyr3(p: &[u8], k: usize) -> u64 {
+    ((p[0] as u64) << 16) | ((p[k >> 1] as u64) << 8) | p[k - 1] as u64
+}
+
+pub fn wyhash(key: &[u8], seed: u64) -> u64 {
+    let len = key.len();
+    let mut seed = seed ^ wymix(seed ^ WY[0], WY[1]);
+    let (mut a, mut b);
+    if len <= 16 {
+        if len >= 4 {
+            let q = (len >> 3) << 2;
+            a = (wyr4(key) << 32) | wyr4(&key[q..]);
+            b = (wyr4(&key[len - 4..]) << 32) | wyr4(&key[len - 4 - q..]);
+        } else if len > 0 {
+            a = wyr3(key, len);
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        let mut p = key;
+        if p.len() > 48 {
+            let (mut see1, mut see2) = (seed, seed);
+            while p.len() > 48 {
+                seed = wymix(wyr8(p) ^ WY[1], wyr8(&p[8..]) ^ seed);
+                see1 = wymix(wyr8(&p[16..]) ^ WY[2], wyr8(&p[24..]) ^ see1);
+                see2 = wymix(wyr8(&p[32..]) ^ WY[3], wyr8(&p[40..]) ^ see2);
+                p = &p[48..];
+            }
+            seed ^= see1 ^ see2;
+        }
+        while p.len() > 16 {
+            seed = wymix(wyr8(p) ^ WY[1], wyr8(&p[8..]) ^ seed);
+            p = &p[16..];
+        }
+        a = wyr8(&key[len - 16..]);
+        b = wyr8(&key[len - 8..]);
+    }
+    a ^= WY[1];
+    b ^= seed;
+    let (lo, hi) = wymum(a, b);
+    wymix(lo ^ WY[0] ^ len as u64, hi ^ WY[1])
+}
@@ -13,14 +13,25 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
-use argparse::{ArgumentParser, Store};
-use libc::{MAP_FIXED, MAP_SHARED, O_CREAT, O_RDWR, O_TRUNC, PROT_READ, S_IRUSR, S_IWUSR};
+mod builder;
+mod hash;
+mod table;
+
+use argparse::{ArgumentParser, Store, StoreTrue};
+use libc::{
+    MAP_ANONYMOUS, MAP_FAILED, MAP_FIXED, MAP_PRIVATE, MAP_SHARED, O_CREAT, O_RDWR, O_TRUNC, PROT_READ,
+    PROT_WRITE, S_IRUSR, S_IWUSR,
+};
 use rand::{distributions::{Alphanumeric, Distribution, Uniform}, Rng};
 use std::{
-    collections::{hash_map::DefaultHasher, HashMap}, cmp, ffi::CString, fs::File,
-    hash::Hasher, io::{prelude::*, SeekFrom}, mem, ops::RangeInclusive,
-    os::unix::io::{AsRawFd, FromRawFd}, str, time::SystemTime,
+    collections::HashMap, ffi::CString, fs::{self, File, OpenOptions}, io::prelude::*, mem,
+    ops::RangeInclusive, os::unix::{fs::MetadataExt, io::{AsRawFd, FromRawFd}}, ptr, slice, str,
+    sync::{atomic::{AtomicU32, Ordering}, Arc, Barrier},
+    thread, time::{Duration, Instant, SystemTime},
 };
+use builder::Builder;
+use hash::{KeyHash, HASHES};
+use table::{Control, ControlSlot, Header, FORMATS, HEADER_SIZE};
 use wasmi::{
     Error, Externals, FuncInstance, FuncRef, ImportsBuilder, LittleEndianConvert, MemoryRef,
     Module, ModuleImportResolver, ModuleInstance, ModuleRef, RuntimeArgs, RuntimeValue,
@@ -28,15 +39,27 @@ use wasmi::{
 };
 
 const PAGE_SIZE: usize = 4096;
+const HUGE_PAGE_SIZE: usize = 2 * 1024 * 1024;
 const MMAP_NAME: &str = "/lookup";
 const KEY_SIZE: RangeInclusive<usize> = 5..=40;
 const VAL_SIZE: RangeInclusive<usize> = 10..=200;
 
+
 struct Params {
     lookup_entries: usize,
     index_slots: usize,
+    format: String,
+    filter_bits: usize,
+    hash: String,
     test_keys: i32,
     default_msg_bytes: i32,
+    batch_size: i32,
+    threads: usize,
+    chunk_size: usize,
+    updates: usize,
+    output: String,
+    input: String,
+    huge: bool,
     module_name: String,
 }
 
@@ -49,8 +72,18 @@ fn main() {
     let mut params = Params {
         lookup_entries: 1_000_000,
         index_slots: 128 * 1024,
+        format: String::from("chained"),
+        filter_bits: 0,
+        hash: String::from("all"),
         test_keys: 10_000,
         default_msg_bytes: 100,
+        batch_size: 64,
+        threads: 0,
+        chunk_size: 1,
+        updates: 0,
+        output: String::default(),
+        input: String::default(),
+        huge: false,
         module_name: String::default(),
     };
     {
@@ -58,11 +91,35 @@ fn main() {
         ap.refer(&mut params.lookup_entries)
             .add_option(&["-e"], Store, "number of key/value entries in the lookup table");
         ap.refer(&mut params.index_slots)
-            .add_option(&["-s"], Store, "number of hash slots in the lookup table");
+            .add_option(&["-s"], Store, "number of hash slots in the lookup table (chained and compact formats)");
+        ap.refer(&mut params.format)
+            .add_option(&["-f"], Store, "lookup table format: chained, bucketed or compact");
+        ap.refer(&mut params.filter_bits)
+            .add_option(&["-F"], Store, "bits per key of a blocked Bloom filter checked before lookups (0 for none)");
+        ap.refer(&mut params.hash)
+            .add_option(&["-H"], Store, "key hash: sip, wyhash, fnv1a or all (to compare them)");
         ap.refer(&mut params.test_keys)
             .add_option(&["-k"], Store, "number of test keys to use");
         ap.refer(&mut params.default_msg_bytes)
             .add_option(&["-m"], Store, "default size of message buffer for external lookup calls");
+        ap.refer(&mut params.batch_size)
+            .add_option(&["-b"], Store, "number of keys per batched external lookup call");
+        ap.refer(&mut params.threads)
+            .add_option(&["-t"], Store,
+                        "run the tests on this many threads, each with its own wasm instance and -k keys");
+        ap.refer(&mut params.chunk_size)
+            .add_option(&["-c"], Store,
+                        "number of keys per timed chunk for latency percentiles (with -t); above 1, the \
+                         percentiles are of each chunk's mean latency");
+        ap.refer(&mut params.updates)
+            .add_option(&["-u"], Store, "number of live table updates to publish after the tests (without -t)");
+        ap.refer(&mut params.output)
+            .add_option(&["-o"], Store, "store the lookup table in this file for later runs (needs a single -H hash)");
+        ap.refer(&mut params.input)
+            .add_option(&["-i"], Store, "load a lookup table stored with -o instead of building one");
+        ap.refer(&mut params.huge)
+            .add_option(&["--huge"], StoreTrue,
+                        "map the lookup table with transparent huge pages (implied for files on hugetlbfs)");
         ap.refer(&mut params.module_name)
             .add_argument("module_name", Store, "wasm module to run")
             .required();
@@ -71,62 +128,283 @@ fn main() {
         }
     }
 
-    println!("Loading wasm module");
-    let instance = load_wasm_module(&params.module_name);
+    if !params.input.is_empty() {
+        // The stored table's header determines its format and hash.
+        println!("Loading lookup table: {}", params.input);
+        let table_file = File::open(&params.input)
+            .unwrap_or_else(|e| panic!("failed to open '{}': {}", params.input, e));
+        let time = SystemTime::now();
+        let (key_hash, lookup, test_keys) = load_table(&table_file, num_test_keys(&params));
+        let lookup = Arc::new(lookup);
+        println!("  loaded {} entries in {:.2?}", lookup.len(), time.elapsed().unwrap());
+        run_tests(&params, &table_file, key_hash, &lookup, &test_keys);
+        return;
+    }
+
+    let format = match FORMATS.iter().find(|&&(n, _)| n == params.format) {
+        Some(&(_, id)) => id,
+        None => panic!("unknown lookup table format '{}'", params.format),
+    };
+
+    let hash_ids: Vec<u32> = match params.hash.as_str() {
+        "all" => HASHES.iter().map(|&(_, id)| id).collect(),
+        name => match HASHES.iter().find(|&&(n, _)| n == name) {
+            Some(&(_, id)) => vec![id],
+            None => panic!("unknown hash '{}'", name),
+        },
+    };
+
+    if !params.output.is_empty() && hash_ids.len() > 1 {
+        panic!("-o stores a single table; select its hash with -H");
+    }
+
+    println!("Creating lookup table: {} entries", params.lookup_entries);
+    let (lookup, test_keys) = create_lookup(&params, num_test_keys(&params));
+    let lookup = Arc::new(lookup);
+
+    // The same table contents are stored and tested with each requested hash.
+    let seed = rand::thread_rng().gen::<u64>();
+    for id in hash_ids {
+        let key_hash = KeyHash { id, seed };
+        println!("\nStoring lookup table: {} format, {} hash", params.format, hash::name(id));
+        let table_file = if params.output.is_empty() {
+            create_shm_file()
+        } else {
+            create_table_file(&params.output)
+        };
+        let time = SystemTime::now();
+        Builder::new(format, key_hash, params.index_slots, params.filter_bits)
+            .build(lookup.iter().map(|(key, val)| (key.as_str(), val.as_str())), &table_file);
+        println!("  built in {:.2?}", time.elapsed().unwrap());
+        run_tests(&params, &table_file, key_hash, &lookup, &test_keys);
+    }
+}
+
+// Each thread needs its own set of test keys.
+fn num_test_keys(params: &Params) -> usize {
+    params.test_keys as usize * params.threads.max(1)
+}
 
-    println!("Creating lookup table: {} entries, {} slots", params.lookup_entries, params.index_slots);
-    let (lookup, test_keys) = create_lookup(&params);
+fn run_tests(
+    params: &Params,
+    table_file: &File,
+    key_hash: KeyHash,
+    lookup: &Arc<HashMap<String, String>>,
+    test_keys: &[String],
+) {
+    let views = Arc::new(index_values(table_file));
+    if params.threads > 0 {
+        return run_threaded_tests(params, table_file, key_hash, lookup, &views, test_keys);
+    }
 
-    println!("Storing lookup table");
-    let shm_file = store_lookup(&lookup, &params);
+    println!("Loading wasm module");
+    let instance = load_wasm_module(&params.module_name);
 
     let mut ctx = Context {
         instance: &instance,
-        lookup,
+        lookup: lookup.clone(),
+        views,
+        buffer_index: 0,
         buffer: std::ptr::null_mut(),
         buffer_size: 0,
+        slots: TableSlots::default(),
         wasm_context: I32(0),
     };
 
     println!("Storing test keys");
-    let test_keys_index = store_test_keys(&ctx, &test_keys);
+    let test_keys_index = store_test_keys(&ctx, test_keys);
 
     println!("Initializing wasm module");
-    initialise_wasm(&mut ctx, &params, &shm_file, test_keys_index, test_keys.len() as i32);
+    initialise_wasm(&mut ctx, params, table_file, test_keys, test_keys_index);
     wasm_call(&ctx, "verify_lookups", &[ctx.wasm_context]);
 
-    println!("Running performance tests: {} reps", params.test_keys);
+    println!("Running performance tests: {} reps", test_keys.len());
     let time = SystemTime::now();
     wasm_call(&ctx, "performance_test_internal", &[ctx.wasm_context]);
     let duration_int = time.elapsed().unwrap();
-    println!("  internal: {:.2?}", duration_int);
+    println!("  internal ({}): {:.2?}", hash::name(key_hash.id), duration_int);
 
     let time = SystemTime::now();
     wasm_call(&ctx, "performance_test_external", &[ctx.wasm_context]);
     let duration_ext = time.elapsed().unwrap();
     println!("  external: {:.2?}", duration_ext);
-    println!("  speed up: {:.1}x", duration_ext.as_micros() as f32 / duration_int.as_micros() as f32);
+
+    let time = SystemTime::now();
+    wasm_call(&ctx, "performance_test_external_batch", &[ctx.wasm_context]);
+    let duration_batch = time.elapsed().unwrap();
+    println!("  external (batches of {}): {:.2?}", params.batch_size, duration_batch);
+
+    let time = SystemTime::now();
+    wasm_call(&ctx, "performance_test_view", &[ctx.wasm_context]);
+    let duration_view = time.elapsed().unwrap();
+    println!("  host-indexed (zero-copy): {:.2?}", duration_view);
+    println!("  speed up: {:.1}x, {:.1}x vs batched, {:.1}x vs host-indexed",
+             duration_ext.as_micros() as f32 / duration_int.as_micros() as f32,
+             duration_batch.as_micros() as f32 / duration_int.as_micros() as f32,
+             duration_view.as_micros() as f32 / duration_int.as_micros() as f32);
+
+    if params.updates > 0 {
+        run_updates(&mut ctx, params, key_hash);
+    }
+}
+
+// Timings for one thread's pass over its test keys.
+struct PhaseTimes {
+    elapsed: Duration,
+    // Average per-lookup latency of each chunk of keys, sorted. Chunks are single keys by default.
+    latencies: Vec<Duration>,
+}
+
+impl PhaseTimes {
+    fn percentile(&self, p: usize) -> Duration {
+        self.latencies[(self.latencies.len() - 1) * p / 100]
+    }
+}
+
+// Runs the internal and external lookup tests concurrently on 'params.threads' threads. Each
+// thread has its own wasm instance with the same table file mapped into its linear memory, and
+// looks up a disjoint set of keys.
+fn run_threaded_tests(
+    params: &Params,
+    table_file: &File,
+    key_hash: KeyHash,
+    lookup: &Arc<HashMap<String, String>>,
+    views: &Arc<ValueViews>,
+    test_keys: &[String],
+) {
+    let n_threads = params.threads;
+    let keys_per_thread = test_keys.len() / n_threads;
+    assert!(keys_per_thread > 0, "not enough test keys for {} threads", n_threads);
+    assert!(params.chunk_size > 0);
+    println!("Running threaded tests: {} threads, {} keys each, {} hash",
+             n_threads, keys_per_thread, hash::name(key_hash.id));
+
+    // All threads start each phase together, then hold their instances until memory use has
+    // been sampled.
+    const PHASES: [(&str, &str); 3] = [
+        ("internal", "performance_test_internal_range"),
+        ("external", "performance_test_external_range"),
+        ("host-indexed", "performance_test_view_range"),
+    ];
+    let barrier = Barrier::new(n_threads + 1);
+    let (results, memory) = thread::scope(|s| {
+        let handles: Vec<_> = test_keys
+            .chunks_exact(keys_per_thread)
+            .take(n_threads)
+            .map(|keys| {
+                let barrier = &barrier;
+                s.spawn(move || {
+                    let instance = load_wasm_module(&params.module_name);
+                    let mut ctx = Context {
+                        instance: &instance,
+                        lookup: lookup.clone(),
+                        views: views.clone(),
+                        buffer_index: 0,
+                        buffer: std::ptr::null_mut(),
+                        buffer_size: 0,
+                        slots: TableSlots::default(),
+                        wasm_context: I32(0),
+                    };
+                    let test_keys_index = store_test_keys(&ctx, keys);
+                    initialise_wasm(&mut ctx, params, table_file, keys, test_keys_index);
+                    wasm_call(&ctx, "verify_lookups", &[ctx.wasm_context]);
+
+                    let mut times = Vec::new();
+                    for (_, export) in PHASES {
+                        barrier.wait();
+                        let start = Instant::now();
+                        let mut latencies = Vec::new();
+                        for first in (0..keys.len()).step_by(params.chunk_size) {
+                            let count = params.chunk_size.min(keys.len() - first);
+                            let time = Instant::now();
+                            wasm_call(&ctx, export, &[ctx.wasm_context, I32(first as i32), I32(count as i32)]);
+                            latencies.push(time.elapsed() / count as u32);
+                        }
+                        let elapsed = start.elapsed();
+                        latencies.sort();
+                        times.push(PhaseTimes { elapsed, latencies });
+                    }
+                    barrier.wait();
+                    barrier.wait();
+                    times
+                })
+            })
+            .collect();
+        for _ in PHASES {
+            barrier.wait();
+        }
+        barrier.wait();
+        let memory = memory_usage();
+        barrier.wait();
+        let results: Vec<Vec<PhaseTimes>> = handles.into_iter().map(|h| h.join().unwrap()).collect();
+        (results, memory)
+    });
+
+    // Percentiles over chunk means hide the tail, so say so when chunks hold more than one key.
+    let label = if params.chunk_size == 1 { "" } else { "chunk-mean " };
+    for (p, (name, _)) in PHASES.iter().enumerate() {
+        let slowest = results.iter().map(|r| r[p].elapsed).max().unwrap();
+        let rate = (keys_per_thread * n_threads) as f64 / slowest.as_secs_f64();
+        println!("  {}: {:.0} lookups/s aggregate, {:.2?} wall time", name, rate, slowest);
+        for (t, r) in results.iter().enumerate() {
+            println!("    thread {:2}: {}p50 {:.2?}  {}p99 {:.2?}  ({:.2?})",
+                     t, label, r[p].percentile(50), label, r[p].percentile(99), r[p].elapsed);
+        }
+    }
+    println!("  memory: {}", memory);
+}
+
+// Summarises the process's resident memory from /proc/self/status. The mapped table pages are
+// shared between all instances, so they only count once in RssFile/RssShmem.
+fn memory_usage() -> String {
+    let mut status = String::new();
+    File::open("/proc/self/status").unwrap().read_to_string(&mut status).unwrap();
+    status
+        .lines()
+        .filter(|line| ["VmRSS:", "RssAnon:", "RssFile:", "RssShmem:"].iter().any(|f| line.starts_with(f)))
+        .map(|line| line.split_whitespace().collect::<Vec<_>>().join(" "))
+        .collect::<Vec<_>>()
+        .join(", ")
 }
 
+// Locations of each key's value within the serialized table, as (offset, len).
+type ValueViews = HashMap<String, (u32, u32)>;
+
 struct Context<'a> {
     instance: &'a ModuleInstance,
-    lookup: HashMap<String, String>,
+    lookup: Arc<HashMap<String, String>>,
+    views: Arc<ValueViews>,
+    // Linear memory index of the mapped table.
+    buffer_index: u32,
     buffer: cptr,
     buffer_size: usize,
+    slots: TableSlots,
     wasm_context: RuntimeValue,
 }
 
+// Space reserved in linear memory for mapping tables, plus the live update state.
+#[derive(Default)]
+struct TableSlots {
+    // Location of linear memory in our address space.
+    memory_base: usize,
+    // (index, size) of each reservation; only the first is used without live updates.
+    reserved: Vec<(usize, usize)>,
+    align: usize,
+    advise_huge: bool,
+    // The current table's file, for remapping if linear memory moves.
+    file: Option<File>,
+    // Linear memory index of the table::Control block, or 0 without live updates.
+    control: usize,
+    epoch: u32,
+}
+
 impl Drop for Context<'_> {
     fn drop(&mut self) {
         if self.buffer != std::ptr::null_mut() {
             assert!(self.buffer_size > 0);
-            let cname = CString::new(MMAP_NAME).unwrap();
             unsafe {
                 if libc::munmap(self.buffer, self.buffer_size) == -1 {
-                    println!("munmap failed for shared_ro");
-                }
-                if libc::shm_unlink(cname.as_ptr()) == -1 {
-                    println!("shm_unlink failed for shared_rw");
+                    println!("munmap failed for lookup table");
                 }
             }
         }
@@ -143,59 +421,36 @@ fn load_wasm_module(module_name: &str) -> ModuleRef {
         .assert_no_start()
 }
 
-fn create_lookup(params: &Params) -> (HashMap<String, String>, Vec<u8>) {
-    let mut lookup = HashMap::new();
-    let mut test_keys = Vec::new();
-    let mut test_key_count = 0;
+fn create_lookup(params: &Params, num_test_keys: usize) -> (HashMap<String, String>, Vec<String>) {
+    let mut lookup = HashMap::with_capacity(params.lookup_entries);
+    let mut test_keys = Vec::with_capacity(num_test_keys);
     let mut rng = rand::thread_rng();
     let key_dist = Uniform::<usize>::from(KEY_SIZE);
     let val_dist = Uniform::<usize>::from(VAL_SIZE);
     for _ in 0..params.lookup_entries {
-        let key: String = rand::thread_rng()
+        let key_len = key_dist.sample(&mut rng);
+        let key: String = (&mut rng)
             .sample_iter(&Alphanumeric)
-            .take(key_dist.sample(&mut rng))
+            .take(key_len)
             .map(char::from)
             .collect();
 
-        let val: String = rand::thread_rng()
+        let val_len = val_dist.sample(&mut rng);
+        let val: String = (&mut rng)
             .sample_iter(&Alphanumeric)
-            .take(val_dist.sample(&mut rng))
+            .take(val_len)
             .map(char::from)
             .collect();
 
-        if test_key_count < params.test_keys {
-            test_keys.extend((key.len() as u32).to_le_bytes());
-            test_keys.extend(key.as_bytes());
-            test_key_count += 1;
+        if test_keys.len() < num_test_keys {
+            test_keys.push(key.clone());
         }
         lookup.insert(key, val);
     }
     (lookup, test_keys)
 }
 
-// The lookup table is serialized with the following format:
-//
-//  | index table | bumper | packed chains |
-//
-// index table: list of u32 offsets into packed data (starting from end of the index table)
-// bumper: a single unused byte so offsets of 0 can indicate an empty slot in the index table
-// packed chains: a sequence of chains per used index slot; each chain has the format:
-//
-//  | n_pairs:u32 | key_len:u32 | key | value_len:u32 | value | key_len | ... |
-//
-// Keys are stored in ascending size order to enable a slightly faster lookup on the wasm side.
-fn store_lookup(lookup: &HashMap<String, String>, params: &Params) -> File {
-    // Convert the map to a table with vectors of key/value pairs.
-    let mut table = Vec::<Vec<KeyValue>>::with_capacity(params.index_slots);
-    table.resize(params.index_slots, Vec::new());
-    for (key, val) in lookup.iter() {
-        let mut hasher = DefaultHasher::new();
-        hasher.write(key.as_bytes());
-        let i = (hasher.finish() as usize) % params.index_slots;
-        table[i].push(KeyValue(key.to_string(), val.to_string()));
-    }
-
-    // Create the shared memory file.
+fn create_shm_file() -> File {
     let cname = CString::new(MMAP_NAME).unwrap();
     let fd = unsafe {
         libc::shm_open(cname.as_ptr(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR)
@@ -203,154 +458,322 @@ fn store_lookup(lookup: &HashMap<String, String>, params: &Params) -> File {
     if fd == -1 {
         panic!("shm_open failed");
     }
-    let mut file = unsafe { File::from_raw_fd(fd) };
-
-    // Zero out the index table, adding a single bumper byte after it to allow indexes
-    // of zero to indicate an empty slot.
-    file.set_len((params.index_slots * 4 + 1) as u64).unwrap();
-
-    // Pack the key/value pairs onto the end of the file, tracking offsets (from the
-    // start of the packed region, not the file) in the index table.
-    let mut offset = 1u32;
-    let mut num_chains = 0usize;
-    let mut sum_chain = 0usize;
-    let mut max_chain = 0usize;
-    for i in 0..params.index_slots {
-        if table[i].len() > 0 {
-            table[i].sort();
-            let list = &table[i];
-
-            // Update index table with current offset.
-            file.seek(SeekFrom::Start((i * 4) as u64)).unwrap();
-            write_u32(&mut file, offset);
-
-            // Append the list of key/value pairs to the file.
-            file.seek(SeekFrom::End(0)).unwrap();
-            offset += write_u32(&mut file, list.len() as u32);
-            for KeyValue(key, val) in list {
-                let kbytes = key.as_bytes();
-                offset += write_u32(&mut file, kbytes.len() as u32);
-                offset += write_bytes(&mut file, kbytes);
-
-                let vbytes = val.as_bytes();
-                offset += write_u32(&mut file, vbytes.len() as u32);
-                offset += write_bytes(&mut file, vbytes);
-            }
-            num_chains += 1;
-            sum_chain += list.len();
-            max_chain = cmp::max(list.len(), max_chain);
-        }
-    }
-    file.flush().unwrap();
-
-    println!("  size: {:.1} Mb", file.metadata().unwrap().len() as f64 / (1024.0 * 1024.0));
-    println!("  avg chain: {:.1}", sum_chain as f64 / num_chains as f64);
-    println!("  max chain: {}", max_chain);
-    file
-}
-
-#[derive(Debug, Clone)]
-struct KeyValue(String, String);
-
-impl Ord for KeyValue {
-    fn cmp(&self, other: &Self) -> cmp::Ordering {
-        if self.0 < other.0 {
-            cmp::Ordering::Less
-        } else if self.0 > other.0 {
-            cmp::Ordering::Greater
-        } else {
-            self.1.cmp(&other.1)
-        }
+    // The table only needs to outlive this run, so drop the name straight away.
+    if unsafe { libc::shm_unlink(cname.as_ptr()) } == -1 {
+        println!("shm_unlink failed for lookup table");
     }
+    unsafe { File::from_raw_fd(fd) }
 }
 
-impl PartialOrd for KeyValue {
-    fn partial_cmp(&self, other: &Self) -> Option<cmp::Ordering> {
-        Some(self.cmp(other))
-    }
+fn create_table_file(path: &str) -> File {
+    OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .open(path)
+        .unwrap_or_else(|e| panic!("failed to create '{}': {}", path, e))
 }
 
-impl Eq for KeyValue {}
-
-impl PartialEq for KeyValue {
-    fn eq(&self, other: &Self) -> bool {
-        self.0 == other.0 && self.1 == other.1
-    }
+// Checks a table stored by an earlier run and recovers its contents, which the host needs to
+// serve external lookups. The wasm module maps the file itself, so the table isn't rebuilt, but
+// this still reads the whole file: once for the checksum and once to copy every pair into the
+// host's map.
+fn load_table(table_file: &File, num_test_keys: usize) -> (KeyHash, HashMap<String, String>, Vec<String>) {
+    with_table_bytes(table_file, |bytes| {
+        assert!(bytes.len() >= HEADER_SIZE, "lookup table file is too small");
+        let header = unsafe { &*(bytes.as_ptr() as *const Header) };
+        header.validate(bytes.len());
+        assert!(table::checksum(&bytes[HEADER_SIZE..header.size as usize]) == header.checksum,
+                "lookup table checksum mismatch");
+        println!("  {} format, {} hash, {:.1} Mb", table::format_name(header.format),
+                 hash::name(header.hash), header.size as f64 / (1024.0 * 1024.0));
+
+        let mut lookup = HashMap::new();
+        let mut test_keys = Vec::with_capacity(num_test_keys);
+        table::for_each_pair(bytes, |key, val| {
+            let key = String::from_utf8(key.to_vec()).unwrap();
+            if test_keys.len() < num_test_keys {
+                test_keys.push(key.clone());
+            }
+            lookup.insert(key, String::from_utf8(val.to_vec()).unwrap());
+        });
+        (header.key_hash(), lookup, test_keys)
+    })
 }
 
-fn write_u32(file: &mut File, num: u32) -> u32 {
-    write_bytes(file, &num.to_le_bytes())
+// Records where each value is stored in the table, for host-indexed lookups.
+fn index_values(table_file: &File) -> ValueViews {
+    with_table_bytes(table_file, |bytes| {
+        let mut views = HashMap::new();
+        table::for_each_pair(bytes, |key, val| {
+            let offset = val.as_ptr() as usize - bytes.as_ptr() as usize;
+            views.insert(String::from_utf8(key.to_vec()).unwrap(), (offset as u32, val.len() as u32));
+        });
+        views
+    })
 }
 
-fn write_bytes(file: &mut File, bytes: &[u8]) -> u32 {
-    file.write_all(bytes).unwrap();
-    bytes.len() as u32
+// Temporarily maps the whole table file into the host's address space.
+fn with_table_bytes<R>(table_file: &File, f: impl FnOnce(&[u8]) -> R) -> R {
+    let file_size = table_file.metadata().unwrap().len() as usize;
+    let ptr = unsafe {
+        libc::mmap(std::ptr::null_mut(), file_size, PROT_READ, MAP_SHARED, table_file.as_raw_fd(), 0)
+    };
+    assert!(ptr != MAP_FAILED, "mmap failed for lookup table");
+    let res = f(unsafe { slice::from_raw_parts(ptr as *const u8, file_size) });
+    unsafe {
+        if libc::munmap(ptr, file_size) == -1 {
+            println!("munmap failed for lookup table");
+        }
+    }
+    res
 }
 
 // Store the test keys as "packed strings" (u32 length followed by utf8 bytes).
-fn store_test_keys(ctx: &Context, test_keys: &Vec<u8>) -> i32 {
-    let alloc_index = wasm_alloc(ctx, test_keys.len() as i32);
+fn store_test_keys(ctx: &Context, test_keys: &[String]) -> i32 {
+    let alloc_index = wasm_alloc(ctx, packed_size(test_keys) as i32);
     get_linear_memory(ctx).with_direct_access_mut(|buf| {
         let mut bi = alloc_index as usize;
-        for ki in 0..test_keys.len() {
-            buf[bi] = test_keys[ki];
-            bi += 1;
+        for key in test_keys {
+            set_u32(buf, bi, key.len() as u32);
+            buf[bi + 4..bi + 4 + key.len()].copy_from_slice(key.as_bytes());
+            bi += 4 + key.len();
         }
     });
     alloc_index
 }
 
+fn packed_size(test_keys: &[String]) -> usize {
+    test_keys.iter().map(|key| 4 + key.len()).sum()
+}
+
 // Set up the mapped buffer and create the wasm's context object.
 fn initialise_wasm(
     ctx: &mut Context,
     params: &Params,
-    shm_file: &File,
+    table_file: &File,
+    test_keys: &[String],
     test_keys_index: i32,
-    test_keys_bytes: i32,
 ) {
+    // Huge page mappings must start on a huge page boundary. Files on hugetlbfs always use huge
+    // pages; otherwise --huge requests transparent huge pages for the mapping.
+    let hugetlbfs_page = builder::hugetlbfs_page_size(table_file);
+    ctx.slots.align = hugetlbfs_page.unwrap_or(if params.huge { HUGE_PAGE_SIZE } else { PAGE_SIZE });
+    ctx.slots.advise_huge = params.huge && hugetlbfs_page.is_none();
+
     // Call wasm.malloc to reserve enough space for the mapped buffer plus alignment concerns.
-    ctx.buffer_size = shm_file.metadata().unwrap().len() as usize;
-    let alloc_size = ctx.buffer_size + 2 * PAGE_SIZE;
-    let wasm_alloc_index = wasm_alloc(ctx, alloc_size as i32);
+    // Live updates alternate between two reservations, with some room for the table to grow;
+    // both are made now so that later generations can be mapped without calling into the module.
+    let table_size = table_file.metadata().unwrap().len() as usize;
+    let (n_slots, capacity) = if params.updates > 0 {
+        (2, table_size + table_size / 4)
+    } else {
+        (1, table_size)
+    };
+    let alloc_size = capacity + 2 * ctx.slots.align;
+    for _ in 0..n_slots {
+        let wasm_alloc_index = wasm_alloc(ctx, alloc_size as i32);
+        ctx.slots.reserved.push((wasm_alloc_index as usize, alloc_size));
+    }
+    if params.updates > 0 {
+        ctx.slots.control = wasm_alloc(ctx, mem::size_of::<Control>() as i32) as usize;
+    }
+
+    // Get the location of wasm's linear memory buffer in our address space and map the table in.
+    ctx.slots.memory_base = get_linear_memory(ctx).with_direct_access(|buf| buf.as_ptr() as usize);
+    if ctx.slots.control != 0 {
+        unsafe { ptr::write(control_block(ctx), Control { epoch: AtomicU32::new(0), reader_epoch: AtomicU32::new(0),
+                                                          slots: [ControlSlot::default(); 2] }); }
+    }
+    map_table(ctx, 0, table_file);
 
-    // Get the location of wasm's linear memory buffer in our address space.
-    let wasm_memory_base = get_linear_memory(ctx).with_direct_access(|buf| buf.as_ptr() as usize);
-    let wasm_alloc_ptr = wasm_memory_base + wasm_alloc_index as usize;
+    // Inform the module of the buffer's wasm linear memory index; the table's header tells it how
+    // the buffer is laid out.
+    ctx.wasm_context = wasm_call(
+        ctx,
+        "create_context",
+        &[
+            I32(ctx.buffer_index as i32),
+            I32(ctx.buffer_size as i32),
+            I32(test_keys.len() as i32),
+            I32(test_keys_index),
+            I32(packed_size(test_keys) as i32),
+            I32(params.default_msg_bytes),
+            I32(params.batch_size),
+        ],
+    ).expect("create_context should return a context pointer");
+    check_memory(ctx);
+    if ctx.slots.control != 0 {
+        publish_slot(ctx, 0);
+        wasm_call(ctx, "attach_control", &[ctx.wasm_context, I32(ctx.slots.control as i32)]);
+    }
+}
 
-    // Align the buffer inside wasm's linear memory against our page boundaries and map it in.
-    let aligned_ptr = page_align(wasm_alloc_ptr);
+// Maps 'table_file' read-only into reservation 'slot' in wasm's linear memory, aligned against
+// our page boundaries, and makes it the current table.
+fn map_table(ctx: &mut Context, slot: usize, table_file: &File) {
+    let (index, size) = ctx.slots.reserved[slot];
+    let reserved_ptr = ctx.slots.memory_base + index;
+    let aligned_ptr = align_up(reserved_ptr, ctx.slots.align);
+    ctx.buffer_size = table_file.metadata().unwrap().len() as usize;
+    assert!(aligned_ptr + ctx.buffer_size <= reserved_ptr + size,
+            "lookup table ({} bytes) is too large for its reserved space", ctx.buffer_size);
     ctx.buffer = unsafe {
         libc::mmap(
             aligned_ptr as cptr,
             ctx.buffer_size,
             PROT_READ,
             MAP_FIXED | MAP_SHARED,
-            shm_file.as_raw_fd(),
+            table_file.as_raw_fd(),
             0,
         )
     };
     assert_eq!(ctx.buffer as usize, aligned_ptr);
+    if ctx.slots.advise_huge {
+        // For /dev/shm this needs shmem_enabled set to 'advise' (or higher), and for regular
+        // files a kernel with CONFIG_READ_ONLY_THP_FOR_FS; otherwise it has no effect.
+        if unsafe { libc::madvise(ctx.buffer, ctx.buffer_size, libc::MADV_HUGEPAGE) } == -1 {
+            println!("madvise(MADV_HUGEPAGE) failed for lookup table");
+        }
+    }
+    ctx.buffer_index = (aligned_ptr - ctx.slots.memory_base) as u32;
+    ctx.slots.file = Some(table_file.try_clone().unwrap());
+}
 
-    // Convert the aligned buffer location into its wasm linear memory index and inform the module.
-    let wasm_buf_index = (ctx.buffer as usize - wasm_memory_base) as i32;
-    let lookup_bytes = ctx.buffer_size - params.index_slots * 4;
-    ctx.wasm_context = wasm_call(
-        ctx,
-        "create_context",
-        &[
-            I32(wasm_buf_index),
-            I32(params.index_slots as i32),
-            I32(lookup_bytes as i32),
-            I32(params.test_keys),
-            I32(test_keys_index),
-            I32(test_keys_bytes),
-            I32(params.default_msg_bytes),
-        ],
-    ).expect("create_context should return a context pointer");
+fn control_block(ctx: &Context) -> *mut Control {
+    (ctx.slots.memory_base + ctx.slots.control) as *mut Control
+}
+
+// Records the current table's location in control block slot 'slot'.
+fn publish_slot(ctx: &Context, slot: usize) {
+    unsafe {
+        (*control_block(ctx)).slots[slot] = ControlSlot {
+            index: ctx.buffer_index,
+            bytes: ctx.buffer_size as u32,
+        };
+    }
 }
 
-fn page_align(ptr: usize) -> usize {
-    ((ptr - 1) & !(PAGE_SIZE - 1)) + PAGE_SIZE
+// Growing linear memory can move it, leaving a private copy of the table where the mapping was;
+// if that happened, map the current table again at its new location. If the old memory went back
+// to the heap rather than being unmapped, the old mapping is still there and is replaced with
+// private pages; if it was unmapped, the range may already have been reused and is left alone.
+fn check_memory(ctx: &mut Context) {
+    let base = get_linear_memory(ctx).with_direct_access(|buf| buf.as_ptr() as usize);
+    if base != ctx.slots.memory_base {
+        println!("  linear memory moved; remapping lookup table");
+        ctx.slots.memory_base = base;
+        let old = (ctx.buffer, ctx.buffer_size);
+        let slot = (ctx.slots.epoch & 1) as usize;
+        let table_file = ctx.slots.file.take().unwrap();
+        map_table(ctx, slot, &table_file);
+        if mapped_from(old.0 as usize, old.1, &table_file) {
+            reclaim_table(old);
+        }
+    }
+}
+
+// Whether [ptr, ptr + size) is still mapped from the start of 'file', going by /proc/self/maps.
+fn mapped_from(ptr: usize, size: usize, file: &File) -> bool {
+    let meta = file.metadata().unwrap();
+    let maps = fs::read_to_string("/proc/self/maps").expect("failed to read /proc/self/maps");
+    let mut cur = ptr;
+    for (start, end, offset, dev, inode) in maps.lines().filter_map(parse_maps_line) {
+        if end <= cur {
+            continue;
+        }
+        // The entries are sorted, so this is either the one holding 'cur' or there is a gap.
+        if start > cur || dev != meta.dev() || inode != meta.ino() || offset + (cur - start) != cur - ptr {
+            return false;
+        }
+        cur = end;
+        if cur >= ptr + size {
+            return true;
+        }
+    }
+    false
+}
+
+// Splits a /proc/self/maps line into (start, end, file offset, device, inode).
+fn parse_maps_line(line: &str) -> Option<(usize, usize, usize, u64, u64)> {
+    let mut fields = line.split_whitespace();
+    let (start, end) = fields.next()?.split_once('-')?;
+    let offset = fields.nth(1)?;
+    let (major, minor) = fields.next()?.split_once(':')?;
+    let hex = |s| usize::from_str_radix(s, 16).ok();
+    let dev = libc::makedev(u32::from_str_radix(major, 16).ok()?, u32::from_str_radix(minor, 16).ok()?);
+    Some((hex(start)?, hex(end)?, hex(offset)?, dev as u64, fields.next()?.parse().ok()?))
+}
+
+// Publishes 'params.updates' new generations of the table to the running module, each with fresh
+// values for the same keys, and checks that the module picks each one up without being
+// re-instantiated.
+fn run_updates(ctx: &mut Context, params: &Params, key_hash: KeyHash) {
+    let header = unsafe { *(ctx.buffer as *const Header) };
+    println!("Running live updates: {}", params.updates);
+    for _ in 0..params.updates {
+        // Build the new generation in its own shm region.
+        let time = SystemTime::now();
+        let lookup = Arc::new(refresh_values(&ctx.lookup));
+        let table_file = create_shm_file();
+        Builder::new(header.format, key_hash, header.slots as usize, params.filter_bits)
+            .build(lookup.iter().map(|(key, val)| (key.as_str(), val.as_str())), &table_file);
+        let views = Arc::new(index_values(&table_file));
+        let duration_build = time.elapsed().unwrap();
+
+        // Map it into the spare slot and swap epochs; the module switches over at its next
+        // refresh, after which the old generation is no longer referenced.
+        let time = SystemTime::now();
+        check_memory(ctx);
+        let old = (ctx.buffer, ctx.buffer_size);
+        let epoch = ctx.slots.epoch + 1;
+        let slot = (epoch & 1) as usize;
+        map_table(ctx, slot, &table_file);
+        publish_slot(ctx, slot);
+        let control = unsafe { &*control_block(ctx) };
+        control.epoch.store(epoch, Ordering::Release);
+        ctx.slots.epoch = epoch;
+        ctx.lookup = lookup;
+        ctx.views = views;
+        assert!(matches!(wasm_call(ctx, "refresh_table", &[ctx.wasm_context]), Some(I32(1))));
+        assert_eq!(control.reader_epoch.load(Ordering::Acquire), epoch);
+        reclaim_table(old);
+        let duration_swap = time.elapsed().unwrap();
+
+        wasm_call(ctx, "verify_lookups", &[ctx.wasm_context]);
+        println!("  epoch {}: built in {:.2?}, swapped in {:.2?}", epoch, duration_build, duration_swap);
+    }
+
+    let time = SystemTime::now();
+    wasm_call(ctx, "performance_test_internal", &[ctx.wasm_context]);
+    println!("  internal after updates: {:.2?}", time.elapsed().unwrap());
+}
+
+// Generates new values for every key in 'lookup'.
+fn refresh_values(lookup: &HashMap<String, String>) -> HashMap<String, String> {
+    let mut rng = rand::thread_rng();
+    let val_dist = Uniform::<usize>::from(VAL_SIZE);
+    lookup
+        .keys()
+        .map(|key| {
+            let val_len = val_dist.sample(&mut rng);
+            let val = (&mut rng).sample_iter(&Alphanumeric).take(val_len).map(char::from).collect();
+            (key.clone(), val)
+        })
+        .collect()
+}
+
+// Releases a table generation the module has moved on from. The range is part of linear memory,
+// so it is replaced with zero pages rather than unmapped.
+fn reclaim_table((buffer, buffer_size): (cptr, usize)) {
+    let ptr = unsafe {
+        libc::mmap(buffer, buffer_size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+    };
+    assert_eq!(ptr, buffer, "failed to reclaim old lookup table");
+}
+
+fn align_up(ptr: usize, align: usize) -> usize {
+    ((ptr - 1) & !(align - 1)) + align
 }
 
 fn wasm_alloc(ctx: &Context, size: i32) -> i32 {
@@ -366,6 +789,8 @@ fn wasm_call(ctx: &Context, name: &str, args: &[RuntimeValue]) -> Option<Runtime
     let mut externs = Externs {
         memory: get_linear_memory(ctx),
         lookup: &ctx.lookup,
+        views: &ctx.views,
+        buffer_index: ctx.buffer_index,
     };
     ctx.instance
         .invoke_export(name, args, &mut externs)
@@ -383,10 +808,17 @@ fn get_linear_memory(ctx: &Context) -> MemoryRef {
 struct Externs<'a> {
     memory: MemoryRef,
     lookup: &'a HashMap<String, String>,
+    views: &'a ValueViews,
+    buffer_index: u32,
 }
 
 const PRINT_CALLBACK: usize = 0;
 const LOOKUP_CALLBACK: usize = 1;
+const LOOKUP_BATCH_CALLBACK: usize = 2;
+const LOOKUP_VIEW_CALLBACK: usize = 3;
+
+// Size of each (status, len, offset) record at the start of a batch lookup's arena.
+const BATCH_RECORD_SIZE: usize = 12;
 
 const SUCCESS: i32 = 0;
 const BUFFER_TOO_SMALL: i32 = 1;
@@ -440,6 +872,79 @@ impl Externs<'_> {
             }
         }
     }
+
+    fn lookup_batch_callback(&self, args: &RuntimeArgs) -> Result<Option<RuntimeValue>, Trap> {
+        // The function signature from the wasm side is:
+        //   (n_keys: u32, keys: *const (key_len: u32, key: *const u8), arena_len: u32,
+        //    arena: *mut u8) -> u32
+        //
+        // The arena starts with a (status: i32, len: u32, offset: u32) record for each key,
+        // followed by the values packed in order. Values that don't fit in the arena are marked
+        // BUFFER_TOO_SMALL; the return value is the arena size needed to hold all of them.
+        // Linear memory is accessed directly, so keys and values are not copied in between.
+        let n_keys = args.nth::<u32>(0) as usize;
+        let keys_ptr = args.nth::<u32>(1) as usize;
+        let arena_len = args.nth::<u32>(2) as usize;
+        let arena_ptr = args.nth::<u32>(3) as usize;
+        assert!(n_keys * BATCH_RECORD_SIZE <= arena_len);
+        let needed = self.memory.with_direct_access_mut(|mem| {
+            let mut value_offset = n_keys * BATCH_RECORD_SIZE;
+            for i in 0..n_keys {
+                let key_len = get_u32(mem, keys_ptr + i * 8) as usize;
+                let key_ptr = get_u32(mem, keys_ptr + i * 8 + 4) as usize;
+                let key = str::from_utf8(&mem[key_ptr..key_ptr + key_len]).unwrap();
+                let record = match self.lookup.get(key) {
+                    Some(val) => {
+                        let offset = value_offset;
+                        value_offset += val.len();
+                        if value_offset <= arena_len {
+                            let start = arena_ptr + offset;
+                            mem[start..start + val.len()].copy_from_slice(val.as_bytes());
+                            [SUCCESS as u32, val.len() as u32, offset as u32]
+                        } else {
+                            [BUFFER_TOO_SMALL as u32, val.len() as u32, offset as u32]
+                        }
+                    }
+                    None => [NOT_FOUND as u32, 0, 0],
+                };
+                for (j, field) in record.iter().enumerate() {
+                    set_u32(mem, arena_ptr + i * BATCH_RECORD_SIZE + j * 4, *field);
+                }
+            }
+            value_offset
+        });
+        Ok(Some(I32(needed as i32)))
+    }
+
+    fn lookup_view_callback(&self, args: &RuntimeArgs) -> Result<Option<RuntimeValue>, Trap> {
+        // The function signature from the wasm side is:
+        //   (key_len: u32, key: *const u8, value_len: *mut u32) -> *const u8
+        //
+        // Returns the value's location in the table mapped into linear memory, or null if the
+        // key is not found, so that the module can read it in place.
+        let key_len = args.nth::<u32>(0) as usize;
+        let key_ptr = args.nth::<u32>(1) as usize;
+        let value_len_ptr = args.nth::<u32>(2) as usize;
+        let ptr = self.memory.with_direct_access_mut(|mem| {
+            let key = str::from_utf8(&mem[key_ptr..key_ptr + key_len]).unwrap();
+            match self.views.get(key) {
+                Some(&(offset, len)) => {
+                    set_u32(mem, value_len_ptr, len);
+                    self.buffer_index + offset
+                }
+                None => 0,
+            }
+        });
+        Ok(Some(I32(ptr as i32)))
+    }
+}
+
+fn get_u32(mem: &[u8], at: usize) -> u32 {
+    u32::from_le_bytes(mem[at..at + 4].try_into().unwrap())
+}
+
+fn set_u32(mem: &mut [u8], at: usize, val: u32) {
+    mem[at..at + 4].copy_from_slice(&val.to_le_bytes());
 }
 
 impl Externals for Externs<'_> {
@@ -447,6 +952,8 @@ impl Externals for Externs<'_> {
         match index {
             PRINT_CALLBACK => self.print_callback(&args),
             LOOKUP_CALLBACK => self.lookup_callback(&args),
+            LOOKUP_BATCH_CALLBACK => self.lookup_batch_callback(&args),
+            LOOKUP_VIEW_CALLBACK => self.lookup_view_callback(&args),
             _ => panic!("unimplemented function at {}", index),
         }
     }
@@ -459,6 +966,8 @@ impl ModuleImportResolver for Resolver {
         let index = match field_name {
             "print_callback" => PRINT_CALLBACK,
             "lookup_callback" => LOOKUP_CALLBACK,
+            "lookup_batch_callback" => LOOKUP_BATCH_CALLBACK,
+            "lookup_view_callback" => LOOKUP_VIEW_CALLBACK,
             _ => panic!("unexpected export {}", field_name),
         };
         Ok(FuncInstance::alloc_host(signature.clone(), index))
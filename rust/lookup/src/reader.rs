@@ -13,7 +13,15 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
-use std::{collections::hash_map::DefaultHasher, hash::Hasher, mem, slice};
+mod hash;
+mod table;
+
+use hash::KeyHash;
+use std::{mem, ptr, slice, str, sync::atomic::Ordering};
+use table::{
+    Bucket, Control, FilterBlock, Header, BUCKET_ENTRIES, BUCKET_SIZE, FORMAT_BUCKETED, FORMAT_CHAINED, FORMAT_COMPACT,
+    HEADER_SIZE,
+};
 
 const SUCCESS: i32 = 0;
 const BUFFER_TOO_SMALL: i32 = 1;
@@ -22,6 +30,26 @@ const NOT_FOUND: i32 = 2;
 extern "C" {
     fn print_callback(len: u32, msg: *const u8);
     fn lookup_callback(key_len: u32, key: *const u8, value_len: *mut u32, value: *mut u8) -> i32;
+    fn lookup_batch_callback(n_keys: u32, keys: *const BatchKey, arena_len: u32, arena: *mut u8) -> u32;
+    fn lookup_view_callback(key_len: u32, key: *const u8, value_len: *mut u32) -> *const u8;
+}
+
+// Passed to lookup_batch_callback for each key in the batch.
+#[repr(C)]
+struct BatchKey {
+    len: u32,
+    ptr: *const u8,
+}
+
+// Written by the host at the start of the arena, one per key, followed by the values. 'len' is
+// the value's size and 'offset' its position in the arena; both are also set for values that
+// did not fit (status BUFFER_TOO_SMALL).
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct BatchRecord {
+    status: i32,
+    len: u32,
+    offset: u32,
 }
 
 fn print_str(s: &str) {
@@ -52,23 +80,47 @@ pub extern "C" fn malloc_(size: usize) -> *const u8 {
     ptr
 }
 
+enum Table {
+    Chained {
+        index: &'static [u32],
+        lookup: *const u8,
+        lookup_bytes: usize,
+    },
+    Compact {
+        index: &'static [u32],
+        lookup: *const u8,
+        lookup_bytes: usize,
+    },
+    Bucketed {
+        buckets: &'static [Bucket],
+        pairs: *const u8,
+        pairs_bytes: usize,
+    },
+}
+
 pub struct Context {
-    index: &'static [u32],
-    lookup: *const u8,
-    lookup_bytes: usize,
+    table: Table,
+    key_hash: KeyHash,
+    // Empty if the table has no Bloom filter.
+    filter: &'static [FilterBlock],
     test_keys: Vec<&'static str>,
     default_msg_bytes: u32,
+    batch_size: usize,
+    batch_keys: Vec<BatchKey>,
+    arena: Vec<u8>,
+    control: *const Control,
+    epoch: u32,
 }
 
 #[no_mangle]
 pub extern "C" fn create_context(
     buffer: *const u8,
-    index_slots: i32,
-    lookup_bytes: i32,
+    buffer_bytes: i32,
     num_test_keys: i32,
     test_keys_ptr: *const u8,
     test_keys_bytes: i32,
     default_msg_bytes: i32,
+    batch_size: i32,
 ) -> *const Context {
     // Collect the keys to be used in the performance tests.
     let mut reader = Reader {
@@ -82,21 +134,95 @@ pub extern "C" fn create_context(
     }
 
     // Create and release unownership of the context object.
-    let slots = index_slots as usize;
-    Box::into_raw(Box::new(unsafe {
-        Context {
-            index: slice::from_raw_parts(buffer as *const u32, slots),
-            lookup: buffer.add(slots * 4) as *const u8,
-            lookup_bytes: lookup_bytes as usize,
-            test_keys,
-            default_msg_bytes: default_msg_bytes as u32,
-        }
+    let (table, key_hash, filter) = read_table(buffer, buffer_bytes as usize);
+    Box::into_raw(Box::new(Context {
+        table,
+        key_hash,
+        filter,
+        test_keys,
+        default_msg_bytes: default_msg_bytes as u32,
+        batch_size: batch_size as usize,
+        batch_keys: Vec::with_capacity(batch_size as usize),
+        arena: vec![0; batch_size as usize * (mem::size_of::<BatchRecord>() + default_msg_bytes as usize)],
+        control: ptr::null(),
+        epoch: 0,
     }))
 }
 
+// Enables live table updates through the given control block; see table::Control.
+#[no_mangle]
+pub extern "C" fn attach_control(ctx: &mut Context, control: *const Control) {
+    ctx.control = control;
+    ctx.epoch = unsafe { (*control).epoch.load(Ordering::Acquire) };
+}
+
+// Switches to the latest table generation published by the host, returning 1 if it changed.
+// Values borrowed from the previous generation must not be used after this call, since the host
+// reclaims it as soon as the switch is acknowledged.
+#[no_mangle]
+pub extern "C" fn refresh_table(ctx: &mut Context) -> i32 {
+    let control = match unsafe { ctx.control.as_ref() } {
+        Some(control) => control,
+        None => return 0,
+    };
+    let epoch = control.epoch.load(Ordering::Acquire);
+    if epoch == ctx.epoch {
+        return 0;
+    }
+    let slot = control.slots[(epoch & 1) as usize];
+    let (table, key_hash, filter) = read_table(slot.index as usize as *const u8, slot.bytes as usize);
+    ctx.table = table;
+    ctx.key_hash = key_hash;
+    ctx.filter = filter;
+    ctx.epoch = epoch;
+    control.reader_epoch.store(epoch, Ordering::Release);
+    1
+}
+
+// Decodes the table's layout, key hash and filter from its header.
+fn read_table(buffer: *const u8, buffer_bytes: usize) -> (Table, KeyHash, &'static [FilterBlock]) {
+    assert!(buffer_bytes >= HEADER_SIZE);
+    let header = unsafe { &*(buffer as *const Header) };
+    header.validate(buffer_bytes);
+    // The mapping may extend past the end of the table.
+    let buffer_bytes = header.size as usize;
+    let slots = header.slots as usize;
+    // The sections following the header.
+    let start = header.data_offset();
+    let table = unsafe {
+        let data = buffer.add(start);
+        match header.format {
+            FORMAT_CHAINED | FORMAT_COMPACT => {
+                assert!(start + slots * 4 <= buffer_bytes);
+                let index = slice::from_raw_parts(data as *const u32, slots);
+                let lookup = data.add(slots * 4);
+                let lookup_bytes = buffer_bytes - start - slots * 4;
+                if header.format == FORMAT_CHAINED {
+                    Table::Chained { index, lookup, lookup_bytes }
+                } else {
+                    Table::Compact { index, lookup, lookup_bytes }
+                }
+            }
+            FORMAT_BUCKETED => {
+                assert!(slots.is_power_of_two() && start + slots * BUCKET_SIZE <= buffer_bytes);
+                Table::Bucketed {
+                    buckets: slice::from_raw_parts(data as *const Bucket, slots),
+                    pairs: data.add(slots * BUCKET_SIZE),
+                    pairs_bytes: buffer_bytes - start - slots * BUCKET_SIZE,
+                }
+            }
+            _ => panic!("unknown lookup table format {}", header.format),
+        }
+    };
+    let filter = unsafe {
+        slice::from_raw_parts(buffer.add(HEADER_SIZE) as *const FilterBlock, header.filter_blocks as usize)
+    };
+    (table, header.key_hash(), filter)
+}
+
 // Check that the internal and external lookup functions match for a few different keys.
 #[no_mangle]
-pub extern "C" fn verify_lookups(ctx: &Context) {
+pub extern "C" fn verify_lookups(ctx: &mut Context) {
     for key in ctx.test_keys.iter().take(10) {
         let value_int = lookup_int(ctx, key).unwrap();
         let value_ext = lookup_ext(ctx, key).unwrap();
@@ -105,6 +231,15 @@ pub extern "C" fn verify_lookups(ctx: &Context) {
     let key = "404 not found";
     assert!(lookup_int(ctx, key).is_none());
     assert!(lookup_ext(ctx, key).is_none());
+    assert!(lookup_view(key).is_none());
+    for key in ctx.test_keys.iter().take(10) {
+        assert_eq!(lookup_int(ctx, key), lookup_view(key));
+    }
+
+    let mut keys: Vec<&str> = ctx.test_keys.iter().take(10).cloned().collect();
+    keys.push(key);
+    let expected: Vec<_> = keys.iter().map(|key| lookup_int(ctx, key)).collect();
+    lookup_ext_batch(ctx, &keys, |i, value| assert_eq!(value, expected[i]));
 }
 
 #[no_mangle]
@@ -121,19 +256,69 @@ pub extern "C" fn performance_test_external(ctx: &Context) {
     }
 }
 
+#[no_mangle]
+pub extern "C" fn performance_test_view(ctx: &Context) {
+    for key in &ctx.test_keys {
+        assert!(lookup_view(key).is_some());
+    }
+}
+
+// Variants of the above for test keys [start, start + count), so the host can time smaller
+// groups of lookups.
+#[no_mangle]
+pub extern "C" fn performance_test_internal_range(ctx: &Context, start: i32, count: i32) {
+    for key in &ctx.test_keys[start as usize..][..count as usize] {
+        assert!(lookup_int(ctx, key).is_some());
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn performance_test_external_range(ctx: &Context, start: i32, count: i32) {
+    for key in &ctx.test_keys[start as usize..][..count as usize] {
+        assert!(lookup_ext(ctx, key).is_some());
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn performance_test_view_range(ctx: &Context, start: i32, count: i32) {
+    for key in &ctx.test_keys[start as usize..][..count as usize] {
+        assert!(lookup_view(key).is_some());
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn performance_test_external_batch(ctx: &mut Context) {
+    let test_keys = mem::take(&mut ctx.test_keys);
+    for keys in test_keys.chunks(ctx.batch_size) {
+        lookup_ext_batch(ctx, keys, |_, value| assert!(value.is_some()));
+    }
+    ctx.test_keys = test_keys;
+}
+
 // Uses the "internal" mapped buffer to find the value associated with 'key'.
+// Keys rejected by the filter are known to be missing without touching the table itself.
 fn lookup_int(ctx: &Context, key: &str) -> Option<&'static str> {
+    let hash = ctx.key_hash.hash(key.as_bytes());
+    if !table::filter_contains(ctx.filter, hash) {
+        return None;
+    }
+    match ctx.table {
+        Table::Chained { index, lookup, lookup_bytes } => lookup_chained(index, lookup, lookup_bytes, hash, key),
+        Table::Compact { index, lookup, lookup_bytes } => lookup_compact(index, lookup, lookup_bytes, hash, key),
+        Table::Bucketed { buckets, pairs, pairs_bytes } => lookup_bucketed(buckets, pairs, pairs_bytes, hash, key),
+    }
+}
+
+fn lookup_chained(index: &[u32], lookup: *const u8, lookup_bytes: usize, hash: u64, key: &str) -> Option<&'static str> {
     // Find the key's position in the index table..
-    let mut hasher = DefaultHasher::new();
-    hasher.write(key.as_bytes());
-    let i = (hasher.finish() as usize) % ctx.index.len();
+    let i = (hash % index.len() as u64) as usize;
 
     // ..to get the offest into the packed data following the table.
-    let offset = ctx.index[i] as usize;
+    let offset = index[i] as usize;
     if offset > 0 {
         let mut reader = Reader {
-            buffer: ctx.lookup,
-            size: ctx.lookup_bytes,
+            buffer: lookup,
+            size: lookup_bytes,
             offset,
         };
 
@@ -152,6 +337,127 @@ fn lookup_int(ctx: &Context, key: &str) -> Option<&'static str> {
     None
 }
 
+// Keys are front-coded against the previous key in their sorted chain, so each one is compared
+// in place by tracking how much of 'key' matches the previous key: a candidate sharing less than
+// that sorts after 'key', and one sharing more can't match either.
+fn lookup_compact(
+    index: &[u32],
+    lookup: *const u8,
+    lookup_bytes: usize,
+    hash: u64,
+    key: &str,
+) -> Option<&'static str> {
+    let offset = index[(hash % index.len() as u64) as usize] as usize;
+    if offset == 0 {
+        return None;
+    }
+    let mut reader = Reader {
+        buffer: lookup,
+        size: lookup_bytes,
+        offset,
+    };
+    let key = key.as_bytes();
+    let mut matched = 0;
+    let n_items = reader.read_varint();
+    for _ in 0..n_items {
+        let shared = reader.read_varint() as usize;
+        if shared < matched {
+            return None;
+        }
+        let suffix = reader.read_var_bytes();
+        if shared == matched {
+            let rest = &key[matched..];
+            let common = table::common_prefix(suffix, rest);
+            if common == suffix.len() && common == rest.len() {
+                return Some(reader.read_var_str());
+            }
+            // Past 'key' in sort order: either it is a proper prefix of the candidate or the
+            // first differing byte is smaller.
+            if common == rest.len() || (common < suffix.len() && rest[common] < suffix[common]) {
+                return None;
+            }
+            matched += common;
+        }
+        reader.skip_var_bytes();
+    }
+    None
+}
+
+fn lookup_bucketed(
+    buckets: &[Bucket],
+    pairs: *const u8,
+    pairs_bytes: usize,
+    hash: u64,
+    key: &str,
+) -> Option<&'static str> {
+    let fp = table::fingerprint(hash);
+    let mut b = table::home_bucket(hash, buckets.len());
+    for _ in 0..buckets.len() {
+        let bucket = &buckets[b];
+        let (mut matches, has_empty) = match_fingerprints(bucket, fp);
+        while matches != 0 {
+            let e = matches.trailing_zeros() as usize;
+            matches &= matches - 1;
+            if bucket.key_len[e] as usize != key.len() {
+                continue;
+            }
+            let offset = bucket.off[e] as usize;
+            assert!(offset + key.len() + 4 <= pairs_bytes);
+            let candidate = unsafe { slice::from_raw_parts(pairs.add(offset), key.len()) };
+            if candidate == key.as_bytes() {
+                let mut reader = Reader {
+                    buffer: pairs,
+                    size: pairs_bytes,
+                    offset: offset + key.len(),
+                };
+                return Some(reader.read_str());
+            }
+        }
+        // Keys are only placed in later buckets when all earlier ones were full.
+        if has_empty {
+            return None;
+        }
+        b = (b + 1) & (buckets.len() - 1);
+    }
+    None
+}
+
+// Returns a bitmask of the bucket entries with fingerprint 'fp', and whether any are empty.
+#[cfg(all(target_arch = "wasm32", target_feature = "simd128"))]
+fn match_fingerprints(bucket: &Bucket, fp: u16) -> (u32, bool) {
+    use core::arch::wasm32::*;
+    let fps = unsafe { v128_load(bucket.fp.as_ptr() as *const v128) };
+    let matches = u16x8_bitmask(u16x8_eq(fps, u16x8_splat(fp)));
+    let empty = u16x8_bitmask(u16x8_eq(fps, u16x8_splat(0)));
+    (matches as u32, empty != 0)
+}
+
+// Without simd128 (which wasmi does not support), compare four fingerprints at a time in a u64.
+#[cfg(not(all(target_arch = "wasm32", target_feature = "simd128")))]
+fn match_fingerprints(bucket: &Bucket, fp: u16) -> (u32, bool) {
+    const LANES: usize = 4;
+    let words: &[u64; BUCKET_ENTRIES / LANES] = unsafe { mem::transmute(&bucket.fp) };
+    let mut matches = 0;
+    let mut empty = 0;
+    for (i, &word) in words.iter().enumerate() {
+        matches |= zero_lanes(word ^ (fp as u64 * 0x0001_0001_0001_0001)) << (i * LANES);
+        empty |= zero_lanes(word);
+    }
+    (matches, empty != 0)
+}
+
+// Returns a 4-bit mask of the 16-bit lanes in 'x' that are zero.
+#[cfg(not(all(target_arch = "wasm32", target_feature = "simd128")))]
+fn zero_lanes(x: u64) -> u32 {
+    const LOW: u64 = 0x7fff_7fff_7fff_7fff;
+    // The top bit of each lane is set iff the lane is non-zero; this doesn't carry across lanes.
+    let nonzero = ((x & LOW) + LOW) | x;
+    let zero = (!nonzero & !LOW) >> 15;
+    // Gather the per-lane bits (at 0, 16, 32, 48) into bits 48..51; the cross terms of the
+    // multiplication land in distinct bits below 48 or overflow, so nothing carries.
+    ((zero.wrapping_mul(0x0001_0002_0004_0008) >> 48) & 0xf) as u32
+}
+
 // Calls out to the wasm host to find the value associated with 'key'.
 fn lookup_ext(ctx: &Context, key: &str) -> Option<String> {
     // We start with a small size for the 'value' parameter. The host will store the result size
@@ -181,8 +487,62 @@ fn lookup_ext(ctx: &Context, key: &str) -> Option<String> {
     panic!("lookup failed");
 }
 
-// Given a buffer base pointer and starting offset, this can decode u32 and packed
-// String values (u32 length followed by bytes) while advancing the offset.
+// Calls out to the wasm host once to find the values for all of 'keys', passing each result to
+// 'f' along with the key's index. The key list and result arena are reused across calls; if the
+// host reports that the arena is too small, it is grown and the batch is retried.
+fn lookup_ext_batch(ctx: &mut Context, keys: &[&str], mut f: impl FnMut(usize, Option<&str>)) {
+    ctx.batch_keys.clear();
+    ctx.batch_keys.extend(keys.iter().map(|key| BatchKey { len: key.len() as u32, ptr: key.as_ptr() }));
+    let min_len = keys.len() * mem::size_of::<BatchRecord>();
+    if ctx.arena.len() < min_len {
+        ctx.arena.resize(min_len, 0);
+    }
+    for _ in 0..2 {
+        let needed = unsafe {
+            lookup_batch_callback(
+                keys.len() as u32,
+                ctx.batch_keys.as_ptr(),
+                ctx.arena.len() as u32,
+                ctx.arena.as_mut_ptr(),
+            )
+        } as usize;
+        if needed > ctx.arena.len() {
+            ctx.arena.resize(needed, 0);
+            continue;
+        }
+        for i in 0..keys.len() {
+            let record = unsafe {
+                ptr::read_unaligned((ctx.arena.as_ptr() as *const BatchRecord).add(i))
+            };
+            match record.status {
+                SUCCESS => {
+                    let value = &ctx.arena[record.offset as usize..][..record.len as usize];
+                    f(i, Some(unsafe { str::from_utf8_unchecked(value) }));
+                }
+                NOT_FOUND => f(i, None),
+                _ => panic!("invalid batch lookup status: {}", record.status),
+            }
+        }
+        return;
+    }
+    // Should never be reached.
+    panic!("batch lookup failed");
+}
+
+// Asks the wasm host where the value for 'key' is in the mapped buffer. The host returns its
+// location in linear memory, so no bytes are copied and the result borrows from the mapping just
+// like lookup_int's.
+fn lookup_view(key: &str) -> Option<&'static str> {
+    let mut value_len = 0;
+    let ptr = unsafe { lookup_view_callback(key.len() as u32, key.as_ptr(), &mut value_len) };
+    if ptr.is_null() {
+        return None;
+    }
+    unsafe { Some(str::from_utf8_unchecked(slice::from_raw_parts(ptr, value_len as usize))) }
+}
+
+// Given a buffer base pointer and starting offset, this can decode u32s, LEB128 varints and
+// packed String values (u32 or varint length followed by bytes) while advancing the offset.
 struct Reader {
     buffer: *const u8,
     size: usize,
@@ -231,6 +591,29 @@ impl Reader {
         assert!(self.offset + len <= self.size);
         self.offset += len;
     }
+
+    fn read_varint(&mut self) -> u32 {
+        let buf = unsafe { slice::from_raw_parts(self.buffer, self.size) };
+        table::read_varint(buf, &mut self.offset)
+    }
+
+    fn read_var_bytes(&mut self) -> &'static [u8] {
+        let len = self.read_varint() as usize;
+        assert!(self.offset + len <= self.size);
+        let res = unsafe { slice::from_raw_parts(self.buffer.add(self.offset), len) };
+        self.offset += len;
+        res
+    }
+
+    fn read_var_str(&mut self) -> &'static str {
+        unsafe { str::from_utf8_unchecked(self.read_var_bytes()) }
+    }
+
+    fn skip_var_bytes(&mut self) {
+        let len = self.read_varint() as usize;
+        assert!(self.offset + len <= self.size);
+        self.offset += len;
+    }
 }
 
 fn main() {
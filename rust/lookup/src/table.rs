@@ -0,0 +1,345 @@
+//
+// Copyright 2022 The Project Oak Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Serialized lookup table definitions shared by the host (main.rs) and the wasm reader.
+//
+// Every table starts with a Header, padded to a cache line so that the filter, index or bucket
+// array following it stays cache-line aligned within the page-aligned mapping. Tables are position
+// independent and can be stored in a file and mapped directly by later runs; the header's size
+// and checksum let a loader reject truncated or stale files. The file may be longer than 'size'
+// (e.g. when rounded up to a huge page multiple on hugetlbfs).
+//
+// Any format may have a blocked Bloom filter of the keys between the header and the rest of the
+// table, with 'filter_blocks' FilterBlocks (a power of two, or 0 for none). A key's hash selects
+// one block, so checking it touches a single cache line; lookups of keys the filter rejects stop
+// there, before the index probe.
+
+#![allow(dead_code)]
+
+use crate::hash::KeyHash;
+use std::{cmp, mem, slice, sync::atomic::AtomicU32};
+
+pub const MAGIC: u32 = u32::from_le_bytes(*b"LKUP");
+pub const VERSION: u32 = 4;
+
+// Chained format:
+//
+//  | header | index table | bumper | packed chains |
+//
+// index table: 'slots' u32 offsets into packed data (starting from end of the index table)
+// bumper: a single unused byte so offsets of 0 can indicate an empty slot in the index table
+// packed chains: a sequence of chains per used index slot; each chain has the format:
+//
+//  | n_pairs:u32 | key_len:u32 | key | value_len:u32 | value | key_len | ... |
+//
+// Pairs are sorted by key within each chain.
+pub const FORMAT_CHAINED: u32 = 1;
+
+// Compact format: the chained format with prefix-compressed keys and LEB128 varint lengths.
+// Each chain has the format:
+//
+//  | n_pairs:var | shared:var | suffix_len:var | suffix | value_len:var | value | shared | ... |
+//
+// where a key is the first 'shared' bytes of the previous key in its chain (0 for the first
+// pair) followed by 'suffix'. Since the keys are sorted, a lookup can compare each key against
+// the one it is looking for without rebuilding it, and stop at the first key that sorts after it.
+pub const FORMAT_COMPACT: u32 = 3;
+
+// Bucketed format:
+//
+//  | header | buckets | packed pairs |
+//
+// Buckets are open-addressed with linear probing; 'slots' is the number of buckets, always a
+// power of two. A key's home bucket is taken from the low bits of its hash and each entry
+// records a 16-bit fingerprint from the high bits, so a probe only touches the packed pairs
+// for entries whose fingerprint matches. A fingerprint of 0 marks an empty entry; lookups stop
+// at the first bucket with an empty entry. Each pair in the packed region has the format:
+//
+//  | key | value_len:u32 | value |
+//
+// with the entry's offset pointing at the key (relative to the start of the packed region).
+pub const FORMAT_BUCKETED: u32 = 2;
+
+pub const FORMATS: [(&str, u32); 3] =
+    [("chained", FORMAT_CHAINED), ("bucketed", FORMAT_BUCKETED), ("compact", FORMAT_COMPACT)];
+
+pub const BUCKET_ENTRIES: usize = 8;
+
+#[repr(C, align(64))]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Header {
+    pub magic: u32,
+    pub version: u32,
+    pub format: u32,
+    pub hash: u32,  // one of the hash::HASH_* ids
+    pub seed: u64,
+    pub slots: u32,
+    pub filter_blocks: u32,
+    pub size: u64,      // total table size in bytes, including the header
+    pub checksum: u64,  // checksum() of everything after the header
+}
+
+pub const HEADER_SIZE: usize = mem::size_of::<Header>();
+
+#[repr(C, align(64))]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Bucket {
+    pub fp: [u16; BUCKET_ENTRIES],
+    pub off: [u32; BUCKET_ENTRIES],
+    pub key_len: [u16; BUCKET_ENTRIES],
+}
+
+pub const BUCKET_SIZE: usize = mem::size_of::<Bucket>();
+
+// One bit is set in each word for a key, at a position taken from its hash by FILTER_SALT.
+#[repr(C, align(64))]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct FilterBlock {
+    pub words: [u64; 8],
+}
+
+pub const FILTER_BLOCK_SIZE: usize = mem::size_of::<FilterBlock>();
+const _: () = assert!(HEADER_SIZE == 64 && BUCKET_SIZE == 64 && FILTER_BLOCK_SIZE == 64);
+
+// Odd multipliers spreading the low half of the hash over each word's 64 bits, as in Parquet's
+// split block Bloom filter. The block is chosen by the high half.
+const FILTER_SALT: [u32; 8] =
+    [0x47b6_137b, 0x4497_4d91, 0x8824_ad5b, 0xa2b7_289d, 0x7054_95c7, 0x2df1_424b, 0x9efc_4947, 0x5c6b_fb31];
+
+impl Header {
+    pub fn new(
+        format: u32,
+        key_hash: KeyHash,
+        slots: usize,
+        filter_blocks: usize,
+        size: usize,
+        checksum: u64,
+    ) -> Self {
+        Self {
+            magic: MAGIC,
+            version: VERSION,
+            format,
+            hash: key_hash.id,
+            seed: key_hash.seed,
+            slots: slots as u32,
+            filter_blocks: filter_blocks as u32,
+            size: size as u64,
+            checksum,
+        }
+    }
+
+    // Checks that this is the header of a complete, current-version table held in a buffer of
+    // 'buffer_bytes' bytes.
+    pub fn validate(&self, buffer_bytes: usize) {
+        assert!(self.magic == MAGIC, "lookup table has an invalid header");
+        assert!(self.version == VERSION, "unsupported lookup table version {}", self.version);
+        assert!(self.size as usize >= HEADER_SIZE && self.size as usize <= buffer_bytes,
+                "lookup table is truncated ({} of {} bytes)", buffer_bytes, self.size);
+        assert!(self.filter_blocks == 0 || self.filter_blocks.is_power_of_two());
+        assert!(HEADER_SIZE + self.filter_size() <= self.size as usize, "lookup table filter is truncated");
+    }
+
+    pub fn filter_size(&self) -> usize {
+        self.filter_blocks as usize * FILTER_BLOCK_SIZE
+    }
+
+    // Offset of the index or buckets, following the header and filter.
+    pub fn data_offset(&self) -> usize {
+        HEADER_SIZE + self.filter_size()
+    }
+
+    pub fn key_hash(&self) -> KeyHash {
+        KeyHash { id: self.hash, seed: self.seed }
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self as *const Self as *const u8, HEADER_SIZE) }
+    }
+}
+
+// Control block for live table updates, allocated in the reader's linear memory and written by
+// the host. Table generations alternate between two slots, with 'epoch & 1' selecting the current
+// one. The host maps a new generation into the other slot, fills in that slot's location and then
+// publishes it by storing the next epoch (release). The reader switches over between requests and
+// acknowledges with 'reader_epoch', after which the host may reclaim the old generation.
+#[repr(C)]
+pub struct Control {
+    pub epoch: AtomicU32,
+    pub reader_epoch: AtomicU32,
+    pub slots: [ControlSlot; 2],
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct ControlSlot {
+    pub index: u32,  // linear memory index of the mapped table
+    pub bytes: u32,
+}
+
+// Views a slice of plain-old-data structs as raw bytes for serialization.
+pub fn as_bytes<T: Copy>(items: &[T]) -> &[u8] {
+    unsafe { slice::from_raw_parts(items.as_ptr() as *const u8, items.len() * mem::size_of::<T>()) }
+}
+
+pub fn checksum(body: &[u8]) -> u64 {
+    crate::hash::wyhash(body, 0)
+}
+
+pub fn format_name(id: u32) -> &'static str {
+    FORMATS.iter().find(|(_, f)| *f == id).map(|(n, _)| *n).unwrap_or("unknown")
+}
+
+pub fn fingerprint(hash: u64) -> u16 {
+    ((hash >> 48) as u16).max(1)
+}
+
+pub fn home_bucket(hash: u64, n_buckets: usize) -> usize {
+    (hash as usize) & (n_buckets - 1)
+}
+
+// The number of filter blocks for 'n_keys' keys at about 'bits_per_key' bits each; 0 disables the
+// filter.
+pub fn filter_blocks(n_keys: usize, bits_per_key: usize) -> usize {
+    if bits_per_key == 0 {
+        return 0;
+    }
+    let bits = FILTER_BLOCK_SIZE * 8;
+    cmp::max((n_keys * bits_per_key + bits - 1) / bits, 1).next_power_of_two()
+}
+
+fn filter_bits(hash: u64, filter: &[FilterBlock]) -> (usize, [u64; 8]) {
+    let block = ((hash >> 32) as usize) & (filter.len() - 1);
+    let mut mask = [0u64; 8];
+    for (m, salt) in mask.iter_mut().zip(FILTER_SALT) {
+        *m = 1 << ((hash as u32).wrapping_mul(salt) >> 26);
+    }
+    (block, mask)
+}
+
+pub fn filter_insert(filter: &mut [FilterBlock], hash: u64) {
+    let (block, mask) = filter_bits(hash, filter);
+    for (w, m) in filter[block].words.iter_mut().zip(mask) {
+        *w |= m;
+    }
+}
+
+// False if the key with 'hash' is definitely not in the table; always true without a filter.
+pub fn filter_contains(filter: &[FilterBlock], hash: u64) -> bool {
+    if filter.is_empty() {
+        return true;
+    }
+    let (block, mask) = filter_bits(hash, filter);
+    filter[block].words.iter().zip(mask).all(|(&w, m)| w & m == m)
+}
+
+pub fn varint_len(mut val: u32) -> usize {
+    let mut len = 1;
+    while val >= 0x80 {
+        val >>= 7;
+        len += 1;
+    }
+    len
+}
+
+// Decodes the LEB128 varint at 'buf[*pos]', advancing 'pos' past it.
+pub fn read_varint(buf: &[u8], pos: &mut usize) -> u32 {
+    let mut val = 0u32;
+    let mut shift = 0;
+    loop {
+        let b = buf[*pos];
+        *pos += 1;
+        val |= ((b & 0x7f) as u32) << shift;
+        if b < 0x80 {
+            return val;
+        }
+        shift += 7;
+        assert!(shift < 32, "invalid varint in lookup table");
+    }
+}
+
+pub fn common_prefix(a: &[u8], b: &[u8]) -> usize {
+    a.iter().zip(b).take_while(|(x, y)| x == y).count()
+}
+
+// Calls 'f' with every key/value pair in a serialized table, in storage order. 'table' must
+// be a validated table (see Header::validate). Values are borrowed from the table, but keys
+// may have had to be rebuilt.
+pub fn for_each_pair<'a>(table: &'a [u8], mut f: impl FnMut(&[u8], &'a [u8])) {
+    let header = unsafe { &*(table.as_ptr() as *const Header) };
+    let slots = header.slots as usize;
+    let data = &table[header.data_offset()..header.size as usize];
+    let read_u32 = |buf: &[u8], at: usize| u32::from_le_bytes(buf[at..at + 4].try_into().unwrap()) as usize;
+    match header.format {
+        FORMAT_CHAINED => {
+            let (index, packed) = data.split_at(slots * 4);
+            for s in 0..slots {
+                let mut pos = read_u32(index, s * 4);
+                if pos == 0 {
+                    continue;
+                }
+                let n_pairs = read_u32(packed, pos);
+                pos += 4;
+                for _ in 0..n_pairs {
+                    let key_len = read_u32(packed, pos);
+                    let key = &packed[pos + 4..pos + 4 + key_len];
+                    pos += 4 + key_len;
+                    let val_len = read_u32(packed, pos);
+                    let val = &packed[pos + 4..pos + 4 + val_len];
+                    pos += 4 + val_len;
+                    f(key, val);
+                }
+            }
+        }
+        FORMAT_COMPACT => {
+            let (index, packed) = data.split_at(slots * 4);
+            let mut key = Vec::new();
+            for s in 0..slots {
+                let mut pos = read_u32(index, s * 4);
+                if pos == 0 {
+                    continue;
+                }
+                let n_pairs = read_varint(packed, &mut pos);
+                for _ in 0..n_pairs {
+                    let shared = read_varint(packed, &mut pos) as usize;
+                    let suffix_len = read_varint(packed, &mut pos) as usize;
+                    key.truncate(shared);
+                    key.extend_from_slice(&packed[pos..pos + suffix_len]);
+                    pos += suffix_len;
+                    let val_len = read_varint(packed, &mut pos) as usize;
+                    let val = &packed[pos..pos + val_len];
+                    pos += val_len;
+                    f(&key, val);
+                }
+            }
+        }
+        FORMAT_BUCKETED => {
+            let buckets = unsafe { slice::from_raw_parts(data.as_ptr() as *const Bucket, slots) };
+            let pairs = &data[slots * BUCKET_SIZE..];
+            for bucket in buckets {
+                for e in 0..BUCKET_ENTRIES {
+                    if bucket.fp[e] == 0 {
+                        continue;
+                    }
+                    let off = bucket.off[e] as usize;
+                    let key_len = bucket.key_len[e] as usize;
+                    let val_len = read_u32(pairs, off + key_len);
+                    f(&pairs[off..off + key_len], &pairs[off + key_len + 4..][..val_len]);
+                }
+            }
+        }
+        _ => panic!("unknown lookup table format {}", header.format),
+    }
+}
@@ -13,14 +13,27 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "wasm_c_api.h"
+#include "../c/module-cache.c"
+#include "../c/unix-socket.c"
+#include "../c/buffer-manifest.c"
 
 // Ownership indicator as used by the wasm-c-api code.
 #define own
@@ -35,6 +48,8 @@ enum ExportFuncs {
   FN_READ_RW,
   FN_WRITE_RO,
   FN_FORCE_ERROR,
+  FN_WRITE_MEM,
+  FN_READ_MEM,
 };
 
 const char *kExportFuncNames[] = {
@@ -47,15 +62,31 @@ const char *kExportFuncNames[] = {
   "read_rw",
   "write_ro",
   "force_error",
+  "write_mem",
+  "read_mem",
 };
 
 #define N_FUNCS  (sizeof(kExportFuncNames) / sizeof(*kExportFuncNames))
 
+// Build with -DTRACE_CALLS=1 to log every fn_call with its arguments. Off by default to keep
+// the formatting off the call path; commands are still logged as they run.
+#ifndef TRACE_CALLS
+#define TRACE_CALLS  0
+#endif
+
 typedef struct {
   char label;
+  const char *module_name;
   int read_fd;
   int write_fd;
 
+  // Off for the stress commands, which are timed.
+  bool quiet;
+
+  // Linear memory for the pipe baseline's payloads, allocated on first use.
+  int scratch_index;
+  uint32_t scratch_size;
+
   // Engine components
   own wasm_engine_t *engine;
   own wasm_store_t *store;
@@ -68,23 +99,24 @@ typedef struct {
   wasm_memory_t *memory;
   wasm_func_t *funcs[N_FUNCS];
 
-  // Shared buffers
+  // Export signatures, cached by init_module()
+  int arity[N_FUNCS];
+  bool has_result[N_FUNCS];
+
+  // Shared buffers, received from the host as a manifest: the read-only one, then read-write.
+  BufferManifest buffers;
+  int buffer_fds[MANIFEST_MAX_BUFFERS];
+  unsigned char *bufs[MANIFEST_MAX_BUFFERS];
+
   own unsigned char *ro_buf;
-  const char *ro_name;
   int ro_size;
 
   own unsigned char *rw_buf;
-  const char *rw_name;
   int rw_size;
 } WasmComponents;
 
 WasmComponents wc = { 0 };
 
-// Aligns to next largest page boundary, unless p is already aligned.
-void *page_align(void *p, size_t page_size) {
-  return (void *)((((size_t)p - 1) & ~(page_size - 1)) + page_size);
-}
-
 void info(const char *fmt, ...) {
   char msg[500];
   va_list ap;
@@ -122,31 +154,34 @@ typedef struct {
 // Wraps the cumbersome wasm_func_call API. Assumes args and return value, where present, are i32.
 FuncResult fn_call(int index, ...) {
   wasm_func_t *fn = wc.funcs[index];
-  int arity = wasm_func_param_arity(fn);
-  bool has_result = wasm_func_result_arity(fn);
+  int arity = wc.arity[index];
+  bool has_result = wc.has_result[index];
   const char *name = kExportFuncNames[index];
 
-  // Args vector; capacity of 10 but reset current number to 0.
-  wasm_val_t args[10] = { 0 };
+  // Args vector; only the first 'arity' elements are filled in and passed.
+  wasm_val_t args[10];
   wasm_val_vec_t args_vec = WASM_ARRAY_VEC(args);
-  args_vec.num_elems = 0;
-  assert(arity <= args_vec.size);
+  args_vec.num_elems = arity;
 
   // Process varags to fill in required number of elements in args/args_vec.
-  char buf[500];
-  char *p = buf;
-  p += sprintf(p, "  -- calling %s(", name);
   va_list ap;
   va_start(ap, index);
   for (int i = 0; i < arity; i++) {
-    int val = va_arg(ap, int);
     args[i].kind = WASM_I32;
-    args[i].of.i32 = val;
-    args_vec.num_elems++;
-    p += sprintf(p, "%s%d", i ? ", " : "", val);
+    args[i].of.i32 = va_arg(ap, int);
   }
   va_end(ap);
-  info("%s)", buf);
+#if TRACE_CALLS
+  if (!wc.quiet) {
+    char buf[500];
+    char *p = buf;
+    p += sprintf(p, "  -- calling %s(", name);
+    for (int i = 0; i < arity; i++) {
+      p += sprintf(p, "%s%d", i ? ", " : "", args[i].of.i32);
+    }
+    info("%s)", buf);
+  }
+#endif
 
   // Call the wasm function.
   FuncResult result = { false, 0 };
@@ -172,29 +207,15 @@ FuncResult fn_call(int index, ...) {
 }
 
 bool init_module() {
-  info("Loading wasm file");
-  FILE *file = fopen("module.wasm", "r");
-  if (file == NULL) {
-    return error("Error loading wasm file");
-  }
-  fseek(file, 0, SEEK_END);
-  wasm_byte_vec_t wasm_bytes;
-  wasm_bytes.size = ftell(file);
-  wasm_bytes.data = malloc(wasm_bytes.size);
-  fseek(file, 0, SEEK_SET);
-  fread(wasm_bytes.data, 1, wasm_bytes.size, file);
-  fclose(file);
-
   info("Creating the store");
   wc.engine = wasm_engine_new();
   wc.store = wasm_store_new(wc.engine);
 
-  info("Compiling module");
-  wc.module = wasm_module_new(wc.store, &wasm_bytes);
+  info("Loading module");
+  wc.module = load_module(wc.store, wc.module_name);
   if (wc.module == NULL) {
-    return error("Error compiling module");
+    return error("Error loading module");
   }
-  free(wasm_bytes.data);
 
   info("Checking module imports");
   own wasm_importtype_vec_t expected_imports;
@@ -245,6 +266,11 @@ bool init_module() {
     if (wc.funcs[i] == NULL) {
       return error("Function export '%s' not found", kExportFuncNames[i]);
     }
+    wc.arity[i] = wasm_func_param_arity(wc.funcs[i]);
+    wc.has_result[i] = wasm_func_result_arity(wc.funcs[i]);
+    if (wc.arity[i] > 10) {
+      return error("Function export '%s' takes %d params", kExportFuncNames[i], wc.arity[i]);
+    }
   }
   return true;
 }
@@ -254,7 +280,9 @@ bool init_shared_bufs() {
   int page_size = sysconf(_SC_PAGESIZE);
 
   // Call wasm.malloc to reserve enough space for the shared buffers plus alignment concerns.
-  int wasm_alloc_size = wc.ro_size + wc.rw_size + 3 * page_size;
+  size_t reserve_size = manifest_reserve_size(&wc.buffers, page_size, 0);
+  assert(reserve_size <= INT_MAX);
+  int wasm_alloc_size = reserve_size;
   info("  wasm_alloc_size: %d", wasm_alloc_size);
   FuncResult malloc_res = fn_call(FN_MALLOC, wasm_alloc_size);
   if (!malloc_res.ok) {
@@ -270,37 +298,22 @@ bool init_shared_bufs() {
   info("  wasm_alloc_index: %d", malloc_res.val);
   info("  wasm_alloc_ptr:   %p", wasm_alloc_ptr);
 
-  // Align the shared buffers inside wasm's linear memory against our page boundaries.
-  void *aligned_ro = page_align(wasm_alloc_ptr, page_size);
-  void *aligned_rw = page_align(aligned_ro + wc.ro_size, page_size);
-  info("  aligned_ro:       %p", aligned_ro);
-  info("  aligned_rw:       %p", aligned_rw);
-
-  // Verify that our overall mmapped size will be safely contained in the wasm allocation.
-  void *end = page_align(aligned_rw + wc.rw_size, page_size);
-  int aligned_size = end - wasm_alloc_ptr;
-  info("  aligned_size:     %d", aligned_size);
-  assert(aligned_size <= wasm_alloc_size);
-
-  info("Mapping read-only buffer");
-  int flags = MAP_SHARED | MAP_FIXED;
-  int ro_fd = shm_open(wc.ro_name, O_RDONLY, S_IRUSR | S_IWUSR);
-  if (ro_fd == -1) {
-    return error("Error calling shm_open");
-  }
-  wc.ro_buf = mmap(aligned_ro, wc.ro_size, PROT_READ, flags, ro_fd, 0);
-  assert(wc.ro_buf == aligned_ro);
-
-  info("Mapping read-write buffer");
-  int rw_fd = shm_open(wc.rw_name, O_RDWR, S_IRUSR | S_IWUSR);
-  if (rw_fd == -1) {
-    return error("Error calling shm_open");
+  // Map the buffers inside wasm's linear memory, aligned against our page boundaries.
+  info("Mapping shared buffers");
+  void *end = manifest_overlay(&wc.buffers, wc.buffer_fds, wasm_alloc_ptr, reserve_size, 0,
+                               wc.bufs);
+  for (uint32_t i = 0; i < wc.buffers.n_buffers; i++) {
+    info("  %-6s %p  %u bytes", wc.buffers.entries[i].name, wc.bufs[i],
+         wc.buffers.entries[i].size);
   }
-  wc.rw_buf = mmap(aligned_rw, wc.rw_size, PROT_READ | PROT_WRITE, flags, rw_fd, 0);
-  assert(wc.rw_buf == aligned_rw);
+  info("  aligned_size:     %d", (int)(end - wasm_alloc_ptr));
+  wc.ro_buf = wc.bufs[0];
+  wc.rw_buf = wc.bufs[1];
 
   // We don't need the file descriptors once the buffers have been mapped.
-  assert(close(rw_fd) != -1 && close(ro_fd) != -1);
+  for (uint32_t i = 0; i < wc.buffers.n_buffers; i++) {
+    assert(close(wc.buffer_fds[i]) != -1);
+  }
 
   // Inform the wasm module of the aligned shared buffer location in linear memory.
   int shift_ro = (void *)wc.ro_buf - wasm_memory_base;
@@ -407,10 +420,91 @@ bool test_error_handling() {
   return !fn_call(FN_FORCE_ERROR).ok;
 }
 
-void send(char code) {
+void send_ack(char code) {
   assert(write(wc.write_fd, &code, 1) == 1);
 }
 
+void transfer(int fd, void *buf, size_t len, bool to_fd) {
+  for (size_t n = 0; n < len;) {
+    ssize_t res = to_fd ? write(fd, buf + n, len - n) : read(fd, buf + n, len - n);
+    assert(res > 0);
+    n += res;
+  }
+}
+
+// Returns the linear memory index of a region of at least 'len' bytes for pipe payloads. The
+// module doesn't export free, so the region is allocated once, the size of the read-write
+// buffer: the host sizes that to its largest stress payload.
+int scratch(uint32_t len) {
+  if (wc.scratch_size == 0) {
+    FuncResult res = fn_call(FN_MALLOC, wc.rw_size);
+    if (!res.ok || res.val == 0) {
+      error("Could not allocate %d bytes for pipe payloads", wc.rw_size);
+      return 0;
+    }
+    wc.scratch_index = res.val;
+    wc.scratch_size = wc.rw_size;
+  }
+  if (len > wc.scratch_size) {
+    error("Payload of %u bytes is larger than the pipe payload region", len);
+    return 0;
+  }
+  return wc.scratch_index;
+}
+
+// Stress commands, each followed by a u32 payload length and a u32 starting byte value. These
+// are acked without logging as the host is timing them.
+//   W: write the payload to the start of the read-write buffer
+//   R: verify the payload in the read-write buffer
+//   S: write the payload to linear memory, then send it over the pipe after the ack
+//   G: receive the payload over the pipe into linear memory, then verify it
+bool stress_command(char cmd) {
+  uint32_t params[2];
+  transfer(wc.read_fd, params, sizeof(params), false);
+  uint32_t len = params[0];
+  uint32_t val = params[1];
+  bool in_rw = len <= (uint32_t)wc.rw_size;
+  wc.quiet = true;
+  FuncResult res = { false, 0 };
+  int index = 0;
+  switch (cmd) {
+    case 'W':
+      res = in_rw ? fn_call(FN_WRITE_RW, 0, val, len) : res;
+      break;
+    case 'R':
+      res = in_rw ? fn_call(FN_READ_RW, 0, val, len) : res;
+      break;
+    case 'S':
+      if ((index = scratch(len)) != 0) {
+        res = fn_call(FN_WRITE_MEM, index, val, len);
+      }
+      break;
+    case 'G':
+      // The payload has to be drained even if it can't be stored.
+      if ((index = scratch(len)) != 0) {
+        transfer(wc.read_fd, wasm_memory_data(wc.memory) + index, len, false);
+        res = fn_call(FN_READ_MEM, index, val, len);
+      } else {
+        char discard[4096];
+        for (uint32_t n = 0; n < len; n += sizeof(discard)) {
+          size_t chunk = len - n < sizeof(discard) ? len - n : sizeof(discard);
+          transfer(wc.read_fd, discard, chunk, false);
+        }
+      }
+      break;
+  }
+  wc.quiet = false;
+  bool ok = res.ok && res.val == 0;
+  if (!in_rw && (cmd == 'W' || cmd == 'R')) {
+    error("Payload of %u bytes is larger than the read-write buffer", len);
+  }
+  send_ack(ok ? cmd : '*');
+  if (ok && cmd == 'S') {
+    transfer(wc.write_fd, wasm_memory_data(wc.memory) + index, len, true);
+  }
+  return ok;
+}
+
 // Commands:
 //   i: initialise
 //   v: verify shared memory contents
@@ -420,11 +514,16 @@ void send(char code) {
 //   q: write to read-only buffer (will crash)
 //   e: test container's handling of errors in wasm function calls
 //   x: exit
+// and the stress commands W, R, S and G; see stress_command().
 void command_loop() {
   bool ok = true;
   while (ok) {
     char cmd = '-';
     assert(read(wc.read_fd, &cmd, 1) == 1);
+    if (cmd == 'W' || cmd == 'R' || cmd == 'S' || cmd == 'G') {
+      ok = stress_command(cmd);
+      continue;
+    }
     printf("\n");
     info("<cmd> %c", cmd);
     switch (cmd) {
@@ -450,7 +549,7 @@ void command_loop() {
         ok = test_error_handling();
         break;
       case 'x':
-        send(cmd);
+        send_ack(cmd);
         return;
       default:
         info("  ?? unknown command code");
@@ -459,27 +558,36 @@ void command_loop() {
     if (ok) {
       info("  success");
       // Send ack to host.
-      send(cmd);
+      send_ack(cmd);
     } else {
       // Send failure signal to host.
-      send('*');
+      send_ack('*');
     }
   }
 }
 
 int main(int argc, const char *argv[]) {
-  assert(argc == 8);
+  assert(argc == 6);
   wc.label = *argv[1];
   wc.read_fd = atoi(argv[2]);
   wc.write_fd = atoi(argv[3]);
-  wc.ro_name = argv[4];
-  wc.ro_size = atoi(argv[5]);
-  wc.rw_name = argv[6];
-  wc.rw_size = atoi(argv[7]);
+  wc.module_name = argv[5];
+
+  // The host sends the buffer manifest once, then closes its end of the socket.
+  int sock = atoi(argv[4]);
+  bool ok = recv_manifest(sock, &wc.buffers, wc.buffer_fds) && wc.buffers.n_buffers == 2 &&
+            wc.buffers.entries[0].prot == PROT_READ;
+  assert(close(sock) != -1);
+  if (!ok) {
+    error("Invalid buffer manifest");
+    return 1;
+  }
+  wc.ro_size = wc.buffers.entries[0].size;
+  wc.rw_size = wc.buffers.entries[1].size;
   info("Container started; pid %d", getpid());
 
   // Send ready signal to host.
-  send('@');
+  send_ack('@');
 
   // Process commands from host.
   command_loop();
@@ -13,76 +13,88 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
+#define _GNU_SOURCE
 #include <assert.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include "../c/unix-socket.c"
+#include "../c/buffer-manifest.c"
 
-const char *kReadOnlyBufName = "/shared_ro";
-const char *kReadWriteBufName = "/shared_rw";
 const int kReadOnlyBufSize = 5000;
 const int kReadWriteBufSize = 1000;
 
 #define R 0
 #define W 1
 
+// Stress mode defaults: payloads double in size from kStressMin to kStressMax.
+const int kStressIters = 200;
+const int kStressMin = 64;
+const int kStressMax = 1 << 20;
+
 typedef struct {
   int p2c[2];
   int c2p[2];
 } Pipes;
 
-void *setup_shared_buf(const char *name, int size, const char *mode) {
-  int fd = shm_open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-  if (fd == -1) {
-    perror("shm_open");
-    exit(1);
-  }
-  if (ftruncate(fd, size) == -1) {
-    perror("ftruncate");
-    exit(1);
-  }
+// The shared buffers, sent to each container as a manifest.
+BufferManifest buffers;
+int buffer_fds[MANIFEST_MAX_BUFFERS];
+
+// The buffer is rounded up to whole pages, and the containers see all of it.
+void *setup_shared_buf(const char *name, int size, uint32_t prot, const char *mode) {
+  char *shared = manifest_create(&buffers, buffer_fds, name, size, prot, 0);
+  size = buffers.entries[buffers.n_buffers - 1].size;
 
   // Fill the shared buffer for verification in wasm.
-  char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   sprintf(shared, "%s:", mode);
   sprintf(shared + size - 3, "buf");
   char v[2] = { 131, 173 };
   for (int i = 3; i < size - 3; i++) {
     shared[i] = v[i % 2];
   }
-  assert(close(fd) != -1);
   return shared;
 }
 
-void fork_container(Pipes *pipes, const char *label) {
+void fork_container(Pipes *pipes, const char *label, const char *module) {
   assert(pipe(pipes->p2c) == 0);
   assert(pipe(pipes->c2p) == 0);
+  int sv[2];
+  assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == 0);
 
   if (fork() == 0) {
     // Child
     close(pipes->p2c[W]);
     close(pipes->c2p[R]);
 
-    char read_fd[3];
-    char write_fd[3];
-    char ro_size[20];
-    char rw_size[20];
+    char read_fd[12];
+    char write_fd[12];
+    char sock[12];
     sprintf(read_fd, "%d", pipes->p2c[R]);
     sprintf(write_fd, "%d", pipes->c2p[W]);
-    sprintf(ro_size, "%d", kReadOnlyBufSize);
-    sprintf(rw_size, "%d", kReadWriteBufSize);
-    execlp("./container", "container", label, read_fd, write_fd,
-           kReadOnlyBufName, ro_size, kReadWriteBufName, rw_size, NULL);
+    sprintf(sock, "%d", sv[1]);
+    assert(fcntl(sv[1], F_SETFD, 0) != -1);
+    execlp("./container", "container", label, read_fd, write_fd, sock, module, NULL);
     perror("exec");
     assert(false);  // should not be reached
   } else {
     // Parent
     close(pipes->p2c[R]);
     close(pipes->c2p[W]);
+    close(sv[1]);
+
+    // Hand over the shared buffers.
+    assert(send_manifest(sv[0], &buffers, buffer_fds));
+    close(sv[0]);
 
     // Wait for the ready signal from the container binary.
     char ready;
@@ -91,9 +103,7 @@ void fork_container(Pipes *pipes, const char *label) {
   }
 }
 
-bool send(Pipes *pipes, char cmd) {
-  assert(write(pipes->p2c[W], &cmd, 1) == 1);
-
+bool wait_ack(Pipes *pipes, char cmd) {
   char ack = '-';
   assert(read(pipes->c2p[R], &ack, 1) == 1);
   if (ack == '*') {
@@ -107,14 +117,130 @@ bool send(Pipes *pipes, char cmd) {
   return true;
 }
 
+bool send_cmd(Pipes *pipes, char cmd) {
+  assert(write(pipes->p2c[W], &cmd, 1) == 1);
+  return wait_ack(pipes, cmd);
+}
+
+// Stress commands carry a payload length and a starting byte value; see command_loop() in
+// container.c. The 9 bytes are written atomically.
+void send_stress_cmd(Pipes *pipes, char cmd, uint32_t len, uint32_t val) {
+  char msg[9] = { cmd };
+  memcpy(msg + 1, &len, 4);
+  memcpy(msg + 5, &val, 4);
+  assert(write(pipes->p2c[W], msg, sizeof(msg)) == sizeof(msg));
+}
+
+void transfer(int fd, void *buf, size_t len, bool to_fd) {
+  for (size_t n = 0; n < len;) {
+    ssize_t res = to_fd ? write(fd, buf + n, len - n) : read(fd, buf + n, len - n);
+    assert(res > 0);
+    n += res;
+  }
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// One round trip: A's module writes a payload of 'len' bytes and B's module verifies it. Through
+// the shared buffer, A writes it in place and the pipes only carry the commands; the baseline
+// has A's container send it from A's linear memory to the host, which forwards it to B's.
+bool round_trip(Pipes *pipes, bool shared, uint32_t len, uint32_t val, void *payload) {
+  if (shared) {
+    send_stress_cmd(&pipes[0], 'W', len, val);
+    if (!wait_ack(&pipes[0], 'W')) {
+      return false;
+    }
+    send_stress_cmd(&pipes[1], 'R', len, val);
+    return wait_ack(&pipes[1], 'R');
+  }
+  send_stress_cmd(&pipes[0], 'S', len, val);
+  if (!wait_ack(&pipes[0], 'S')) {
+    return false;
+  }
+  transfer(pipes[0].c2p[R], payload, len, false);
+  send_stress_cmd(&pipes[1], 'G', len, val);
+  transfer(pipes[1].p2c[W], payload, len, true);
+  return wait_ack(&pipes[1], 'G');
+}
+
+// Times 'iters' round trips for each payload size over both paths, after one warm-up round,
+// and reports the latency percentiles and the payload throughput.
+bool run_stress(Pipes *pipes, int iters, int min_size, int max_size) {
+  if (!send_cmd(&pipes[0], 'i') || !send_cmd(&pipes[1], 'i')) {
+    return false;
+  }
+  void *payload = malloc(max_size);
+  uint64_t *latency = malloc(iters * sizeof(uint64_t));
+  assert(payload != NULL && latency != NULL);
+
+  printf("\n%8s  %-6s  %9s  %9s  %9s  %9s  %7s\n", "size", "path", "p50 us", "p90 us",
+         "p99 us", "max us", "GB/s");
+  uint32_t val = 0;
+  bool ok = true;
+  for (int size = min_size; ok && size <= max_size; size *= 2) {
+    for (int shared = 1; ok && shared >= 0; shared--) {
+      ok = round_trip(pipes, shared, size, val++, payload);
+      uint64_t total = 0;
+      for (int i = 0; ok && i < iters; i++) {
+        uint64_t start = now_ns();
+        ok = round_trip(pipes, shared, size, val++, payload);
+        latency[i] = now_ns() - start;
+        total += latency[i];
+      }
+      if (ok) {
+        qsort(latency, iters, sizeof(uint64_t), compare_u64);
+        printf("%8d  %-6s  %9.1lf  %9.1lf  %9.1lf  %9.1lf  %7.3lf\n", size,
+               shared ? "shared" : "pipe", latency[iters / 2] / 1e3,
+               latency[iters * 9 / 10] / 1e3, latency[iters * 99 / 100] / 1e3,
+               latency[iters - 1] / 1e3, (double)size * iters / total);
+      }
+    }
+  }
+  free(payload);
+  free(latency);
+  return ok && send_cmd(&pipes[0], 'x') && send_cmd(&pipes[1], 'x');
+}
+
 int main(int argc, const char *argv[]) {
+  bool stress = false;
+  int iters = kStressIters;
+  int min_size = kStressMin;
+  int max_size = kStressMax;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stress") == 0) {
+      stress = true;
+    } else if (strcmp(argv[i], "--iters") == 0 && i + 1 < argc) {
+      iters = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+      assert(sscanf(argv[++i], "%d-%d", &min_size, &max_size) == 2);
+    } else {
+      printf("usage: host [--stress [--iters N] [--sizes MIN-MAX]]\n");
+      return 1;
+    }
+  }
+  assert(iters > 0 && min_size > 0 && min_size <= max_size);
+
+  // The stress mode's payloads go through the read-write buffer, and its module is built with a
+  // heap big enough for them.
   printf("Creating shared memory buffers\n");
-  void *shared_ro = setup_shared_buf(kReadOnlyBufName, kReadOnlyBufSize, "ro");
-  void *shared_rw = setup_shared_buf(kReadWriteBufName, kReadWriteBufSize, "rw");
+  int rw_size = (stress && max_size > kReadWriteBufSize) ? max_size : kReadWriteBufSize;
+  void *shared_ro = setup_shared_buf("ro", kReadOnlyBufSize, PROT_READ, "ro");
+  void *shared_rw = setup_shared_buf("rw", rw_size, PROT_READ | PROT_WRITE, "rw");
 
   Pipes pipes[2];
-  fork_container(&pipes[0], "A");
-  fork_container(&pipes[1], "B");
+  const char *module = stress ? "stress.wasm" : "module.wasm";
+  fork_container(&pipes[0], "A", module);
+  fork_container(&pipes[1], "B", module);
 
   // Writes to read-only buffer (crashes).
   //const char *cmds[] = { "bx", "ai", "aq", "ax" };
@@ -125,20 +251,25 @@ int main(int argc, const char *argv[]) {
   // Concurrent write-read with memory tests.
   const char *cmds[] = { "ai", "av", "bi", "bv", "am", "aw", "br", "bm", "ax", "bx" };
 
-  for (int i = 0; i < sizeof(cmds) / sizeof(*cmds); i++) {
-    if (!send(&pipes[cmds[i][0] - 'a'], cmds[i][1]))
-      break;
+  bool ok = true;
+  if (stress) {
+    ok = run_stress(pipes, iters, min_size, max_size);
+  } else {
+    for (int i = 0; i < sizeof(cmds) / sizeof(*cmds); i++) {
+      if (!send_cmd(&pipes[cmds[i][0] - 'a'], cmds[i][1]))
+        break;
+    }
   }
   wait(NULL);
 
   printf("\nDeleting shared memory buffers\n");
-  if (munmap(shared_ro, kReadOnlyBufSize) == -1 || munmap(shared_rw, kReadWriteBufSize) == -1) {
+  if (munmap(shared_ro, buffers.entries[0].size) == -1 ||
+      munmap(shared_rw, buffers.entries[1].size) == -1) {
     perror("munmap");
     return 1;
   }
-  if (shm_unlink(kReadOnlyBufName) == -1 || shm_unlink(kReadWriteBufName) == -1) {
-    perror("shm_unlink");
-    return 1;
+  for (uint32_t i = 0; i < buffers.n_buffers; i++) {
+    assert(close(buffer_fds[i]) != -1);
   }
-  return 0;
+  return ok ? 0 : 1;
 }
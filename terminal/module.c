@@ -89,22 +89,33 @@ void clear_memory() {
   }
 }
 
+// Writes 'len' bytes counting up from 'val'; the payload for write_rw() and the stress mode.
 EMSCRIPTEN_KEEPALIVE
-void write_rw(int pos, unsigned char val, int len) {
-  for (unsigned char *p = rw_buf + pos; len > 0; len--) {
+void write_mem(unsigned char *p, unsigned char val, int len) {
+  for (; len > 0; len--) {
     *p++ = val++;
   }
 }
 
 EMSCRIPTEN_KEEPALIVE
-int read_rw(int pos, unsigned char val, int len) {
-  for (unsigned char *p = rw_buf + pos; len > 0; len--) {
+int read_mem(const unsigned char *p, unsigned char val, int len) {
+  for (; len > 0; len--) {
     if (*p++ != val++)
       return 1;
   }
   return 0;
 }
 
+EMSCRIPTEN_KEEPALIVE
+void write_rw(int pos, unsigned char val, int len) {
+  write_mem(rw_buf + pos, val, len);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int read_rw(int pos, unsigned char val, int len) {
+  return read_mem(rw_buf + pos, val, len);
+}
+
 EMSCRIPTEN_KEEPALIVE
 void write_ro() {
   // Should crash the process due to virtual memory read-only protection.